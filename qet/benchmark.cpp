@@ -0,0 +1,366 @@
+//
+//  benchmark.cpp
+//  qet
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "benchmark.hpp"
+#include "deque.hpp"
+#include "object.hpp"
+#include "queue.hpp"
+#include "stack.hpp"
+#include "string.hpp"
+
+namespace lox {
+    
+    namespace {
+        
+        struct DispatchBenchmark {
+            const char* name;
+            // opcodes executed per trip around the loop, counted by hand
+            // from the disassembly of the optimized or unoptimized chunk
+            int opcodesPerIteration;
+            const char* source;
+        };
+        
+        constexpr int64_t ITERATIONS = 1000000;
+        
+        // Each loop runs inside a function so that its variables are locals.
+#ifdef LOX_OPTIMIZE_BYTECODE
+        // "i = i + 1" plus the loop test is GET_LOCAL CONSTANT
+        // LESS_JUMP_IF_FALSE POP GET_LOCAL ADD_CONSTANT SET_LOCAL_POP LOOP,
+        // "a = b;" is GET_LOCAL SET_LOCAL_POP, and "x = x * 1 + 0 - 0;" is
+        // GET_LOCAL CONSTANT MULTIPLY ADD_CONSTANT CONSTANT SUBTRACT
+        // SET_LOCAL_POP
+        constexpr int LOOP_OPCODES = 8;
+        constexpr int ASSIGN_OPCODES = 2;
+        constexpr int ARITHMETIC_OPCODES = 7;
+#else
+        // "i = i + 1" plus the loop test is GET_LOCAL CONSTANT LESS
+        // JUMP_IF_FALSE POP GET_LOCAL CONSTANT ADD SET_LOCAL POP LOOP,
+        // "a = b;" is GET_LOCAL SET_LOCAL POP, and "x = x * 1 + 0 - 0;" is
+        // GET_LOCAL CONSTANT MULTIPLY CONSTANT ADD CONSTANT SUBTRACT
+        // SET_LOCAL POP
+        constexpr int LOOP_OPCODES = 11;
+        constexpr int ASSIGN_OPCODES = 3;
+        constexpr int ARITHMETIC_OPCODES = 9;
+#endif
+        
+        const DispatchBenchmark dispatchBenchmarks[] = {
+            {
+                "loop", LOOP_OPCODES,
+                "fun f() {"
+                "  var i = 0;"
+                "  while (i < 1000000) { i = i + 1; }"
+                "}"
+                "f();"
+            },
+            {
+                "locals", LOOP_OPCODES + 2 * ASSIGN_OPCODES,
+                "fun f() {"
+                "  var i = 0; var a = 0; var b = 1;"
+                "  while (i < 1000000) { i = i + 1; a = b; b = a; }"
+                "}"
+                "f();"
+            },
+            {
+                "arithmetic", LOOP_OPCODES + ARITHMETIC_OPCODES,
+                "fun f() {"
+                "  var i = 0; var x = 1;"
+                "  while (i < 1000000) { i = i + 1; x = x * 1 + 0 - 0; }"
+                "}"
+                "f();"
+            },
+            {
+                // NIL POP TRUE POP FALSE POP CONSTANT POP
+                "constants", LOOP_OPCODES + 8,
+                "fun f() {"
+                "  var i = 0;"
+                "  while (i < 1000000) { i = i + 1; nil; true; false; 1; }"
+                "}"
+                "f();"
+            },
+            {
+                // GET_GLOBAL CALL POP, then NIL RETURN in the callee
+                "call", LOOP_OPCODES + 5,
+                "fun g() {}"
+                "fun f() {"
+                "  var i = 0;"
+                "  while (i < 1000000) { i = i + 1; g(); }"
+                "}"
+                "f();"
+            },
+        };
+        
+        double timeOne(VM& vm, const DispatchBenchmark& benchmark) {
+            auto first = benchmark.source;
+            auto last = first + strlen(first);
+            // warm up caches and the string table
+            vm.interpret(first, last);
+            auto start = std::chrono::steady_clock::now();
+            vm.interpret(first, last);
+            auto stop = std::chrono::steady_clock::now();
+            double nanoseconds = std::chrono::duration<double, std::nano>(stop - start).count();
+            return nanoseconds / (double) (ITERATIONS * benchmark.opcodesPerIteration);
+        }
+        
+        constexpr int OBJECT_ITERATIONS = 1000000;
+        
+        Value nopNative(VM&, int, Value*) {
+            return Value();
+        }
+        
+        template<typename F>
+        double timeObjects(const std::vector<Object*>& objects, F&& f) {
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i != OBJECT_ITERATIONS; ++i)
+                f(objects[i % objects.size()]);
+            auto stop = std::chrono::steady_clock::now();
+            return std::chrono::duration<double, std::nano>(stop - start).count() / OBJECT_ITERATIONS;
+        }
+        
+        constexpr int64_t CONTAINER_PAIRS = 1 << 20;
+        
+        // Runs body on each of threads new GC participants, which share
+        // CONTAINER_PAIRS push-pop pairs between them, and returns the wall
+        // time per pair.  This thread handshakes meanwhile, and shades the
+        // container, which the workers hold too.
+        template<typename F>
+        double timeThreads(int threads, const gc::Object* container, F body) {
+            std::atomic<int> running = threads;
+            std::vector<std::thread> workers;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i != threads; ++i) {
+                workers.emplace_back([&running, &body, threads] {
+                    gc::this_thread::enter();
+                    for (int64_t n = CONTAINER_PAIRS / threads; n; --n) {
+                        body(n);
+                        if (!(n & 0xff))
+                            gc::this_thread::safepoint();
+                    }
+                    gc::this_thread::leave();
+                    running.fetch_sub(1, std::memory_order_release);
+                });
+            }
+            while (running.load(std::memory_order_acquire)) {
+                if (gc::this_thread::safepoint())
+                    gc::shade(container);
+                std::this_thread::yield();
+            }
+            auto stop = std::chrono::steady_clock::now();
+            for (std::thread& worker : workers)
+                worker.join();
+            return std::chrono::duration<double, std::nano>(stop - start).count() / CONTAINER_PAIRS;
+        }
+        
+        // the mutex-protected baseline; a gc::Object only so that it can be
+        // passed to timeThreads
+        struct LockedDeque : gc::Leaf<gc::Object> {
+            std::mutex mutex;
+            gc::deque<Value> deque;
+            virtual std::size_t _gc_bytes() const override {
+                return sizeof(LockedDeque);
+            }
+        };
+        
+
+        constexpr int PROGRAM_RUNS = 5;
+        
+        // the high-water mark of the whole process, in kilobytes
+        long peakResidentKilobytes() {
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+            return usage.ru_maxrss / 1024;
+#else
+            return usage.ru_maxrss;
+#endif
+        }
+        
+        // Each run maps the file afresh, and so includes compiling it; the
+        // programs in benchmarks/ are sized to run for much longer than that
+        bool runProgram(VM& vm, const char* path) {
+            Source* source = Source::map(path);
+            return source && (vm.interpret(source) == INTERPRET_OK);
+        }
+        
+    } // namespace
+    
+    void benchmarkContainers() {
+        printf("%-8s %12s %12s %12s %12s\n", "threads", "stack", "eliminating", "queue", "mutex");
+        for (int threads = 1; threads <= 64; threads *= 2) {
+            auto* stack = new gc::TrieberStack<Value>(false);
+            double plain = timeThreads(threads, stack, [stack](int64_t n) {
+                Value value;
+                stack->push(Value(n));
+                stack->pop(value);
+            });
+            auto* eliminating = new gc::TrieberStack<Value>(true);
+            double eliminated = timeThreads(threads, eliminating, [eliminating](int64_t n) {
+                Value value;
+                eliminating->push(Value(n));
+                eliminating->pop(value);
+            });
+            auto* queue = new gc::MichaelScottQueue<Value>;
+            double queued = timeThreads(threads, queue, [queue](int64_t n) {
+                Value value;
+                queue->push(Value(n));
+                queue->pop(value);
+            });
+            auto* locked = new LockedDeque;
+            double mutexed = timeThreads(threads, locked, [locked](int64_t n) {
+                {
+                    std::unique_lock lock{locked->mutex};
+                    locked->deque.push_back(Value(n));
+                }
+                std::unique_lock lock{locked->mutex};
+                locked->deque.pop_front();
+            });
+            printf("%-8d %9.2f ns %9.2f ns %9.2f ns %9.2f ns\n", threads, plain, eliminated, queued, mutexed);
+        }
+    }
+    
+    void benchmarkObjectDispatch(VM& vm) {
+        const char source[] =
+            "fun f() {}"
+            "class C { m() {} }"
+            "var c = C();"
+            "var m = c.m;";
+        vm.interpret(source, source + sizeof(source) - 1);
+        
+        Value f, m, c;
+        vm.getGlobal(copyString("f", 1), &f);
+        vm.getGlobal(copyString("m", 1), &m);
+        vm.getGlobal(copyString("c", 1), &c);
+        Value native(new ObjectNative(nopNative));
+        vm.push(native); // <-- keep alive
+        
+        // Calls only push a frame, which we discard, so each kind costs about
+        // the same and the difference is in the dispatch
+        std::vector<Object*> callables{
+            f.as_object(), native.as_object(), m.as_object(), native.as_object(),
+        };
+        // calls may move the stack
+        ptrdiff_t stackTop = vm.stackTop - vm.stack;
+        int frameCount = vm.frameCount;
+        auto viaVirtual = [&](Object* object) {
+            vm.push(Value(object));
+            object->callObject(vm, 0);
+            vm.stackTop = vm.stack + stackTop;
+            vm.frameCount = frameCount;
+        };
+        auto viaKind = [&](Object* object) {
+            vm.push(Value(object));
+            vm.callValue(Value(object), 0);
+            vm.stackTop = vm.stack + stackTop;
+            vm.frameCount = frameCount;
+        };
+        double callVirtual = timeObjects(callables, viaVirtual);
+        double callKind = timeObjects(callables, viaKind);
+        
+        Value string(copyString("s", 1));
+        vm.push(string); // <-- keep alive
+        std::vector<Object*> printables{
+            f.as_object(), c.as_object(), native.as_object(),
+            m.as_object(), string.as_object(), AS_INSTANCE(c)->class_,
+        };
+        // discard the printing itself
+        fflush(stdout);
+        int saved = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+        double printVirtual = timeObjects(printables, [](Object* object) {
+            object->printObject();
+        });
+        double printKind = timeObjects(printables, [](Object* object) {
+            printObject(Value(object));
+        });
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        
+        vm.pop();
+        vm.pop();
+        
+        printf("%-12s %12s %12s\n", "benchmark", "virtual", "kind");
+        printf("%-12s %9.2f ns %9.2f ns\n", "callObject", callVirtual, callKind);
+        printf("%-12s %9.2f ns %9.2f ns\n", "printObject", printVirtual, printKind);
+    }
+    
+    void benchmarkDispatch(VM& vm) {
+        DispatchMode saved = vm.dispatchMode;
+        // the register column runs the same programs with the fastest
+        // dispatch, and is per stack opcode, so it shows the whole saving
+        printf("%-12s %12s %12s %12s\n", "benchmark", "switch", "threaded", "registers");
+        for (const DispatchBenchmark& benchmark : dispatchBenchmarks) {
+            vm.dispatchMode = DISPATCH_SWITCH;
+            double switched = timeOne(vm, benchmark);
+            vm.dispatchMode = saved;
+            vm.useRegisters = true;
+            double registers = timeOne(vm, benchmark);
+            vm.useRegisters = false;
+#ifdef LOX_COMPUTED_GOTO
+            vm.dispatchMode = DISPATCH_THREADED;
+            double threaded = timeOne(vm, benchmark);
+            printf("%-12s %9.2f ns %9.2f ns %9.2f ns\n", benchmark.name, switched, threaded, registers);
+#else
+            printf("%-12s %9.2f ns %12s %9.2f ns\n", benchmark.name, switched, "n/a", registers);
+#endif
+        }
+        vm.dispatchMode = saved;
+    }
+    
+    void benchmarkPrograms(VM& vm, int count, const char* paths[]) {
+        for (int i = 0; i != count; ++i) {
+            const char* path = paths[i];
+            // a first run warms the string table, the caches and the heap
+            if (!runProgram(vm, path)) {
+                fprintf(stderr, "{\"benchmark\":\"%s\",\"error\":true}\n", path);
+                continue;
+            }
+            std::vector<std::int64_t> times;
+            std::uint64_t cycles = gc::statistics().cycles;
+            for (int run = 0; run != PROGRAM_RUNS; ++run) {
+                auto start = std::chrono::steady_clock::now();
+                runProgram(vm, path);
+                auto stop = std::chrono::steady_clock::now();
+                times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+            }
+            cycles = gc::statistics().cycles - cycles;
+            std::sort(times.begin(), times.end());
+            std::int64_t median = times[PROGRAM_RUNS / 2];
+            
+            fprintf(stderr, "{\"benchmark\":\"%s\",\"runs\":%d,\"wall_ns_median\":%lld,\"wall_ns_min\":%lld,",
+                    path, PROGRAM_RUNS, (long long) median, (long long) times.front());
+#ifdef LOX_PROFILE
+            // counted in a run of its own, so the timed runs aren't slowed
+            vm.beginProfile();
+            runProgram(vm, path);
+            vm.endProfile();
+            std::uint64_t instructions = 0;
+            for (std::uint64_t n : vm.profile->opcodes)
+                instructions += n;
+            fprintf(stderr, "\"instructions\":%llu,\"instructions_per_second\":%.0f,",
+                    (unsigned long long) instructions, instructions * 1e9 / (double) median);
+#else
+            fprintf(stderr, "\"instructions\":null,\"instructions_per_second\":null,");
+#endif
+            fprintf(stderr, "\"gc_cycles_per_run\":%.2f,\"peak_rss_kb\":%ld}\n",
+                    cycles / (double) PROGRAM_RUNS, peakResidentKilobytes());
+        }
+    }
+    
+} // namespace lox
@@ -0,0 +1,35 @@
+//
+//  benchmark.hpp
+//  qet
+//
+
+#ifndef benchmark_hpp
+#define benchmark_hpp
+
+#include "vm.hpp"
+
+namespace lox {
+    
+    // time opcode-dominated loops under each available dispatch mode and
+    // report the cost per executed opcode
+    void benchmarkDispatch(VM& vm);
+    
+    // compare virtual calls with switching on Object::kind for callObject
+    // and printObject over a mix of object kinds
+    void benchmarkObjectDispatch(VM& vm);
+    
+    // time push-pop pairs on TrieberStack, with and without elimination,
+    // MichaelScottQueue and a mutex-protected gc::deque, from 1 to 64
+    // threads, reporting the wall time per pair
+    void benchmarkContainers();
+    
+    // run each Lox program once to warm up, then time PROGRAM_RUNS more,
+    // writing one JSON object per program to stderr (stdout is left to the
+    // programs): the median and fastest wall time, the GC cycles per run,
+    // the process's peak RSS so far and, with LOX_PROFILE, the instruction
+    // count of a further, profiled run and the rate it implies
+    void benchmarkPrograms(VM& vm, int count, const char* paths[]);
+    
+} // namespace lox
+
+#endif /* benchmark_hpp */
@@ -5,26 +5,214 @@
 //  Created by Antony Searle on 20/3/2024.
 //
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
 #include "chunk.hpp"
+#include "opcodes.hpp"
 #include "vm.hpp"
 
 namespace lox {
     
+    Source* Source::make(const char* first, const char* last) {
+        Source* source = new Source;
+        source->text.assign(first, last);
+        source->first = source->text.data();
+        source->last = source->first + source->text.size();
+        return source;
+    }
+    
+    Source* Source::map(const char* path) {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1)
+            return nullptr;
+        struct stat status;
+        void* mapping = nullptr;
+        std::size_t size = 0;
+        if (fstat(fd, &status) == 0) {
+            size = status.st_size;
+            if (size < SOURCE_MAP_MIN) {
+                Source* source = new Source;
+                source->name.assign(path, path + strlen(path));
+                source->text.resize(size);
+                // a file shrinking as we read it just ends early
+                std::size_t count = 0;
+                while (count != size) {
+                    ssize_t n = read(fd, source->text.data() + count, size - count);
+                    if (n <= 0)
+                        break;
+                    count += n;
+                }
+                close(fd);
+                source->text.resize(count);
+                source->first = count ? source->text.data() : "";
+                source->last = source->first + count;
+                return source;
+            }
+            mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED)
+                madvise(mapping, size, MADV_SEQUENTIAL);
+        } else {
+            mapping = MAP_FAILED;
+        }
+        close(fd);
+        if (mapping == MAP_FAILED)
+            return nullptr;
+        Source* source = new Source;
+        source->name.assign(path, path + strlen(path));
+        source->_mapping = mapping;
+        source->_mapped = size;
+        source->first = (const char*) mapping;
+        source->last = source->first + size;
+        return source;
+    }
+    
+    Source::~Source() {
+        if (_mapping)
+            munmap(_mapping, _mapped);
+    }
+    
+    std::size_t Source::_gc_bytes() const {
+        return sizeof(Source) + name.capacity() + text.capacity();
+    }
+    
+    void LineTable::add(size_t offset, int line, const char* where) {
+        if (!runs.empty() && (runs.back().line == line) && (runs.back().where == where))
+            return;
+        runs.push_back({(uint32_t) offset, line, where});
+    }
+    
+    void LineTable::clear() {
+        runs.clear();
+    }
+    
+    const LineTable::Run& LineTable::find(size_t offset) const {
+        assert(!runs.empty());
+        // the last run that starts at or before offset
+        auto run = std::upper_bound(runs.begin(), runs.end(), offset, [](size_t offset, const Run& run) {
+            return offset < run.offset;
+        });
+        return *(run - 1);
+    }
+    
     void Chunk::write(uint8_t byte, int line, const char* start) {
+        lines.add(code.size(), line, start);
         code.push_back(byte);
-        lines.push_back(line);
-        this->where.push_back(start);
     }
     
     size_t Chunk::add_constant(Value value) {
         value.shade();
         constants.push_back(value);
+        // the function may already be old
+        gc::remember(&constants);
         return constants.size() - 1;
     }
     
+    size_t Chunk::add_cache() {
+        return cacheCount++;
+    }
+    
+    void Chunk::allocate_caches() {
+        if (cacheCount)
+            caches = gc::Array<InlineCache>::make(cacheCount);
+    }
+    
+    size_t instructionLength(const Chunk* chunk, size_t offset) {
+        switch (chunk->code[offset]) {
+            case OPCODE_CONSTANT:
+            case OPCODE_GET_LOCAL:
+            case OPCODE_SET_LOCAL:
+            case OPCODE_GET_GLOBAL:
+            case OPCODE_DEFINE_GLOBAL:
+            case OPCODE_SET_GLOBAL:
+            case OPCODE_GET_UPVALUE:
+            case OPCODE_SET_UPVALUE:
+            case OPCODE_GET_SUPER:
+            case OPCODE_CALL:
+            case OPCODE_CLASS:
+            case OPCODE_METHOD:
+            case OPCODE_ADD_CONSTANT:
+            case OPCODE_SET_LOCAL_POP:
+            case OPCODE_REG_NIL:
+            case OPCODE_REG_TRUE:
+            case OPCODE_REG_FALSE:
+            case OPCODE_REG_PRINT:
+            case OPCODE_REG_RETURN:
+                return 2;
+            case OPCODE_GET_GLOBAL_SLOT:
+            case OPCODE_DEFINE_GLOBAL_SLOT:
+            case OPCODE_SET_GLOBAL_SLOT:
+            case OPCODE_JUMP:
+            case OPCODE_JUMP_IF_FALSE:
+            case OPCODE_LOOP:
+            case OPCODE_SUPER_INVOKE:
+            case OPCODE_GET_LOCAL_GET_LOCAL:
+            case OPCODE_LESS_JUMP_IF_FALSE:
+            case OPCODE_REG_MOVE:
+            case OPCODE_REG_GET_UPVALUE:
+            case OPCODE_REG_SET_UPVALUE:
+            case OPCODE_REG_NOT:
+            case OPCODE_REG_NEGATE:
+            case OPCODE_REG_CALL:
+                return 3;
+            case OPCODE_GET_PROPERTY:
+            case OPCODE_SET_PROPERTY:
+            case OPCODE_REG_GET_GLOBAL_SLOT:
+            case OPCODE_REG_DEFINE_GLOBAL_SLOT:
+            case OPCODE_REG_SET_GLOBAL_SLOT:
+            case OPCODE_REG_EQUAL:
+            case OPCODE_REG_GREATER:
+            case OPCODE_REG_LESS:
+            case OPCODE_REG_ADD:
+            case OPCODE_REG_SUBTRACT:
+            case OPCODE_REG_MULTIPLY:
+            case OPCODE_REG_DIVIDE:
+            case OPCODE_REG_JUMP_IF_FALSE:
+                return 4;
+            case OPCODE_INVOKE:
+                return 5;
+            case OPCODE_CLOSURE: {
+                Value function = chunk->constants[chunk->code[offset + 1]];
+                return 2 + 2 * AS_FUNCTION(function)->upvalueCount;
+            }
+            default:
+                return 1;
+        }
+    }
+    
     void scan(const Chunk& self, gc::ScanContext& context) {
         scan(self.constants, context);
         scan(self.source, context);
+        context.push(self.caches);
+    }
+    
+    InlineCache::Entry* InlineCache::lookup(const gc::Object* key) {
+        int n = std::min(count.load(std::memory_order_relaxed), INLINE_CACHE_WAYS);
+        for (int i = 0; i != n; ++i) {
+            Entry* entry = entries + i;
+            if (entry->key.load(std::memory_order_acquire) == key)
+                return entry;
+        }
+        return nullptr;
+    }
+    
+    InlineCache::Entry* InlineCache::claim() {
+        // check first so that a megamorphic site stops incrementing
+        if (count.load(std::memory_order_relaxed) >= INLINE_CACHE_WAYS)
+            return nullptr;
+        int i = count.fetch_add(1, std::memory_order_relaxed);
+        return (i < INLINE_CACHE_WAYS) ? entries + i : nullptr;
+    }
+    
+    void InlineCache::scan(gc::ScanContext& context) const {
+        for (const Entry& entry : entries)
+            context.push(entry.key);
     }
     
 } // namespace lox
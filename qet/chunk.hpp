@@ -8,6 +8,7 @@
 #ifndef chunk_hpp
 #define chunk_hpp
 
+#include <atomic>
 #include <vector>
 
 #include "common.hpp"
@@ -16,11 +17,99 @@
 
 namespace lox {
     
+    struct ObjectClosure;
+    struct ObjectShape;
+    
+    // The text of a script, which the where pointers of its chunks point
+    // into.  A large file is mapped rather than read, so it is never copied,
+    // and stays mapped until the last function compiled from it is
+    // collected.  Truncating the file meanwhile makes touching the lost
+    // pages raise SIGBUS, in the compiler or in a later error message, so
+    // files smaller than SOURCE_MAP_MIN, which is every ordinary script,
+    // are read instead.
+    
+    constexpr std::size_t SOURCE_MAP_MIN = 1 << 20;
+    
     struct Source
     : gc::Leaf<gc::Object> {
                 
         std::vector<char> name;
-        std::vector<char> text;
+        std::vector<char> text; // <-- unless mapped
+        const char* first = nullptr;
+        const char* last = nullptr;
+        
+        static Source* make(const char* first, const char* last); // <-- copies
+        static Source* map(const char* path); // <-- nullptr if it can't
+        
+        virtual ~Source() override;
+        virtual std::size_t _gc_bytes() const override;
+        
+    private:
+        
+        void* _mapping = nullptr;
+        std::size_t _mapped = 0;
+        
+    };
+    
+    // Inline caches
+    //
+    // GET_PROPERTY, SET_PROPERTY and INVOKE carry a 16-bit operand indexing a
+    // per-site cache that remembers what the site saw for its last few
+    // receiver shapes: the slot of the field, the shape an added field
+    // transitioned to, or the method closure.
+    //
+    // Entries are write-once.  A thread claims an entry by bumping count,
+    // fills it in, and publishes it with a release store of the key, so a
+    // concurrent reader sees either an empty entry or a complete one.
+    // Once all the ways are claimed the site is megamorphic and always takes
+    // the slow path.
+    
+    constexpr int INLINE_CACHE_WAYS = 4;
+    
+    struct InlineCache {
+        
+        struct Entry {
+            gc::Atomic<gc::StrongPtr<const gc::Object>> key; // <-- receiver's shape
+            std::atomic<int> index;                          // <-- slot, or -1
+            std::atomic<ObjectShape*> transition;            // <-- kept alive by key
+            std::atomic<ObjectClosure*> method;              // <-- kept alive by key
+        };
+        
+        std::atomic<int> count;
+        Entry entries[INLINE_CACHE_WAYS];
+        
+        Entry* lookup(const gc::Object* key);
+        Entry* claim();
+        
+        void scan(gc::ScanContext& context) const;
+        
+    };
+    
+    // Source positions of the bytecode, run-length encoded
+    //
+    // Every byte of an instruction shares its position, and the compiler
+    // emits several instructions for most tokens, so the table keeps one run
+    // per change of position: the offset of the first byte it covers, with
+    // the line and the location in the text.  Only error reporting and the
+    // disassembler look positions up, by binary search.
+    
+    struct LineTable {
+        
+        struct Run {
+            uint32_t offset;
+            int line;
+            const char* where;
+        };
+        
+        std::vector<Run> runs;
+        
+        // the byte at offset, after all those before it
+        void add(size_t offset, int line, const char* where);
+        void clear();
+        
+        const Run& find(size_t offset) const;
+        int line(size_t offset) const { return find(offset).line; }
+        const char* where(size_t offset) const { return find(offset).where; }
         
     };
     
@@ -36,22 +125,27 @@ namespace lox {
         
         std::vector<uint8_t> code;    // <-- bytecode
         std::vector<Value> constants; // <-- function literals table
-
+        gc::StrongPtr<gc::Array<InlineCache>> caches; // <-- one per site
+        size_t cacheCount = 0;
         
         void    write(uint8_t byte, int line, const char* start);
         size_t  add_constant(Value value);
+        size_t  add_cache();
+        void    allocate_caches();
 
         
         // cold/debug
         
-        std::vector<int>            lines           ; // <-- line number from tokenizer
-        std::vector<const char*>    where           ; // <-- location in text provoking bytecode
+        LineTable                   lines           ; // <-- line and location in text provoking bytecode
         Source*                     source = nullptr; // <-- shared source code
         
                 
     }; // struct Chunk
     
     void scan(const Chunk&, gc::ScanContext&);
+    
+    // length of the instruction at offset, including its operands
+    size_t instructionLength(const Chunk* chunk, size_t offset);
         
 } // namespace lox
 
@@ -14,7 +14,40 @@
 //#define LOX_DEBUG_PRINT_CODE
 //#define LOX_DEBUG_TRACE_EXECUTION
 //#define LOX_DEBUG_STRESS_GC
-#define LOX_DEBUG_LOG_GC
+//#define LOX_DEBUG_LOG_GC
+
+// pack Value into a single NaN-boxed 64-bit word so that AtomicValue is a
+// lock-free 8-byte atomic; integers are then limited to 48 bits
+//#define LOX_NAN_BOXING
+
+// find objects for the collector by walking per-page live bitmaps rather
+// than by listing every allocation
+//#define LOX_GC_SWEEP_PAGES
+
+// promote survivors into an old generation that minor cycles neither trace
+// nor sweep; stores mark cards so that old-to-young pointers are found
+//#define LOX_GC_GENERATIONAL
+
+// hold globals in a lock-free ctrie that several VMs can share, rather than
+// in a private Table that rehashes all at once as it grows
+//#define LOX_GLOBALS_CTRIE
+
+// grow a Table by moving a few buckets per operation into the new array,
+// rather than by rehashing every entry at once
+//#define LOX_TABLE_INCREMENTAL_REHASH
+
+// fold constants, thread jumps and fuse superinstructions in each chunk
+// after it is compiled
+#define LOX_OPTIMIZE_BYTECODE
+
+// count instructions by opcode and function, and sample call stacks, in a
+// VM that has begun a profile (--profile, or profile(true) from Lox)
+//#define LOX_PROFILE
+
+// threaded dispatch needs the labels-as-values extension
+#if defined(__GNUC__) || defined(__clang__)
+#define LOX_COMPUTED_GOTO
+#endif
 
 namespace lox {
         
@@ -5,15 +5,22 @@
 //  Created by Antony Searle on 20/3/2024.
 //
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include "common.hpp"
 #include "compiler.hpp"
 #include "opcodes.hpp"
+#include "optimize.hpp"
+#include "registers.hpp"
 #include "tokenizer.hpp"
 #include "string.hpp"
+#include "vm.hpp"
 
 #ifdef LOX_DEBUG_PRINT_CODE
 #include "debug.hpp"
@@ -40,6 +47,12 @@ namespace lox {
         struct Parser {
             
             Tokenizer* tokenizer;
+            VM* vm;
+            Source* source;
+            
+            // identifiers and string literals, interned in bulk before
+            // compilation begins
+            std::unordered_map<std::string_view, ObjectString*> strings;
             
             Token current;
             Token previous;
@@ -56,6 +69,9 @@ namespace lox {
             bool match(TokenType type);
             
             void synchronize();
+            
+            void internStrings(const char* first, const char* last);
+            ObjectString* intern(const char* start, int length);
         };
         
         struct Compiler;
@@ -72,6 +88,14 @@ namespace lox {
             Token name;
             int depth;
             bool isCaptured;
+            bool isAssigned;    // <-- after its definition, here or in a closure
+        };
+        
+        // Where a CLOSURE captures a local, to be patched from CAPTURE_LOCAL
+        // to CAPTURE_VALUE when the local goes out of scope unassigned
+        struct Capture {
+            int local;
+            ptrdiff_t offset;
         };
         
         struct Upvalue {
@@ -98,6 +122,7 @@ namespace lox {
             int localCount;
             Upvalue upvalues[UINT8_COUNT];
             int scopeDepth;
+            std::vector<Capture> captures;
             
             Compiler(FunctionType, Compiler* enclosing);
             ~Compiler();
@@ -111,21 +136,26 @@ namespace lox {
             void emitReturn();
             uint8_t makeConstant(Value value);
             void emitConstant(Value value);
+            void emitCache();
             void patchJump(ptrdiff_t offset);
             
             void beginScope();
             void endScope();
             
             uint8_t identifierConstant(Token* name);
+            int globalVariable(Token* name);
+            void emitGlobal(uint8_t instruction, int global);
             int resolveLocal(Token* name);
             int addUpvalue(uint8_t index, bool isLocal);
             int resolveUpvalue(Token* name);
+            void assignUpvalue(int upvalue);
+            void resolveCaptures(int local);
             
             void addLocal(Token name);
             void declareVariable();
-            uint8_t parseVariable(const char* errorMessage);
+            int parseVariable(const char* errorMessage);
             void markInitialized();
-            void defineVariable(uint8_t global);
+            void defineVariable(int global);
             
             
             void namedVariable(Token name, bool canAssign);
@@ -200,6 +230,34 @@ namespace lox {
             errorAt(&current, message);
         }
         
+        void Parser::internStrings(const char* first, const char* last) {
+            Tokenizer* scan = Tokenizer::make(first, last);
+            for (;;) {
+                Token token = scan->next();
+                if (token.type == TOKEN_EOF)
+                    break;
+                if (token.type == TOKEN_IDENTIFIER)
+                    strings.emplace(std::string_view(token.start, token.length), nullptr);
+                else if (token.type == TOKEN_STRING)
+                    strings.emplace(std::string_view(token.start + 1, token.length - 2), nullptr);
+            }
+            std::vector<ObjectString::Query> queries;
+            queries.reserve(strings.size());
+            for (const auto& [view, _] : strings)
+                queries.emplace_back(view);
+            std::vector<ObjectString*> results(queries.size());
+            ObjectString::make(queries, results.data());
+            for (std::size_t i = 0; i != queries.size(); ++i)
+                strings[queries[i].view] = results[i];
+        }
+        
+        ObjectString* Parser::intern(const char* start, int length) {
+            auto it = strings.find(std::string_view(start, length));
+            if (it != strings.end())
+                return it->second;
+            return copyString(start, length);
+        }
+        
         void Parser::advance() {
             previous = current;
             for (;;) {
@@ -284,6 +342,15 @@ namespace lox {
             emitBytes(OPCODE_CONSTANT, makeConstant(value));
         }
         
+        void Compiler::emitCache() {
+            size_t cache = chunk()->add_cache();
+            if (cache > UINT16_MAX) {
+                parser->error("Too many property accesses in one chunk.");
+            }
+            emitByte((cache >> 8) & 0xff);
+            emitByte(cache & 0xff);
+        }
+        
         void Compiler::patchJump(ptrdiff_t offset) {
             // -2 to adjust for the bytecode for the jump offset itself
             ptrdiff_t jump = chunk()->code.size() - offset - 2;
@@ -307,13 +374,15 @@ namespace lox {
             this->scopeDepth = 0;
             this->function = new ObjectFunction();
             if (type != TYPE_SCRIPT) {
-                this->function->name = copyString(parser->previous.start,
-                                                  parser->previous.length);
+                this->function->chunk.source = parser->source;
+                this->function->name = parser->intern(parser->previous.start,
+                                                      parser->previous.length);
             }
             
             Local* local = &this->locals[this->localCount++];
             local->depth = 0;
             local->isCaptured = false;
+            local->isAssigned = false;
             if (type != TYPE_FUNCTION) {
                 local->name.start = "this";
                 local->name.length = 4;
@@ -326,11 +395,22 @@ namespace lox {
         
         ObjectFunction* endCompiler(Compiler* compiler) {
             compiler->emitReturn();
+            for (int i = compiler->localCount - 1; i >= 0; i--)
+                compiler->resolveCaptures(i);
             ObjectFunction* function = compiler->function;
+            if (!compiler->parser->hadError)
+                function->registerCount = lowerToRegisters(&function->chunk, function->arity, &function->registers);
+#ifdef LOX_OPTIMIZE_BYTECODE
+            if (!compiler->parser->hadError)
+                optimizeChunk(&function->chunk);
+#endif
+            function->chunk.allocate_caches();
             
 #ifdef LOX_DEBUG_PRINT_CODE
             if (!compiler->parser->hadError) {
                 disassembleChunk(compiler->chunk(), function->name != NULL ? function->name->_data : "<script>");
+                if (function->registerCount)
+                    disassembleChunk(&function->registers, "(registers)");
             }
 #endif
             return function;
@@ -347,7 +427,9 @@ namespace lox {
             scopeDepth--;
             while (localCount > 0 &&
                    locals[localCount - 1].depth > scopeDepth) {
-                if (locals[ localCount - 1].isCaptured) {
+                resolveCaptures(localCount - 1);
+                // a local that is never assigned is only captured by value
+                if (locals[ localCount - 1].isCaptured && locals[localCount - 1].isAssigned) {
                     emitByte(OPCODE_CLOSE_UPVALUE);
                 } else {
                     emitByte(OPCODE_POP);
@@ -356,12 +438,60 @@ namespace lox {
             }
         }
         
+        // The local is going out of scope, so whether anything assigns it is
+        // now known; if nothing does, its closures can copy it instead of
+        // sharing it through an ObjectUpvalue
+        void Compiler::resolveCaptures(int local) {
+            bool isAssigned = locals[local].isAssigned;
+            std::erase_if(captures, [&](const Capture& capture) {
+                if (capture.local != local)
+                    return false;
+                if (!isAssigned)
+                    chunk()->code[capture.offset] = CAPTURE_VALUE;
+                return true;
+            });
+        }
+        
         ParseRule* getRule(TokenType type);
         
         uint8_t Compiler::identifierConstant(Token* name) {
-            return makeConstant(Value(copyString(name->start, name->length)));
+            return makeConstant(Value(parser->intern(name->start, name->length)));
+        }
+        
+#ifdef LOX_GLOBALS_CTRIE
+        
+        // shared globals are looked up by name at runtime
+        
+        int Compiler::globalVariable(Token* name) {
+            return identifierConstant(name);
+        }
+        
+        void Compiler::emitGlobal(uint8_t instruction, int global) {
+            emitBytes(instruction, (uint8_t) global);
         }
         
+#else
+        
+        // the VM assigns each global name a slot when first compiled, which
+        // the instructions then index directly
+        
+        int Compiler::globalVariable(Token* name) {
+            int slot = parser->vm->globalSlot(parser->intern(name->start, name->length));
+            if (slot > UINT16_MAX) {
+                parser->error("Too many global variables.");
+                return 0;
+            }
+            return slot;
+        }
+        
+        void Compiler::emitGlobal(uint8_t instruction, int global) {
+            emitByte(instruction);
+            emitByte((global >> 8) & 0xff);
+            emitByte(global & 0xff);
+        }
+        
+#endif
+        
         bool identifiersEqual(Token* a, Token* b) {
             if (a->length != b->length)
                 return false;
@@ -419,6 +549,13 @@ namespace lox {
             return -1;
         }
         
+        void Compiler::assignUpvalue(int upvalue) {
+            if (upvalues[upvalue].isLocal)
+                enclosing->locals[upvalues[upvalue].index].isAssigned = true;
+            else
+                enclosing->assignUpvalue(upvalues[upvalue].index);
+        }
+        
         void Compiler::addLocal(Token name) {
             if (localCount == UINT8_COUNT) {
                 parser->error("Too many local variables in function.");
@@ -427,6 +564,7 @@ namespace lox {
             Local* local = &locals[ localCount++];
             local->name = name;
             local->depth = -1; // Sentinel value for uninitialized variables.
+            local->isAssigned = false;
             local->isCaptured = false;
         }
         
@@ -446,11 +584,11 @@ namespace lox {
             addLocal(*name);
         }
         
-        uint8_t Compiler::parseVariable(const char* errorMessage) {
+        int Compiler::parseVariable(const char* errorMessage) {
             parser->consume(TOKEN_IDENTIFIER, errorMessage);
             declareVariable();
             if (scopeDepth > 0) return 0;
-            return identifierConstant(&parser->previous);
+            return globalVariable(&parser->previous);
         }
         
         // not GC mark
@@ -460,12 +598,16 @@ namespace lox {
             scopeDepth;
         }
         
-        void Compiler::defineVariable(uint8_t global) {
+        void Compiler::defineVariable(int global) {
             if (scopeDepth > 0) {
                 markInitialized();
                 return;
             }
-            emitBytes(OPCODE_DEFINE_GLOBAL, global);
+#ifdef LOX_GLOBALS_CTRIE
+            emitGlobal(OPCODE_DEFINE_GLOBAL, global);
+#else
+            emitGlobal(OPCODE_DEFINE_GLOBAL_SLOT, global);
+#endif
         }
         
         uint8_t Compiler::argumentList() {
@@ -523,12 +665,15 @@ namespace lox {
             if (canAssign && parser->match(TOKEN_EQUAL)) {
                 expression();
                 emitBytes(OPCODE_SET_PROPERTY, name);
+                emitCache();
             } else if (parser->match(TOKEN_LEFT_PAREN)) {
                 uint8_t argCount = argumentList();
                 emitBytes(OPCODE_INVOKE, name);
                 emitByte(argCount);
+                emitCache();
             } else {
                 emitBytes(OPCODE_GET_PROPERTY, name);
+                emitCache();
             }
         }
         
@@ -548,6 +693,13 @@ namespace lox {
         }
         
         void Compiler::number(bool canAssign) {
+            const char* first = parser->previous.start;
+            const char* last = first + parser->previous.length;
+            if (std::find(first, last, '.') != last) {
+                double value = strtod(parser->previous.start, NULL);
+                emitConstant(Value(value));
+                return;
+            }
             int64_t value = strtoll(parser->previous.start, NULL, 10);
             emitConstant(Value(value));
         }
@@ -564,8 +716,8 @@ namespace lox {
         }
         
         void Compiler::string(bool canAssign) {
-            emitConstant(Value(copyString(parser->previous.start + 1,
-                                          parser->previous.length - 2)));
+            emitConstant(Value(parser->intern(parser->previous.start + 1,
+                                              parser->previous.length - 2)));
         }
         
         void Compiler::namedVariable(Token name, bool canAssign) {
@@ -578,13 +730,29 @@ namespace lox {
                 getOp = OPCODE_GET_UPVALUE;
                 setOp = OPCODE_SET_UPVALUE;
             } else {
-                arg = identifierConstant(&name);
+                arg = globalVariable(&name);
+#ifdef LOX_GLOBALS_CTRIE
                 getOp = OPCODE_GET_GLOBAL;
                 setOp = OPCODE_SET_GLOBAL;
+#else
+                getOp = OPCODE_GET_GLOBAL_SLOT;
+                setOp = OPCODE_SET_GLOBAL_SLOT;
+#endif
+                if (canAssign && parser->match(TOKEN_EQUAL)) {
+                    expression();
+                    emitGlobal(setOp, arg);
+                } else {
+                    emitGlobal(getOp, arg);
+                }
+                return;
             }
             
             if (canAssign && parser->match(TOKEN_EQUAL)) {
                 expression();
+                if (setOp == OPCODE_SET_LOCAL)
+                    locals[arg].isAssigned = true;
+                else
+                    assignUpvalue(arg);
                 emitBytes(setOp, arg);
             } else {
                 emitBytes(getOp, arg);
@@ -654,7 +822,7 @@ namespace lox {
                     if (compiler.function->arity > 255) {
                         parser->errorAtCurrent("Can't have more than 255 parameters.");
                     }
-                    uint8_t constant = compiler.parseVariable("Expect parameter name.");
+                    int constant = compiler.parseVariable("Expect parameter name.");
                     compiler.defineVariable(constant);
                 } while (parser->match(TOKEN_COMMA));
             }
@@ -666,7 +834,12 @@ namespace lox {
             emitBytes(OPCODE_CLOSURE, makeConstant(Value(function)));
             
             for (int i = 0; i < function->upvalueCount; i++) {
-                emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+                if (compiler.upvalues[i].isLocal) {
+                    captures.push_back({compiler.upvalues[i].index, (ptrdiff_t) chunk()->code.size()});
+                    emitByte(CAPTURE_LOCAL);
+                } else {
+                    emitByte(CAPTURE_UPVALUE);
+                }
                 emitByte(compiler.upvalues[i].index);
             }
             
@@ -692,7 +865,7 @@ namespace lox {
             declareVariable();
             
             emitBytes(OPCODE_CLASS, nameConstant);
-            defineVariable(nameConstant);
+            defineVariable(scopeDepth > 0 ? 0 : globalVariable(&className));
             
             ClassCompiler classCompiler;
             classCompiler.enclosing = currentClass;
@@ -732,14 +905,14 @@ namespace lox {
         }
         
         void Compiler::funDeclaration() {
-            uint8_t global = parseVariable("Expect function name.");
+            int global = parseVariable("Expect function name.");
             markInitialized();
             functionDefinition(TYPE_FUNCTION);
             defineVariable(global);
         }
         
         void Compiler::varDeclaration() {
-            uint8_t global = parseVariable("Expect variable name.");
+            int global = parseVariable("Expect variable name.");
             if (parser->match(TOKEN_EQUAL)) {
                 expression();
             } else {
@@ -998,9 +1171,15 @@ namespace lox {
         
     } // namespace
     
-    ObjectFunction* compile(const char* first, const char* last) {
+    ObjectFunction* compile(VM* vm, const char* first, const char* last, Source* source) {
         Compiler compiler(TYPE_SCRIPT, nullptr);
         compiler.parser = new Parser;
+        compiler.parser->vm = vm;
+        compiler.parser->source = source;
+        compiler.function->chunk.source = source;
+        // a first pass interns every name and literal together; they stay
+        // alive in the parser's map because the compiler never handshakes
+        compiler.parser->internStrings(first, last);
         compiler.parser->tokenizer = Tokenizer::make(first, last);
 
         compiler.parser->hadError = false;
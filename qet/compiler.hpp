@@ -12,7 +12,11 @@
 
 namespace lox {
     
-    ObjectFunction* compile(const char* first, const char* last);
+    struct VM;
+    
+    // global names are resolved to slots of the given VM; the functions
+    // keep source alive, if given, for the where pointers into it
+    ObjectFunction* compile(VM* vm, const char* first, const char* last, Source* source = nullptr);
     
 }
 
@@ -8,719 +8,844 @@
 #ifndef ctrie_hpp
 #define ctrie_hpp
 
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include "gc.hpp"
 
 namespace gc {
-    
+
     namespace _ctrie {
-        
+
+        // Concurrent hash array mapped trie, with snapshots
+        //
+        // Prokopec, A., Bronson N., Bagwell P., Odersky M. (2012) Concurrent Tries
+        //     with Efficient Non-Blocking Snapshots
+        //
+        // Unlike the weak string set in string.cpp, this is a strong map
+        // from Key to T.  Keys and values are immutable once in an SNode;
+        // assignment replaces the SNode.
+        //
+        // Snapshots take constant time.  Every INode and CNode belongs to a
+        // generation, and taking a snapshot installs a new root INode of a
+        // new generation with RDCSS.  Writers then copy the nodes of older
+        // generations on their way down, and GCAS ensures that no write
+        // commits into a node whose generation is no longer the root's.
+        // A read-only snapshot keeps the old root, so it never copies, and
+        // it can be enumerated, serially or in parallel, while mutators go
+        // on writing to the original.
+        //
+        // Nodes carry a kind tag, as lox objects do, so that code outside
+        // the virtual traversals can classify them without RTTI.
+        //
+        // Key and T must have ADL-visible scan and shade overloads, as
+        // Object* (gc::) and lox::Value do.
+
         // Todo:
-        
-        // To support HashSet and HashMap equally we need to store an opaque
-        // thing in SNode, and access it through Hash and KeyEqual
-        
+
         // To support more general-than-key lookup, we need to specify the
-        // virtual interfaces in terms of some general Query type
-        
-        // SNode doesn't actually need any table-specific members, so it's a
-        // benign overhead for any HashSet (or WeakHashSet) of Objects to just
-        // inherit from such an SNode interface and have the nodes be directly
-        // in the HashSet (so long as the Key part is immutable)
-        
-        // So, the fundamental interface could well be in terms of
-        // SNode type
-        // GetOp type -- hash and keycmp
-        // SetOp type -- hash and keycmp and emplace / assign
-        
-        // Operations --
-        // find, erase - hash and predicate
-        // erase_if - hash and extra predicate
-        // insert, insert_or_assign - hash and predicate and value_type
-        // emplace - hash and predicate and constructor args
-        //
-        // In fact, just the hash will get us to either
-        // - a CNode* without the hash
-        // - an SNode* with the same hash
-        // - an LNode* with the same hash
-        
-        // And from such a handle we can do whatever
-        // LNode behavior dictates how multisets are handled
+        // virtual interfaces in terms of some general Query type, as the
+        // string ctrie does
+
         // In the multiset case hash collisions are expected and should be
         // eagerly checked for rather than exhausting the hash bits first
-        
-        
-        template<typename Key, typename T, typename Hash, typename KeyEqual>
-        struct Ctrie : gc::Object {
-            
+
+
+        template<typename Key, typename T, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+        struct Ctrie : Object {
+
             using key_type = Key;
             using mapped_type = T;
-            using value_type = std::pair<const Key, T>;
             using size_type = std::size_t;
             using difference_type = std::ptrdiff_t;
             using hasher = Hash;
-            
-            struct ANode; // Any       : Object
-            struct BNode; // Branch    : Any
-            struct MNode; // Main      : Any
-            struct INode; // Indirect  : Branch
-            struct SNode; // Singleton : Branch
-            struct CNode; // Ctrie     : Main
-            struct LNode; // List      : Main
-            struct TNode; // Tomb      : Main
-            
+            using key_equal = KeyEqual;
+
+            struct ANode; // Any        : Object
+            struct BNode; // Branch     : Any
+            struct MNode; // Main       : Any
+            struct INode; // Indirect   : Branch
+            struct SNode; // Singleton  : Branch
+            struct CNode; // Ctrie      : Main
+            struct LNode; // List       : Main
+            struct TNode; // Tomb       : Main
+            struct FNode; // Failed     : Main
+            struct DNode; // Descriptor : Any
+            struct Gen;   // Generation : Object
+
+            enum Kind {
+                INODE,
+                SNODE,
+                CNODE,
+                LNODE,
+                TNODE,
+                FNODE,
+                DNODE,
+            };
+
             enum Tag {
                 NOTFOUND = -1,
                 RESTART = 0,
                 OK = 1,
             };
-            
+
             struct Result {
                 Tag tag;
-                union {
-                    T value;
-                };
+                T value;
             };
-            
+
             static Result Ok(T value) {
                 return Result{OK, value};
             }
-            
+
             static Result Restart() {
-                return Result{RESTART};
+                return Result{RESTART, T{}};
             }
-            
+
             static Result NotFound() {
-                return Result{NOTFOUND};
+                return Result{NOTFOUND, T{}};
+            }
+
+            static std::size_t hash(const Key& k) {
+                return Hash{}(k);
+            }
+
+            static bool equal(const Key& a, const Key& b) {
+                return KeyEqual{}(a, b);
             }
-            
+
+            // Generations are compared by identity
+            struct Gen : Leaf<Object> {
+                virtual std::size_t _gc_bytes() const override {
+                    return sizeof(Gen);
+                }
+            }; // struct Gen
+
             struct ANode : Object {
-                virtual void debug(int lev) const = 0;
-            };
-            
+                const Kind kind;
+                explicit ANode(Kind kind) : kind(kind) {}
+            }; // struct ANode
+
             struct BNode : ANode {
-                virtual Result _find(INode* i, Key k, int lev, INode* parent,
-                                     CNode* cn, std::uint64_t flag, int pos) const = 0;
-                virtual Result _insert_or_assign(INode* i, Key k, T v, int lev, INode* parent,
-                                                 CNode* cn, std::uint64_t flag, int pos) const = 0;
-                virtual Result _erase(INode* i, Key k, int lev, INode* parent,
-                                      CNode* cn, std::uint64_t flag, int pos) const  = 0;
-                virtual BNode* _resurrect() const = 0;
-                virtual MNode* _contract(CNode* parent, int lev) const = 0;
+                using ANode::ANode;
+                virtual Result _find(INode* i, const Key& k, int lev, INode* parent,
+                                     CNode* cn, int pos, Gen* startgen, Ctrie* ct) = 0;
+                virtual Result _insert_or_assign(INode* i, const Key& k, const T& v, int lev, INode* parent,
+                                                 CNode* cn, int pos, Gen* startgen, Ctrie* ct) = 0;
+                virtual Result _erase(INode* i, const Key& k, int lev, INode* parent,
+                                      CNode* cn, std::uint64_t flag, int pos, Gen* startgen, Ctrie* ct) = 0;
+                virtual BNode* _resurrect() = 0;
+                virtual BNode* _renewed(Gen* ngen, Ctrie* ct) = 0;
+                virtual MNode* _contract(CNode* cn, int lev) = 0;
+                virtual void _for_each(const std::function<void(const Key&, const T&)>& f, Ctrie* ct) = 0;
             }; // struct BNode
-            
+
             struct MNode : ANode {
-                
-                virtual Result _find(INode* i, Key k, int lev, INode* parent) const = 0;
-                virtual Result _insert_or_assign(INode* i, Key k, T value, int lev, INode* parent) const = 0;
-                virtual Result _erase(INode* i, Key k, int lev, INode* parent) const = 0;
-                virtual void _erase2(INode* i, Key k, int lev, INode* parent) const {}
-                virtual BNode* _resurrect(INode* parent) const { return parent; }
-                virtual void vcleanA(INode* i, int lev) const {}
-                virtual bool vcleanParentA(INode* p, INode* i, std::size_t hc, int lev,
-                                           MNode* m) const { return true; }
-                virtual bool vcleanParentB(INode* p, INode* i, std::size_t hc, int lev,
-                                           MNode* m,
-                                           CNode* cn, std::uint64_t flag, int pos) const { return true; }
+                using ANode::ANode;
+                // GCAS: nullptr once committed; else the main node this one
+                // replaced, or an FNode if the replacement has failed
+                mutable Atomic<StrongPtr<MNode>> prev;
+                virtual void _gc_scan(ScanContext& context) const override {
+                    context.push(prev);
+                }
+                virtual Result _find(INode* i, const Key& k, int lev, INode* parent, Gen* startgen, Ctrie* ct) = 0;
+                virtual Result _insert_or_assign(INode* i, const Key& k, const T& v, int lev, INode* parent, Gen* startgen, Ctrie* ct) = 0;
+                virtual Result _erase(INode* i, const Key& k, int lev, INode* parent, Gen* startgen, Ctrie* ct) = 0;
+                virtual BNode* _resurrect(INode* i) { return i; }
+                virtual void _clean(INode*, int, Ctrie*) {}
+                virtual void _clean_parent(INode*, INode*, std::size_t, int, Gen*, Ctrie*, MNode*) {}
+                virtual MNode* _untombed_into(CNode*, int, int, Gen*) { return nullptr; }
+                virtual void _for_each(const std::function<void(const Key&, const T&)>& f, Ctrie* ct) = 0;
             }; // struct MNode
-            
+
+            struct FNode : MNode {
+                MNode* old;
+                explicit FNode(MNode* old) : MNode(FNODE), old(old) {}
+                virtual void _gc_scan(ScanContext& context) const override {
+                    MNode::_gc_scan(context);
+                    context.push(old);
+                }
+                virtual std::size_t _gc_bytes() const override { return sizeof(FNode); }
+                // never installed as a main node
+                virtual Result _find(INode*, const Key&, int, INode*, Gen*, Ctrie*) override { abort(); }
+                virtual Result _insert_or_assign(INode*, const Key&, const T&, int, INode*, Gen*, Ctrie*) override { abort(); }
+                virtual Result _erase(INode*, const Key&, int, INode*, Gen*, Ctrie*) override { abort(); }
+                virtual void _for_each(const std::function<void(const Key&, const T&)>&, Ctrie*) override { abort(); }
+            }; // struct FNode
+
             struct INode : BNode {
                 mutable Atomic<StrongPtr<MNode>> main;
-                explicit INode(MNode* desired) : main(desired) {}
-                virtual void debug(int lev) const override {
-                    auto p =  main.load(std::memory_order::acquire);
-                    printf("INode(%lx): ",this->color.load(std::memory_order::relaxed));
-                    p->debug(lev);
-                }
-                virtual void scan(ScanContext& context) const override {
+                Gen* const gen;
+                INode(MNode* desired, Gen* gen) : BNode(INODE), main(desired), gen(gen) {}
+                virtual void _gc_scan(ScanContext& context) const override {
                     context.push(main);
+                    context.push(gen);
+                }
+                virtual std::size_t _gc_bytes() const override { return sizeof(INode); }
+                INode* copyToGen(Gen* ngen, Ctrie* ct) {
+                    return new INode(ct->GCAS_READ(this), ngen);
+                }
+                virtual Result _find(INode* i, const Key& k, int lev, INode* parent,
+                                     CNode* cn, int, Gen* startgen, Ctrie* ct) override {
+                    if (ct->read_only || startgen == gen)
+                        return ct->_find(this, k, lev + 6, i, startgen);
+                    if (ct->GCAS(i, cn, cn->renewed(startgen, ct)))
+                        return ct->_find(i, k, lev, parent, startgen);
+                    return Restart();
                 }
-                virtual Result _find(INode* i, Key k, int lev, INode* parent,
-                                     CNode* cn, std::uint64_t flag, int pos) const override {
-                    return Ctrie::_find(this, k, lev + 6, i);
+                virtual Result _insert_or_assign(INode* i, const Key& k, const T& v, int lev, INode* parent,
+                                                 CNode* cn, int, Gen* startgen, Ctrie* ct) override {
+                    if (startgen == gen)
+                        return ct->_insert_or_assign(this, k, v, lev + 6, i, startgen);
+                    if (ct->GCAS(i, cn, cn->renewed(startgen, ct)))
+                        return ct->_insert_or_assign(i, k, v, lev, parent, startgen);
+                    return Restart();
                 }
-                virtual Result _insert_or_assign(INode* i, Key k, T v, int lev, INode* parent,
-                                                 CNode* cn, std::uint64_t flag, int pos) const override {
-                    return Ctrie::_insert_or_assign(this, k, v, lev + 6, i);
+                virtual Result _erase(INode* i, const Key& k, int lev, INode* parent,
+                                      CNode* cn, std::uint64_t, int, Gen* startgen, Ctrie* ct) override {
+                    if (startgen == gen)
+                        return ct->_erase(this, k, lev + 6, i, startgen);
+                    if (ct->GCAS(i, cn, cn->renewed(startgen, ct)))
+                        return ct->_erase(i, k, lev, parent, startgen);
+                    return Restart();
                 }
-                virtual Result _erase(INode* i, Key k, int lev, INode* parent,
-                                      CNode* cn, std::uint64_t flag, int pos) const override{
-                    return Ctrie::_erase(this, k, lev + 6, i);
+                virtual BNode* _resurrect() override {
+                    return main.load(std::memory_order::acquire)->_resurrect(this);
                 }
-                virtual BNode* _resurrect() const override {
-                    return this->main.load(std::memory_order::acquire)->_resurrect(this);
+                virtual BNode* _renewed(Gen* ngen, Ctrie* ct) override {
+                    return copyToGen(ngen, ct);
                 }
-                virtual MNode* _contract(CNode* cn, int lev) const override {
+                virtual MNode* _contract(CNode* cn, int) override {
                     return cn;
                 }
-                
-                
+                virtual void _for_each(const std::function<void(const Key&, const T&)>& f, Ctrie* ct) override {
+                    ct->GCAS_READ(this)->_for_each(f, ct);
+                }
             }; // struct INode
-            
+
             struct SNode : BNode {
-                Key key;
-                T value;
-                SNode(Key k, T v) : key(k), value(v) {}
-                virtual void shade(ShadeContext& context) const override {
-                    Color expected = context.WHITE;
-                    color.compare_exchange_strong(expected,
-                                                  context.BLACK(),
-                                                  std::memory_order::relaxed,
-                                                  std::memory_order::relaxed);
-                }
-                virtual void debug(int lev) const override {
-                    printf("SNode(%lx)\n", this->color.load(std::memory_order::relaxed));
-                }
-                virtual Result _find(INode* i, Key k, int lev, INode* parent,
-                                     CNode* cn, std::uint64_t flag, int pos) const override {
-                    if (this->key == k) {
-                        return Ok(value);
-                    } else {
-                        return NotFound();
-                    }
-                }
-                virtual Result _insert_or_assign(INode* i, Key k, T v, int lev, INode* parent,
-                                                 CNode* cn, std::uint64_t flag, int pos) const override {
+                const Key key;
+                const T value;
+                SNode(const Key& k, const T& v) : BNode(SNODE), key(k), value(v) {
+                    // the node may be allocated BLACK
+                    using gc::shade;
+                    shade(key);
+                    shade(value);
+                }
+                virtual void _gc_scan(ScanContext& context) const override {
+                    using gc::scan;
+                    scan(key, context);
+                    scan(value, context);
+                }
+                virtual std::size_t _gc_bytes() const override { return sizeof(SNode); }
+                virtual Result _find(INode*, const Key& k, int, INode*,
+                                     CNode*, int, Gen*, Ctrie*) override {
+                    return equal(key, k) ? Ok(value) : NotFound();
+                }
+                virtual Result _insert_or_assign(INode* i, const Key& k, const T& v, int lev, INode*,
+                                                 CNode* cn, int pos, Gen*, Ctrie* ct) override {
                     SNode* nsn = new SNode(k, v);
                     CNode* ncn;
-                    if (this->key != k) {
-                        INode* nin = new INode(CNode::make(this, nsn, lev + 6));
-                        ncn = cn->updated(pos, nin);
-                    } else {
-                        ncn = cn->updated(pos, nsn);
+                    if (equal(key, k)) {
+                        ncn = cn->updated(pos, nsn, i->gen);
+                        return ct->GCAS(i, cn, ncn) ? Ok(value) : Restart();
                     }
-                    MNode* expected = cn;
-                    if (i->main.compare_exchange_strong(expected,
-                                                        ncn,
-                                                        std::memory_order::release,
-                                                        std::memory_order::relaxed)) {
-                        return Ok(value);
-                    } else {
-                        return Restart();
-                    }
-                }
-                
-                virtual Result _erase(INode* i, Key k, int lev, INode* parent,
-                                      CNode* cn, std::uint64_t flag, int pos) const override  {
-                    if (this->key != k)
+                    CNode* rn = (cn->gen == i->gen) ? cn : cn->renewed(i->gen, ct);
+                    INode* nin = new INode(CNode::dual(this, nsn, lev + 6, i->gen), i->gen);
+                    ncn = rn->updated(pos, nin, i->gen);
+                    return ct->GCAS(i, cn, ncn) ? NotFound() : Restart();
+                }
+                virtual Result _erase(INode* i, const Key& k, int lev, INode*,
+                                      CNode* cn, std::uint64_t flag, int pos, Gen*, Ctrie* ct) override {
+                    if (!equal(key, k))
                         return NotFound();
-                    CNode* ncn = cn->removed(pos, flag);
-                    MNode* cntr = toContracted(ncn, lev);
-                    MNode* expected = cn;
-                    if (i->main.compare_exchange_strong(expected,
-                                                        cntr,
-                                                        std::memory_order::release,
-                                                        std::memory_order::relaxed)) {
-                        return Ok(value);
-                    } else {
-                        return Restart();
-                    }
+                    CNode* ncn = cn->removed(pos, flag, i->gen);
+                    return ct->GCAS(i, cn, toContracted(ncn, lev)) ? Ok(value) : Restart();
+                }
+                virtual BNode* _resurrect() override {
+                    return this;
                 }
-                
-                virtual BNode* _resurrect() const override {
+                virtual BNode* _renewed(Gen*, Ctrie*) override {
                     return this;
                 }
-                virtual MNode* _contract(CNode* cn, int lev) const override {
-                    SNode* sn = this;
-                    return entomb(sn);
+                virtual MNode* _contract(CNode*, int) override {
+                    return new TNode(this);
+                }
+                virtual void _for_each(const std::function<void(const Key&, const T&)>& f, Ctrie*) override {
+                    f(key, value);
                 }
-                
             }; // struct SNode
-            
+
             struct TNode : MNode {
-                SNode* sn;
-                
-                virtual void debug(int lev) const override {
-                    printf("TNode(%lx): ", this->color.load(std::memory_order::relaxed));
-                    sn->debug(lev);
-                }
-                virtual void scan(ScanContext& context) const override {
+                SNode* const sn;
+                explicit TNode(SNode* sn) : MNode(TNODE), sn(sn) {}
+                virtual void _gc_scan(ScanContext& context) const override {
+                    MNode::_gc_scan(context);
                     context.push(sn);
                 }
-                virtual Result _find(INode* i, Key k, int lev, INode* parent) const override {
-                    clean(parent, lev - 6);
+                virtual std::size_t _gc_bytes() const override { return sizeof(TNode); }
+                virtual Result _find(INode*, const Key& k, int lev, INode* parent, Gen*, Ctrie* ct) override {
+                    if (ct->read_only)
+                        return equal(sn->key, k) ? Ok(sn->value) : NotFound();
+                    ct->clean(parent, lev - 6);
                     return Restart();
                 }
-                virtual Result _insert_or_assign(INode* i, Key k, T value, int lev, INode* parent) const override {
-                    clean(parent, lev - 6);
+                virtual Result _insert_or_assign(INode*, const Key&, const T&, int lev, INode* parent, Gen*, Ctrie* ct) override {
+                    ct->clean(parent, lev - 6);
                     return Restart();
                 }
-                virtual Result _erase(INode* i, Key k, int lev, INode* parent) const override {
-                    clean(parent, lev - 6);
+                virtual Result _erase(INode*, const Key&, int lev, INode* parent, Gen*, Ctrie* ct) override {
+                    ct->clean(parent, lev - 6);
                     return Restart();
                 }
-                virtual void _erase2(INode* i, Key k, int lev, INode* parent) const override {
-                    cleanParent(parent, i, Hash{}(k), lev - 6);
-                }
-                virtual bool vcleanParentB(INode* p, INode* i, std::size_t hc, int lev,
-                                           MNode* m,
-                                           CNode* cn, std::uint64_t flag, int pos) const override {
-                    CNode* ncn = cn->updated(pos, this->sn);
-                    MNode* expected = cn;
-                    MNode* desired = toContracted(ncn, lev);
-                    return p->main.compare_exchange_strong(expected,
-                                                           desired,
-                                                           std::memory_order::release,
-                                                           std::memory_order::relaxed);
-                }
-                virtual BNode* _resurrect(INode* parent) const override {
+                virtual BNode* _resurrect(INode*) override {
                     return sn;
                 }
+                virtual MNode* _untombed_into(CNode* cn, int pos, int lev, Gen* gen) override {
+                    return toContracted(cn->updated(pos, sn, gen), lev);
+                }
+                virtual void _for_each(const std::function<void(const Key&, const T&)>& f, Ctrie*) override {
+                    f(sn->key, sn->value);
+                }
             }; // struct TNode
-            
+
             struct LNode : MNode {
                 SNode* sn;
-                const LNode* next;
-                virtual void debug(int lev) const override {
-                    printf("LNode(%lx,%p): ", this->color.load(std::memory_order::relaxed), sn);
-                    if (next)
-                        next->debug(lev);
-                    else
-                        printf("\n");
-                }
-                virtual void scan(ScanContext& context) const override {
+                LNode* next;
+                LNode(SNode* sn, LNode* next) : MNode(LNODE), sn(sn), next(next) {}
+                virtual void _gc_scan(ScanContext& context) const override {
+                    MNode::_gc_scan(context);
                     context.push(sn);
                     context.push(next);
                 }
-                Result lookup(Key k) const {
-                    const LNode* ln = this;
-                    for (;;) {
-                        if (!ln)
-                            return NotFound();
-                        if (ln->sn->key == k)
+                virtual std::size_t _gc_bytes() const override { return sizeof(LNode); }
+                Result lookup(const Key& k) const {
+                    for (const LNode* ln = this; ln; ln = ln->next)
+                        if (equal(ln->sn->key, k))
                             return Ok(ln->sn->value);
-                        ln = ln->next;
-                    }
-                }
-                MNode* inserted(Key k, T v) const  {
-                    const LNode* a = this;
-                    for (;;) {
-                        if (a->sn->key == k) {
-                            // The key exists in the list, so we must copy the
-                            // first part, replace that node, and point to the
-                            // second part
-                            const LNode* b = this;
-                            LNode* c = new LNode;
-                            LNode* d = c;
-                            for (;;) {
-                                if (b != a) {
-                                    d->sn = b->sn;
-                                    gc::shade(d->sn);
-                                    b = b->next;
-                                    LNode* e = new LNode;
-                                    d->next = e;
-                                    d = e;
-                                } else {
-                                    d->sn = new SNode(k, v);
-                                    d->next = b->next;
-                                    gc::shade(d->next);
-                                    return c;
-                                }
-                            }
-                        } else {
-                            a = a->next;
-                        }
-                        if (a == nullptr) {
-                            // We did not find the same key, so just prepend it
-                            LNode* b = new LNode;
-                            b->sn = new SNode(k, v);
-                            b->next = this;
-                            gc::shade(b->next);
-                            return b;
-                        }
-                    }
-                }
-                std::pair<const LNode*, T> removed(Key k) const {
-                    if (this->sn->key == k)
-                        return {this->next, this->sn->value};
-                    const LNode* a = this->next;
-                    for (;;) {
-                        if (a == nullptr) {
-                            // Not found at all
-                            return {this, nullptr};
-                        }
-                        if (a->sn->key != k) {
-                            // Not found yet
-                            a = a->next;
-                        } else {
-                            // Found inside the list
-                            const LNode* b = this;
-                            LNode* c = new LNode; // make new head
-                            LNode* d = c;
-                            for (;;) {
-                                d->sn = b->sn; // copy over node
-                                gc::shade(d->sn);
-                                b = b->next;
-                                if (b == a) {
-                                    // we've reached the node we are erasing, skip
-                                    // over it
-                                    d->next = a->next;
-                                    gc::shade(d->next);
-                                    return {c, a->sn->value};
-                                }
-                                LNode* e = new LNode;
-                                d->next = e;
-                                d = e;
-                            }
-                        }
-                    }
-                }
-                
-                virtual Result _find(INode* i, Key k, int lev, INode* parent) const override {
+                    return NotFound();
+                }
+                // a copy of the list without the key, and its former value
+                std::pair<LNode*, Result> removed(const Key& k) {
+                    if (equal(sn->key, k))
+                        return {next, Ok(sn->value)};
+                    if (!next)
+                        return {this, NotFound()};
+                    auto [rest, result] = next->removed(k);
+                    if (rest == next)
+                        return {this, result};
+                    return {new LNode(sn, rest), result};
+                }
+                virtual Result _find(INode*, const Key& k, int, INode*, Gen*, Ctrie*) override {
                     return lookup(k);
                 }
-                virtual Result _insert_or_assign(INode* i, Key k, T v, int lev, INode* parent) const override {
-                    // printf("LNode %lx,%p iinsert\n", this->color.load(RELAXED), this);
-                    MNode* expected = this;
-                    if (i->main.compare_exchange_strong(expected,
-                                                        inserted(k, v),
-                                                        std::memory_order::release,
-                                                        std::memory_order::relaxed)) {
-                        return NotFound(); // but, success
-                    } else {
-                        return Restart();
-                    }
+                virtual Result _insert_or_assign(INode* i, const Key& k, const T& v, int, INode*, Gen*, Ctrie* ct) override {
+                    auto [rest, result] = removed(k);
+                    LNode* nln = new LNode(new SNode(k, v), rest);
+                    return ct->GCAS(i, this, nln) ? result : Restart();
                 }
-                virtual Result _erase(INode* i, Key k, int lev, INode* parent) const override {
-                    const LNode* ln = this;
-                    auto [nln, v] = ln->removed(k);
-                    assert(nln && nln->sn);
-                    MNode* expected = ln;
-                    MNode* desired = nln->next ? nln : entomb(nln->sn);
-                    if (i->main.compare_exchange_strong(expected,
-                                                        desired,
-                                                        std::memory_order::release,
-                                                        std::memory_order::relaxed)) {
-                        return Ok(v);
-                    } else {
-                        return Restart();
-                    }
+                virtual Result _erase(INode* i, const Key& k, int, INode*, Gen*, Ctrie* ct) override {
+                    auto [rest, result] = removed(k);
+                    if (result.tag != OK)
+                        return result;
+                    MNode* desired = rest->next ? (MNode*) rest : (MNode*) new TNode(rest->sn);
+                    return ct->GCAS(i, this, desired) ? result : Restart();
+                }
+                virtual void _for_each(const std::function<void(const Key&, const T&)>& f, Ctrie*) override {
+                    for (const LNode* ln = this; ln; ln = ln->next)
+                        f(ln->sn->key, ln->sn->value);
                 }
             }; // struct LNode
-            
+
             struct CNode : MNode {
-                
+
+                Gen* gen;
                 std::uint64_t bmp;
-                BNode* array[0];
-                
+                BNode* array[0];  // flexible array member
+
+                explicit CNode(Gen* gen) : MNode(CNODE), gen(gen), bmp{0} {}
+
+                static CNode* make(std::size_t count, Gen* gen) {
+                    return new(alloc(sizeof(CNode) + sizeof(BNode*) * count)) CNode(gen);
+                }
+
                 static std::pair<std::uint64_t, int> flagpos(std::size_t hash, int lev, std::uint64_t bmp) {
                     auto a = (hash >> lev) & 63;
                     std::uint64_t flag = std::uint64_t{1} << a;
                     int pos = __builtin_popcountll(bmp & (flag - 1));
                     return std::pair(flag, pos);
                 }
-                
-                static CNode* make(SNode* sn1, SNode* sn2, int lev) {
-                    assert(sn1->key != sn2->key);
-                    // distinct keys but potentially the same hash
-                    auto a1 = (Hash{}(sn1->key) >> lev) & 63;
-                    auto a2 = (Hash{}(sn2->key) >> lev) & 63;
-                    //printf("a1 a2 %ld %ld\n", a1, a2);
+
+                static MNode* dual(SNode* sn1, SNode* sn2, int lev, Gen* gen) {
+                    if (lev >= 64) {
+                        // true hash collision
+                        return new LNode(sn2, new LNode(sn1, nullptr));
+                    }
+                    auto a1 = (hash(sn1->key) >> lev) & 63;
+                    auto a2 = (hash(sn2->key) >> lev) & 63;
                     std::uint64_t flag1 = std::uint64_t{1} << a1;
                     if (a1 != a2) {
-                        // different hash at lev
-                        std::uint64_t flag2 = std::uint64_t{1} << a2;
-                        CNode* c = CNode::make(2); // new (extra_val_t{sizeof(BNode) * 2}) CNode;
-                        c->bmp = flag1 | flag2;
-                        int pos1 = a1 > a2;
-                        int pos2 = a2 > a1;
-                        c->array[pos1] = sn1;
-                        c->array[pos2] = sn2;
+                        CNode* c = CNode::make(2, gen);
+                        c->bmp = flag1 | (std::uint64_t{1} << a2);
+                        c->array[a1 > a2] = sn1;
+                        c->array[a2 > a1] = sn2;
                         return c;
                     } else {
-                        // same hash at lev
-                        CNode* c = CNode::make(1); // new (extra_val_t{sizeof(BNode)}) CNode;
-                        // TODO: check for exact hash collision immediately and
-                        // install an LNode instead
-                        // But: if this happens enough to matter then we have
-                        // a bad hash function
+                        CNode* c = CNode::make(1, gen);
                         c->bmp = flag1;
-                        if (lev + 6 < 64) {
-                            c->array[0] = new INode(make(sn1, sn2, lev + 6));
-                        } else {
-                            // true hash collision,
-                            // TODO: should we check for this immediately before we
-                            // make the chain of CNodes?  I think it's benign to have
-                            // LNodes at any level so long as they all share the hash
-                            // value; we may need to add a CNode::make flavor with
-                            // INodes->LNodes though?
-                            LNode* d = new LNode;
-                            d->sn = sn1;
-                            d->next = nullptr;
-                            LNode* e = new LNode;
-                            e->sn = sn2;
-                            e->next = d;
-                            c->array[0] = new INode(e);
-                        }
+                        c->array[0] = new INode(dual(sn1, sn2, lev + 6, gen), gen);
                         return c;
                     }
                 }
-                
-                CNode() : bmp{0} {}
-                
-                virtual void debug(int lev) const override {
-                    lev += 6;
-                    printf("CNode(%lx,%#llx):\n", this->color.load(std::memory_order::relaxed), bmp);
-                    int j = 0;
-                    for (int i = 0; i != 64; ++i) {
-                        std::uint64_t flag = std::uint64_t{1} << i;
-                        if (bmp & flag) {
-                            printf("%*s[%d]: ", lev, "", i);
-                            array[j]->debug(lev);
-                            j++;
-                        }
-                    }
+
+                virtual void _gc_scan(ScanContext& context) const override {
+                    MNode::_gc_scan(context);
+                    context.push(gen);
+                    int num = __builtin_popcountll(bmp);
+                    for (int i = 0; i != num; ++i)
+                        context.push(array[i]);
                 }
-                virtual void scan(ScanContext& context) const override  {
-                    int num = __builtin_popcountll(this->bmp);
-                    for (int i = 0; i != num; ++i) {
-                        this->array[i]->scan_weak(context);
-                    }
+
+                virtual std::size_t _gc_bytes() const override {
+                    return sizeof(CNode) + sizeof(BNode*) * __builtin_popcountll(bmp);
                 }
-                
-                CNode* inserted(std::uint64_t flag, int pos, BNode* child) const {
-                    //printf("CNode inserted\n");
+
+                CNode* inserted(std::uint64_t flag, int pos, BNode* child, Gen* ngen) const {
                     auto n = __builtin_popcountll(bmp);
-                    CNode* b = CNode::make(n + 1); // new (extra_val_t{sizeof(BNode*) * (n + 1)}) CNode;
-                    assert(!(this->bmp & flag));
-                    b->bmp = this->bmp | flag;
-                    std::memcpy(b->array, this->array, sizeof(BNode*) * pos);
+                    assert(!(bmp & flag));
+                    CNode* b = CNode::make(n + 1, ngen);
+                    b->bmp = bmp | flag;
+                    std::memcpy(b->array, array, sizeof(BNode*) * pos);
                     b->array[pos] = child;
-                    std::memcpy(b->array + pos + 1, this->array + pos, sizeof(BNode*) * (n - pos));
-                    ShadeContext context;
-                    context.WHITE = local.WHITE;
-                    for (int i = 0; i != n + 1; ++i)
-                        b->array[i]->shade(context);
+                    std::memcpy(b->array + pos + 1, array + pos, sizeof(BNode*) * (n - pos));
                     return b;
                 }
-                
-                CNode* updated(int pos, BNode* child) const {
-                    //printf("CNode updated\n");
+
+                CNode* updated(int pos, BNode* child, Gen* ngen) const {
                     auto n = __builtin_popcountll(bmp);
-                    CNode* b = CNode::make(n); // new (extra_val_t{sizeof(BNode*) * n}) CNode;
-                    b->bmp = this->bmp;
-                    std::memcpy(b->array, this->array, sizeof(BNode*) * n);
+                    CNode* b = CNode::make(n, ngen);
+                    b->bmp = bmp;
+                    std::memcpy(b->array, array, sizeof(BNode*) * n);
                     b->array[pos] = child;
-                    ShadeContext context;
-                    context.WHITE = local.WHITE;
-                    for (int i = 0; i != n; ++i)
-                        b->array[i]->shade(context);
                     return b;
                 }
-                
-                CNode* removed(int pos, std::uint64_t flag) const {
-                    assert(this->bmp & flag);
-                    assert(__builtin_popcountll((flag - 1) & this->bmp) == pos);
+
+                CNode* removed(int pos, std::uint64_t flag, Gen* ngen) const {
+                    assert(bmp & flag);
                     auto n = __builtin_popcountll(bmp);
-                    assert(pos < n);
-                    CNode* b = CNode::make(n - 1); // new (extra_val_t{sizeof(BNode*) * (n - 1)}) CNode;
-                    b->bmp = this->bmp ^ flag;
-                    std::memcpy(b->array, this->array, sizeof(BNode*) * pos);
-                    std::memcpy(b->array + pos, this->array + pos + 1, sizeof(BNode*) * (n - 1 - pos));
-                    ShadeContext context;
-                    context.WHITE = local.WHITE;
-                    for (int i = 0; i != n - 1; ++i)
-                        b->array[i]->shade_weak(context);
+                    CNode* b = CNode::make(n - 1, ngen);
+                    b->bmp = bmp ^ flag;
+                    std::memcpy(b->array, array, sizeof(BNode*) * pos);
+                    std::memcpy(b->array + pos, array + pos + 1, sizeof(BNode*) * (n - 1 - pos));
                     return b;
                 }
-                
-                virtual Result _find(INode* i, Key k, int lev, INode* parent) const override {
-                    CNode* cn = this;
-                    auto [flag, pos] = flagpos(Hash{}(k), lev, cn->bmp);
-                    if (!(flag & cn->bmp)) {
-                        return {OK, nullptr};
-                    } else {
-                        return array[pos]->_find(i, k, lev, parent, cn, flag, pos);
-                    }
+
+                // a copy in which every INode belongs to ngen
+                CNode* renewed(Gen* ngen, Ctrie* ct) const {
+                    auto n = __builtin_popcountll(bmp);
+                    CNode* b = CNode::make(n, ngen);
+                    b->bmp = bmp;
+                    for (int i = 0; i != n; ++i)
+                        b->array[i] = array[i]->_renewed(ngen, ct);
+                    return b;
                 }
-                
-                virtual Result _insert_or_assign(INode* i, Key k, T v, int lev, INode* parent) const override {
-                    CNode* cn = this;
-                    auto [flag, pos] = flagpos(Hash{}(k), lev, cn->bmp);
-                    if (!(flag & cn->bmp)) {
-                        MNode* expected = this;
-                        SNode* sn =  new SNode(k, v);
-                        MNode* desired = inserted(flag, pos, sn);
-                        if (i->main.compare_exchange_strong(expected,
-                                                            desired,
-                                                            std::memory_order::release,
-                                                            std::memory_order::relaxed)) {
-                            return Ok(sn->value);
-                        } else {
-                            return Restart();
-                        }
-                    } else {
-                        return array[pos]->_insert_or_assign(i, k, v, lev, parent, cn, flag, pos);
-                    }
+
+                virtual Result _find(INode* i, const Key& k, int lev, INode* parent, Gen* startgen, Ctrie* ct) override {
+                    auto [flag, pos] = flagpos(hash(k), lev, bmp);
+                    if (!(flag & bmp))
+                        return NotFound();
+                    return array[pos]->_find(i, k, lev, parent, this, pos, startgen, ct);
                 }
-                
-                virtual Result _erase(INode* i, Key k, int lev, INode* parent) const override {
-                    auto [flag, pos] = flagpos(Hash{}(k), lev, bmp);
+
+                virtual Result _insert_or_assign(INode* i, const Key& k, const T& v, int lev, INode* parent, Gen* startgen, Ctrie* ct) override {
+                    auto [flag, pos] = flagpos(hash(k), lev, bmp);
                     if (!(flag & bmp)) {
-                        return NotFound();
+                        CNode* rn = (gen == i->gen) ? this : renewed(i->gen, ct);
+                        CNode* ncn = rn->inserted(flag, pos, new SNode(k, v), i->gen);
+                        return ct->GCAS(i, this, ncn) ? NotFound() : Restart();
                     }
-                    BNode* sub = array[pos];
-                    assert(sub);
-                    Result result = sub->_erase(i, k, lev, parent, this, flag, pos);
-                    if (result.tag == OK) {
-                        i->main.load(std::memory_order::acquire)->_erase2(i, k, lev, parent);
+                    return array[pos]->_insert_or_assign(i, k, v, lev, parent, this, pos, startgen, ct);
+                }
+
+                virtual Result _erase(INode* i, const Key& k, int lev, INode* parent, Gen* startgen, Ctrie* ct) override {
+                    std::size_t hc = hash(k);
+                    auto [flag, pos] = flagpos(hc, lev, bmp);
+                    if (!(flag & bmp))
+                        return NotFound();
+                    Result result = array[pos]->_erase(i, k, lev, parent, this, flag, pos, startgen, ct);
+                    if (result.tag == OK && parent) {
+                        MNode* m = ct->GCAS_READ(i);
+                        // left a tomb; hoist its survivor into the parent
+                        ct->cleanParent(m, parent, i, hc, lev - 6, startgen);
                     }
                     return result;
                 }
-                
-                virtual void vcleanA(INode* i, int lev) const override {
-                    CNode* m = this;
-                    MNode* expected = m;
-                    MNode* desired = toCompressed(m, lev);
-                    i->main.compare_exchange_strong(expected, desired, 
-                                                    std::memory_order::release,
-                                                    std::memory_order::relaxed);
+
+                virtual void _clean(INode* i, int lev, Ctrie* ct) override {
+                    ct->GCAS(i, this, toCompressed(this, lev, i->gen));
                 }
-                
-                virtual bool vcleanParentA(INode* p, INode* i, std::size_t hc, int lev,
-                                           MNode* m) const override {
-                    CNode* cn = this;
-                    auto [flag, pos] = flagpos(hc, lev, this->bmp);
-                    if (!(flag & bmp))
-                        return true;
-                    BNode* sub = this->array[pos];
-                    if (sub != i)
-                        return true;
-                    return m->vcleanParentB(p, i, hc, lev, m, cn, flag, pos);
+
+                virtual void _clean_parent(INode* p, INode* i, std::size_t hc, int lev, Gen* startgen, Ctrie* ct, MNode* m) override {
+                    auto [flag, pos] = flagpos(hc, lev, bmp);
+                    if (!(flag & bmp) || array[pos] != i)
+                        return;
+                    MNode* ncn = m->_untombed_into(this, pos, lev, i->gen);
+                    if (!ncn)
+                        return;
+                    if (!ct->GCAS(p, this, ncn) && ct->readRoot(false)->gen == startgen)
+                        ct->cleanParent(m, p, i, hc, lev, startgen);
                 }
-                
+
+                virtual void _for_each(const std::function<void(const Key&, const T&)>& f, Ctrie* ct) override {
+                    int num = __builtin_popcountll(bmp);
+                    for (int i = 0; i != num; ++i)
+                        array[i]->_for_each(f, ct);
+                }
+
             }; // struct CNode
-            
-            static BNode* resurrect(BNode* m) {
-                return m->_resurrect();
-            }
-            
-            static MNode* toCompressed(CNode* cn, int lev) {
+
+            // RDCSS descriptor: replace the root if its main node is unchanged
+            struct DNode : ANode {
+                INode* old_root;
+                MNode* expected_main;
+                INode* new_root;
+                std::atomic<bool> committed;
+                DNode(INode* o, MNode* e, INode* n)
+                : ANode(DNODE), old_root(o), expected_main(e), new_root(n), committed(false) {}
+                virtual void _gc_scan(ScanContext& context) const override {
+                    context.push(old_root);
+                    context.push(expected_main);
+                    context.push(new_root);
+                }
+                virtual std::size_t _gc_bytes() const override { return sizeof(DNode); }
+            }; // struct DNode
+
+            static MNode* toCompressed(CNode* cn, int lev, Gen* gen) {
                 int num = __builtin_popcountll(cn->bmp);
-                CNode* ncn = CNode::make(num); // new (extra_val_t{sizeof(BNode*) * num}) CNode;
+                CNode* ncn = CNode::make(num, gen);
                 ncn->bmp = cn->bmp;
-                ShadeContext context;
-                context.WHITE = local.WHITE;
-                for (int i = 0; i != num; ++i) {
-                    ncn->array[i] = resurrect(cn->array[i]);
-                    ncn->array[i]->shade(context);
-                }
+                for (int i = 0; i != num; ++i)
+                    ncn->array[i] = cn->array[i]->_resurrect();
                 return toContracted(ncn, lev);
             }
-            
+
             static MNode* toContracted(CNode* cn, int lev) {
                 int num = __builtin_popcountll(cn->bmp);
-                if (lev == 0 || num > 1)
+                if (lev == 0 || num != 1)
                     return cn;
                 return cn->array[0]->_contract(cn, lev);
             }
-            
-            static void clean(INode* i, int lev) {
-                i->main.load(std::memory_order::acquire)->vcleanA(i, lev);
+
+            // GCAS: generation-compare-and-swap of an INode's main node
+
+            bool GCAS(INode* i, MNode* old, MNode* n) {
+                n->prev.store(old, std::memory_order::relaxed);
+                MNode* expected = old;
+                if (i->main.compare_exchange_strong(expected, n,
+                                                    std::memory_order::release,
+                                                    std::memory_order::relaxed)) {
+                    GCAS_Commit(i, n);
+                    return n->prev.load(std::memory_order::acquire) == nullptr;
+                }
+                return false;
             }
-            
-            static void cleanParent(INode* p, INode* i, std::size_t hc, int lev) {
+
+            MNode* GCAS_Commit(INode* i, MNode* m) {
                 for (;;) {
-                    MNode* m = i->main.load(std::memory_order::acquire); // <-- TODO we only redo this if it is a TNode and therefore final
-                    MNode* pm = p->main.load(std::memory_order::acquire); // <-- TODO get this from the failed CAS
-                    if (pm->vcleanParentA(p, i, hc, lev, m))
-                        return;
+                    MNode* p = m->prev.load(std::memory_order::acquire);
+                    INode* r = readRoot(true);
+                    if (!p)
+                        return m;
+                    if (p->kind == FNODE) {
+                        FNode* fn = static_cast<FNode*>(p);
+                        MNode* expected = m;
+                        if (i->main.compare_exchange_strong(expected, fn->old,
+                                                            std::memory_order::release,
+                                                            std::memory_order::relaxed))
+                            return fn->old;
+                        m = i->main.load(std::memory_order::acquire);
+                        continue;
+                    }
+                    if (r->gen == i->gen && !read_only) {
+                        MNode* expected = p;
+                        if (m->prev.compare_exchange_strong(expected, nullptr,
+                                                            std::memory_order::release,
+                                                            std::memory_order::relaxed))
+                            return m;
+                        continue;
+                    }
+                    MNode* expected = p;
+                    m->prev.compare_exchange_strong(expected, new FNode(p),
+                                                    std::memory_order::release,
+                                                    std::memory_order::relaxed);
+                    m = i->main.load(std::memory_order::acquire);
                 }
             }
-            
-            static MNode* entomb(SNode* sn) {
-                TNode* tn = new TNode;
-                tn->sn = sn;
-                gc::shade(sn);
-                return tn;
+
+            MNode* GCAS_READ(INode* i) {
+                MNode* m = i->main.load(std::memory_order::acquire);
+                if (!m->prev.load(std::memory_order::acquire))
+                    return m;
+                return GCAS_Commit(i, m);
             }
-            
-            static Result _find(INode* i, Key k, int lev, INode* parent) {
-                return i->main.load(std::memory_order::acquire)->_find(i, k, lev, parent);
+
+            // RDCSS: restricted double-compare-single-swap of the root
+
+            INode* readRoot(bool abort) {
+                ANode* r = root.load(std::memory_order::acquire);
+                if (r->kind != DNODE)
+                    return static_cast<INode*>(r);
+                return RDCSS_Complete(abort);
             }
-            
-            static Result _insert_or_assign(INode* i, Key k, T v, int lev, INode* parent) {
-                return i->main.load(std::memory_order::acquire)->_insert_or_assign(i, k, v, lev, parent);
+
+            INode* RDCSS_Complete(bool abort) {
+                for (;;) {
+                    ANode* r = root.load(std::memory_order::acquire);
+                    if (r->kind != DNODE)
+                        return static_cast<INode*>(r);
+                    DNode* d = static_cast<DNode*>(r);
+                    ANode* expected = d;
+                    if (abort) {
+                        if (root.compare_exchange_strong(expected, d->old_root,
+                                                         std::memory_order::release,
+                                                         std::memory_order::relaxed))
+                            return d->old_root;
+                    } else if (GCAS_READ(d->old_root) == d->expected_main) {
+                        if (root.compare_exchange_strong(expected, d->new_root,
+                                                         std::memory_order::release,
+                                                         std::memory_order::relaxed)) {
+                            d->committed.store(true, std::memory_order::release);
+                            return d->new_root;
+                        }
+                    } else {
+                        if (root.compare_exchange_strong(expected, d->old_root,
+                                                         std::memory_order::release,
+                                                         std::memory_order::relaxed))
+                            return d->old_root;
+                    }
+                }
+            }
+
+            bool RDCSS_ROOT(INode* ov, MNode* expected_main, INode* nv) {
+                DNode* d = new DNode(ov, expected_main, nv);
+                ANode* expected = ov;
+                if (root.compare_exchange_strong(expected, d,
+                                                 std::memory_order::release,
+                                                 std::memory_order::relaxed)) {
+                    RDCSS_Complete(false);
+                    return d->committed.load(std::memory_order::acquire);
+                }
+                return false;
+            }
+
+            // Recursive operations
+
+            Result _find(INode* i, const Key& k, int lev, INode* parent, Gen* startgen) {
+                return GCAS_READ(i)->_find(i, k, lev, parent, startgen, this);
+            }
+
+            Result _insert_or_assign(INode* i, const Key& k, const T& v, int lev, INode* parent, Gen* startgen) {
+                return GCAS_READ(i)->_insert_or_assign(i, k, v, lev, parent, startgen, this);
+            }
+
+            Result _erase(INode* i, const Key& k, int lev, INode* parent, Gen* startgen) {
+                return GCAS_READ(i)->_erase(i, k, lev, parent, startgen, this);
+            }
+
+            void clean(INode* i, int lev) {
+                if (!read_only)
+                    GCAS_READ(i)->_clean(i, lev, this);
             }
-            
-            static Result _erase(INode* i, Key k, int lev, INode* parent) {
-                return i->main.load(std::memory_order::acquire)->_erase(i, k, lev, parent);
+
+            void cleanParent(MNode* m, INode* p, INode* i, std::size_t hc, int lev, Gen* startgen) {
+                GCAS_READ(p)->_clean_parent(p, i, hc, lev, startgen, this, m);
             }
-            
-            Ctrie() : root(new INode(new CNode)) {
+
+            // Interface
+
+            Atomic<StrongPtr<ANode>> root;
+            const bool read_only;
+
+            Ctrie()
+            : read_only(false) {
+                Gen* gen = new Gen;
+                root.store(new INode(new CNode(gen), gen), std::memory_order::release);
             }
-            
-            void debug() {
-                printf("%p: Ctrie\n", this);
-                root->debug(0);
+
+            Ctrie(INode* r, bool read_only)
+            : read_only(read_only) {
+                root.store(r, std::memory_order::release);
             }
-            
-            void _gc_scan(ScanContext& context) const {
+
+            virtual void _gc_scan(ScanContext& context) const override {
                 context.push(root);
             }
-            
-            T find(Key k) {
+
+            virtual std::size_t _gc_bytes() const override {
+                return sizeof(Ctrie);
+            }
+
+            std::optional<T> find(const Key& k) {
                 for (;;) {
-                    INode* r = root;
-                    Result result = _find(r, k, 0, nullptr);
+                    INode* r = readRoot(false);
+                    Result result = _find(r, k, 0, nullptr, r->gen);
                     if (result.tag == RESTART)
                         continue;
+                    if (result.tag == NOTFOUND)
+                        return std::nullopt;
                     return result.value;
                 }
             }
-            
-            T insert_or_assign(Key k, T v) {
+
+            // returns the value replaced, if any
+            std::optional<T> insert_or_assign(const Key& k, const T& v) {
+                assert(!read_only);
                 for (;;) {
-                    INode* r = root;
-                    Result result = _insert_or_assign(r, k, v, 0, nullptr);
+                    INode* r = readRoot(false);
+                    Result result = _insert_or_assign(r, k, v, 0, nullptr, r->gen);
                     if (result.tag == RESTART)
                         continue;
+                    if (result.tag == NOTFOUND)
+                        return std::nullopt;
                     return result.value;
                 }
             }
-            
-            T erase(Key k) {
+
+            // returns the value erased, if any
+            std::optional<T> erase(const Key& k) {
+                assert(!read_only);
                 for (;;) {
-                    INode* r = root;
-                    Result result = _erase(r, k, 0, nullptr);
+                    INode* r = readRoot(false);
+                    Result result = _erase(r, k, 0, nullptr, r->gen);
                     if (result.tag == RESTART)
                         continue;
+                    if (result.tag == NOTFOUND)
+                        return std::nullopt;
                     return result.value;
                 }
             }
-            
-            INode* root;
-            
-            
-            
-            
-            
-            
+
+            // A writable copy, in constant time
+            Ctrie* snapshot() {
+                for (;;) {
+                    INode* r = readRoot(false);
+                    MNode* expected_main = GCAS_READ(r);
+                    if (RDCSS_ROOT(r, expected_main, r->copyToGen(new Gen, this)))
+                        return new Ctrie(r->copyToGen(new Gen, this), read_only);
+                }
+            }
+
+            // A frozen copy, in constant time
+            Ctrie* read_only_snapshot() {
+                if (read_only)
+                    return this;
+                for (;;) {
+                    INode* r = readRoot(false);
+                    MNode* expected_main = GCAS_READ(r);
+                    if (RDCSS_ROOT(r, expected_main, r->copyToGen(new Gen, this)))
+                        return new Ctrie(r, true);
+                }
+            }
+
+            // Calls f(key, value) for each entry of a read-only snapshot
+            void for_each(const std::function<void(const Key&, const T&)>& f) {
+                Ctrie* s = read_only_snapshot();
+                s->readRoot(false)->_for_each(f, s);
+            }
+
+            // As for_each, but splits the snapshot's subtrees among up to
+            // threads helper threads, which enter the collector for the
+            // duration.  f must be thread-safe.  The calling thread works
+            // too, and goes on handshaking while it waits for the helpers,
+            // shading the snapshot whenever it does.
+            void parallel_for_each(const std::function<void(const Key&, const T&)>& f,
+                                   std::size_t threads = std::thread::hardware_concurrency()) {
+                Ctrie* s = read_only_snapshot();
+                // split the top levels of the trie into enough subtrees
+                std::vector<BNode*> work;
+                std::vector<BNode*> next;
+                {
+                    INode* r = s->readRoot(false);
+                    work.push_back(r);
+                    while (work.size() < 4 * threads) {
+                        bool split = false;
+                        next.clear();
+                        for (BNode* b : work) {
+                            MNode* m = (b->kind == INODE) ? s->GCAS_READ(static_cast<INode*>(b)) : nullptr;
+                            if (m && m->kind == CNODE) {
+                                CNode* cn = static_cast<CNode*>(m);
+                                int num = __builtin_popcountll(cn->bmp);
+                                next.insert(next.end(), cn->array, cn->array + num);
+                                split = true;
+                            } else {
+                                next.push_back(b);
+                            }
+                        }
+                        work.swap(next);
+                        if (!split)
+                            break;
+                    }
+                }
+                std::atomic<std::size_t> cursor{0};
+                auto worker = [&]() {
+                    for (;;) {
+                        std::size_t j = cursor.fetch_add(1, std::memory_order::relaxed);
+                        if (j >= work.size())
+                            return;
+                        work[j]->_for_each(f, s);
+                        if (this_thread::safepoint())
+                            shade(s);
+                    }
+                };
+                std::vector<std::thread> helpers;
+                std::size_t n = std::min(threads, work.size());
+                std::mutex mutex;
+                std::condition_variable condition_variable;
+                std::size_t running = (n > 1) ? n - 1 : 0;
+                for (std::size_t t = 1; t < n; ++t)
+                    helpers.emplace_back([&]() {
+                        this_thread::enter();
+                        shade(s);
+                        worker();
+                        this_thread::leave();
+                        {
+                            std::unique_lock lock{mutex};
+                            --running;
+                        }
+                        condition_variable.notify_one();
+                    });
+                worker();
+                // the helpers can't finish a collection that is waiting for
+                // this thread to handshake, so it must not block in join
+                {
+                    std::unique_lock lock{mutex};
+                    while (running) {
+                        condition_variable.wait_for(lock, std::chrono::milliseconds(1));
+                        lock.unlock();
+                        if (this_thread::safepoint())
+                            shade(s);
+                        lock.lock();
+                    }
+                }
+                for (std::thread& t : helpers)
+                    t.join();
+            }
+
         }; // Ctrie
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
+
     } // _ctrie
-    
+
     using _ctrie::Ctrie;
-    
+
 } // namespace gc
 
 #endif /* ctrie_hpp */
@@ -3,6 +3,7 @@
 #include "debug.hpp"
 #include "object.hpp"
 #include "opcodes.hpp"
+#include "registers.hpp"
 #include "value.hpp"
 
 namespace lox {
@@ -29,12 +30,47 @@ namespace lox {
         return offset + 3;
     }
     
+    ptrdiff_t propertyInstruction(Chunk* chunk, ptrdiff_t offset) {
+        uint8_t constant = chunk->code[offset + 1];
+        uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+        cache |= chunk->code[offset + 3];
+        printf("%4d '", constant);
+        printValue(chunk->constants[constant]);
+        printf("' [%d]\n", cache);
+        return offset + 4;
+    }
+    
+    ptrdiff_t cachedInvokeInstruction(Chunk* chunk, ptrdiff_t offset) {
+        uint8_t constant = chunk->code[offset + 1];
+        uint8_t argCount = chunk->code[offset + 2];
+        uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+        cache |= chunk->code[offset + 4];
+        printf("(%d args) %4d '", argCount, constant);
+        printValue(chunk->constants[constant]);
+        printf("' [%d]\n", cache);
+        return offset + 5;
+    }
+    
     ptrdiff_t byteInstruction(Chunk* chunk, ptrdiff_t offset) {
         uint8_t slot = chunk->code[offset + 1];
         printf("%4d\n", slot);
         return offset + 2;
     }
     
+    ptrdiff_t twoByteInstruction(Chunk* chunk, ptrdiff_t offset) {
+        uint8_t first = chunk->code[offset + 1];
+        uint8_t second = chunk->code[offset + 2];
+        printf("%4d %4d\n", first, second);
+        return offset + 3;
+    }
+    
+    ptrdiff_t slotInstruction(Chunk* chunk, ptrdiff_t offset) {
+        uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+        slot |= chunk->code[offset + 2];
+        printf("%4d\n", slot);
+        return offset + 3;
+    }
+    
     ptrdiff_t jumpInstruction(Chunk* chunk, ptrdiff_t offset) {
         int sign = 1;
         uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -58,20 +94,102 @@ namespace lox {
         printValue(chunk->constants[constant]);
         printf("\n");
         
-        ObjectFunction* function = 
-            // AS_FUNCTION(chunk->constants[constant]);
-            dynamic_cast<ObjectFunction*>(chunk->constants[constant].as_object());
-        assert(function);
+        assert(IS_FUNCTION(chunk->constants[constant]));
+        ObjectFunction* function = AS_FUNCTION(chunk->constants[constant]);
         for (int j = 0; j < function->upvalueCount; j++) {
-            int isLocal = chunk->code[offset++];
+            int capture = chunk->code[offset++];
             int index = chunk->code[offset++];
+            const char* kind = (capture == CAPTURE_VALUE) ? "value  " : (capture == CAPTURE_LOCAL) ? "local  " : "upvalue";
             printf("%04ld      |                     %s %d\n",
-                   offset - 2, isLocal ? "local  " : "upvalue", index);
+                   offset - 2, kind, index);
         }
         
         return offset;
     }
     
+    // register operands print as rN, and RK operands that name a constant
+    // as kN
+    
+    static void printRegister(uint8_t operand) {
+        printf(" r%-3d", operand);
+    }
+    
+    static void printRK(uint8_t operand) {
+        if (operand & RK_CONSTANT)
+            printf(" k%-3d", operand & ~RK_CONSTANT);
+        else
+            printRegister(operand);
+    }
+    
+    static uint16_t readShort(Chunk* chunk, ptrdiff_t offset) {
+        return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+    }
+    
+    ptrdiff_t registerInstruction(Chunk* chunk, ptrdiff_t offset) {
+        printRegister(chunk->code[offset + 1]);
+        printf("\n");
+        return offset + 2;
+    }
+    
+    ptrdiff_t rkInstruction(Chunk* chunk, ptrdiff_t offset) {
+        printRK(chunk->code[offset + 1]);
+        printf("\n");
+        return offset + 2;
+    }
+    
+    ptrdiff_t unaryRegisterInstruction(Chunk* chunk, ptrdiff_t offset) {
+        printRegister(chunk->code[offset + 1]);
+        printRK(chunk->code[offset + 2]);
+        printf("\n");
+        return offset + 3;
+    }
+    
+    ptrdiff_t binaryRegisterInstruction(Chunk* chunk, ptrdiff_t offset) {
+        printRegister(chunk->code[offset + 1]);
+        printRK(chunk->code[offset + 2]);
+        printRK(chunk->code[offset + 3]);
+        printf("\n");
+        return offset + 4;
+    }
+    
+    ptrdiff_t getRegisterSlotInstruction(Chunk* chunk, ptrdiff_t offset) {
+        printRegister(chunk->code[offset + 1]);
+        printf(" %4d\n", readShort(chunk, offset + 2));
+        return offset + 4;
+    }
+    
+    ptrdiff_t setRegisterSlotInstruction(Chunk* chunk, ptrdiff_t offset) {
+        printRK(chunk->code[offset + 1]);
+        printf(" %4d\n", readShort(chunk, offset + 2));
+        return offset + 4;
+    }
+    
+    ptrdiff_t getRegisterUpvalueInstruction(Chunk* chunk, ptrdiff_t offset) {
+        printRegister(chunk->code[offset + 1]);
+        printf(" %4d\n", chunk->code[offset + 2]);
+        return offset + 3;
+    }
+    
+    ptrdiff_t setRegisterUpvalueInstruction(Chunk* chunk, ptrdiff_t offset) {
+        printf("%4d", chunk->code[offset + 1]);
+        printRK(chunk->code[offset + 2]);
+        printf("\n");
+        return offset + 3;
+    }
+    
+    ptrdiff_t registerJumpInstruction(Chunk* chunk, ptrdiff_t offset) {
+        uint16_t jump = readShort(chunk, offset + 2);
+        printRK(chunk->code[offset + 1]);
+        printf(" %4ld -> %ld\n", offset, offset + 4 + jump);
+        return offset + 4;
+    }
+    
+    ptrdiff_t registerCallInstruction(Chunk* chunk, ptrdiff_t offset) {
+        printRegister(chunk->code[offset + 1]);
+        printf(" (%d args)\n", chunk->code[offset + 2]);
+        return offset + 3;
+    }
+    
     using disassembleFunctionType = ptrdiff_t (*)(Chunk* chunk, ptrdiff_t offset);
     
     disassembleFunctionType disassembleFunctionTable[UINT8_COUNT] = {
@@ -85,10 +203,13 @@ namespace lox {
         [OPCODE_GET_GLOBAL] = constantInstruction,
         [OPCODE_DEFINE_GLOBAL] = constantInstruction,
         [OPCODE_SET_GLOBAL] = constantInstruction,
+        [OPCODE_GET_GLOBAL_SLOT] = slotInstruction,
+        [OPCODE_DEFINE_GLOBAL_SLOT] = slotInstruction,
+        [OPCODE_SET_GLOBAL_SLOT] = slotInstruction,
         [OPCODE_GET_UPVALUE] = byteInstruction,
         [OPCODE_SET_UPVALUE] = byteInstruction,
-        [OPCODE_GET_PROPERTY] = constantInstruction,
-        [OPCODE_SET_PROPERTY] = constantInstruction,
+        [OPCODE_GET_PROPERTY] = propertyInstruction,
+        [OPCODE_SET_PROPERTY] = propertyInstruction,
         [OPCODE_GET_SUPER] = constantInstruction,
         [OPCODE_EQUAL] = simpleInstruction,
         [OPCODE_GREATER] = simpleInstruction,
@@ -104,7 +225,7 @@ namespace lox {
         [OPCODE_JUMP_IF_FALSE] = jumpInstruction,
         [OPCODE_LOOP] = loopInstruction,
         [OPCODE_CALL] = byteInstruction,
-        [OPCODE_INVOKE] = invokeInstruction,
+        [OPCODE_INVOKE] = cachedInvokeInstruction,
         [OPCODE_SUPER_INVOKE] = invokeInstruction,
         [OPCODE_CLOSURE] = closureInstruction,
         [OPCODE_CLOSE_UPVALUE] = simpleInstruction,
@@ -112,22 +233,63 @@ namespace lox {
         [OPCODE_CLASS] = constantInstruction,
         [OPCODE_INHERIT] = simpleInstruction,
         [OPCODE_METHOD] = constantInstruction,
+        [OPCODE_GET_LOCAL_GET_LOCAL] = twoByteInstruction,
+        [OPCODE_SET_LOCAL_POP] = byteInstruction,
+        [OPCODE_ADD_CONSTANT] = constantInstruction,
+        [OPCODE_LESS_JUMP_IF_FALSE] = jumpInstruction,
+        [OPCODE_ADD_INT] = simpleInstruction,
+        [OPCODE_ADD_FLOAT] = simpleInstruction,
+        [OPCODE_SUBTRACT_INT] = simpleInstruction,
+        [OPCODE_SUBTRACT_FLOAT] = simpleInstruction,
+        [OPCODE_MULTIPLY_INT] = simpleInstruction,
+        [OPCODE_MULTIPLY_FLOAT] = simpleInstruction,
+        [OPCODE_DIVIDE_INT] = simpleInstruction,
+        [OPCODE_DIVIDE_FLOAT] = simpleInstruction,
+        [OPCODE_LESS_INT] = simpleInstruction,
+        [OPCODE_LESS_FLOAT] = simpleInstruction,
+        [OPCODE_GREATER_INT] = simpleInstruction,
+        [OPCODE_GREATER_FLOAT] = simpleInstruction,
+        [OPCODE_REG_MOVE] = unaryRegisterInstruction,
+        [OPCODE_REG_NIL] = registerInstruction,
+        [OPCODE_REG_TRUE] = registerInstruction,
+        [OPCODE_REG_FALSE] = registerInstruction,
+        [OPCODE_REG_GET_GLOBAL_SLOT] = getRegisterSlotInstruction,
+        [OPCODE_REG_DEFINE_GLOBAL_SLOT] = setRegisterSlotInstruction,
+        [OPCODE_REG_SET_GLOBAL_SLOT] = setRegisterSlotInstruction,
+        [OPCODE_REG_GET_UPVALUE] = getRegisterUpvalueInstruction,
+        [OPCODE_REG_SET_UPVALUE] = setRegisterUpvalueInstruction,
+        [OPCODE_REG_EQUAL] = binaryRegisterInstruction,
+        [OPCODE_REG_GREATER] = binaryRegisterInstruction,
+        [OPCODE_REG_LESS] = binaryRegisterInstruction,
+        [OPCODE_REG_ADD] = binaryRegisterInstruction,
+        [OPCODE_REG_SUBTRACT] = binaryRegisterInstruction,
+        [OPCODE_REG_MULTIPLY] = binaryRegisterInstruction,
+        [OPCODE_REG_DIVIDE] = binaryRegisterInstruction,
+        [OPCODE_REG_NOT] = unaryRegisterInstruction,
+        [OPCODE_REG_NEGATE] = unaryRegisterInstruction,
+        [OPCODE_REG_PRINT] = rkInstruction,
+        [OPCODE_REG_JUMP_IF_FALSE] = registerJumpInstruction,
+        [OPCODE_REG_CALL] = registerCallInstruction,
+        [OPCODE_REG_RETURN] = rkInstruction,
     };
     
     ptrdiff_t disassembleInstruction(Chunk* chunk, ptrdiff_t offset) {
-        {
-            const char* first = chunk->where[offset];
+        const LineTable::Run& run = chunk->lines.find(offset);
+        if (run.where) {
+            // a mapped source isn't null-terminated
+            const char* first = run.where;
+            const char* end = chunk->source ? chunk->source->last : nullptr;
             const char* last = first;
-            while (*last != '\0' && *last != '\n')
+            while (last != end && *last != '\0' && *last != '\n')
                 ++last;
             printf("    %.*s...\n", (int)(last - first), first);
         }
         printf("%04ld ", offset);
         if (offset > 0 &&
-            chunk->lines[offset] == chunk->lines[offset - 1]) {
+            run.line == chunk->lines.line(offset - 1)) {
             printf("   | ");
         } else {
-            printf("%04d ", chunk->lines[offset]);
+            printf("%04d ", run.line);
         }
         
         uint8_t instruction = chunk->code[offset];
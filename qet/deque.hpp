@@ -84,9 +84,15 @@ namespace gc {
     // TODO: benchmark claims above
     //
     // TODO: concurrent?
-    // TODO: bag operations that don't respect order but allow splicing
     // TODO: concurrent bag?
     //
+    // `splice(other)` is the bag operation: it takes other's elements in an
+    // unspecified order, moving at most two nodes' worth of them one by one
+    // and relinking the rest, so handing over a deque of any size costs
+    // O(M).  The spare nodes of both go to other, which is left empty, so
+    // that a producer gets back nodes to refill rather than the consumer
+    // hoarding them.
+    //
     // A thing:
     //
     // 64-slot array
@@ -261,12 +267,13 @@ namespace gc {
         }
         
         ~deque() {
-            node_type* first = _node_from(_begin);
-            node_type* last = _node_from(_end);
-            while (first != last) {
-                delete std::exchange(first, first->next);
+            // the whole ring, including spare nodes
+            if (node_type* first = _node_from(_begin)) {
+                node_type* node = first;
+                do {
+                    delete std::exchange(node, node->next);
+                } while (node != first);
             }
-            delete first;
         }
         
         deque& operator=(const deque&) = delete;
@@ -289,10 +296,9 @@ namespace gc {
         
         T& back() {
             assert(!empty());
-            node_type* last = _node_from(_begin);
-            T* p;
-            if (_begin != last->begin()) {
-                return *(_begin - 1);
+            node_type* last = _node_from(_end);
+            if (_end != last->begin()) {
+                return *(_end - 1);
             } else {
                 return *(last->prev->end() - 1);
             }
@@ -353,7 +359,6 @@ namespace gc {
         
         void pop_back() {
             assert(!empty());
-            node_type* first = _node_from(_begin);
             node_type* last = _node_from(_end);
             if (_end == last->begin()) {
                 last = last->prev;
@@ -364,13 +369,13 @@ namespace gc {
         
         void clear() {
             node_type* first = _node_from(_begin);
-            node_type* last = _node_from(_end);
-            while (first != last)
-                delete std::exchange(first, first->next);
             if (first) {
+                node_type* node = first->next;
+                while (node != first)
+                    delete std::exchange(node, node->next);
                 first->next = first;
                 first->prev = first;
-                _begin = _end = first->elements.begin() + INIT;
+                _begin = _end = first->begin() + INIT;
             }
         }
         
@@ -408,6 +413,59 @@ namespace gc {
             }
         }
         
+        void splice(deque&& other) {
+            if (other.empty())
+                return;
+            if (empty()) {
+                swap(other);
+                return;
+            }
+            // move other's leading partial node, so that it starts on a node
+            node_type* partial = _node_from(other._begin);
+            if (other._begin != partial->begin()) {
+                while (!other.empty() && (_node_from(other._begin) == partial)) {
+                    push_back(std::move(other.front()));
+                    other.pop_front();
+                }
+                if (other.empty())
+                    return;
+            }
+            // move our trailing partial node onto other, so that we end on one
+            node_type* last = _node_from(_end);
+            while (!empty() && (_end != last->begin())) {
+                other.push_back(std::move(*(_end - 1)));
+                pop_back();
+            }
+            if (empty()) {
+                swap(other);
+                return;
+            }
+            // our full nodes, then other's nodes
+            node_type* first = _node_from(_begin);
+            node_type* full = last->prev;
+            node_type* spare = first->prev;
+            node_type* other_first = _node_from(other._begin);
+            node_type* other_last = _node_from(other._end);
+            node_type* other_spare = (other_last->next != other_first) ? other_last->next : nullptr;
+            node_type* other_spare_last = other_first->prev;
+            full->next = other_first;
+            other_first->prev = full;
+            other_last->next = first;
+            first->prev = other_last;
+            _end = other._end;
+            // the rest, from last, are spare
+            if (other_spare) {
+                spare->next = other_spare;
+                other_spare->prev = spare;
+                other_spare_last->next = last;
+                last->prev = other_spare_last;
+            } else {
+                spare->next = last;
+                last->prev = spare;
+            }
+            other._begin = other._end = last->begin() + INIT;
+        }
+        
     };
     
     using std::swap;
@@ -5,13 +5,18 @@
 //  Created by Antony Searle on 10/4/2024.
 //
 
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <thread>
 #include "gc.hpp"
 #include "vm.hpp"
 
 namespace gc {
     
-    void LOG(const char* format, ...) {
+    void LOG([[maybe_unused]] const char* format, ...) {
 #ifdef LOX_DEBUG_LOG_GC
         char buffer[256];
         pthread_getname_np(pthread_self(), buffer + 240, 16);
@@ -25,8 +30,157 @@ namespace gc {
 #endif
     }
     
+    constexpr std::size_t SWEEP_BATCH = 256;
+    
+    // Lazy sweeping
+    //
+    // With LOX_GC_SWEEP=lazy, the collector does not destroy the WHITE
+    // objects it finds, but publishes them in batches that mutators destroy
+    // one at a time when they handshake.  The collector destroys whatever is
+    // left before it next examines the heap.
+    
+    struct Sweeper {
+        
+        std::mutex mutex;
+        std::condition_variable condition_variable;
+        std::vector<std::vector<Object*>> batches;
+        std::size_t busy = 0;
+        std::atomic<bool> pending = false; // <-- batches is not empty
+        bool lazy = false;
+        
+        void publish(std::vector<Object*>& dead) {
+            std::unique_lock lock{mutex};
+            for (std::size_t i = 0; i < dead.size(); i += SWEEP_BATCH) {
+                std::size_t n = std::min(i + SWEEP_BATCH, dead.size());
+                batches.emplace_back(dead.begin() + i, dead.begin() + n);
+            }
+            dead.clear();
+            pending.store(!batches.empty(), std::memory_order_relaxed);
+        }
+        
+        // destroy one batch, if there is one
+        bool help() {
+            if (!pending.load(std::memory_order_relaxed))
+                return false;
+            std::vector<Object*> batch;
+            {
+                std::unique_lock lock{mutex};
+                if (batches.empty())
+                    return false;
+                batch.swap(batches.back());
+                batches.pop_back();
+                pending.store(!batches.empty(), std::memory_order_relaxed);
+                ++busy;
+            }
+            for (Object* object : batch)
+                delete object;
+            _heap::flush();
+            this_thread::publish_bytes();
+            {
+                std::unique_lock lock{mutex};
+                --busy;
+            }
+            condition_variable.notify_all();
+            return true;
+        }
+        
+        // collector only; returns when every published object is destroyed
+        void finish() {
+            while (help())
+                ;
+            std::unique_lock lock{mutex};
+            while (busy)
+                condition_variable.wait(lock);
+        }
+        
+    }; // struct Sweeper
+    
+    Sweeper& sweeper = *new Sweeper;
+    
+    // The collector accumulates a cycle's statistics privately and publishes
+    // them here when the cycle ends
+    
+    struct Telemetry {
+        std::mutex mutex;
+        Statistics statistics;
+    };
+    
+    Telemetry& telemetry = *new Telemetry;
+    
+    Statistics statistics() {
+        Statistics result;
+        {
+            std::unique_lock lock{telemetry.mutex};
+            result = telemetry.statistics;
+        }
+        result.bytes_allocated = global.bytes_allocated.load(std::memory_order_relaxed);
+        result.bytes_freed = global.bytes_freed.load(std::memory_order_relaxed);
+        return result;
+    }
+    
+    std::string statistics_json() {
+        Statistics s = statistics();
+        std::string json;
+        char buffer[256];
+        auto append = [&](const char* format, auto... args) {
+            snprintf(buffer, sizeof(buffer), format, args...);
+            json += buffer;
+        };
+        const CycleStatistics& c = s.last;
+        append("{\"cycles\":%llu,\"bytes_allocated\":%lld,\"bytes_freed\":%lld,",
+               (unsigned long long) s.cycles,
+               (long long) s.bytes_allocated,
+               (long long) s.bytes_freed);
+        json += "\"pauses\":[";
+        for (std::size_t i = 0; i != PAUSE_BUCKETS; ++i)
+            append(i ? ",%llu" : "%llu", (unsigned long long) s.pauses[i]);
+        json += "],";
+        append("\"last\":{\"cycle\":%llu,\"live\":%lld,\"trigger\":%lld,",
+               (unsigned long long) c.cycle,
+               (long long) c.live,
+               (long long) c.trigger);
+        append("\"sleep_ns\":%lld,\"enable_ns\":%lld,\"transition_ns\":%lld,"
+               "\"mark_ns\":%lld,\"sweep_ns\":%lld,\"recolor_ns\":%lld,",
+               (long long) c.sleep_ns,
+               (long long) c.enable_ns,
+               (long long) c.transition_ns,
+               (long long) c.mark_ns,
+               (long long) c.sweep_ns,
+               (long long) c.recolor_ns);
+        append("\"minor\":%s,\"remembered\":%zu,\"old\":%zu,",
+               c.minor ? "true" : "false", c.remembered, c.old);
+        append("\"scans\":%zu,\"grays\":%zu,\"blacks\":%zu,\"whites\":%zu,\"reds\":%zu,",
+               c.scans, c.grays, c.blacks, c.whites, c.reds);
+        json += "\"handshakes\":[";
+        for (std::size_t i = 0; i != c.handshakes.size(); ++i) {
+            const HandshakeStatistics& h = c.handshakes[i];
+            append("%s{\"channel\":%llu,\"phase\":\"%s\",\"ns\":%lld}",
+                   i ? "," : "",
+                   (unsigned long long) h.channel,
+                   h.phase,
+                   (long long) h.nanoseconds);
+        }
+        json += "]}}";
+        return json;
+    }
+    
     namespace this_thread {
         
+        void publish_bytes() {
+            std::int64_t allocated = std::exchange(local.bytes_allocated, 0);
+            std::int64_t freed = std::exchange(local.bytes_freed, 0);
+            freed = global.bytes_freed.fetch_add(freed) + freed;
+            allocated = global.bytes_allocated.fetch_add(allocated) + allocated;
+            if ((allocated - freed >= global.trigger.load())
+                && !global.triggered.exchange(true)) {
+                {
+                    // synchronize with the collector's wait
+                    std::unique_lock lock{global.mutex};
+                }
+                global.condition_variable.notify_all();
+            }
+        }
+        
         void enter() {
             assert(local.depth >= 0);
             if (local.depth++)
@@ -35,15 +189,19 @@ namespace gc {
             // Create a new communication channel to the collector
             
             assert(local.channel == nullptr);
+            assert(local.heap == nullptr);
+            local.heap = _heap::acquire();
             Channel* channel = local.channel = new Channel;
             LOG("enters collectible state");
             {
                 // Publish it to the collector's list of channels
                 std::unique_lock lock{global.mutex};
                 // channel->next = global.channels;
+                channel->id = ++global.channels;
                 global.entrants.push_back(channel);
                 channel->WHITE = local.WHITE = global.WHITE;
                 channel->ALLOC = local.ALLOC = global.ALLOC;
+                channel->barrier = local.barrier = global.barrier;
             }
             // Wake up the mutator
             global.condition_variable.notify_all();
@@ -66,22 +224,14 @@ namespace gc {
                 LOG("leaves collectible state", channel);
                 // Was there a handshake requested?
                 pending = std::exchange(channel->pending, false);
+                channel->requested.store(false, std::memory_order_relaxed);
                 channel->abandoned = true;
                 channel->dirty = local.dirty;
                 LOG("%spublishes %s, orphans", pending ? "handshakes, " : "", local.dirty ? "dirty" : "clean");
                 local.dirty = false;
-                if (channel->infants.empty()) {
-                    channel->infants.swap(local.allocations);
-                    assert(local.allocations.empty());
-                } else {
-                    // we are leaving after we have acknowledged a handshake, but
-                    // before the collector has taken our infants
-                    while (!local.allocations.empty()) {
-                        Object* p = local.allocations.front();
-                        local.allocations.pop_front();
-                        channel->infants.push_back(p);
-                    }
-                }
+                // we may be leaving after we have acknowledged a handshake,
+                // but before the collector has taken our infants
+                channel->infants.splice(std::move(local.allocations));
                 channel->request_infants = false;
             }
             // wake up the collector if it was already waiting on a handshake
@@ -90,6 +240,11 @@ namespace gc {
                 channel->condition_variable.notify_all();
             }
             local.channel = nullptr;
+            publish_bytes();
+            
+            // Our pages stay in use by our objects; orphan the heap for
+            // adoption by the next thread to enter
+            _heap::release(std::exchange(local.heap, nullptr));
             
         }
         
@@ -119,6 +274,7 @@ namespace gc {
                     
                     local.WHITE = channel->WHITE;
                     local.ALLOC = channel->ALLOC;
+                    local.barrier = channel->barrier;
                     
                     if (channel->request_infants) {
                         LOG("publishing ?? new allocations");
@@ -129,6 +285,8 @@ namespace gc {
                     channel->request_infants = false;
                     
                     channel->pending = false;
+                    channel->requested.store(false, std::memory_order_relaxed);
+                    channel->acknowledged_at = std::chrono::steady_clock::now();
                     
                 } else {
                     // LOG("handshake not requested");
@@ -144,12 +302,200 @@ namespace gc {
                     shade(ref);
                 }
                 LOG("shades %ld roots", count);
+                // reclaim a bounded amount of garbage on the collector's behalf
+                sweeper.help();
             }
         }
         
     } // namespace this_thread
     
     
+    // Helper threads that share the collector's tracing and destruction
+    //
+    // The collector pushes the objects it turns BLACK onto its own
+    // ScanContext and calls mark.  Each participant drains its own
+    // work-stealing deque, steals from the others when it runs dry, and
+    // goes idle when it fails to.  Only an active participant can hold
+    // or produce work, so when the count of active participants reaches
+    // zero every deque is empty and the trace is complete.
+    //
+    // The sweep only classifies objects, because weak objects must unlink
+    // themselves from the string table as a mutator would.  The WHITE
+    // objects it finds are then destroyed in parallel by the same threads.
+    //
+    // The number of helpers is read from the environment variable
+    // LOX_GC_MARKERS, and defaults to zero.
+
+    struct Markers {
+
+        std::vector<ScanContext*> contexts; // <-- [0] is the collector's
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable condition_variable;
+        std::uint64_t epoch = 0;
+        std::size_t finished = 0;
+        std::atomic<std::size_t> active = 0;
+        std::function<void(std::size_t)> task;
+
+        void start(ScanContext* working) {
+            contexts.push_back(working);
+            std::size_t helpers = 0;
+            if (const char* s = std::getenv("LOX_GC_MARKERS"))
+                helpers = (std::size_t) std::max(std::atoi(s), 0);
+            helpers = std::min<std::size_t>(helpers, std::thread::hardware_concurrency());
+            for (std::size_t i = 1; i <= helpers; ++i)
+                contexts.push_back(new ScanContext);
+            for (std::size_t i = 1; i <= helpers; ++i)
+                threads.emplace_back(&Markers::helper, this, i);
+            LOG("starts %zu helper markers", helpers);
+        }
+
+        // collector only; runs task(index) on every participant and returns
+        // when they have all finished
+        template<typename F>
+        void parallel(F&& f) {
+            std::size_t helpers = contexts.size() - 1;
+            {
+                std::unique_lock lock{mutex};
+                task = std::forward<F>(f);
+                finished = 0;
+                ++epoch;
+            }
+            if (helpers)
+                condition_variable.notify_all();
+            task(0);
+            std::unique_lock lock{mutex};
+            while (finished != helpers)
+                condition_variable.wait(lock);
+        }
+
+        // collector only; returns when all reachable objects are scanned
+        void mark() {
+            for (ScanContext* context : contexts)
+                context->WHITE = contexts[0]->WHITE;
+            active.store(contexts.size(), std::memory_order_seq_cst);
+            parallel([this](std::size_t index) {
+                work(index);
+            });
+        }
+        
+        // collector only; runs the destructors of WHITE objects, in
+        // SWEEP_BATCH chunks claimed by all participants
+        void destroy(std::vector<Object*>& dead) {
+            std::atomic<std::size_t> next = 0;
+            parallel([&](std::size_t) {
+                for (;;) {
+                    std::size_t i = next.fetch_add(SWEEP_BATCH, std::memory_order_relaxed);
+                    if (i >= dead.size())
+                        break;
+                    std::size_t n = std::min(i + SWEEP_BATCH, dead.size());
+                    for (; i != n; ++i)
+                        delete dead[i];
+                }
+                _heap::flush();
+                this_thread::publish_bytes();
+            });
+            dead.clear();
+        }
+
+        void helper(std::size_t index) {
+            char name[16];
+            snprintf(name, 16, "C%zu", index);
+            pthread_setname_np(name);
+            std::uint64_t seen = 0;
+            for (;;) {
+                {
+                    std::unique_lock lock{mutex};
+                    while (epoch == seen)
+                        condition_variable.wait(lock);
+                    seen = epoch;
+                }
+                task(index);
+                {
+                    std::unique_lock lock{mutex};
+                    ++finished;
+                }
+                condition_variable.notify_all();
+            }
+        }
+
+        bool steal(std::size_t index, Object const*& object) {
+            std::size_t n = contexts.size();
+            for (std::size_t i = 1; i != n; ++i)
+                if (contexts[(index + i) % n]->_stack.steal(object))
+                    return true;
+            return false;
+        }
+
+        bool stealable(std::size_t index) {
+            std::size_t n = contexts.size();
+            for (std::size_t i = 1; i != n; ++i)
+                if (!contexts[(index + i) % n]->_stack.empty())
+                    return true;
+            return false;
+        }
+
+        static void scan(Object const* object, ScanContext& context) {
+            assert(object && object->color.load(std::memory_order::relaxed) == (context.BLACK()));
+            object->_gc_scan(context);
+        }
+
+        void work(std::size_t index) {
+            ScanContext& context = *contexts[index];
+            Object const* object = nullptr;
+            for (;;) {
+                while (context._stack.pop(object))
+                    scan(object, context);
+                if (steal(index, object)) {
+                    scan(object, context);
+                    continue;
+                }
+                // go idle, but return to work if any appears
+                active.fetch_sub(1, std::memory_order_seq_cst);
+                for (;;) {
+                    if (active.load(std::memory_order_seq_cst) == 0)
+                        return;
+                    if (stealable(index)) {
+                        active.fetch_add(1, std::memory_order_seq_cst);
+                        if (steal(index, object)) {
+                            scan(object, context);
+                            break;
+                        }
+                        active.fetch_sub(1, std::memory_order_seq_cst);
+                    }
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+    }; // struct Markers
+    
+
+#ifdef LOX_GC_GENERATIONAL
+    
+    // collector only; moves the marked cards into taken, clearing them
+    void take_cards(std::vector<std::uint8_t>& taken) {
+        taken.resize(CARD_COUNT);
+        for (std::size_t i = 0; i != CARD_COUNT; ++i)
+            taken[i] = (cards[i].load(std::memory_order_relaxed)
+                        ? cards[i].exchange(0, std::memory_order_relaxed)
+                        : 0);
+    }
+    
+    // does any taken card overlap the object's block?
+    bool remembered(const Object* object, const std::vector<std::uint8_t>& taken) {
+        const _heap::Page* page = _heap::page_of(object);
+        std::size_t size = page->owner ? page->size : page->size - _heap::HEADER_SIZE;
+        std::uintptr_t first = reinterpret_cast<std::uintptr_t>(object) >> CARD_SHIFT;
+        std::uintptr_t last = (reinterpret_cast<std::uintptr_t>(object) + size - 1) >> CARD_SHIFT;
+        for (std::uintptr_t i = first; i <= last; ++i)
+            if (taken[i & (CARD_COUNT - 1)])
+                return true;
+        return false;
+    }
+    
+#endif
+
     void collect() {
         
         pthread_setname_np("C0");
@@ -165,8 +511,62 @@ namespace gc {
         deque<Object*> whitelist;
         
         ScanContext working;
+        Markers markers;
+        markers.start(&working);
+        if (const char* s = std::getenv("LOX_GC_SWEEP"))
+            sweeper.lazy = !std::strcmp(s, "lazy");
+        std::vector<Object*> dead;
+        std::int64_t gogc = 100;
+        if (const char* s = std::getenv("LOX_GOGC"))
+            gogc = std::max(std::atoll(s), 0ll);
 
         std::vector<Channel*> mutators, mutators2;
+        
+        // the old generation, and the policy for when to collect it
+        bool minor = false;
+#ifdef LOX_GC_GENERATIONAL
+        deque<Object*> old;
+        deque<Object*> quarantine; // <-- RED, awaiting a major cycle
+        std::size_t old_count = 0;
+        std::size_t old_after_major = 0;
+        std::size_t minors = 0;
+        std::size_t max_minors = 4;
+        if (const char* s = std::getenv("LOX_GC_MINORS"))
+            max_minors = (std::size_t) std::max(std::atoi(s), 0);
+        std::vector<std::uint8_t> taken;
+#endif
+        
+        using clock = std::chrono::steady_clock;
+        auto nanoseconds = [](clock::time_point a, clock::time_point b) -> std::int64_t {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(b - a).count();
+        };
+        CycleStatistics cycle;
+        clock::time_point phase = clock::now();
+        // ends the current phase, returning its duration
+        auto lap = [&]() {
+            clock::time_point now = clock::now();
+            return nanoseconds(std::exchange(phase, now), now);
+        };
+        // records the round trip of a channel's acknowledged handshake
+        auto acknowledged = [&](Channel* channel, const char* name) {
+            cycle.handshakes.push_back({
+                channel->id,
+                name,
+                nanoseconds(channel->requested_at, channel->acknowledged_at)
+            });
+        };
+        // publishes the statistics of a completed cycle
+        auto publish = [&]() {
+            std::unique_lock lock{telemetry.mutex};
+            Statistics& s = telemetry.statistics;
+            cycle.cycle = ++s.cycles;
+            for (const HandshakeStatistics& h : cycle.handshakes) {
+                std::size_t i = std::bit_width((std::uint64_t) std::max<std::int64_t>(h.nanoseconds, 1)) - 1;
+                ++s.pauses[std::min(i, PAUSE_BUCKETS - 1)];
+            }
+            s.last = std::move(cycle);
+            cycle = CycleStatistics{};
+        };
                 
         auto accept_entrants = [&]() {
             assert(mutators2.empty());
@@ -189,6 +589,92 @@ namespace gc {
                 
         for (;;) {
             
+            // the heap must hold no dead objects when we next examine it
+            sweeper.finish();
+            lap();
+            
+            if (gogc) {
+                // sleep until the heap has grown enough
+                this_thread::publish_bytes();
+                std::int64_t live = global.bytes_allocated.load() - global.bytes_freed.load();
+                std::int64_t trigger = std::max(live + live * gogc / 100, PACER_MIN_HEAP);
+                LOG("live %lld, sleeping until %lld", (long long) live, (long long) trigger);
+                global.trigger.store(trigger);
+                global.triggered.store(false);
+                cycle.live = live;
+                cycle.trigger = trigger;
+                std::unique_lock lock{global.mutex};
+                while (global.bytes_allocated.load() - global.bytes_freed.load() < trigger)
+                    global.condition_variable.wait(lock);
+            }
+            cycle.sleep_ns = lap();
+            
+            if (!global.barrier) {
+                
+                // Handshake to turn the write barrier back on, so that every
+                // mutator is shading before any mutator reports its roots
+                
+                LOG("enabling write barrier");
+                {
+                    std::unique_lock lock{global.mutex};
+                    global.barrier = true;
+                }
+                accept_entrants();
+                assert(mutators2.empty());
+                while (!mutators.empty()) {
+                    Channel* channel = mutators.back();
+                    mutators.pop_back();
+                    bool abandoned = false;
+                    {
+                        std::unique_lock lock{channel->mutex};
+                        assert(!channel->pending);
+                        if (!channel->abandoned) {
+                            channel->pending = true;
+                            channel->requested.store(true, std::memory_order_relaxed);
+                            channel->requested_at = clock::now();
+                        } else {
+                            abandoned = true;
+                            assert(infants.empty());
+                            infants.swap(channel->infants);
+                        }
+                        channel->barrier = true;
+                    }
+                    if (!abandoned) {
+                        mutators2.push_back(channel);
+                    } else {
+                        delete channel;
+                        objects.splice(std::move(infants));
+                    }
+                }
+                // autoshake
+                gc::this_thread::handshake();
+                while (!mutators2.empty()) {
+                    Channel* channel = mutators2.back();
+                    mutators2.pop_back();
+                    bool abandoned = false;
+                    {
+                        std::unique_lock lock{channel->mutex};
+                        while (!channel->abandoned && channel->pending)
+                            channel->condition_variable.wait(lock);
+                        if (channel->abandoned) {
+                            abandoned = true;
+                            assert(infants.empty());
+                            infants.swap(channel->infants);
+                        } else {
+                            acknowledged(channel, "enable");
+                        }
+                        channel->dirty = false;
+                    }
+                    if (!abandoned) {
+                        mutators.push_back(channel);
+                    } else {
+                        delete channel;
+                        objects.splice(std::move(infants));
+                    }
+                }
+            }
+            
+            cycle.enable_ns = lap();
             LOG("collection begins");
 
             LOG("begin transition to allocating BLACK");
@@ -224,6 +710,8 @@ namespace gc {
                             assert(!channel->pending); // handshake fumbled?!
                             if (!channel->abandoned) {
                                 channel->pending = true;
+                                channel->requested.store(true, std::memory_order_relaxed);
+                                channel->requested_at = clock::now();
                                 channel->request_infants = true;
                             } else {
                                 abandoned = true;
@@ -236,7 +724,7 @@ namespace gc {
                             mutators2.push_back(channel);
                         } else {
                             delete channel;
-                            objects.append(std::move(infants));
+                            objects.splice(std::move(infants));
                         }
                     }
 
@@ -265,11 +753,13 @@ namespace gc {
                                 channel->condition_variable.wait(lock);
                             if (channel->abandoned)
                                 abandoned = true;
+                            else
+                                acknowledged(channel, "transition");
                             channel->dirty = false;
                             assert(infants.empty());
                             infants.swap(channel->infants);
                         }
-                        objects.append(std::move(infants));
+                        objects.splice(std::move(infants));
                         if (!abandoned) {
                             mutators.push_back(channel);
                         } else {
@@ -300,6 +790,31 @@ namespace gc {
             }
 
             LOG("end transition to allocating BLACK");
+            cycle.transition_ns = lap();
+            
+#ifdef LOX_GC_GENERATIONAL
+            // Every mutator's barrier is now shading, so stores from here on
+            // are seen without their cards.  Those marked before are taken,
+            // and the old objects they overlap are traced again.  A major
+            // cycle traces everything anyway, and only clears them.
+            take_cards(taken);
+            cycle.minor = minor;
+            if (minor) {
+                for (Object* object : old) {
+                    if (remembered(object, taken)) {
+                        working._stack.push(object);
+                        ++cycle.remembered;
+                    }
+                }
+            }
+#endif
+            // In a minor cycle, the BLACK objects handed over are those
+            // allocated during the last cycle.  They are old, but they have
+            // never been traced, so the first pass traces them.  Minor cycles
+            // need the object list, so the heap walk has no use for this.
+#ifndef LOX_GC_SWEEP_PAGES
+            bool trace_blacks = minor;
+#endif
             
             // hack some stuff
             //markTable(&lox::gc.strings);
@@ -334,6 +849,29 @@ namespace gc {
                     std::size_t whites = 0;
                     std::size_t reds = 0;
                     LOG("scanning...");
+#ifdef LOX_GC_SWEEP_PAGES
+                    // walk the heap for GRAY objects; the only objects being
+                    // constructed concurrently are BLACK, so we make no
+                    // virtual calls on them
+                    _heap::for_each_live([&](void* block, bool) {
+                        Object* object = static_cast<Object*>(block);
+                        Color expected = Color::GRAY;
+                        object->color.compare_exchange_strong(expected,
+                                                              local.BLACK(),
+                                                              std::memory_order_relaxed,
+                                                              std::memory_order_relaxed);
+                        if (expected == (local.BLACK())) {
+                            ++blacks;
+                        } else if (expected == Color::GRAY) { // GRAY -> BLACK
+                            ++grays;
+                            working._stack.push(object);
+                        } else if (expected == local.WHITE) {
+                            ++whites;
+                        } else {
+                            abort();
+                        }
+                    });
+#else
                     // for (Object* object : objects) {
                     while (!objects.empty()) {
                         //object->_gc_print();
@@ -349,26 +887,30 @@ namespace gc {
                         if (expected == (local.BLACK())) {
                             ++blacks;
                             blacklist.push_back(object);
+                            if (trace_blacks)
+                                working._stack.push(object);
                         } else if (expected == Color::GRAY) { // GRAY -> BLACK
                             ++grays;
-                            object->_gc_scan(working);
+                            working._stack.push(object);
                             blacklist.push_back(object);
-                            while (!working._stack.empty()) {
-                                Object const* object = working._stack.top();
-                                working._stack.pop();
-                                assert(object && object->color.load(std::memory_order::relaxed) == (working.BLACK()));
-                                object->_gc_scan(working);
-                            }
                         } else if (expected == local.WHITE) {
                             ++whites;
                             whitelist.push_back(object);
                         } else {
-                            printf("%ld\n", local.BLACK());
-                            printf("%ld\n", local.WHITE);
-                            printf("%ld\n", expected);
+                            printf("%d\n", (int) local.BLACK());
+                            printf("%d\n", (int) local.WHITE);
+                            printf("%d\n", (int) expected);
                             abort();
                         }
                     }
+#endif
+                    // trace from the newly BLACK objects
+                    markers.mark();
+#ifndef LOX_GC_SWEEP_PAGES
+                    trace_blacks = false;
+#endif
+                    ++cycle.scans;
+                    cycle.grays += grays;
                     LOG("        ...scanning found BLACK=%zu, GRAY=%zu, WHITE=%zu, RED=%zu", blacks, grays, whites, reds);
                     swap(objects, whitelist);
                 } while (local.dirty);
@@ -398,6 +940,8 @@ namespace gc {
                         assert(!channel->pending);
                         if (!channel->abandoned) {
                             channel->pending = true;
+                            channel->requested.store(true, std::memory_order_relaxed);
+                            channel->requested_at = clock::now();
                         } else {
                             abandoned = true;
                             if (channel->dirty) {
@@ -416,7 +960,7 @@ namespace gc {
                         // observed alloc = black, so they should all be black,
                         // and we should put them directly into some place we
                         // won't keep rescanning
-                        objects.append(std::move(infants));
+                        objects.splice(std::move(infants));
                     }
                 }
                 // autoshake
@@ -434,6 +978,8 @@ namespace gc {
                             abandoned = true;
                             assert(infants.empty());
                             infants.swap(channel->infants);
+                        } else {
+                            acknowledged(channel, "mark");
                         }
                         LOG("%p reports it was %s", channel, channel->dirty ? "dirty" : "clean");
                         if (channel->dirty) {
@@ -445,7 +991,7 @@ namespace gc {
                         mutators.push_back(channel);
                     } else {
                         delete channel;
-                        objects.append(std::move(infants));
+                        objects.splice(std::move(infants));
                     }
                 }
                 
@@ -458,6 +1004,8 @@ namespace gc {
                 
             }
             
+            cycle.mark_ns = lap();
+            
             // Neither the collectors nor mutators marked any nodes GRAY since
             // the last handshake.
             //
@@ -473,13 +1021,43 @@ namespace gc {
                 std::size_t reds = 0;
                 SweepContext context;
                 context.WHITE = local.WHITE;
+#ifdef LOX_GC_SWEEP_PAGES
+                _heap::for_each_live([&](void* block, bool trivial) {
+                    Object* object = static_cast<Object*>(block);
+                    Color before = object->color.load(std::memory_order_relaxed);
+                    if (before == (local.BLACK())) {
+                        // possibly still under construction
+                        ++blacks;
+                        return;
+                    }
+                    if (trivial) {
+                        // nothing to destroy, so skip the virtual calls
+                        assert(before == local.WHITE);
+                        gc::free(block);
+                        ++whites;
+                        ++freed;
+                        return;
+                    }
+                    Color after = object->_gc_sweep(context);
+                    if (after == local.WHITE) {
+                        dead.push_back(object);
+                        ++whites;
+                        ++freed;
+                    } else if (after == (local.BLACK())) {
+                        ++blacks;
+                    } else if (after == Color::RED) {
+                        ++reds;
+                        redlist.push_back(object);
+                    }
+                });
+#endif
                 while (!objects.empty()) {
                     Object* object = objects.front();
                     objects.pop_front();
                     assert(object);
                     Color after = object->_gc_sweep(context);
                     if (after == local.WHITE) {
-                        // delete object;
+                        dead.push_back(object);
                         ++whites;
                         ++freed;
                     } else if (after == (local.BLACK())) {
@@ -491,9 +1069,19 @@ namespace gc {
                     }
                     
                 }
+                if (sweeper.lazy)
+                    sweeper.publish(dead);
+                else
+                    markers.destroy(dead);
+                // return the swept blocks to their owners in batches
+                _heap::flush();
                 LOG("    ...sweeping found BLACK=%zu, WHITE=%zu, RED=%zu", blacks, whites, reds);
                 LOG("freed %zu", whites);
+                cycle.blacks = blacks;
+                cycle.whites = whites;
+                cycle.reds = reds;
             }
+            cycle.sweep_ns = lap();
             
             // Only BLACK and RED objects exist
             // The mutators are allocating BLACK
@@ -507,11 +1095,36 @@ namespace gc {
             // The write barrier turns some WHITE objects GRAY or BLACK
             // All colours exist
             
+#ifdef LOX_GC_GENERATIONAL
+            // Decide what the next cycle collects.  Before a minor cycle the
+            // survivors stay BLACK, and mutators allocate WHITE again
+            if (minor)
+                ++minors;
+            else
+                minors = 0;
+            {
+                std::size_t survivors = 0;
+                for ([[maybe_unused]] Object* object : blacklist)
+                    ++survivors;
+                if (!minor)
+                    old_after_major = survivors;
+                minor = ((minors < max_minors)
+                         && (old_count + survivors < 2 * old_after_major + 1024));
+                if (minor)
+                    old_count += survivors;
+            }
+#endif
             {
-                local.WHITE = Color{static_cast<std::intptr_t>(local.WHITE) ^ 1};
+                if (minor)
+                    local.ALLOC = local.WHITE;
+                else
+                    local.WHITE = Color{static_cast<std::int32_t>(local.WHITE) ^ 1};
                 working.WHITE = local.WHITE;
                 std::unique_lock lock{global.mutex};
                 global.WHITE = local.WHITE;
+                global.ALLOC = local.ALLOC;
+                // while we sleep, shading would only make floating garbage
+                global.barrier = !gogc;
             }
 
             accept_entrants();
@@ -527,6 +1140,8 @@ namespace gc {
                     assert(!channel->pending);
                     if (!channel->abandoned) {
                         channel->pending = true;
+                        channel->requested.store(true, std::memory_order_relaxed);
+                        channel->requested_at = clock::now();
                         assert(channel->infants.empty());
                     } else {
                         abandoned = true;
@@ -535,6 +1150,7 @@ namespace gc {
                     }
                     channel->WHITE = local.WHITE;
                     channel->ALLOC = local.ALLOC;
+                    channel->barrier = !gogc;
                 }
                 if (!abandoned) {
                     mutators2.push_back(channel);
@@ -544,7 +1160,7 @@ namespace gc {
                     // which has changed meaning from black to white since the
                     // last handshake.  Some of them may have already been
                     // turned from white to gray or black by the write barrier.
-                    objects.append(std::move(infants));
+                    objects.splice(std::move(infants));
                 }
             }
             // autoshake
@@ -561,6 +1177,7 @@ namespace gc {
                         channel->condition_variable.wait(lock);
                     if (!channel->abandoned) {
                         LOG("%p acknowledges recoloring", channel);
+                        acknowledged(channel, "recolor");
                         assert(infants.empty());
                     } else {
                         LOG("%p leaves", channel);
@@ -577,12 +1194,23 @@ namespace gc {
                     mutators.push_back(channel);
                 } else {
                     delete channel;
-                    objects.append(std::move(infants));
+                    objects.splice(std::move(infants));
                 }
             }
             
             // claim the red objects
             
+#ifdef LOX_GC_GENERATIONAL
+            // Old objects, and those allocated during this cycle, may still
+            // hold weak references to the red objects, and a minor cycle may
+            // scan them whether they are live or not.  Only a major cycle
+            // reclaims such objects, so the red objects wait for the end of
+            // the next one.
+            if (cycle.minor)
+                quarantine.append(std::move(redlist));
+            else
+                swap(redlist, quarantine);
+#endif
             {
                 std::size_t reds = 0;
                 while (!redlist.empty()) {
@@ -592,14 +1220,25 @@ namespace gc {
                     ++reds;
                     ++freed;
                 }
+                _heap::flush();
                 LOG("freed REDS %zd", reds);
             }
             
-            while (!blacklist.empty()) {
-                Object* object = blacklist.front();
-                blacklist.pop_front();
-                objects.push_back(object);
+#ifdef LOX_GC_GENERATIONAL
+            // promote the survivors, or return everything to the next trace
+            if (minor) {
+                old.splice(std::move(blacklist));
+            } else {
+                objects.splice(std::move(old));
+                old_count = 0;
             }
+            cycle.old = old_count;
+#endif
+            
+            objects.splice(std::move(blacklist));
+            
+            cycle.recolor_ns = lap();
+            publish();
             
             
             
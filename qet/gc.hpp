@@ -14,9 +14,14 @@
 #include <cstdint>
 
 #include <atomic>
+#include <chrono>
 #include <stack>
+#include <string>
+#include <vector>
 
 #include "deque.hpp"
+#include "heap.hpp"
+#include "workstealing.hpp"
 
 namespace gc {
 
@@ -66,7 +71,69 @@ namespace gc {
         //   - dirty flag (did we shade any objects WHITE -> GRAY since last handshake?)
         void handshake();
         
+        // called frequently, at safepoints
+        // - handshakes only if the collector has requested it, without taking
+        //   the channel's mutex in the common case
+        // - returns true if a handshake occurred, in which case the caller
+        //   must mark any roots it holds outside of local.roots
+        bool safepoint();
+        
+        // adds the local byte counts to the global ones, and wakes the
+        // collector if the heap has grown enough to warrant a cycle
+        void publish_bytes();
+        
     }
+    
+    // Telemetry
+    //
+    // The collector times each phase of every cycle, and the round trip of
+    // every handshake it requests, from the request to the mutator's
+    // acknowledgement.  The round trips are also accumulated into a
+    // histogram with power-of-two nanosecond buckets, since they bound how
+    // long a mutator can hold up a cycle.
+    
+    constexpr std::size_t PAUSE_BUCKETS = 40; // <-- up to about 18 minutes
+    
+    struct HandshakeStatistics {
+        std::uint64_t channel;    // <-- Channel::id of the mutator
+        const char* phase;
+        std::int64_t nanoseconds;
+    };
+    
+    struct CycleStatistics {
+        std::uint64_t cycle = 0;
+        std::int64_t live = 0;    // <-- bytes when the pacer last slept
+        std::int64_t trigger = 0; // <-- bytes that woke it
+        std::int64_t sleep_ns = 0;
+        std::int64_t enable_ns = 0; // <-- turning the write barrier on
+        std::int64_t transition_ns = 0; // <-- to allocating BLACK
+        std::int64_t mark_ns = 0;
+        std::int64_t sweep_ns = 0;
+        std::int64_t recolor_ns = 0;
+        bool minor = false;       // <-- traced only the young generation
+        std::size_t remembered = 0; // <-- old objects with marked cards
+        std::size_t old = 0;      // <-- size of the old generation after
+        std::size_t scans = 0;    // <-- passes over the object list
+        std::size_t grays = 0;    // <-- found by those passes
+        std::size_t blacks = 0;   // <-- the sweep's census
+        std::size_t whites = 0;
+        std::size_t reds = 0;
+        std::vector<HandshakeStatistics> handshakes;
+    };
+    
+    struct Statistics {
+        std::uint64_t cycles = 0;
+        std::int64_t bytes_allocated = 0;
+        std::int64_t bytes_freed = 0;
+        std::uint64_t pauses[PAUSE_BUCKETS] = {}; // <-- [i] counts [2^i, 2^(i+1)) ns
+        CycleStatistics last;     // <-- the most recently completed cycle
+    };
+    
+    // a consistent copy of the collector's statistics
+    Statistics statistics();
+    
+    // the same, as a JSON object
+    std::string statistics_json();
 
     // internal garbage collection interface
 
@@ -74,20 +141,28 @@ namespace gc {
     struct CollectionContext;
     struct Global;
     struct Local;
+    struct Markers;
     struct ScanContext;
+    struct Sweeper;
     struct ShadeContext;
     struct SweepContext;
 
+    // thread-local pooled storage for Objects; see heap.hpp
     void* alloc(std::size_t count);
-    void free(Object*); // <-- delete is convenient...
+    void free(void*);
     void LOG(const char* format, ...);
     
     // must shade involved objects whenever mutating the graph
     // - StrongPtr automates this for common use cases
     void shade(const Object* object);
     void shade(const Object* object, ShadeContext& context);
+    
+    // must mark the card of a field of an Object after storing a pointer
+    // into it; a no-op unless LOX_GC_GENERATIONAL
+    // - StrongPtr and AtomicValue automate this for common use cases
+    void remember(const void* field);
 
-    enum class Color : std::intptr_t {
+    enum class Color : std::int32_t {
         // WHITE = 0 or 1, not (yet) reached
         // BLACK = 1 or 0, reached and (will be) scanned
         GRAY = 2, //       reached but not yet scanned
@@ -103,6 +178,12 @@ namespace gc {
     
     struct Object {
         
+        // route new and delete of all Objects through the pools
+        static void* operator new(std::size_t count);
+        static void* operator new(std::size_t count, void* ptr);
+        static void operator delete(void* ptr);
+        static void operator delete(void* ptr, void* place);
+        
     protected:
         
         mutable std::atomic<Color> color;
@@ -127,6 +208,8 @@ namespace gc {
         
         // friends that access protected methods
         friend struct ScanContext;
+        friend struct Markers;
+        friend struct Sweeper;
         friend void shade(const Object*, ShadeContext&);
         friend void collect();
 
@@ -269,6 +352,58 @@ namespace gc {
 
 
 
+    // Pacing
+    //
+    // Like GOGC, the collector sleeps after each cycle until the heap has
+    // grown by LOX_GOGC percent (default 100) of what the cycle left live,
+    // or to PACER_MIN_HEAP if that is larger.  LOX_GOGC=0 collects back to
+    // back.
+    
+    constexpr std::int64_t PACER_MIN_HEAP = std::int64_t{4} << 20;
+    constexpr std::int64_t PACER_QUANTUM = std::int64_t{64} << 10;
+    
+    // Generations
+    //
+    // With LOX_GC_GENERATIONAL, the objects that survive a cycle are
+    // promoted into an old generation that stays BLACK, and the next cycles
+    // are minor: they trace and sweep only the objects allocated since,
+    // until LOX_GC_MINORS of them have run (default 4) or the old generation
+    // has doubled, when a major cycle recolors and traces everything again.
+    //
+    // A minor cycle does not trace the old generation, so it must learn of
+    // every pointer stored into an old object since the last cycle.  Every
+    // barriered store marks the card of the field it writes, in a table
+    // indexed by address.  Distinct addresses can share a card, which only
+    // costs a needless rescan.  The collector takes the marked cards once
+    // the barrier is on again, and rescans the old objects overlapping them.
+    
+#ifdef LOX_GC_GENERATIONAL
+#ifdef LOX_GC_SWEEP_PAGES
+#error "LOX_GC_GENERATIONAL needs the object list that LOX_GC_SWEEP_PAGES replaces"
+#endif
+    
+    constexpr std::size_t CARD_SHIFT = 7;
+    constexpr std::size_t CARD_COUNT = std::size_t{1} << 20;
+    
+    inline std::atomic<std::uint8_t>* const cards = new std::atomic<std::uint8_t>[CARD_COUNT]{};
+    
+    inline std::size_t card_of(const void* ptr) {
+        return (reinterpret_cast<std::uintptr_t>(ptr) >> CARD_SHIFT) & (CARD_COUNT - 1);
+    }
+    
+    inline void remember(const void* field) {
+        std::atomic<std::uint8_t>& card = cards[card_of(field)];
+        // check first, to keep a hot card's line shared
+        if (!card.load(std::memory_order_relaxed))
+            card.store(1, std::memory_order_relaxed);
+    }
+    
+#else
+    
+    inline void remember(const void*) {}
+    
+#endif
+    
     struct Global {
         
         // public sequential state
@@ -278,10 +413,21 @@ namespace gc {
         
         Color WHITE = Color{0};
         Color ALLOC = Color{0};
+        bool barrier = true;
         
         std::vector<Channel*> entrants;
         deque<Object*> roots;
         
+        // pacing; threads publish their byte counts in PACER_QUANTUM steps,
+        // and wake the collector when the heap reaches trigger
+        
+        std::atomic<std::int64_t> bytes_allocated = 0;
+        std::atomic<std::int64_t> bytes_freed = 0;
+        std::atomic<std::int64_t> trigger = PACER_MIN_HEAP;
+        std::atomic<bool> triggered = false;
+        
+        std::uint64_t channels = 0; // <-- Channel::id source
+        
     };
         
     
@@ -293,8 +439,14 @@ namespace gc {
         bool pending = false;
         bool dirty = false;
         bool request_infants = false;
+        // mirrors pending so that the mutator can poll it without the mutex
+        std::atomic<bool> requested = false;
+        std::uint64_t id = 0;
+        std::chrono::steady_clock::time_point requested_at;
+        std::chrono::steady_clock::time_point acknowledged_at;
         Color WHITE = Color{-1};
         Color ALLOC = Color{-1};
+        bool barrier = true;
         deque<Object*> infants;
     };
 
@@ -302,15 +454,17 @@ namespace gc {
     // Thread local state
     struct Local {
         Color WHITE = Color{-1};
-        Color BLACK() const { return Color{static_cast<std::intptr_t>(WHITE)^1}; }
+        Color BLACK() const { return Color{static_cast<std::int32_t>(WHITE)^1}; }
         Color ALLOC = Color{-1};
+        bool barrier = true; // <-- write barrier is shading
         int depth = 0;
         bool dirty = false;
         deque<Object*> allocations;
         deque<Object*> roots;
         Channel* channel = nullptr;
-        std::int64_t bytes_allocated;
-        std::int64_t bytes_freed;
+        _heap::Heap* heap = nullptr;
+        std::int64_t bytes_allocated = 0; // <-- not yet published to global
+        std::int64_t bytes_freed = 0;     // <-- not yet published to global
     };
     
     // Context passed to gc operations to avoid, for example, repeated atomic
@@ -318,7 +472,7 @@ namespace gc {
     
     struct CollectionContext {
         Color WHITE;
-        Color BLACK() const { return Color{static_cast<std::intptr_t>(WHITE)^1}; }
+        Color BLACK() const { return Color{static_cast<std::int32_t>(WHITE)^1}; }
     };
 
     struct ShadeContext : CollectionContext {
@@ -342,7 +496,8 @@ namespace gc {
             push(field.load(std::memory_order::acquire));
         }
 
-        std::stack<Object const*, std::vector<Object const*>> _stack;
+        // BLACK objects awaiting scanning; helper markers steal from it
+        WorkStealingDeque<Object const*> _stack;
         
     };
     
@@ -352,9 +507,23 @@ namespace gc {
         
     
     
-    inline Global global;
+    // never destroyed, since the collector sleeps on it across exit
+    inline Global& global = *new Global;
     inline thread_local Local local;
 
+    namespace this_thread {
+        
+        inline bool safepoint() {
+            // relaxed is sufficient; handshake() synchronizes on the mutex
+            if (local.channel->requested.load(std::memory_order_relaxed)) {
+                handshake();
+                return true;
+            }
+            return false;
+        }
+        
+    } // namespace this_thread
+
 
     inline void shade(const Object* object, ShadeContext& context) {
         if (object) {
@@ -363,6 +532,9 @@ namespace gc {
     }
 
     inline void shade(const Object* object) {
+        // no cycle is tracing, so there is nothing to preserve
+        if (!local.barrier)
+            return;
         ShadeContext context;
         context.WHITE = local.WHITE;
         shade(object, context);
@@ -373,10 +545,14 @@ namespace gc {
     inline Object::Object() 
     : color(local.ALLOC) {
         assert(local.depth); // <-- catch allocations that are not inside a mutator state
+#ifdef LOX_GC_SWEEP_PAGES
+        _heap::set_live(this);
+#else
         local.allocations.push_back(this);
+#endif
     }
     
-    inline Object::Object(const Object& other) : Object() {}
+    inline Object::Object(const Object&) : Object() {}
 
     inline void Object::_gc_shade(ShadeContext& context) const {
         Color expected = context.WHITE;
@@ -402,12 +578,10 @@ namespace gc {
         }
     }
 
-    inline Color Object::_gc_sweep(SweepContext& context) {
-        Color color = this->color.load(std::memory_order::relaxed);
-        if (color == context.WHITE) {
-            delete this;
-        }
-        return color;
+    // Reports the color after sweeping; the collector reclaims WHITE objects,
+    // possibly later and on another thread
+    inline Color Object::_gc_sweep(SweepContext&) {
+        return this->color.load(std::memory_order::relaxed);
     }
     
     inline void Object::_gc_shade_weak(ShadeContext& context) const {
@@ -429,7 +603,7 @@ namespace gc {
     }
 
     template<typename T>
-    void Leaf<T>::_gc_scan(ScanContext& context) const {
+    void Leaf<T>::_gc_scan(ScanContext&) const {
     }
     
     template<typename T>
@@ -458,6 +632,8 @@ namespace gc {
         shade(desired);
         T* old = inner.exchange(desired, order);
         shade(old);
+        if (desired)
+            remember(this);
     }
 
     template<typename T>
@@ -465,6 +641,8 @@ namespace gc {
         shade(desired);
         T* old = inner.exchange(desired, order);
         shade(old);
+        if (desired)
+            remember(this);
         return old;
     }
 
@@ -474,7 +652,7 @@ namespace gc {
                                                        std::memory_order success,
                                                        std::memory_order failure) {
         return (inner.compare_exchange_strong(expected, desired, success, failure)
-                && (shade(expected), shade(desired), true));
+                && (shade(expected), shade(desired), remember(this), true));
     }
     
     template<typename T>
@@ -483,7 +661,7 @@ namespace gc {
                                                      std::memory_order success,
                                                      std::memory_order failure) {
         return (inner.compare_exchange_weak(expected, desired, success, failure)
-                && (shade(expected), shade(desired), true));
+                && (shade(expected), shade(desired), remember(this), true));
     }
 
     
@@ -591,6 +769,8 @@ namespace gc {
         Array<T>* p = new (alloc(sizeof(Array<T>) + sizeof(T) * n)) Array<T>;
         p->_capacity = n;
         std::uninitialized_value_construct_n(p->_data, p->_capacity);
+        if constexpr (std::is_trivially_destructible_v<T>)
+            _heap::set_trivial(p);
         return p;
     }
 
@@ -618,8 +798,32 @@ namespace gc {
 namespace gc {
     
     inline void* alloc(std::size_t count) {
-        local.bytes_allocated += count;
-        return malloc(count);
+        assert(local.heap); // <-- catch allocations that are not inside a mutator state
+        local.bytes_allocated += _heap::block_size(count);
+        if (local.bytes_allocated >= PACER_QUANTUM)
+            this_thread::publish_bytes();
+        return local.heap->allocate(count);
+    }
+    
+    inline void free(void* ptr) {
+        if (ptr)
+            local.bytes_freed += _heap::deallocate(local.heap, ptr);
+    }
+    
+    inline void* Object::operator new(std::size_t count) {
+        return alloc(count);
+    }
+    
+    inline void* Object::operator new(std::size_t, void* ptr) {
+        return ptr;
+    }
+    
+    inline void Object::operator delete(void* ptr) {
+        free(ptr);
+    }
+    
+    inline void Object::operator delete(void* ptr, void*) {
+        free(ptr);
     }
     
     template<typename T>
@@ -0,0 +1,197 @@
+//
+//  heap.cpp
+//  qet
+//
+
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "heap.hpp"
+
+namespace gc {
+
+    namespace _heap {
+
+        namespace {
+
+            std::mutex orphans_mutex;
+            Heap* orphans = nullptr;
+
+            // A chain of blocks freed by this thread and owned by another heap
+            struct Batch {
+                Heap* owner;
+                Block* head;
+                Block* tail;
+            };
+
+            thread_local std::vector<Batch> batches;
+            
+#ifdef LOX_GC_SWEEP_PAGES
+            
+            std::mutex registry_mutex;
+            std::vector<Page*> registry;
+            
+            Page* allocate_page(std::size_t bytes) {
+                void* ptr = nullptr;
+                if (posix_memalign(&ptr, PAGE_SIZE, bytes))
+                    throw std::bad_alloc();
+                Page* page = static_cast<Page*>(ptr);
+                for (std::size_t j = 0; j != BITMAP_WORDS; ++j) {
+                    page->live[j].store(0, std::memory_order_relaxed);
+                    page->trivial[j].store(0, std::memory_order_relaxed);
+                }
+                std::unique_lock lock{registry_mutex};
+                page->index = registry.size();
+                registry.push_back(page);
+                return page;
+            }
+            
+            void free_page(Page* page) {
+                {
+                    std::unique_lock lock{registry_mutex};
+                    Page* last = registry.back();
+                    registry[page->index] = last;
+                    last->index = page->index;
+                    registry.pop_back();
+                }
+                std::free(page);
+            }
+            
+            void clear_bits(Page* page, const void* ptr) {
+                std::size_t i = granule_of(ptr);
+                std::uint64_t mask = ~(std::uint64_t{1} << (i % 64));
+                page->live[i / 64].fetch_and(mask, std::memory_order_relaxed);
+                page->trivial[i / 64].fetch_and(mask, std::memory_order_relaxed);
+            }
+            
+#else
+
+            Page* allocate_page(std::size_t bytes) {
+                void* ptr = nullptr;
+                if (posix_memalign(&ptr, PAGE_SIZE, bytes))
+                    throw std::bad_alloc();
+                return static_cast<Page*>(ptr);
+            }
+            
+            void free_page(Page* page) {
+                std::free(page);
+            }
+            
+            void clear_bits(Page*, const void*) {
+            }
+            
+#endif
+
+        } // namespace
+
+        void* Heap::_allocate_slow(std::size_t k) {
+            if (_reclaim_remote())
+                if (Block* block = free_lists[k]) {
+                    free_lists[k] = block->next;
+                    return block;
+                }
+            Page* page = allocate_page(PAGE_SIZE);
+            page->owner = this;
+            page->next = pages;
+            page->size = SIZE_CLASSES[k];
+            page->size_class = k;
+            pages = page;
+            char* first = reinterpret_cast<char*>(page) + HEADER_SIZE;
+            std::size_t n = (PAGE_SIZE - HEADER_SIZE) / page->size;
+            bump[k] = first + page->size;
+            end[k] = first + page->size * n;
+            return first;
+        }
+
+        void* Heap::_allocate_large(std::size_t count) {
+            Page* page = allocate_page(HEADER_SIZE + count);
+            page->owner = nullptr;
+            page->next = nullptr;
+            page->size = HEADER_SIZE + count;
+            page->size_class = SIZE_CLASS_COUNT;
+            return reinterpret_cast<char*>(page) + HEADER_SIZE;
+        }
+
+        bool Heap::_reclaim_remote() {
+            Block* block = remote.exchange(nullptr, std::memory_order_acquire);
+            if (!block)
+                return false;
+            while (block) {
+                Block* next = block->next;
+                deallocate(block, page_of(block)->size_class);
+                block = next;
+            }
+            return true;
+        }
+
+        Heap* acquire() {
+            {
+                std::unique_lock lock{orphans_mutex};
+                if (Heap* heap = orphans) {
+                    orphans = heap->next_orphan;
+                    heap->next_orphan = nullptr;
+                    return heap;
+                }
+            }
+            return new Heap;
+        }
+
+        void release(Heap* heap) {
+            flush();
+            std::unique_lock lock{orphans_mutex};
+            heap->next_orphan = orphans;
+            orphans = heap;
+        }
+
+        std::size_t deallocate(Heap* self, void* ptr) {
+            Page* page = page_of(ptr);
+            std::size_t size = page->size;
+            Heap* owner = page->owner;
+            Block* block = static_cast<Block*>(ptr);
+            clear_bits(page, ptr);
+            if (!owner) {
+                free_page(page);
+            } else if (owner == self) {
+                self->deallocate(block, page->size_class);
+            } else {
+                // the collector typically frees into a handful of heaps
+                for (Batch& batch : batches) {
+                    if (batch.owner == owner) {
+                        block->next = batch.head;
+                        batch.head = block;
+                        return size;
+                    }
+                }
+                block->next = nullptr;
+                batches.push_back(Batch{owner, block, block});
+            }
+            return size;
+        }
+
+#ifdef LOX_GC_SWEEP_PAGES
+        
+        std::vector<Page*> pages() {
+            std::unique_lock lock{registry_mutex};
+            return registry;
+        }
+        
+#endif
+        
+        void flush() {
+            for (Batch& batch : batches) {
+                Block* expected = batch.owner->remote.load(std::memory_order_relaxed);
+                do {
+                    batch.tail->next = expected;
+                } while (!batch.owner->remote.compare_exchange_weak(expected,
+                                                                    batch.head,
+                                                                    std::memory_order_release,
+                                                                    std::memory_order_relaxed));
+            }
+            batches.clear();
+        }
+
+    } // namespace _heap
+
+} // namespace gc
@@ -0,0 +1,231 @@
+//
+//  heap.hpp
+//  qet
+//
+
+#ifndef heap_hpp
+#define heap_hpp
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <iterator>
+#include <vector>
+
+#include "common.hpp"
+
+namespace gc {
+
+    namespace _heap {
+
+        // Size-segregated thread-local pools for gc::alloc and gc::free
+        //
+        // Memory is obtained in pages of PAGE_SIZE bytes aligned to PAGE_SIZE,
+        // so the Page header describing any block is found by masking its
+        // address.  Each page is carved into blocks of a single size class and
+        // belongs to a single Heap.  A Heap is used by one thread at a time,
+        // which allocates from per-class free lists, or by bumping through
+        // the current page of that class, without synchronization.
+        //
+        // Blocks freed by other threads (usually the collector, when
+        // sweeping) are batched per owning heap, and each batch is pushed
+        // onto the owner's lock-free remote list in a single operation by
+        // flush.  The owner takes the whole remote list when a free list
+        // runs dry.
+        //
+        // Requests larger than the largest size class get a dedicated
+        // PAGE_SIZE-aligned allocation with the same header, owned by no
+        // heap, and go straight back to the system when freed.
+        //
+        // Pages are never returned to the system.  When a thread leaves, its
+        // heap is orphaned, and a later thread adopts it.
+        //
+        // With LOX_GC_SWEEP_PAGES, every page is also registered globally
+        // and carries side bitmaps with one bit per GRANULE: live marks the
+        // start of each constructed Object, and trivial marks Objects that
+        // can be reclaimed without a virtual sweep or destructor call.  The
+        // collector then finds Objects by walking the bitmaps in address
+        // order rather than by keeping a list of them.
+
+        constexpr std::size_t PAGE_SIZE = std::size_t{1} << 16;
+        constexpr std::size_t GRANULE = 16;
+        constexpr std::size_t BITMAP_WORDS = PAGE_SIZE / GRANULE / 64;
+
+        constexpr std::size_t SIZE_CLASSES[] = {
+            16, 32, 48, 64, 80, 96, 112, 128,
+            160, 192, 224, 256, 320, 384, 448, 512,
+            640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+            2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192,
+        };
+        constexpr std::size_t SIZE_CLASS_COUNT = std::size(SIZE_CLASSES);
+        constexpr std::size_t MAX_SMALL_SIZE = SIZE_CLASSES[SIZE_CLASS_COUNT - 1];
+
+        // size_class_of[(count + 15) / 16] is the smallest class that fits
+        struct SizeClassTable {
+            std::uint8_t lookup[MAX_SMALL_SIZE / 16 + 1];
+            constexpr SizeClassTable() : lookup{} {
+                std::size_t k = 0;
+                for (std::size_t i = 0; i != std::size(lookup); ++i) {
+                    while (SIZE_CLASSES[k] < i * 16)
+                        ++k;
+                    lookup[i] = (std::uint8_t) k;
+                }
+            }
+        };
+        inline constexpr SizeClassTable size_class_of{};
+
+        struct Heap;
+
+        struct alignas(64) Page {
+            Heap* owner;            // <-- nullptr for a large allocation
+            Page* next;             // <-- owner's list of pages
+            std::size_t size;       // <-- of each block, or of the large allocation
+            std::size_t size_class; // <-- index into SIZE_CLASSES
+#ifdef LOX_GC_SWEEP_PAGES
+            std::size_t index;      // <-- in the global registry
+            std::atomic<std::uint64_t> live[BITMAP_WORDS];
+            std::atomic<std::uint64_t> trivial[BITMAP_WORDS];
+#endif
+        };
+        
+        constexpr std::size_t HEADER_SIZE = sizeof(Page);
+        static_assert(HEADER_SIZE % GRANULE == 0);
+
+        inline Page* page_of(const void* ptr) {
+            return reinterpret_cast<Page*>(reinterpret_cast<std::uintptr_t>(ptr)
+                                           & ~(PAGE_SIZE - 1));
+        }
+        
+        // publish a constructed Object to the collector's walk
+        void set_live(const void* ptr);
+        
+        // declare that an Object's destructor has nothing to do
+        void set_trivial(const void* ptr);
+        
+#ifdef LOX_GC_SWEEP_PAGES
+        
+        inline std::size_t granule_of(const void* ptr) {
+            return (reinterpret_cast<std::uintptr_t>(ptr) & (PAGE_SIZE - 1)) / GRANULE;
+        }
+        
+        inline void set_live(const void* ptr) {
+            std::size_t i = granule_of(ptr);
+            // release, so the walk sees an initialized color
+            page_of(ptr)->live[i / 64].fetch_or(std::uint64_t{1} << (i % 64),
+                                                std::memory_order_release);
+        }
+        
+        inline void set_trivial(const void* ptr) {
+            std::size_t i = granule_of(ptr);
+            page_of(ptr)->trivial[i / 64].fetch_or(std::uint64_t{1} << (i % 64),
+                                                   std::memory_order_relaxed);
+        }
+        
+        // copy of the global registry of pages
+        std::vector<Page*> pages();
+        
+        // visit(void*, bool trivial) every live Object in address order; the
+        // visitor may free the Object it is visiting
+        template<typename F>
+        void for_each_live(F&& visit) {
+            for (Page* page : pages()) {
+                char* base = reinterpret_cast<char*>(page);
+                if (!page->owner) {
+                    // the one Object of a large allocation; the visit may
+                    // free the page itself
+                    std::size_t i = HEADER_SIZE / GRANULE;
+                    std::uint64_t bit = std::uint64_t{1} << (i % 64);
+                    if (page->live[i / 64].load(std::memory_order_acquire) & bit)
+                        visit(base + HEADER_SIZE,
+                              page->trivial[i / 64].load(std::memory_order_relaxed) & bit);
+                    continue;
+                }
+                for (std::size_t j = 0; j != BITMAP_WORDS; ++j) {
+                    std::uint64_t live = page->live[j].load(std::memory_order_acquire);
+                    std::uint64_t trivial = page->trivial[j].load(std::memory_order_relaxed);
+                    while (live) {
+                        int k = __builtin_ctzll(live);
+                        std::uint64_t bit = std::uint64_t{1} << k;
+                        live &= ~bit;
+                        visit(base + (j * 64 + k) * GRANULE, (bool) (trivial & bit));
+                    }
+                }
+            }
+        }
+        
+#else
+        
+        inline void set_live(const void*) {}
+        inline void set_trivial(const void*) {}
+        
+#endif
+
+        struct Block {
+            Block* next;
+        };
+
+        struct Heap {
+
+            Block* free_lists[SIZE_CLASS_COUNT] = {};
+            char* bump[SIZE_CLASS_COUNT] = {};
+            char* end[SIZE_CLASS_COUNT] = {};
+            Page* pages = nullptr;
+            std::atomic<Block*> remote = nullptr;
+            Heap* next_orphan = nullptr;
+
+            void* allocate(std::size_t count);
+            void deallocate(Block* block, std::size_t size_class);
+
+            void* _allocate_slow(std::size_t size_class);
+            void* _allocate_large(std::size_t count);
+            bool _reclaim_remote();
+
+        };
+
+        // adopt an orphaned heap, or make a new one
+        Heap* acquire();
+
+        // orphan a heap, after flushing this thread's remote frees
+        void release(Heap* heap);
+
+        // return a block to its heap from any thread; returns its size
+        std::size_t deallocate(Heap* self, void* ptr);
+
+        // publish the blocks this thread has freed on behalf of other heaps
+        void flush();
+
+        // bytes actually consumed by an allocation of count bytes
+        inline std::size_t block_size(std::size_t count) {
+            if (count > MAX_SMALL_SIZE)
+                return HEADER_SIZE + count;
+            return SIZE_CLASSES[size_class_of.lookup[(count + 15) >> 4]];
+        }
+
+        inline void* Heap::allocate(std::size_t count) {
+            if (count > MAX_SMALL_SIZE)
+                return _allocate_large(count);
+            std::size_t k = size_class_of.lookup[(count + 15) >> 4];
+            if (Block* block = free_lists[k]) {
+                free_lists[k] = block->next;
+                return block;
+            }
+            if (bump[k] != end[k]) {
+                void* ptr = bump[k];
+                bump[k] += SIZE_CLASSES[k];
+                return ptr;
+            }
+            return _allocate_slow(k);
+        }
+
+        inline void Heap::deallocate(Block* block, std::size_t size_class) {
+            block->next = free_lists[size_class];
+            free_lists[size_class] = block;
+        }
+
+    } // namespace _heap
+
+} // namespace gc
+
+#endif /* heap_hpp */
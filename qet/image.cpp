@@ -0,0 +1,652 @@
+//
+//  image.cpp
+//  qet
+//
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "compiler.hpp"
+#include "image.hpp"
+#include "opcodes.hpp"
+#include "registers.hpp"
+#include "string.hpp"
+#include "vm.hpp"
+
+namespace lox {
+
+    namespace {
+
+        constexpr char IMAGE_MAGIC[4] = { 'Q', 'E', 'T', 'C' };
+        // Bump whenever an opcode's operands or what it does change, which
+        // the fingerprint can't see; 3 is CLOSURE's capture kinds
+        constexpr uint32_t IMAGE_VERSION = 3;
+        constexpr uint32_t NONE = UINT32_MAX;
+
+        enum ConstantTag : uint8_t {
+            CONSTANT_NIL,
+            CONSTANT_BOOL,
+            CONSTANT_INT64,
+            CONSTANT_STRING,
+            CONSTANT_FUNCTION,
+            CONSTANT_DOUBLE,
+        };
+
+        struct Header {
+            char magic[4];
+            uint32_t version;
+            uint32_t fingerprint;
+            uint32_t reserved;
+            uint64_t hash;     // <-- of the source text
+            uint64_t length;   // <-- of the source text
+            uint64_t checksum; // <-- of the rest of the image
+        };
+
+        // FNV-1a
+        uint64_t hashBytes(const void* data, size_t count, uint64_t hash = 0xcbf29ce484222325) {
+            const unsigned char* p = (const unsigned char*) data;
+            for (size_t i = 0; i != count; ++i) {
+                hash ^= p[i];
+                hash *= 0x100000001b3;
+            }
+            return hash;
+        }
+
+        // the opcodes by name and number, and how globals are held
+        uint32_t fingerprint() {
+            uint64_t hash = hashBytes(nullptr, 0);
+            for (const char* name : OpCodeCString)
+                hash = hashBytes(name, strlen(name) + 1, hash);
+#ifdef LOX_GLOBALS_CTRIE
+            hash = hashBytes("LOX_GLOBALS_CTRIE", 17, hash);
+#endif
+            return (uint32_t) (hash ^ (hash >> 32));
+        }
+
+#ifndef LOX_GLOBALS_CTRIE
+        // offset of the 16-bit global slot operand of an instruction, or 0
+        size_t slotOperand(uint8_t opcode) {
+            switch (opcode) {
+                case OPCODE_GET_GLOBAL_SLOT:
+                case OPCODE_DEFINE_GLOBAL_SLOT:
+                case OPCODE_SET_GLOBAL_SLOT:
+                    return 1;
+                case OPCODE_REG_GET_GLOBAL_SLOT:
+                case OPCODE_REG_DEFINE_GLOBAL_SLOT:
+                case OPCODE_REG_SET_GLOBAL_SLOT:
+                    return 2;
+                default:
+                    return 0;
+            }
+        }
+
+        // Rewrites the slot operands of the chunk's instructions into code,
+        // which is the chunk's code or a copy of it; fails if the code is
+        // malformed or a slot is out of range
+        template<typename F>
+        bool renumberSlots(const Chunk* chunk, uint8_t* code, F&& renumber) {
+            size_t size = chunk->code.size();
+            for (size_t offset = 0; offset < size;) {
+                size_t length = instructionLength(chunk, offset);
+                if (offset + length > size)
+                    return false;
+                if (size_t operand = slotOperand(chunk->code[offset])) {
+                    uint8_t* p = code + offset + operand;
+                    long slot = renumber((p[0] << 8) | p[1]);
+                    if ((slot < 0) || (slot > UINT16_MAX))
+                        return false;
+                    p[0] = (slot >> 8) & 0xff;
+                    p[1] = slot & 0xff;
+                }
+                offset += length;
+            }
+            return true;
+        }
+#endif
+
+        // Checks each instruction of a loaded chunk: that the opcode exists
+        // and fits, that jumps land on instructions, and that its operands
+        // name constants of the kind it expects, and caches, upvalues and
+        // registers that exist.  With the checksum, this stops a damaged or
+        // stale image indexing out of bounds.  It doesn't follow the stack
+        // code's depth or the types the compiler guarantees, such as the
+        // class under METHOD, so an image is trusted as the script beside
+        // it is, and a crafted one can still crash the VM.
+        bool verify(const ObjectFunction* function, const Chunk* chunk) {
+            const std::vector<uint8_t>& code = chunk->code;
+            const std::vector<Value>& constants = chunk->constants;
+            size_t size = code.size();
+            // only the register form may be missing
+            if (size == 0)
+                return chunk != &function->chunk;
+            auto isString = [&](uint8_t index) {
+                return (index < constants.size()) && IS_STRING(constants[index]);
+            };
+            auto isRegister = [&](uint8_t operand) {
+                return operand < function->registerCount;
+            };
+            auto isRK = [&](uint8_t operand) {
+                return (operand & RK_CONSTANT) ? ((size_t) (operand & ~RK_CONSTANT) < constants.size()) : isRegister(operand);
+            };
+            auto readShort = [&](size_t offset) {
+                return (size_t) ((code[offset] << 8) | code[offset + 1]);
+            };
+            std::vector<bool> starts(size);
+            std::vector<size_t> targets;
+            uint8_t last = 0;
+            for (size_t offset = 0; offset < size;) {
+                uint8_t opcode = code[offset];
+                if (opcode >= std::size(OpCodeCString))
+                    return false;
+                // instructionLength reads CLOSURE's function
+                if ((opcode == OPCODE_CLOSURE)
+                    && ((offset + 2 > size) || (code[offset + 1] >= constants.size()) || !IS_FUNCTION(constants[code[offset + 1]])))
+                    return false;
+                size_t length = instructionLength(chunk, offset);
+                if (offset + length > size)
+                    return false;
+                const uint8_t* operands = code.data() + offset + 1;
+                bool valid = true;
+                switch (opcode) {
+                    case OPCODE_CONSTANT:
+                        valid = operands[0] < constants.size();
+                        break;
+                    case OPCODE_ADD_CONSTANT:
+                        valid = (operands[0] < constants.size()) && constants[operands[0]].is_int64();
+                        break;
+                    case OPCODE_GET_GLOBAL:
+                    case OPCODE_DEFINE_GLOBAL:
+                    case OPCODE_SET_GLOBAL:
+                    case OPCODE_GET_SUPER:
+                    case OPCODE_SUPER_INVOKE:
+                    case OPCODE_CLASS:
+                    case OPCODE_METHOD:
+                        valid = isString(operands[0]);
+                        break;
+#ifdef LOX_GLOBALS_CTRIE
+                    case OPCODE_GET_GLOBAL_SLOT:
+                    case OPCODE_DEFINE_GLOBAL_SLOT:
+                    case OPCODE_SET_GLOBAL_SLOT:
+                    case OPCODE_REG_GET_GLOBAL_SLOT:
+                    case OPCODE_REG_DEFINE_GLOBAL_SLOT:
+                    case OPCODE_REG_SET_GLOBAL_SLOT:
+                        valid = false;
+                        break;
+#else
+                    // the slots themselves are checked as they are renumbered
+                    case OPCODE_REG_GET_GLOBAL_SLOT:
+                        valid = isRegister(operands[0]);
+                        break;
+                    case OPCODE_REG_DEFINE_GLOBAL_SLOT:
+                    case OPCODE_REG_SET_GLOBAL_SLOT:
+                        valid = isRK(operands[0]);
+                        break;
+#endif
+                    case OPCODE_GET_UPVALUE:
+                    case OPCODE_SET_UPVALUE:
+                        valid = operands[0] < function->upvalueCount;
+                        break;
+                    case OPCODE_GET_PROPERTY:
+                    case OPCODE_SET_PROPERTY:
+                        valid = isString(operands[0]) && (readShort(offset + 2) < chunk->cacheCount);
+                        break;
+                    case OPCODE_INVOKE:
+                        valid = isString(operands[0]) && (readShort(offset + 3) < chunk->cacheCount);
+                        break;
+                    case OPCODE_JUMP:
+                    case OPCODE_JUMP_IF_FALSE:
+                    case OPCODE_LESS_JUMP_IF_FALSE:
+                        targets.push_back(offset + 3 + readShort(offset + 1));
+                        break;
+                    case OPCODE_LOOP:
+                        valid = readShort(offset + 1) <= offset + 3;
+                        targets.push_back(offset + 3 - readShort(offset + 1));
+                        break;
+                    case OPCODE_CLOSURE:
+                        for (size_t i = 2; valid && (i != length); i += 2) {
+                            uint8_t capture = operands[i - 1];
+                            valid = (capture == CAPTURE_LOCAL) || (capture == CAPTURE_VALUE)
+                                || ((capture == CAPTURE_UPVALUE) && (operands[i] < function->upvalueCount));
+                        }
+                        break;
+                    case OPCODE_REG_NIL:
+                    case OPCODE_REG_TRUE:
+                    case OPCODE_REG_FALSE:
+                        valid = isRegister(operands[0]);
+                        break;
+                    case OPCODE_REG_PRINT:
+                    case OPCODE_REG_RETURN:
+                        valid = isRK(operands[0]);
+                        break;
+                    case OPCODE_REG_MOVE:
+                    case OPCODE_REG_NOT:
+                    case OPCODE_REG_NEGATE:
+                        valid = isRegister(operands[0]) && isRK(operands[1]);
+                        break;
+                    case OPCODE_REG_GET_UPVALUE:
+                        valid = isRegister(operands[0]) && (operands[1] < function->upvalueCount);
+                        break;
+                    case OPCODE_REG_SET_UPVALUE:
+                        valid = (operands[0] < function->upvalueCount) && isRK(operands[1]);
+                        break;
+                    case OPCODE_REG_EQUAL:
+                    case OPCODE_REG_GREATER:
+                    case OPCODE_REG_LESS:
+                    case OPCODE_REG_ADD:
+                    case OPCODE_REG_SUBTRACT:
+                    case OPCODE_REG_MULTIPLY:
+                    case OPCODE_REG_DIVIDE:
+                        valid = isRegister(operands[0]) && isRK(operands[1]) && isRK(operands[2]);
+                        break;
+                    case OPCODE_REG_JUMP_IF_FALSE:
+                        valid = isRK(operands[0]);
+                        targets.push_back(offset + 4 + readShort(offset + 2));
+                        break;
+                    case OPCODE_REG_CALL:
+                        // the callee and its arguments
+                        valid = operands[0] + operands[1] < function->registerCount;
+                        break;
+                    default:
+                        break;
+                }
+                if (!valid)
+                    return false;
+                starts[offset] = true;
+                last = opcode;
+                offset += length;
+            }
+            for (size_t target : targets)
+                if ((target >= size) || !starts[target])
+                    return false;
+            // so that execution can't run off the end
+            return (last == OPCODE_RETURN) || (last == OPCODE_REG_RETURN);
+        }
+
+        struct Buffer {
+
+            std::vector<unsigned char> bytes;
+
+            template<typename T>
+            void put(const T& value) {
+                put(&value, sizeof(T));
+            }
+
+            void put(const void* data, size_t count) {
+                const unsigned char* p = (const unsigned char*) data;
+                bytes.insert(bytes.end(), p, p + count);
+            }
+
+        };
+
+        struct Writer {
+
+            VM* vm;
+            const char* first;
+            const char* last;
+
+            Buffer functionSection{};
+            Buffer debugSection{};
+
+            std::unordered_map<const ObjectString*, uint32_t> stringIndex{};
+            std::vector<const ObjectString*> strings{};
+            std::unordered_map<int, uint32_t> globalIndex{};
+            std::vector<uint32_t> globals{}; // <-- string index of each name
+            std::unordered_map<const ObjectFunction*, uint32_t> functionIndex{};
+
+            bool ok = true;
+
+            uint32_t string(const ObjectString* string) {
+                auto [it, inserted] = stringIndex.emplace(string, (uint32_t) strings.size());
+                if (inserted)
+                    strings.push_back(string);
+                return it->second;
+            }
+
+#ifndef LOX_GLOBALS_CTRIE
+            long global(int slot) {
+                auto it = globalIndex.find(slot);
+                if (it != globalIndex.end())
+                    return it->second;
+                ObjectString* name = vm->globalName(slot);
+                if (name == nullptr)
+                    return -1;
+                uint32_t index = (uint32_t) globals.size();
+                globals.push_back(string(name));
+                globalIndex.emplace(slot, index);
+                return index;
+            }
+#endif
+
+            void constant(Value value) {
+                Buffer& out = functionSection;
+                if (value.is_nil()) {
+                    out.put(CONSTANT_NIL);
+                    out.put((uint64_t) 0);
+                } else if (value.is_bool()) {
+                    out.put(CONSTANT_BOOL);
+                    out.put((uint64_t) value.as_bool());
+                } else if (value.is_int64()) {
+                    out.put(CONSTANT_INT64);
+                    out.put((uint64_t) value.as_int64());
+                } else if (value.is_double()) {
+                    double number = value.as_double();
+                    uint64_t bits;
+                    memcpy(&bits, &number, sizeof(bits));
+                    out.put(CONSTANT_DOUBLE);
+                    out.put(bits);
+                } else if (IS_STRING(value)) {
+                    out.put(CONSTANT_STRING);
+                    out.put((uint64_t) string(AS_STRING(value)));
+                } else if (IS_FUNCTION(value)) {
+                    out.put(CONSTANT_FUNCTION);
+                    out.put((uint64_t) functionIndex.at(AS_FUNCTION(value)));
+                } else {
+                    ok = false;
+                }
+            }
+
+            void chunk(const Chunk* chunk) {
+                std::vector<uint8_t> code = chunk->code;
+#ifndef LOX_GLOBALS_CTRIE
+                if (!renumberSlots(chunk, code.data(), [this](int slot) { return global(slot); }))
+                    ok = false;
+#endif
+                functionSection.put((uint32_t) code.size());
+                functionSection.put(code.data(), code.size());
+                functionSection.put((uint32_t) chunk->constants.size());
+                for (Value value : chunk->constants)
+                    constant(value);
+
+                debugSection.put((uint32_t) chunk->lines.runs.size());
+                for (const LineTable::Run& run : chunk->lines.runs) {
+                    bool inside = (run.where != nullptr) && (run.where >= first) && (run.where <= last);
+                    debugSection.put(run.offset);
+                    debugSection.put((int32_t) run.line);
+                    debugSection.put(inside ? (uint32_t) (run.where - first) : NONE);
+                }
+            }
+
+            // children first, so that each function's constants can name them
+            void function(const ObjectFunction* function) {
+                for (const Chunk* chunk : { &function->chunk, &function->registers })
+                    for (Value value : chunk->constants)
+                        if (IS_FUNCTION(value) && !functionIndex.contains(AS_FUNCTION(value)))
+                            this->function(AS_FUNCTION(value));
+                Buffer& out = functionSection;
+                out.put((uint32_t) function->arity);
+                out.put((uint32_t) function->upvalueCount);
+                out.put(function->name ? string(function->name) : NONE);
+                out.put((uint32_t) function->registerCount);
+                out.put((uint32_t) function->chunk.cacheCount);
+                chunk(&function->chunk);
+                chunk(&function->registers);
+                uint32_t index = (uint32_t) functionIndex.size();
+                functionIndex.emplace(function, index);
+            }
+
+            Buffer image(const ObjectFunction* script) {
+                function(script);
+                Buffer out;
+                Header header = {};
+                memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+                header.version = IMAGE_VERSION;
+                header.fingerprint = fingerprint();
+                header.hash = hashBytes(first, last - first);
+                header.length = last - first;
+                out.put(header);
+                out.put((uint32_t) strings.size());
+                for (const ObjectString* string : strings) {
+                    out.put((uint32_t) string->_size);
+                    out.put(string->_data, string->_size);
+                }
+                out.put((uint32_t) globals.size());
+                for (uint32_t name : globals)
+                    out.put(name);
+                out.put((uint32_t) functionIndex.size());
+                out.put(functionSection.bytes.data(), functionSection.bytes.size());
+                out.put(debugSection.bytes.data(), debugSection.bytes.size());
+                header.checksum = hashBytes(out.bytes.data() + sizeof(Header), out.bytes.size() - sizeof(Header));
+                memcpy(out.bytes.data(), &header, sizeof(Header));
+                return out;
+            }
+
+        };
+
+        struct Reader {
+
+            const unsigned char* next;
+            const unsigned char* end;
+            bool ok = true;
+
+            const unsigned char* take(size_t count) {
+                if (!ok || ((size_t) (end - next) < count)) {
+                    ok = false;
+                    return nullptr;
+                }
+                const unsigned char* p = next;
+                next += count;
+                return p;
+            }
+
+            template<typename T>
+            T get() {
+                T value = {};
+                if (const unsigned char* p = take(sizeof(T)))
+                    memcpy(&value, p, sizeof(T));
+                return value;
+            }
+
+        };
+
+        struct Loader {
+
+            VM* vm;
+            Source* source;
+            const char* first;
+            const char* last;
+            Reader reader;
+
+            std::vector<ObjectString*> strings{};
+            std::vector<int> slots{};
+            std::vector<ObjectFunction*> functions{};
+
+            Value constant() {
+                uint8_t tag = reader.get<uint8_t>();
+                uint64_t payload = reader.get<uint64_t>();
+                switch (tag) {
+                    case CONSTANT_NIL:
+                        return Value();
+                    case CONSTANT_BOOL:
+                        return Value((bool) payload);
+                    case CONSTANT_INT64:
+                        return Value((int64_t) payload);
+                    case CONSTANT_DOUBLE: {
+                        double number;
+                        memcpy(&number, &payload, sizeof(number));
+                        return Value(number);
+                    }
+                    case CONSTANT_STRING:
+                        if (payload < strings.size())
+                            return Value(strings[payload]);
+                        break;
+                    case CONSTANT_FUNCTION:
+                        if (payload < functions.size())
+                            return Value(functions[payload]);
+                        break;
+                    default:
+                        break;
+                }
+                reader.ok = false;
+                return Value();
+            }
+
+            void chunk(const ObjectFunction* function, Chunk* chunk) {
+                chunk->source = source;
+                uint32_t size = reader.get<uint32_t>();
+                if (const unsigned char* code = reader.take(size))
+                    chunk->code.assign(code, code + size);
+                uint32_t count = reader.get<uint32_t>();
+                for (uint32_t i = 0; reader.ok && (i != count); ++i) {
+                    Value value = constant();
+                    if (reader.ok)
+                        chunk->add_constant(value);
+                }
+                // before renumberSlots, whose instructionLength trusts
+                // CLOSURE's constant
+                if (reader.ok && !verify(function, chunk))
+                    reader.ok = false;
+#ifndef LOX_GLOBALS_CTRIE
+                if (reader.ok && !renumberSlots(chunk, chunk->code.data(), [this](int index) {
+                    return (index < (int) slots.size()) ? (long) slots[index] : -1;
+                }))
+                    reader.ok = false;
+#endif
+            }
+
+            void debug(Chunk* chunk) {
+                uint32_t count = reader.get<uint32_t>();
+                for (uint32_t i = 0; reader.ok && (i != count); ++i) {
+                    uint32_t offset = reader.get<uint32_t>();
+                    int line = reader.get<int32_t>();
+                    uint32_t where = reader.get<uint32_t>();
+                    chunk->lines.add(offset, line, (where <= (size_t) (last - first)) ? first + where : nullptr);
+                }
+                // every byte of code needs a position, from the first
+                if (!chunk->code.empty() && (chunk->lines.runs.empty() || chunk->lines.runs.front().offset))
+                    reader.ok = false;
+            }
+
+            ObjectFunction* load() {
+                Header header = reader.get<Header>();
+                if (!reader.ok
+                    || memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC))
+                    || (header.version != IMAGE_VERSION)
+                    || (header.fingerprint != fingerprint())
+                    || (header.length != (uint64_t) (last - first))
+                    || (header.hash != hashBytes(first, last - first))
+                    || (header.checksum != hashBytes(reader.next, reader.end - reader.next)))
+                    return nullptr;
+
+                // intern the strings together, as the compiler does; they
+                // stay alive because loading never handshakes
+                uint32_t stringCount = reader.get<uint32_t>();
+                std::vector<ObjectString::Query> queries;
+                for (uint32_t i = 0; reader.ok && (i != stringCount); ++i) {
+                    uint32_t size = reader.get<uint32_t>();
+                    if (const unsigned char* p = reader.take(size))
+                        queries.emplace_back(std::string_view((const char*) p, size));
+                }
+                if (!reader.ok)
+                    return nullptr;
+                strings.resize(queries.size());
+                if (!queries.empty())
+                    ObjectString::make(queries, strings.data());
+
+                uint32_t globalCount = reader.get<uint32_t>();
+                for (uint32_t i = 0; reader.ok && (i != globalCount); ++i) {
+                    uint32_t name = reader.get<uint32_t>();
+                    if (name >= strings.size())
+                        return nullptr;
+#ifndef LOX_GLOBALS_CTRIE
+                    slots.push_back(vm->globalSlot(strings[name]));
+#else
+                    return nullptr;
+#endif
+                }
+
+                uint32_t functionCount = reader.get<uint32_t>();
+                for (uint32_t i = 0; reader.ok && (i != functionCount); ++i) {
+                    ObjectFunction* function = new ObjectFunction();
+                    function->arity = reader.get<uint32_t>();
+                    function->upvalueCount = reader.get<uint32_t>();
+                    uint32_t name = reader.get<uint32_t>();
+                    if (name != NONE) {
+                        if (name >= strings.size())
+                            return nullptr;
+                        function->name = strings[name];
+                    }
+                    function->registerCount = reader.get<uint32_t>();
+                    function->chunk.cacheCount = reader.get<uint32_t>();
+                    // registers and upvalues are byte operands
+                    if ((function->upvalueCount < 0) || ((size_t) function->upvalueCount > UINT8_COUNT)
+                        || (function->registerCount < 0) || ((size_t) function->registerCount > UINT8_COUNT)
+                        || (function->chunk.cacheCount > UINT16_MAX + 1))
+                        return nullptr;
+                    chunk(function, &function->chunk);
+                    chunk(function, &function->registers);
+                    functions.push_back(function);
+                }
+
+                for (ObjectFunction* function : functions) {
+                    debug(&function->chunk);
+                    debug(&function->registers);
+                }
+
+                if (!reader.ok || (reader.next != reader.end) || functions.empty())
+                    return nullptr;
+                for (ObjectFunction* function : functions)
+                    function->chunk.allocate_caches();
+                return functions.back();
+            }
+
+        };
+
+        ObjectFunction* readImage(VM* vm, Source* source, const char* path) {
+            int fd = open(path, O_RDONLY);
+            if (fd == -1)
+                return nullptr;
+            ObjectFunction* function = nullptr;
+            struct stat status;
+            if ((fstat(fd, &status) == 0) && (status.st_size >= (off_t) sizeof(Header))) {
+                size_t size = status.st_size;
+                void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                    const unsigned char* p = (const unsigned char*) data;
+                    Loader loader{vm, source, source->first, source->last, Reader{p, p + size}};
+                    function = loader.load();
+                    munmap(data, size);
+                }
+            }
+            close(fd);
+            return function;
+        }
+
+        // Best effort; the image is written aside and renamed into place, so
+        // that a concurrent reader never maps a partial one
+        void writeImage(VM* vm, const ObjectFunction* script, const char* first, const char* last, const char* path) {
+            Writer writer{vm, first, last};
+            Buffer image = writer.image(script);
+            if (!writer.ok)
+                return;
+            std::string temporary = std::string(path) + "." + std::to_string(getpid());
+            FILE* file = fopen(temporary.c_str(), "wb");
+            if (file == nullptr)
+                return;
+            bool written = fwrite(image.bytes.data(), 1, image.bytes.size(), file) == image.bytes.size();
+            written = (fclose(file) == 0) && written;
+            if (!written || rename(temporary.c_str(), path))
+                remove(temporary.c_str());
+        }
+
+    } // namespace
+
+    ObjectFunction* compileCached(VM* vm, Source* source, const char* path) {
+        if (ObjectFunction* function = readImage(vm, source, path))
+            return function;
+        ObjectFunction* function = compile(vm, source->first, source->last, source);
+        if (function != nullptr)
+            writeImage(vm, function, source->first, source->last, path);
+        return function;
+    }
+
+} // namespace lox
@@ -0,0 +1,41 @@
+//
+//  image.hpp
+//  qet
+//
+
+#ifndef image_hpp
+#define image_hpp
+
+#include "object.hpp"
+
+namespace lox {
+
+    struct VM;
+
+    // Precompiled bytecode images
+    //
+    // A script's compiled functions are written next to it, and memory
+    // mapped on later runs instead of compiling again.  The image is a
+    // header, then sections read in order:
+    //
+    // - strings: every name and string literal, interned together on load
+    // - globals: the names behind the global slot operands, which are
+    //   numbered within the image and renumbered for the loading VM
+    // - functions: in post-order, so the functions a function refers to as
+    //   constants come before it, and the script comes last
+    // - debug: the run-length encoded lines and source offsets of the code,
+    //   apart from the rest so that the functions stay compact
+    //
+    // The header carries a format version, a fingerprint of the build (the
+    // opcodes by name and number, and how globals are held), a hash of the
+    // source text and a checksum of the sections.  An image that doesn't
+    // match them, or whose operands are out of range, is ignored and
+    // written again.
+
+    // Compiles the source as compile does, but loads it from the image at
+    // path if that is up to date, and otherwise tries to write one there
+    ObjectFunction* compileCached(VM* vm, Source* source, const char* path);
+
+} // namespace lox
+
+#endif /* image_hpp */
@@ -1,76 +1,127 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
+#include "benchmark.hpp"
 #include "chunk.hpp"
 #include "common.hpp"
 #include "debug.hpp"
+#include "scheduler.hpp"
 #include "vm.hpp"
 #include "string.hpp"
+#include "test.hpp"
+#include "tokenizer.hpp"
 
 namespace lox {
     
-    static void repl(VM& vm) {
+    // Reads a line of any length, with its newline; false at the end of
+    // the input
+    static bool readLine(std::string& line) {
         char buffer[1024];
+        line.clear();
+        while (fgets(buffer, sizeof(buffer), stdin)) {
+            line += buffer;
+            if (line.back() == '\n')
+                return true;
+        }
+        return !line.empty();
+    }
+    
+    // Whether the input so far can be compiled: every bracket is closed and
+    // no string is left open
+    static bool isComplete(const std::string& input) {
+        Tokenizer* tokenizer = Tokenizer::make(input.data(), input.data() + input.size());
+        int depth = 0;
+        for (;;) {
+            Token token = tokenizer->next();
+            switch (token.type) {
+                case TOKEN_EOF:
+                    return depth <= 0;
+                case TOKEN_LEFT_PAREN:
+                case TOKEN_LEFT_BRACE:
+                    ++depth;
+                    break;
+                case TOKEN_RIGHT_PAREN:
+                case TOKEN_RIGHT_BRACE:
+                    --depth;
+                    break;
+                case TOKEN_ERROR:
+                    // a string only ends the input unterminated if no more
+                    // lines have come yet
+                    if (std::string_view(token.start, token.length) == "Unterminated string.")
+                        return false;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    
+    // Lines are gathered until they form complete declarations, which are
+    // then compiled together, so that functions and classes can span lines
+    static void repl(VM& vm) {
+        std::string input;
+        std::string line;
         for (;;) {
             {
                 gc::this_thread::handshake();
-                gc::shade(&vm);
+                vm.shadeRoots();
             }
-            printf("> ");
-            if (!fgets(buffer, sizeof(buffer), stdin)) {
+            printf(input.empty() ? "> " : "... ");
+            if (!readLine(line)) {
                 printf("\n");
                 break;
             }
-            // TODO: gracefully handle structures spanning multiple lines
-            vm.interpret(buffer, buffer + strlen(buffer));
+            input += line;
+            if (!isComplete(input))
+                continue;
+            // each entry has a source of its own, which the functions it
+            // defines keep alive
+            vm.interpret(Source::make(input.data(), input.data() + input.size()));
+            input.clear();
         }
     }
     
-    
-    
-    static char* readFile(const char* path) {
-        FILE* file = fopen(path, "rb");
-        if (file == nullptr) {
+    static Source* mapFile(const char* path) {
+        Source* source = Source::map(path);
+        if (source == nullptr) {
             fprintf(stderr, "Could not open file \"%s\".\n", path);
             exit(74);
         }
-        
-        fseek(file, 0L, SEEK_END);
-        size_t fileSize = ftell(file);
-        rewind(file);
-        
-        char* buffer = (char*) malloc(fileSize + 1);
-        if (buffer == nullptr) {
-            fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-            exit(74);
-        }
-        size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-        if (bytesRead < fileSize) {
-            fprintf(stderr, "Could not read file \"%s\".\n", path);
-            exit(74);
-            
-        }
-        buffer[bytesRead] = '\0';
-        
-        fclose(file);
-        return buffer;
+        return source;
     }
     
-    
-    
-    
-    
     void runFile(VM& vm, const char* path) {
-        char* source = readFile(path);
-        InterpretResult result = vm.interpret(source, source + strlen(source));
-        free(source);
+        Source* source = mapFile(path);
+        // the compiled script is kept beside it, as foo.lox -> foo.loxc
+        std::string cache = std::string(path) + "c";
+        InterpretResult result = vm.interpret(source, cache.c_str());
         
         if (result == INTERPRET_COMPILE_ERROR) exit(65);
         if (result == INTERPRET_RUNTIME_ERROR) exit(70);
     }
     
+    void runTasks(std::size_t threads, int count, const char* paths[]) {
+        int status = 0;
+        {
+            std::vector<Task*> tasks;
+            Scheduler scheduler{threads};
+            for (int i = 0; i != count; ++i)
+                tasks.push_back(scheduler.spawn(mapFile(paths[i])));
+            scheduler.wait();
+            for (Task* task : tasks) {
+                if (task->result == INTERPRET_COMPILE_ERROR) status = std::max(status, 65);
+                if (task->result == INTERPRET_RUNTIME_ERROR) status = std::max(status, 70);
+            }
+        }
+        if (status) exit(status);
+    }
+    
     const char preamble[] =
 R"""(
 
@@ -127,16 +178,6 @@ class CoffeeMaker {
 var maker = CoffeeMaker("coffee and chicory");
 maker.brew();
 
-fun fib(n) {
-    if (n < 2)
-        return n;
-    return fib(n - 2) + fib(n - 1);
-}
-
-var start = clock();
-print fib(10); // was 29 // was 35
-print clock() - start;
-
 )""";
     
 }
@@ -149,22 +190,48 @@ int main(int argc, const char * argv[]) {
     std::thread collector{gc::collect};
     initGC();
     VM* vm =  new VM;
+    // parked while we wait for tasks
+    gc::local.roots.push_back(vm);
     vm->initVM();
     vm->interpret(preamble, preamble + sizeof(preamble) - 1);
     {
         gc::this_thread::handshake();
-        gc::shade(vm);
+        vm->shadeRoots();
     }
     if (true) {
         if (argc == 1) {
             repl(*vm);
+        } else if (argc == 2 && !strcmp(argv[1], "--benchmark-dispatch")) {
+            benchmarkDispatch(*vm);
+        } else if (argc == 2 && !strcmp(argv[1], "--benchmark-objects")) {
+            benchmarkObjectDispatch(*vm);
+        } else if (argc == 2 && !strcmp(argv[1], "--benchmark-containers")) {
+            benchmarkContainers();
+        } else if (argc == 2 && !strcmp(argv[1], "--test-ctrie")) {
+            exit(testCtrie() ? 0 : 1);
+        } else if (argc >= 3 && !strcmp(argv[1], "--benchmark-programs")) {
+            benchmarkPrograms(*vm, argc - 2, argv + 2);
         } else if (argc == 2) {
             runFile(*vm, argv[1]);
+        } else if (argc == 3 && !strcmp(argv[1], "--registers")) {
+            vm->useRegisters = true;
+            runFile(*vm, argv[2]);
+#ifdef LOX_PROFILE
+        } else if (argc == 3 && !strcmp(argv[1], "--profile")) {
+            // the preamble isn't profiled
+            vm->beginProfile();
+            runFile(*vm, argv[2]);
+            vm->endProfile();
+            vm->profile->report(stderr);
+#endif
+        } else if (argc >= 4 && !strcmp(argv[1], "--tasks")) {
+            runTasks(atoi(argv[2]), argc - 3, argv + 3);
         } else {
-            fprintf(stderr, "Usage: qet [path]\n");
+            fprintf(stderr, "Usage: qet [[--registers] path | --tasks threads path... | --benchmark-dispatch | --benchmark-objects | --benchmark-containers | --benchmark-programs path... | --test-ctrie]\n");
             exit(64);
         }
     }
+    Scheduler::stopShared();
     // vm->freeVM();
     freeGC();
     gc::this_thread::leave();
@@ -0,0 +1,195 @@
+//
+//  natives.cpp
+//  qet
+//
+
+#include <cstring>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include "natives.hpp"
+#include "vm.hpp"
+
+namespace lox {
+
+    namespace {
+
+        // the characters of any kind of string, flattening a rope
+        bool stringArgument(Value value, std::string_view& view) {
+            if (!isString(value))
+                return false;
+            Object* object = value.as_object();
+            if (object->kind == OBJECT_ROPE)
+                object = static_cast<ObjectRope*>(object)->flatten();
+            view = stringView(object);
+            return true;
+        }
+
+        bool indexArgument(Value value, std::size_t& index) {
+            if (!value.is_int64() || value.as_int64() < 0)
+                return false;
+            index = (std::size_t) value.as_int64();
+            return true;
+        }
+
+        // strings
+
+        Value lengthNative(VM&, int, Value* args) {
+            if (isString(args[0]))
+                return Value((int64_t) stringLength(args[0].as_object()));
+            if (IS_ARRAY(args[0])) {
+                ObjectArray* array = AS_ARRAY(args[0]);
+                std::unique_lock lock{array->mutex};
+                return Value((int64_t) array->count);
+            }
+            return Value();
+        }
+
+        // the pieces between separators, or the single characters if the
+        // separator is empty; the array is new, so it needs no lock yet
+        Value splitNative(VM&, int, Value* args) {
+            std::string_view string, separator;
+            if (!stringArgument(args[0], string) || !stringArgument(args[1], separator))
+                return Value();
+            ObjectArray* array = new ObjectArray;
+            if (separator.empty()) {
+                for (std::size_t i = 0; i != string.size(); ++i)
+                    array->push(Value(ObjectTransientString::make(string.substr(i, 1))));
+                return Value(array);
+            }
+            std::size_t start = 0;
+            for (;;) {
+                std::size_t end = string.find(separator, start);
+                array->push(Value(ObjectTransientString::make(string.substr(start, end - start))));
+                if (end == std::string_view::npos)
+                    break;
+                start = end + separator.size();
+            }
+            return Value(array);
+        }
+
+        // the elements, which must all be strings, with the separator between
+        // them; the result is allocated at its final size and filled in place
+        Value joinNative(VM&, int, Value* args) {
+            std::string_view separator;
+            if (!IS_ARRAY(args[0]) || !stringArgument(args[1], separator))
+                return Value();
+            ObjectArray* array = AS_ARRAY(args[0]);
+            std::unique_lock lock{array->mutex};
+            std::vector<std::string_view> pieces(array->count);
+            std::size_t size = 0;
+            for (std::size_t i = 0; i != array->count; ++i) {
+                if (!stringArgument(array->get(i), pieces[i]))
+                    return Value();
+                size += pieces[i].size();
+            }
+            if (!pieces.empty())
+                size += separator.size() * (pieces.size() - 1);
+            ObjectTransientString* result = ObjectTransientString::make(size);
+            char* p = result->_data;
+            for (std::size_t i = 0; i != pieces.size(); ++i) {
+                if (i) {
+                    memcpy(p, separator.data(), separator.size());
+                    p += separator.size();
+                }
+                memcpy(p, pieces[i].data(), pieces[i].size());
+                p += pieces[i].size();
+            }
+            return Value(result);
+        }
+
+        // arrays
+
+        // Array() is empty, and Array(n) holds n nils
+        Value arrayNative(VM&, int argCount, Value* args) {
+            std::size_t count = 0;
+            if ((argCount > 1) || ((argCount == 1) && !indexArgument(args[0], count)))
+                return Value();
+            return Value(new ObjectArray(count));
+        }
+
+        // returns the array
+        Value pushNative(VM&, int, Value* args) {
+            if (!IS_ARRAY(args[0]))
+                return Value();
+            ObjectArray* array = AS_ARRAY(args[0]);
+            std::unique_lock lock{array->mutex};
+            array->push(args[1]);
+            return args[0];
+        }
+
+        Value popNative(VM&, int, Value* args) {
+            if (!IS_ARRAY(args[0]))
+                return Value();
+            ObjectArray* array = AS_ARRAY(args[0]);
+            std::unique_lock lock{array->mutex};
+            return array->pop();
+        }
+
+        Value getNative(VM&, int, Value* args) {
+            std::size_t index;
+            if (!IS_ARRAY(args[0]) || !indexArgument(args[1], index))
+                return Value();
+            ObjectArray* array = AS_ARRAY(args[0]);
+            std::unique_lock lock{array->mutex};
+            return array->get(index);
+        }
+
+        // returns the value stored
+        Value setNative(VM&, int, Value* args) {
+            std::size_t index;
+            if (!IS_ARRAY(args[0]) || !indexArgument(args[1], index))
+                return Value();
+            ObjectArray* array = AS_ARRAY(args[0]);
+            std::unique_lock lock{array->mutex};
+            return array->set(index, args[2]) ? args[2] : Value();
+        }
+
+        // an integer while the elements are, and a double from the first
+        // double on; nil if any element isn't a number
+        Value sumNative(VM&, int, Value* args) {
+            if (!IS_ARRAY(args[0]))
+                return Value();
+            ObjectArray* array = AS_ARRAY(args[0]);
+            std::unique_lock lock{array->mutex};
+            int64_t integer = 0;
+            double real = 0.0;
+            bool isReal = false;
+            for (std::size_t i = 0; i != array->count; ++i) {
+                Value element = array->get(i);
+                if (!is_number(element))
+                    return Value();
+                if (!isReal && element.is_double()) {
+                    real = (double) integer;
+                    isReal = true;
+                }
+                if (isReal)
+                    real += as_number(element);
+                else
+                    integer += element.as_int64();
+            }
+            return isReal ? Value(real) : Value(integer);
+        }
+
+        const NativeEntry stringNatives[] = {
+            { "length", 1, lengthNative },
+            { "split", 2, splitNative },
+            { "join", 2, joinNative },
+        };
+
+        const NativeEntry arrayNatives[] = {
+            { "Array", -1, arrayNative },
+            { "push", 2, pushNative },
+            { "pop", 1, popNative },
+            { "get", 2, getNative },
+            { "set", 3, setNative },
+            { "sum", 1, sumNative },
+        };
+
+    } // namespace
+
+    const std::span<const NativeEntry> stringModule = stringNatives;
+    const std::span<const NativeEntry> arrayModule = arrayNatives;
+
+} // namespace lox
@@ -0,0 +1,39 @@
+//
+//  natives.hpp
+//  qet
+//
+
+#ifndef natives_hpp
+#define natives_hpp
+
+#include <span>
+
+#include "object.hpp"
+
+namespace lox {
+
+    // Native modules
+    //
+    // Each module is a table of natives that VM::defineModule defines as
+    // globals.  A native reads its arguments from the caller's stack, and
+    // one that works over a whole string or array does its loop in C++,
+    // instead of a Lox loop of calls:
+    //
+    // core:   clock, gcStats, StringBuilder, append, toString, spawn,
+    //         Channel, Stack, send, receive and, with LOX_PROFILE, profile
+    // string: length(s), split(s, separator), join(array, separator)
+    // array:  Array(), Array(n), push(a, v), pop(a), get(a, i),
+    //         set(a, i, v), sum(a)
+    //
+    // length also counts the elements of an array.  Like the core natives,
+    // the others return nil for arguments of the wrong kinds, or indices
+    // out of range, but a call with the wrong number of arguments is a
+    // runtime error.
+
+    extern const std::span<const NativeEntry> coreModule;
+    extern const std::span<const NativeEntry> stringModule;
+    extern const std::span<const NativeEntry> arrayModule;
+
+} // namespace lox
+
+#endif /* natives_hpp */
@@ -7,6 +7,7 @@
 
 #include <cstdio>
 #include <cstring>
+#include <vector>
 
 #include "object.hpp"
 #include "string.hpp"
@@ -26,10 +27,53 @@ namespace lox {
      */
     
     
+    ObjectArray::ObjectArray(std::size_t count)
+    : elements(gc::Array<AtomicValue>::make(count))
+    , count(count) {
+        kind = OBJECT_ARRAY;
+    }
+    
+    Value ObjectArray::get(std::size_t index) const {
+        return (index < count) ? elements->_data[index].load() : Value();
+    }
+    
+    bool ObjectArray::set(std::size_t index, Value value) {
+        if (index >= count)
+            return false;
+        elements->_data[index] = value;
+        return true;
+    }
+    
+    void ObjectArray::push(Value value) {
+        gc::Array<AtomicValue>* old = (gc::Array<AtomicValue>*) elements;
+        if (count == old->_capacity) {
+            std::size_t capacity = count < 8 ? 8 : count * 2;
+            gc::Array<AtomicValue>* grown = gc::Array<AtomicValue>::make(capacity);
+            for (std::size_t i = 0; i != count; ++i)
+                grown->_data[i] = old->_data[i].load();
+            elements = grown;
+        }
+        elements->_data[count++] = value;
+    }
+    
+    Value ObjectArray::pop() {
+        if (count == 0)
+            return Value();
+        Value value = elements->_data[--count].load();
+        // clear the slot, so that the array doesn't keep the value alive
+        elements->_data[count] = Value();
+        return value;
+    }
+    
+    void ObjectArray::_gc_scan(gc::ScanContext& context) const {
+        context.push(elements);
+    }
+    
     ObjectBoundMethod::ObjectBoundMethod(Value receiver,
                                          ObjectClosure* method)
     : receiver(receiver)
     , method(method) {
+        kind = OBJECT_BOUND_METHOD;
     }
     
     void ObjectBoundMethod::_gc_scan(gc::ScanContext &context) const {
@@ -40,12 +84,15 @@ namespace lox {
     
     ObjectClass::ObjectClass(ObjectString* name)
     : name(name) {
+        kind = OBJECT_CLASS;
         initTable(&methods);
+        shape = new ObjectShape;
     }
 
     void ObjectClass::_gc_scan(gc::ScanContext &context) const {
         context.push(name);
         methods.scan(context);
+        context.push(shape);
     }
     
 
@@ -59,47 +106,319 @@ namespace lox {
      */
     
     void ObjectClosure::_gc_scan(gc::ScanContext &context) const {
+        using lox::scan;
         context.push(function);
         for (int i = 0; i < upvalueCount; i++)
-            context.push(upvalues[i]);
+            scan(upvalues[i], context);
     }
     
     ObjectFunction::ObjectFunction()
     : arity(0)
     , upvalueCount(0)
+    , registerCount(0)
     , name(nullptr) {
+        kind = OBJECT_FUNCTION;
     }
     
     void ObjectFunction::_gc_scan(gc::ScanContext &context) const {
         lox::scan(chunk, context);
+        lox::scan(registers, context);
         context.push(name);
     }
 
     ObjectInstance::ObjectInstance(ObjectClass* class_) {
+        kind = OBJECT_INSTANCE;
         this->class_ = class_;
+        shape = class_->shape;
         initTable(&fields);
     }
     
     void ObjectInstance::_gc_scan(gc::ScanContext &context) const {
         context.push(class_);
+        context.push(shape);
+        context.push(slots);
         fields.scan(context);
     }
     
-    ObjectNative::ObjectNative(NativeFn function)
-    : function(function) {
+    bool ObjectInstance::getField(ObjectString* name, Value* value) {
+        ObjectShape* shape = (ObjectShape*) this->shape;
+        if (!shape)
+            return tableGet(&fields, name, value);
+        int index = shape->find(name);
+        if (index < 0)
+            return false;
+        *value = slots->_data[index].load();
+        return true;
+    }
+    
+    void ObjectInstance::addField(ObjectShape* next, int index, Value value) {
+        gc::Array<AtomicValue>* old_slots = (gc::Array<AtomicValue>*) slots;
+        if (!old_slots || (std::size_t) index >= old_slots->_capacity) {
+            std::size_t capacity = old_slots ? old_slots->_capacity * 2 : 4;
+            gc::Array<AtomicValue>* new_slots = gc::Array<AtomicValue>::make(capacity);
+            for (int i = 0; i != index; ++i)
+                new_slots->_data[i] = old_slots->_data[i];
+            slots = new_slots;
+        }
+        // fill the slot before the shape that exposes it
+        slots->_data[index] = value;
+        shape = next;
+    }
+    
+    bool ObjectInstance::setField(ObjectString* name, Value value) {
+        ObjectShape* shape = (ObjectShape*) this->shape;
+        if (!shape)
+            return tableSet(&fields, name, value);
+        int index = shape->find(name);
+        if (index >= 0) {
+            slots->_data[index] = value;
+            return false;
+        }
+        if (shape->count < SHAPE_MAX_FIELDS) {
+            addField(shape->transition(name), shape->count, value);
+            return true;
+        }
+        // Too many fields to be worth sharing; move them into a table of our
+        // own
+        for (; shape->parent; shape = shape->parent)
+            tableSet(&fields, shape->name, slots->_data[shape->count - 1].load());
+        this->shape = nullptr;
+        slots = nullptr;
+        return tableSet(&fields, name, value);
+    }
+    
+    ObjectShape::ObjectShape()
+    : parent(nullptr)
+    , name(nullptr)
+    , count(0) {
+        kind = OBJECT_SHAPE;
+        initTable(&transitions);
+    }
+    
+    ObjectShape::ObjectShape(ObjectShape* parent, ObjectString* name)
+    : parent(parent)
+    , name(name)
+    , count(parent->count + 1) {
+        kind = OBJECT_SHAPE;
+        initTable(&transitions);
+    }
+    
+    int ObjectShape::find(ObjectString* name) {
+        for (ObjectShape* shape = this; shape->parent; shape = shape->parent)
+            if (shape->name == name)
+                return shape->count - 1;
+        return -1;
+    }
+    
+    ObjectShape* ObjectShape::transition(ObjectString* name) {
+        std::unique_lock lock{mutex};
+        Value child;
+        if (tableGet(&transitions, name, &child))
+            return (ObjectShape*) child.as_object();
+        ObjectShape* shape = new ObjectShape(this, name);
+        tableSet(&transitions, name, Value(shape));
+        return shape;
+    }
+    
+    void ObjectShape::_gc_scan(gc::ScanContext &context) const {
+        context.push(parent);
+        context.push(name);
+        transitions.scan(context);
+    }
+    
+    ObjectChannel::ObjectChannel(bool lifo)
+    : queue(lifo ? nullptr : new gc::MichaelScottQueue<Value>)
+    , stack(lifo ? new gc::TrieberStack<Value> : nullptr) {
+        kind = OBJECT_CHANNEL;
+    }
+    
+    void ObjectChannel::send(Value value) {
+        if (queue)
+            queue->push(value);
+        else
+            stack->push(value);
+    }
+    
+    bool ObjectChannel::receive(Value& value) {
+        return queue ? queue->pop(value) : stack->pop(value);
+    }
+    
+    void ObjectChannel::_gc_scan(gc::ScanContext& context) const {
+        if (queue)
+            context.push(queue);
+        if (stack)
+            context.push(stack);
+    }
+    
+    ObjectNative::ObjectNative(NativeFn function, int arity)
+    : function(function)
+    , arity(arity) {
+        kind = OBJECT_NATIVE;
+        gc::_heap::set_trivial(this);
     }
             
-    ObjectUpvalue::ObjectUpvalue(AtomicValue* slot)
-    : closed(Value())
-    , location(slot)
-    , next(nullptr) {
+    ObjectTransientString::ObjectTransientString(std::size_t size)
+    : _hash(0)
+    , _size(size) {
+        kind = OBJECT_TRANSIENT_STRING;
+        _data[_size] = '\0';
+    }
+    
+    ObjectTransientString* ObjectTransientString::make(std::size_t size) {
+        return new(gc::alloc(sizeof(ObjectTransientString) + size + 1)) ObjectTransientString(size);
+    }
+    
+    ObjectTransientString* ObjectTransientString::make(std::string_view view) {
+        ObjectTransientString* p = make(view.size());
+        memcpy(p->_data, view.data(), view.size());
+        return p;
+    }
+    
+    std::size_t ObjectTransientString::hash() const {
+        // the same hash as an interned string, so that interning can reuse
+        // it; racing threads compute the same value
+        std::size_t h = _hash.load(std::memory_order::relaxed);
+        if (!h) {
+            h = std::hash<std::string_view>()(view());
+            _hash.store(h, std::memory_order::relaxed);
+        }
+        return h;
+    }
+    
+    ObjectString* ObjectTransientString::intern() {
+        if (ObjectString* s = (ObjectString*) interned)
+            return s;
+        ObjectString* s = ObjectString::make(ObjectString::Query(view(), hash()));
+        interned = s;
+        return s;
+    }
+    
+    void ObjectTransientString::_gc_scan(gc::ScanContext& context) const {
+        if (ObjectString* s = (ObjectString*) interned)
+            context.push(s);
+    }
+    
+    ObjectRope::ObjectRope(Object* left, Object* right) {
+        kind = OBJECT_ROPE;
+        // a child that has already been flattened is replaced by its string,
+        // keeping repeated concatenation onto a printed rope shallow
+        if (left->kind == OBJECT_ROPE)
+            if (ObjectTransientString* s = (ObjectTransientString*) static_cast<ObjectRope*>(left)->flat)
+                left = s;
+        if (right->kind == OBJECT_ROPE)
+            if (ObjectTransientString* s = (ObjectTransientString*) static_cast<ObjectRope*>(right)->flat)
+                right = s;
+        this->left = left;
+        this->right = right;
+        this->length = stringLength(left) + stringLength(right);
+    }
+    
+    // Writes the characters of the rope so that they end at end.  Filling
+    // from the right means that the left-leaning ropes built by appending
+    // in a loop need only a constant depth of explicit stack.
+    static void fillRope(ObjectRope* rope, char* end) {
+        std::vector<Object*> stack{rope};
+        while (!stack.empty()) {
+            Object* object = stack.back();
+            stack.pop_back();
+            if (object->kind == OBJECT_ROPE) {
+                ObjectRope* node = static_cast<ObjectRope*>(object);
+                object = (ObjectTransientString*) node->flat;
+                if (!object) {
+                    stack.push_back(node->left);
+                    stack.push_back(node->right);
+                    continue;
+                }
+            }
+            std::string_view view = stringView(object);
+            end -= view.size();
+            memcpy(end, view.data(), view.size());
+        }
+    }
+    
+    ObjectTransientString* ObjectRope::flatten() {
+        if (ObjectTransientString* s = (ObjectTransientString*) flat)
+            return s;
+        // racing flattens make equal strings, and either will do
+        ObjectTransientString* s = ObjectTransientString::make(length);
+        fillRope(this, s->_data + length);
+        flat = s;
+        return s;
+    }
+    
+    void ObjectRope::appendTo(std::string& buffer) {
+        std::size_t n = buffer.size();
+        buffer.resize(n + length);
+        fillRope(this, buffer.data() + n + length);
+    }
+    
+    void ObjectRope::_gc_scan(gc::ScanContext& context) const {
+        // once flattened, the children are never read again
+        if (ObjectTransientString* s = (ObjectTransientString*) flat) {
+            context.push(s);
+        } else {
+            context.push(left);
+            context.push(right);
+        }
+    }
+    
+    std::size_t stringLength(Object* string) {
+        switch (string->kind) {
+            case OBJECT_STRING:
+                return static_cast<ObjectString*>(string)->_size;
+            case OBJECT_TRANSIENT_STRING:
+                return static_cast<ObjectTransientString*>(string)->_size;
+            default:
+                return static_cast<ObjectRope*>(string)->length;
+        }
+    }
+    
+    std::string_view stringView(Object* string) {
+        if (string->kind == OBJECT_STRING)
+            return static_cast<ObjectString*>(string)->view();
+        return static_cast<ObjectTransientString*>(string)->view();
+    }
+    
+    bool stringsEqual(Object* a, Object* b) {
+        if (a == b)
+            return true;
+        if (stringLength(a) != stringLength(b))
+            return false;
+        // distinct interned strings differ
+        if (a->kind == OBJECT_STRING && b->kind == OBJECT_STRING)
+            return false;
+        if (a->kind == OBJECT_ROPE)
+            a = static_cast<ObjectRope*>(a)->flatten();
+        if (b->kind == OBJECT_ROPE)
+            b = static_cast<ObjectRope*>(b)->flatten();
+        return stringView(a) == stringView(b);
+    }
+    
+    ObjectString* internString(Object* string) {
+        switch (string->kind) {
+            case OBJECT_STRING:
+                return static_cast<ObjectString*>(string);
+            case OBJECT_TRANSIENT_STRING:
+                return static_cast<ObjectTransientString*>(string)->intern();
+            default:
+                return static_cast<ObjectRope*>(string)->flatten()->intern();
+        }
+    }
+    
+    ObjectStringBuilder::ObjectStringBuilder() {
+        kind = OBJECT_STRING_BUILDER;
+    }
+    
+    ObjectUpvalue::ObjectUpvalue(Value* slot)
+    : location(slot)
+    , closed(Value()) {
+        kind = OBJECT_UPVALUE;
     }
     
     void ObjectUpvalue::_gc_scan(gc::ScanContext& context) const {
         using lox::scan;
-        scan(*location, context);
+        // while open, the value is on the stack, which the mutator shades
         scan(closed, context);
-        scan(next, context);
     }
     
     static uint32_t hashString(const char* key, int length) {
@@ -142,13 +461,62 @@ namespace lox {
     }
     
     void printObject(Value value) {
-        value.as_object()->printObject();
+        // qualified calls dispatch on the kind rather than the vtable
+        Object* object = value.as_object();
+        switch (object->kind) {
+            case OBJECT_ARRAY:
+                return static_cast<ObjectArray*>(object)->ObjectArray::printObject();
+            case OBJECT_BOUND_METHOD:
+                return static_cast<ObjectBoundMethod*>(object)->ObjectBoundMethod::printObject();
+            case OBJECT_CLASS:
+                return static_cast<ObjectClass*>(object)->ObjectClass::printObject();
+            case OBJECT_CLOSURE:
+                return static_cast<ObjectClosure*>(object)->ObjectClosure::printObject();
+            case OBJECT_FUNCTION:
+                return static_cast<ObjectFunction*>(object)->ObjectFunction::printObject();
+            case OBJECT_INSTANCE:
+                return static_cast<ObjectInstance*>(object)->ObjectInstance::printObject();
+            case OBJECT_NATIVE:
+                return static_cast<ObjectNative*>(object)->ObjectNative::printObject();
+            case OBJECT_ROPE:
+                return static_cast<ObjectRope*>(object)->ObjectRope::printObject();
+            case OBJECT_STRING:
+                return static_cast<ObjectString*>(object)->ObjectString::printObject();
+            case OBJECT_TRANSIENT_STRING:
+                return static_cast<ObjectTransientString*>(object)->ObjectTransientString::printObject();
+            default:
+                return object->printObject();
+        }
+    }
+    
+    void ObjectArray::printObject() {
+        // printing may take the mutex of an element, so take a snapshot
+        std::vector<Value> snapshot;
+        {
+            std::unique_lock lock{mutex};
+            for (std::size_t i = 0; i != count; ++i)
+                snapshot.push_back(elements->_data[i].load());
+        }
+        printf("[");
+        for (std::size_t i = 0; i != snapshot.size(); ++i) {
+            if (i)
+                printf(", ");
+            if (snapshot[i].as_object() == this)
+                printf("[...]");
+            else
+                printValue(snapshot[i]);
+        }
+        printf("]");
     }
     
     void ObjectBoundMethod::printObject() {
         printFunction(method->function);
     }
     
+    void ObjectChannel::printObject() {
+        printf(queue ? "<channel>" : "<stack>");
+    }
+    
     void ObjectClass::printObject() {
         printf("%s", name->_data);
     }
@@ -169,16 +537,40 @@ namespace lox {
         printf("<native fn>");
     }
         
+    void ObjectRope::printObject() {
+        flatten()->printObject();
+    }
+    
+    void ObjectTransientString::printObject() {
+        printf("%.*s", (int) _size, _data);
+    }
+    
+    void ObjectStringBuilder::printObject() {
+        printf("<string builder>");
+    }
+        
     void ObjectUpvalue::printObject() {
         printf("upvalue");
     }
+    
+    void ObjectShape::printObject() {
+        printf("shape");
+    }
 
     
     
+    void ObjectArray::_gc_debug() const {
+        printf("%p %s ObjectArray\n", this, gc::ColorCString(color.load(std::memory_order::relaxed)));
+    }
+
     void ObjectBoundMethod::_gc_debug() const {
         printf("%p %s ObjectBoundMethod\n", this, gc::ColorCString(color.load(std::memory_order::relaxed)));
     }
 
+    void ObjectChannel::_gc_debug() const {
+        printf("%p %s ObjectChannel\n", this, gc::ColorCString(color.load(std::memory_order::relaxed)));
+    }
+
     void ObjectClass::_gc_debug() const {
         printf("%p %s ObjectClass\n", this, gc::ColorCString(color.load(std::memory_order::relaxed)));
     }
@@ -199,22 +591,46 @@ namespace lox {
         printf("%p %s ObjectNative\n", this, gc::ColorCString(color.load(std::memory_order::relaxed)));
     }
 
+    void ObjectRope::_gc_debug() const {
+        printf("%p %s ObjectRope\n", this, gc::ColorCString(color.load(std::memory_order::relaxed)));
+    }
+
+    void ObjectShape::_gc_debug() const {
+        printf("%p %s ObjectShape\n", this, gc::ColorCString(color.load(std::memory_order::relaxed)));
+    }
+
+    void ObjectStringBuilder::_gc_debug() const {
+        printf("%p %s ObjectStringBuilder\n", this, gc::ColorCString(color.load(std::memory_order::relaxed)));
+    }
+
+    void ObjectTransientString::_gc_debug() const {
+        printf("%p %s ObjectTransientString\n", this, gc::ColorCString(color.load(std::memory_order::relaxed)));
+    }
+
     void ObjectUpvalue::_gc_debug() const {
         printf("%p %s ObjectUpvalue\n", this, gc::ColorCString(color.load(std::memory_order::relaxed)));
     }
     
 
     
+    std::size_t ObjectArray::_gc_bytes() const {
+        return sizeof(ObjectArray);
+    }
+
     std::size_t ObjectBoundMethod::_gc_bytes() const {
         return sizeof(ObjectBoundMethod);
     }
 
+    std::size_t ObjectChannel::_gc_bytes() const {
+        return sizeof(ObjectChannel);
+    }
+
     std::size_t ObjectClass::_gc_bytes() const {
         return sizeof(ObjectClass);
     }
     
     std::size_t ObjectClosure::_gc_bytes() const {
-        return sizeof(ObjectClosure) + sizeof(ObjectUpvalue*) * upvalueCount;
+        return sizeof(ObjectClosure) + sizeof(Value) * upvalueCount;
     }
 
     std::size_t ObjectFunction::_gc_bytes() const {
@@ -229,17 +645,34 @@ namespace lox {
         return sizeof(ObjectNative);
     }
 
+    std::size_t ObjectRope::_gc_bytes() const {
+        return sizeof(ObjectRope);
+    }
+
+    std::size_t ObjectShape::_gc_bytes() const {
+        return sizeof(ObjectShape);
+    }
+
+    std::size_t ObjectStringBuilder::_gc_bytes() const {
+        return sizeof(ObjectStringBuilder);
+    }
+
+    std::size_t ObjectTransientString::_gc_bytes() const {
+        return sizeof(ObjectTransientString) + _size + 1;
+    }
+
     std::size_t ObjectUpvalue::_gc_bytes() const {
         return sizeof(ObjectUpvalue);
     }
     
     ObjectClosure* ObjectClosure::make(ObjectFunction* function) {
         ObjectClosure* p = new(gc::alloc(sizeof(ObjectClosure)
-                                         + sizeof(ObjectUpvalue*)
+                                         + sizeof(Value)
                                          * function->upvalueCount)) ObjectClosure;
+        p->kind = OBJECT_CLOSURE;
         p->function = function;
         p->upvalueCount = function->upvalueCount;
-        std::uninitialized_fill_n(p->upvalues, p->upvalueCount, nullptr);
+        std::uninitialized_fill_n(p->upvalues, p->upvalueCount, Value());
         return p;
     }
     
@@ -8,11 +8,17 @@
 #ifndef object_hpp
 #define object_hpp
 
+#include <atomic>
 #include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
 
 #include "chunk.hpp"
 #include "common.hpp"
 #include "gc.hpp"
+#include "queue.hpp"
+#include "stack.hpp"
 #include "table.hpp"
 #include "value.hpp"
 
@@ -24,50 +30,114 @@ namespace gc {
 
 namespace lox {
     
-    // TODO:
-    //
-    // Relative performance of virtual functions vs switch-on-enum
-    //
-    // Using virtual functins for prototyping, contra clox
+    // Objects carry a kind tag, packed next to the gc color, so that the
+    // interpreter can type check them with a load and compare.  The virtual
+    // functions remain for the cold paths; see benchmarkObjectDispatch for
+    // their relative cost.
     
     struct VM;
     
     struct Object;
         
+    struct ObjectArray;
     struct ObjectBoundMethod;
+    struct ObjectChannel;
     struct ObjectClass;
     struct ObjectClosure;
     struct ObjectFunction;
     struct ObjectInstance;
     struct ObjectNative;
+    struct ObjectRope;
+    struct ObjectShape;
     using ObjectString = ::gc::_string::SNode;
+    struct ObjectStringBuilder;
+    struct ObjectTransientString;
     struct ObjectUpvalue;
     
     struct AtomicValue;
     
-    using NativeFn = Value (*)(int argCount, AtomicValue* args);
+    // Natives are passed the VM that calls them, for those that need its
+    // globals or its roots, and their arguments where they are on its
+    // stack.  Like the interpreter, a native can allocate its result, and
+    // any temporaries, without rooting them, since it runs between
+    // safepoints.
+    using NativeFn = Value (*)(VM& vm, int argCount, Value* args);
+    
+    // One native of a module, which VM::defineModule defines as a global;
+    // calls with other than arity arguments are runtime errors, unless the
+    // arity is -1
+    struct NativeEntry {
+        const char* name;
+        int arity;
+        NativeFn function;
+    };
+    
+#define ENUMERATE_X_OBJECT \
+X(OTHER)\
+X(ARRAY)\
+X(BOUND_METHOD)\
+X(CHANNEL)\
+X(CLASS)\
+X(CLOSURE)\
+X(FUNCTION)\
+X(INSTANCE)\
+X(NATIVE)\
+X(ROPE)\
+X(SHAPE)\
+X(STRING)\
+X(STRING_BUILDER)\
+X(TRANSIENT_STRING)\
+X(UPVALUE)\
+
+#define X(Z) OBJECT_##Z,
+    enum ObjectKind : uint8_t { ENUMERATE_X_OBJECT };
+#undef X
+    
+#define X(Z) [OBJECT_##Z] = "OBJECT_" #Z,
+    constexpr const char* ObjectKindCString[] { ENUMERATE_X_OBJECT };
+#undef X
     
-#define IS_BOUND_METHOD(value) (reinterpret_cast<ObjectBoundMethod*>(value.as_object()))
-#define IS_CLASS(value) (reinterpret_cast<ObjectClass*>(value.as_object()))
-#define IS_CLOSURE(value) (reinterpret_cast<ObjectClosure*>(value.as_object()))
-#define IS_FUNCTION(value) (reinterpret_cast<ObjectFunction*>(value.as_object()))
-#define IS_INSTANCE(value) (reinterpret_cast<ObjectInstance*>(value.as_object()))
-#define IS_NATIVE(value) (reinterpret_cast<ObjectNative*>(value.as_object()))
-#define IS_STRING(value) (reinterpret_cast<ObjectString*>(value.as_object()))
+    inline bool isObjectKind(Value value, ObjectKind kind);
     
+#define IS_ARRAY(value) isObjectKind(value, OBJECT_ARRAY)
+#define IS_BOUND_METHOD(value) isObjectKind(value, OBJECT_BOUND_METHOD)
+#define IS_CHANNEL(value) isObjectKind(value, OBJECT_CHANNEL)
+#define IS_CLASS(value) isObjectKind(value, OBJECT_CLASS)
+#define IS_CLOSURE(value) isObjectKind(value, OBJECT_CLOSURE)
+#define IS_FUNCTION(value) isObjectKind(value, OBJECT_FUNCTION)
+#define IS_INSTANCE(value) isObjectKind(value, OBJECT_INSTANCE)
+#define IS_NATIVE(value) isObjectKind(value, OBJECT_NATIVE)
+#define IS_ROPE(value) isObjectKind(value, OBJECT_ROPE)
+#define IS_STRING(value) isObjectKind(value, OBJECT_STRING)
+#define IS_STRING_BUILDER(value) isObjectKind(value, OBJECT_STRING_BUILDER)
+#define IS_TRANSIENT_STRING(value) isObjectKind(value, OBJECT_TRANSIENT_STRING)
+    
+#define AS_ARRAY(value) ((ObjectArray*)value.as_object())
 #define AS_BOUND_METHOD(value) ((ObjectBoundMethod*)value.as_object())
+#define AS_CHANNEL(value) ((ObjectChannel*)value.as_object())
 #define AS_CLASS(value) ((ObjectClass*)value.as_object())
 #define AS_CLOSURE(value) ((ObjectClosure*)value.as_object())
 #define AS_FUNCTION(value) ((ObjectFunction*)value.as_object())
 #define AS_INSTANCE(value) ((ObjectInstance*)value.as_object())
 #define AS_NATIVE(value) (((ObjectNative*)value.as_object())->function)
+#define AS_ROPE(value) ((ObjectRope*)value.as_object())
 #define AS_STRING(value) ((ObjectString*)value.as_object())
+#define AS_STRING_BUILDER(value) ((ObjectStringBuilder*)value.as_object())
+#define AS_TRANSIENT_STRING(value) ((ObjectTransientString*)value.as_object())
 #define AS_CSTRING(value) (((ObjectString*)value.as_object())->chars)
 
     struct Object : gc::Object {
+        ObjectKind kind = OBJECT_OTHER; // <-- set by the most derived constructor
         virtual void printObject() = 0;
         virtual bool callObject(VM& vm, int argCount);
     };
+    
+    // The kind fills the tail padding after gc::Object's color
+    static_assert(sizeof(Object) == sizeof(gc::Object));
+    
+    inline bool isObjectKind(Value value, ObjectKind kind) {
+        return value.is_object() && value.as_object()->kind == kind;
+    }
         
     struct ObjectBoundMethod : Object {
         ObjectBoundMethod(Value receiver, ObjectClosure* method);
@@ -87,18 +157,26 @@ namespace lox {
         virtual bool callObject(VM& vm, int argCount) override;
         ObjectString* name;
         Table methods;
+        ObjectShape* shape; // <-- of instances with no fields
         virtual void _gc_scan(gc::ScanContext& context) const override;
         virtual std::size_t _gc_bytes() const override;
         virtual void _gc_debug() const override;
 
     };
     
+    // A closure holds each captured variable as an ObjectUpvalue, unless
+    // the compiler found that nothing assigns it, in which case it holds
+    // the value itself.  Lox values are never upvalues, so the two can't
+    // be confused.
     struct ObjectClosure : Object {
         virtual void printObject() override;
         virtual bool callObject(VM& vm, int argCount) override;
         ObjectFunction* function;
         int upvalueCount;
-        ObjectUpvalue* upvalues[0];  // flexible array member
+        Value upvalues[0];  // flexible array member
+        // false if the variable is still open on another VM's stack
+        bool loadUpvalue(const VM& vm, int slot, Value* value) const;
+        bool storeUpvalue(const VM& vm, int slot, Value value);
         // explicit ObjectClosure(ObjectFunction* function);
         static ObjectClosure* make(ObjectFunction* function);
         virtual void _gc_scan(gc::ScanContext& context) const override;
@@ -112,6 +190,8 @@ namespace lox {
         int arity;
         int upvalueCount;
         Chunk chunk;
+        Chunk registers;    // <-- empty if there is no register form
+        int registerCount;
         ObjectString* name;
         ObjectFunction();
         virtual void _gc_scan(gc::ScanContext& context) const override;
@@ -119,11 +199,50 @@ namespace lox {
         virtual void _gc_debug() const override;
     };
     
+    // Hidden classes
+    //
+    // Instances that get the same fields in the same order share a shape,
+    // which maps field names to indices into the instance's flat array of
+    // slots.  Adding a field moves the instance along a transition to a child
+    // shape, creating it the first time.  Each class has its own root shape,
+    // so a shape also identifies the class, and inline caches can guard on
+    // it alone.
+    //
+    // A shape records only the field it adds to its parent, so a chain of n
+    // fields costs O(n), and a lookup walks the chain toward the root.  The
+    // inline caches keep that walk off the common paths.
+    //
+    // An instance that gets too many fields drops its shape and falls back
+    // to a per-instance table.
+    
+    constexpr int SHAPE_MAX_FIELDS = 64;
+    
+    struct ObjectShape : Object {
+        virtual void printObject() override;
+        ObjectShape* parent;
+        ObjectString* name;        // <-- of the field in slot count - 1
+        int count;                 // <-- number of fields
+        std::mutex mutex;          // <-- guards transitions
+        Table transitions;         // <-- name -> child ObjectShape
+        ObjectShape();
+        ObjectShape(ObjectShape* parent, ObjectString* name);
+        int find(ObjectString* name); // <-- -1 if absent
+        ObjectShape* transition(ObjectString* name);
+        virtual void _gc_scan(gc::ScanContext& context) const override;
+        virtual std::size_t _gc_bytes() const override;
+        virtual void _gc_debug() const override;
+    };
+    
     struct ObjectInstance : Object {
         virtual void printObject() override;
         ObjectClass* class_;
-        Table fields;
+        gc::StrongPtr<ObjectShape> shape;             // <-- nullptr in dictionary mode
+        gc::StrongPtr<gc::Array<AtomicValue>> slots;  // <-- indexed by shape
+        Table fields;                                 // <-- dictionary mode
         explicit ObjectInstance(ObjectClass* class_);
+        bool getField(ObjectString* name, Value* value);
+        bool setField(ObjectString* name, Value value); // <-- true if new
+        void addField(ObjectShape* next, int index, Value value);
         virtual void _gc_scan(gc::ScanContext& context) const override;
         virtual std::size_t _gc_bytes() const override;
         virtual void _gc_debug() const override;
@@ -134,7 +253,8 @@ namespace lox {
         virtual void printObject() override;
         virtual bool callObject(VM& vm, int argCount) override;
         NativeFn function;
-        explicit ObjectNative(NativeFn function);
+        int arity;  // <-- -1 for any number of arguments
+        explicit ObjectNative(NativeFn function, int arity = -1);
         virtual std::size_t _gc_bytes() const override;
         virtual void _gc_debug() const override;
 
@@ -143,12 +263,132 @@ namespace lox {
     ObjectString* takeString(char* chars, int length);
     ObjectString* copyString(const char* chars, int length);
     
+    // Transient strings
+    //
+    // Interning hashes a string and inserts it into the global ctrie, which
+    // is wasted work for the many strings made at runtime that are only
+    // printed and dropped.  Those are instead made as transient strings,
+    // which are unique objects that compute their hash only when asked,
+    // and are interned only when an ObjectString is actually required.
+    
+    struct ObjectTransientString : Object {
+        virtual void printObject() override;
+        mutable std::atomic<std::size_t> _hash;   // <-- 0 until computed
+        gc::StrongPtr<ObjectString> interned;     // <-- nullptr until interned
+        std::size_t _size;
+        char _data[0];  // flexible array member
+        explicit ObjectTransientString(std::size_t size);
+        static ObjectTransientString* make(std::size_t size); // <-- uninitialized
+        static ObjectTransientString* make(std::string_view view);
+        std::string_view view() const {
+            return std::string_view(_data, _size);
+        }
+        std::size_t hash() const;
+        ObjectString* intern();
+        virtual void _gc_scan(gc::ScanContext& context) const override;
+        virtual std::size_t _gc_bytes() const override;
+        virtual void _gc_debug() const override;
+    };
+    
+    // Ropes
+    //
+    // Copying a concatenation is quadratic when a loop appends to a string.
+    // Concatenations that reach ROPE_MIN_LENGTH instead make a rope, an
+    // immutable binary tree whose leaves are strings, and defer the copy
+    // until the string is needed for comparison or printing.  The flattened
+    // string is then cached, and the rope stops tracing its children.
+    
+    constexpr std::size_t ROPE_MIN_LENGTH = 64;
+    
+    struct ObjectRope : Object {
+        virtual void printObject() override;
+        Object* left;                    // <-- any string kind but a flat rope
+        Object* right;                   // <-- any string kind but a flat rope
+        std::size_t length;
+        gc::StrongPtr<ObjectTransientString> flat;   // <-- nullptr until flattened
+        ObjectRope(Object* left, Object* right);
+        ObjectTransientString* flatten();
+        void appendTo(std::string& buffer);
+        virtual void _gc_scan(gc::ScanContext& context) const override;
+        virtual std::size_t _gc_bytes() const override;
+        virtual void _gc_debug() const override;
+    };
+    
+    // An ObjectString, ObjectTransientString or ObjectRope
+    inline bool isString(Value value);
+    
+    std::size_t stringLength(Object* string);
+    
+    // the characters of an ObjectString or ObjectTransientString
+    std::string_view stringView(Object* string);
+    
+    // compares the characters, interning nothing
+    bool stringsEqual(Object* a, Object* b);
+    
+    ObjectString* internString(Object* string);
+    
+    // Explicit accumulation, for the StringBuilder native
+    
+    struct ObjectStringBuilder : gc::Leaf<Object> {
+        virtual void printObject() override;
+        std::mutex mutex;
+        std::string buffer;
+        ObjectStringBuilder();
+        virtual std::size_t _gc_bytes() const override;
+        virtual void _gc_debug() const override;
+    };
+    
+    // Arrays, for the array natives
+    //
+    // The elements are AtomicValues, since the collector traces them while
+    // the mutator stores them, in a gc::Array that is replaced by one twice
+    // the size when it is full.  Tasks may share an array, so it is only
+    // used under its mutex, which the bulk natives take once for the whole
+    // array rather than once per element.
+    
+    struct ObjectArray : Object {
+        virtual void printObject() override;
+        mutable std::mutex mutex;
+        gc::StrongPtr<gc::Array<AtomicValue>> elements;
+        std::size_t count;
+        explicit ObjectArray(std::size_t count = 0); // <-- of nils
+        // under the mutex
+        Value get(std::size_t index) const;          // <-- nil if out of range
+        bool set(std::size_t index, Value value);
+        void push(Value value);
+        Value pop();                                 // <-- nil if empty
+        virtual void _gc_scan(gc::ScanContext& context) const override;
+        virtual std::size_t _gc_bytes() const override;
+        virtual void _gc_debug() const override;
+    };
+    
+    // Channels between tasks, for the Channel and Stack natives
+    //
+    // A channel is FIFO over a lock-free MichaelScottQueue, or LIFO over a
+    // TrieberStack, which suits a pile of work whose order doesn't matter.
+    // Either way, sends and receives take no locks and never block; a
+    // receive from an empty channel just fails, and the receive native
+    // waits by yielding the task.
+    
+    struct ObjectChannel : Object {
+        virtual void printObject() override;
+        gc::MichaelScottQueue<Value>* queue; // <-- nullptr if LIFO
+        gc::TrieberStack<Value>* stack;      // <-- nullptr if FIFO
+        explicit ObjectChannel(bool lifo);
+        void send(Value value);
+        bool receive(Value& value);
+        virtual void _gc_scan(gc::ScanContext& context) const override;
+        virtual std::size_t _gc_bytes() const override;
+        virtual void _gc_debug() const override;
+    };
+    
     struct ObjectUpvalue : Object {
         virtual void printObject() override;
-        AtomicValue* location;
+        // atomic because spawned VMs may reach the upvalue and must see
+        // whether it is still open on another thread's stack
+        std::atomic<Value*> location;    // <-- the stack slot while open, else nullptr
         AtomicValue closed;
-        ObjectUpvalue* next;
-        explicit ObjectUpvalue(AtomicValue* slot);
+        explicit ObjectUpvalue(Value* slot);
         virtual void _gc_scan(gc::ScanContext& context) const override;
         virtual std::size_t _gc_bytes() const override;
         virtual void _gc_debug() const override;
@@ -157,6 +397,15 @@ namespace lox {
     
     void printObject(Value value);
     
+    inline bool isString(Value value) {
+        if (!value.is_object())
+            return false;
+        ObjectKind kind = value.as_object()->kind;
+        return (kind == OBJECT_STRING
+                || kind == OBJECT_TRANSIENT_STRING
+                || kind == OBJECT_ROPE);
+    }
+    
 } // namespacxe lox
     
 #endif /* object_hpp */
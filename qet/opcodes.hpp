@@ -23,6 +23,9 @@ namespace lox {
     X(GET_GLOBAL)\
     X(DEFINE_GLOBAL)\
     X(SET_GLOBAL)\
+    X(GET_GLOBAL_SLOT)\
+    X(DEFINE_GLOBAL_SLOT)\
+    X(SET_GLOBAL_SLOT)\
     X(GET_UPVALUE)\
     X(SET_UPVALUE)\
     X(GET_PROPERTY)\
@@ -50,6 +53,44 @@ namespace lox {
     X(CLASS)\
     X(INHERIT)\
     X(METHOD)\
+    X(GET_LOCAL_GET_LOCAL)\
+    X(SET_LOCAL_POP)\
+    X(ADD_CONSTANT)\
+    X(LESS_JUMP_IF_FALSE)\
+    X(ADD_INT)\
+    X(ADD_FLOAT)\
+    X(SUBTRACT_INT)\
+    X(SUBTRACT_FLOAT)\
+    X(MULTIPLY_INT)\
+    X(MULTIPLY_FLOAT)\
+    X(DIVIDE_INT)\
+    X(DIVIDE_FLOAT)\
+    X(LESS_INT)\
+    X(LESS_FLOAT)\
+    X(GREATER_INT)\
+    X(GREATER_FLOAT)\
+    X(REG_MOVE)\
+    X(REG_NIL)\
+    X(REG_TRUE)\
+    X(REG_FALSE)\
+    X(REG_GET_GLOBAL_SLOT)\
+    X(REG_DEFINE_GLOBAL_SLOT)\
+    X(REG_SET_GLOBAL_SLOT)\
+    X(REG_GET_UPVALUE)\
+    X(REG_SET_UPVALUE)\
+    X(REG_EQUAL)\
+    X(REG_GREATER)\
+    X(REG_LESS)\
+    X(REG_ADD)\
+    X(REG_SUBTRACT)\
+    X(REG_MULTIPLY)\
+    X(REG_DIVIDE)\
+    X(REG_NOT)\
+    X(REG_NEGATE)\
+    X(REG_PRINT)\
+    X(REG_JUMP_IF_FALSE)\
+    X(REG_CALL)\
+    X(REG_RETURN)\
 
 #define X(Z) OPCODE_##Z,
     enum OpCode : uint8_t { ENUMERATEX_OPCODES };
@@ -59,6 +100,13 @@ namespace lox {
     constexpr const char* OpCodeCString[] = { ENUMERATEX_OPCODES };
 #undef X
     
+    // How OPCODE_CLOSURE captures each upvalue, in the byte before its index
+    enum Capture : uint8_t {
+        CAPTURE_UPVALUE,    // <-- shares an upvalue of the enclosing closure
+        CAPTURE_LOCAL,      // <-- shares a local through an ObjectUpvalue
+        CAPTURE_VALUE,      // <-- copies a local that is never assigned
+    };
+    
 } // namespace lox
     
 #endif /* opcodes_hpp */
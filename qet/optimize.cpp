@@ -0,0 +1,292 @@
+//
+//  optimize.cpp
+//  qet
+//
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "object.hpp"
+#include "opcodes.hpp"
+#include "optimize.hpp"
+
+namespace lox {
+
+    namespace {
+
+        // A decoded instruction.  Jumps refer to the index of the instruction
+        // they land on, rather than to an offset, so that instructions can be
+        // fused and removed before the chunk is encoded again.
+
+        struct Instruction {
+            uint8_t opcode;
+            std::vector<uint8_t> operands; // <-- excluding any jump offset
+            int target = -1;               // <-- instruction a jump lands on
+            size_t offset;                 // <-- in the original code
+            int line;
+            const char* where;
+            bool removed = false;
+            bool isTarget = false;
+        };
+
+        bool isJump(uint8_t opcode) {
+            switch (opcode) {
+                case OPCODE_JUMP:
+                case OPCODE_JUMP_IF_FALSE:
+                case OPCODE_LESS_JUMP_IF_FALSE:
+                case OPCODE_LOOP:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        std::vector<Instruction> decode(const Chunk* chunk) {
+            std::vector<Instruction> instructions;
+            std::vector<int> index(chunk->code.size() + 1, -1);
+            for (size_t offset = 0; offset != chunk->code.size();) {
+                size_t length = instructionLength(chunk, offset);
+                Instruction instruction;
+                instruction.opcode = chunk->code[offset];
+                instruction.offset = offset;
+                const LineTable::Run& run = chunk->lines.find(offset);
+                instruction.line = run.line;
+                instruction.where = run.where;
+                if (!isJump(instruction.opcode))
+                    instruction.operands.assign(chunk->code.begin() + offset + 1,
+                                                chunk->code.begin() + offset + length);
+                index[offset] = (int) instructions.size();
+                instructions.push_back(std::move(instruction));
+                offset += length;
+            }
+            // a jump may land just past the end
+            index[chunk->code.size()] = (int) instructions.size();
+            for (Instruction& instruction : instructions) {
+                if (!isJump(instruction.opcode))
+                    continue;
+                const uint8_t* p = chunk->code.data() + instruction.offset;
+                uint16_t jump = (uint16_t)((p[1] << 8) | p[2]);
+                size_t end = instruction.offset + 3;
+                instruction.target = index[(instruction.opcode == OPCODE_LOOP) ? end - jump : end + jump];
+                assert(instruction.target != -1);
+            }
+            return instructions;
+        }
+
+        void markTargets(std::vector<Instruction>& instructions) {
+            for (Instruction& instruction : instructions)
+                instruction.isTarget = false;
+            for (Instruction& instruction : instructions)
+                if (!instruction.removed && (instruction.target != -1)
+                    && (instruction.target < (int) instructions.size()))
+                    instructions[instruction.target].isTarget = true;
+        }
+
+        // the next live instruction, or -1
+        int next(const std::vector<Instruction>& instructions, int i) {
+            while (++i < (int) instructions.size())
+                if (!instructions[i].removed)
+                    return i;
+            return -1;
+        }
+
+        // the next live instruction, if control can only reach it from i
+        int fusible(const std::vector<Instruction>& instructions, int i) {
+            int j = next(instructions, i);
+            return ((j != -1) && !instructions[j].isTarget) ? j : -1;
+        }
+
+        bool isIntegerConstant(const Chunk* chunk, const Instruction& instruction) {
+            return (instruction.opcode == OPCODE_CONSTANT)
+                && chunk->constants[instruction.operands[0]].is_int64();
+        }
+
+        int64_t integerConstant(const Chunk* chunk, const Instruction& instruction) {
+            return chunk->constants[instruction.operands[0]].as_int64();
+        }
+
+        // Rewrites instruction to push value, reusing an equal constant if
+        // there is one; fails if the constant table is full
+        bool makeConstant(Chunk* chunk, Instruction& instruction, Value value) {
+            if (value.is_bool()) {
+                instruction.opcode = value.as_bool() ? OPCODE_TRUE : OPCODE_FALSE;
+                instruction.operands.clear();
+                return true;
+            }
+            // 1 == 1.0, but the constants are not interchangeable
+            auto same = [&](Value other) {
+                return (other.type() == value.type()) && (other == value);
+            };
+            size_t constant = 0;
+            while ((constant != chunk->constants.size()) && !same(chunk->constants[constant]))
+                ++constant;
+            if (constant > UINT8_MAX)
+                return false;
+            if (constant == chunk->constants.size())
+                chunk->add_constant(value);
+            instruction.opcode = OPCODE_CONSTANT;
+            instruction.operands.assign(1, (uint8_t) constant);
+            return true;
+        }
+
+        // Folds the operation that follows a constant (or two), if it can't
+        // fail at runtime.  Results are made the same way as the VM makes
+        // them, so they wrap the same way when NaN-boxed.
+        bool foldConstants(Chunk* chunk, std::vector<Instruction>& instructions, int i) {
+            if (!isIntegerConstant(chunk, instructions[i]))
+                return false;
+            int64_t a = integerConstant(chunk, instructions[i]);
+            int j = fusible(instructions, i);
+            if (j == -1)
+                return false;
+            if (instructions[j].opcode == OPCODE_NEGATE) {
+                if (a == INT64_MIN || !makeConstant(chunk, instructions[i], Value(-a)))
+                    return false;
+                instructions[j].removed = true;
+                return true;
+            }
+            if (!isIntegerConstant(chunk, instructions[j]))
+                return false;
+            int64_t b = integerConstant(chunk, instructions[j]);
+            int k = fusible(instructions, j);
+            if (k == -1)
+                return false;
+            Value result;
+            switch (instructions[k].opcode) {
+                case OPCODE_ADD: result = Value(a + b); break;
+                case OPCODE_SUBTRACT: result = Value(a - b); break;
+                case OPCODE_MULTIPLY: result = Value(a * b); break;
+                case OPCODE_DIVIDE:
+                    // leave the runtime to fault as it would have
+                    if ((b == 0) || ((a == INT64_MIN) && (b == -1)))
+                        return false;
+                    result = Value(a / b);
+                    break;
+                case OPCODE_LESS: result = Value(a < b); break;
+                case OPCODE_GREATER: result = Value(a > b); break;
+                case OPCODE_EQUAL: result = Value(a == b); break;
+                default:
+                    return false;
+            }
+            if (!makeConstant(chunk, instructions[i], result))
+                return false;
+            instructions[j].removed = true;
+            instructions[k].removed = true;
+            return true;
+        }
+
+        // A jump that lands on an unconditional jump can go straight to where
+        // that one goes, and a JUMP_IF_FALSE that lands on another will find
+        // the same condition there.  Jumps keep their direction, so that every
+        // cycle still passes through a LOOP and its safepoint, and their
+        // distance in the original code, which bounds the new distance.
+        void threadJumps(std::vector<Instruction>& instructions) {
+            int n = (int) instructions.size();
+            for (int i = 0; i != n; ++i) {
+                Instruction& jump = instructions[i];
+                if (!isJump(jump.opcode))
+                    continue;
+                bool forward = (jump.opcode != OPCODE_LOOP);
+                for (int hops = 0; hops != n; ++hops) {
+                    int t = jump.target;
+                    if (t == n)
+                        break;
+                    const Instruction& landing = instructions[t];
+                    bool follow = (landing.opcode == OPCODE_JUMP) || (landing.opcode == OPCODE_LOOP)
+                        || ((jump.opcode == OPCODE_JUMP_IF_FALSE) && (landing.opcode == OPCODE_JUMP_IF_FALSE));
+                    if (!follow || (landing.target > i) != forward)
+                        break;
+                    size_t end = (landing.target == n) ? SIZE_MAX : instructions[landing.target].offset;
+                    size_t distance = forward ? end - (jump.offset + 3) : (jump.offset + 3) - end;
+                    if ((end == SIZE_MAX) || (distance > UINT16_MAX))
+                        break;
+                    jump.target = landing.target;
+                }
+            }
+        }
+
+        void fuse(Chunk* chunk, std::vector<Instruction>& instructions, int i) {
+            Instruction& a = instructions[i];
+            int j = fusible(instructions, i);
+            if (j == -1)
+                return;
+            Instruction& b = instructions[j];
+            if ((a.opcode == OPCODE_GET_LOCAL) && (b.opcode == OPCODE_GET_LOCAL)) {
+                a.opcode = OPCODE_GET_LOCAL_GET_LOCAL;
+                a.operands.push_back(b.operands[0]);
+            } else if (isIntegerConstant(chunk, a) && (b.opcode == OPCODE_ADD)) {
+                // errors are reported against the ADD
+                a.opcode = OPCODE_ADD_CONSTANT;
+                a.line = b.line;
+                a.where = b.where;
+            } else if ((a.opcode == OPCODE_LESS) && (b.opcode == OPCODE_JUMP_IF_FALSE)) {
+                a.opcode = OPCODE_LESS_JUMP_IF_FALSE;
+                a.target = b.target;
+            } else if ((a.opcode == OPCODE_SET_LOCAL) && (b.opcode == OPCODE_POP)) {
+                a.opcode = OPCODE_SET_LOCAL_POP;
+            } else {
+                return;
+            }
+            b.removed = true;
+        }
+
+        void encode(Chunk* chunk, const std::vector<Instruction>& instructions) {
+            std::vector<size_t> offsets(instructions.size() + 1);
+            size_t offset = 0;
+            for (size_t i = 0; i != instructions.size(); ++i) {
+                offsets[i] = offset;
+                const Instruction& instruction = instructions[i];
+                if (!instruction.removed)
+                    offset += 1 + (isJump(instruction.opcode) ? 2 : instruction.operands.size());
+            }
+            offsets[instructions.size()] = offset;
+            std::vector<uint8_t> code;
+            LineTable lines;
+            code.reserve(offset);
+            for (const Instruction& instruction : instructions) {
+                if (instruction.removed)
+                    continue;
+                size_t start = code.size();
+                lines.add(start, instruction.line, instruction.where);
+                code.push_back(instruction.opcode);
+                if (isJump(instruction.opcode)) {
+                    size_t end = start + 3;
+                    size_t target = offsets[instruction.target];
+                    size_t jump = (instruction.opcode == OPCODE_LOOP) ? end - target : target - end;
+                    assert(jump <= UINT16_MAX);
+                    code.push_back((jump >> 8) & 0xff);
+                    code.push_back(jump & 0xff);
+                } else {
+                    code.insert(code.end(), instruction.operands.begin(), instruction.operands.end());
+                }
+            }
+            chunk->code = std::move(code);
+            chunk->lines = std::move(lines);
+        }
+
+    } // namespace
+
+    void optimizeChunk(Chunk* chunk) {
+        std::vector<Instruction> instructions = decode(chunk);
+        int n = (int) instructions.size();
+
+        markTargets(instructions);
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (int i = 0; i != n; ++i)
+                if (!instructions[i].removed && foldConstants(chunk, instructions, i))
+                    changed = true;
+        }
+
+        threadJumps(instructions);
+
+        markTargets(instructions);
+        for (int i = 0; i != n; ++i)
+            if (!instructions[i].removed)
+                fuse(chunk, instructions, i);
+
+        encode(chunk, instructions);
+    }
+
+} // namespace lox
@@ -0,0 +1,26 @@
+//
+//  optimize.hpp
+//  qet
+//
+
+#ifndef optimize_hpp
+#define optimize_hpp
+
+#include "chunk.hpp"
+
+namespace lox {
+
+    // Peephole pass over a freshly compiled chunk, before its function is
+    // installed
+    //
+    // - folds integer arithmetic and comparisons of constants
+    // - threads jumps to jumps through to their final destination
+    // - fuses common pairs into superinstructions (GET_LOCAL_GET_LOCAL,
+    //   ADD_CONSTANT, LESS_JUMP_IF_FALSE, SET_LOCAL_POP)
+    //
+    // The code only ever shrinks, so 16-bit jump offsets stay in range.
+    void optimizeChunk(Chunk* chunk);
+
+} // namespace lox
+
+#endif /* optimize_hpp */
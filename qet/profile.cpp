@@ -0,0 +1,127 @@
+//
+//  profile.cpp
+//  qet
+//
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "object.hpp"
+#include "opcodes.hpp"
+#include "profile.hpp"
+#include "string.hpp"
+#include "vm.hpp"
+
+namespace lox {
+
+    namespace {
+
+        std::atomic<std::uint64_t> samplerTick;
+        std::once_flag samplerStarted;
+
+        // runs until the program exits
+        void sampler() {
+            for (;;) {
+                std::this_thread::sleep_for(PROFILE_SAMPLE_INTERVAL);
+                samplerTick.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        std::string functionName(const ObjectFunction* function) {
+            if (function->name == nullptr)
+                return "script";
+            return std::string(function->name->_data, function->name->_size);
+        }
+
+        double milliseconds(std::chrono::steady_clock::duration duration) {
+            return std::chrono::duration<double, std::milli>(duration).count();
+        }
+
+    } // namespace
+
+    Profile::Profile() {
+        std::call_once(samplerStarted, [] {
+            std::thread(sampler).detach();
+        });
+        _tick = samplerTick.load(std::memory_order_relaxed);
+    }
+
+    void Profile::_switch(const ObjectFunction* function) {
+        auto now = std::chrono::steady_clock::now();
+        if (_entry)
+            _entry->time += now - _stamp;
+        _stamp = now;
+        _current = function;
+        auto [it, inserted] = functions.try_emplace(function);
+        if (inserted)
+            it->second.name = functionName(function);
+        _entry = &it->second;
+    }
+
+    void Profile::pause() {
+        if (_entry)
+            _entry->time += std::chrono::steady_clock::now() - _stamp;
+        _current = nullptr;
+        _entry = nullptr;
+    }
+
+    bool Profile::due() const {
+        return samplerTick.load(std::memory_order_relaxed) != _tick;
+    }
+
+    void Profile::sample(const VM& vm) {
+        _tick = samplerTick.load(std::memory_order_relaxed);
+        std::string stack;
+        for (int i = 0; i != vm.frameCount; ++i) {
+            if (i)
+                stack += ';';
+            stack += functionName(vm.frames[i].closure->function);
+        }
+        ++stacks[stack];
+    }
+
+    std::string Profile::collapsed() const {
+        std::vector<std::pair<std::string, std::uint64_t>> sorted(stacks.begin(), stacks.end());
+        std::sort(sorted.begin(), sorted.end());
+        std::string result;
+        for (const auto& [stack, count] : sorted) {
+            result += stack;
+            result += ' ';
+            result += std::to_string(count);
+            result += '\n';
+        }
+        return result;
+    }
+
+    void Profile::report(FILE* file) const {
+        std::uint64_t total = 0;
+        std::vector<std::pair<std::uint64_t, int>> byOpcode;
+        for (int opcode = 0; opcode != (int) UINT8_COUNT; ++opcode) {
+            total += opcodes[opcode];
+            if (opcodes[opcode])
+                byOpcode.emplace_back(opcodes[opcode], opcode);
+        }
+        std::sort(byOpcode.rbegin(), byOpcode.rend());
+        fprintf(file, "%-28s %14s %7s\n", "opcode", "count", "%");
+        for (auto [count, opcode] : byOpcode)
+            fprintf(file, "%-28s %14llu %6.2f%%\n", OpCodeCString[opcode],
+                    (unsigned long long) count, 100.0 * count / total);
+
+        std::vector<const Function*> byTime;
+        for (const auto& [_, function] : functions)
+            byTime.push_back(&function);
+        std::sort(byTime.begin(), byTime.end(), [](const Function* a, const Function* b) {
+            return a->time > b->time;
+        });
+        fprintf(file, "\n%-28s %14s %12s\n", "function", "instructions", "ms");
+        for (const Function* function : byTime)
+            fprintf(file, "%-28s %14llu %12.3f\n", function->name.c_str(),
+                    (unsigned long long) function->instructions, milliseconds(function->time));
+
+        fprintf(file, "\n%s", collapsed().c_str());
+    }
+
+} // namespace lox
@@ -0,0 +1,85 @@
+//
+//  profile.hpp
+//  qet
+//
+
+#ifndef profile_hpp
+#define profile_hpp
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+
+#include "common.hpp"
+
+namespace lox {
+
+    struct ObjectFunction;
+    struct VM;
+
+    // Execution profile of one VM
+    //
+    // With LOX_PROFILE, a profiling VM counts every instruction it
+    // dispatches, by opcode and by the function running it.  Time is taken
+    // only when control passes from one function to another, and charged to
+    // the one that was running, so a native's time goes to its caller.
+    //
+    // A shared sampler thread ticks every PROFILE_SAMPLE_INTERVAL, and a VM
+    // that sees a new tick at its next safepoint records its call stack, as
+    // the collapsed "outer;inner" lines that flame graph tools read.  The
+    // VM only walks its own frames, so samples land on loop back-edges and
+    // calls, where the safepoints are.
+    //
+    // Functions are keyed by address and named when first seen, so a
+    // function that is collected and whose address is reused is merged
+    // with its predecessor.
+
+    constexpr std::chrono::microseconds PROFILE_SAMPLE_INTERVAL{1000};
+
+    struct Profile {
+
+        struct Function {
+            std::string name;
+            std::uint64_t instructions = 0;
+            std::chrono::steady_clock::duration time{};
+        };
+
+        std::uint64_t opcodes[UINT8_COUNT] = {};
+        std::unordered_map<const ObjectFunction*, Function> functions;
+        std::unordered_map<std::string, std::uint64_t> stacks;
+
+        Profile(); // <-- starts the sampler, if it isn't running
+
+        void instruction(const ObjectFunction* function, std::uint8_t opcode) {
+            ++opcodes[opcode];
+            if (function != _current)
+                _switch(function);
+            ++_entry->instructions;
+        }
+
+        // whether the sampler has ticked since the last sample
+        bool due() const;
+        void sample(const VM& vm);
+
+        // charges the running function, when the VM stops or yields
+        void pause();
+
+        std::string collapsed() const; // <-- the stacks, for flame graphs
+        void report(FILE* file) const;
+
+    private:
+
+        const ObjectFunction* _current = nullptr;
+        Function* _entry = nullptr;
+        std::chrono::steady_clock::time_point _stamp;
+        std::uint64_t _tick = 0;
+
+        void _switch(const ObjectFunction* function);
+
+    };
+
+} // namespace lox
+
+#endif /* profile_hpp */
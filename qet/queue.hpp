@@ -19,6 +19,15 @@
 namespace gc {
     
     
+    // T must have ADL-visible scan and shade overloads, as Object* (gc::)
+    // and lox::Value do.  Values are shaded as they are pushed, since a node
+    // allocated during marking may never be scanned.
+    //
+    // As for TrieberStack, the collector reclaims nodes, which rules out
+    // ABA on head and tail.  A pop moves a lagging tail on before it retires
+    // the sentinel, so that tail never keeps popped nodes and their values
+    // alive.
+    
     template<typename T>
     struct MichaelScottQueue : Object {
         
@@ -31,7 +40,11 @@ namespace gc {
             
             virtual void _gc_scan(ScanContext& context) const override {
                 context.push(this->next);
-                // context.push(this->value);
+                scan(this->value, context);
+            }
+            
+            virtual std::size_t _gc_bytes() const override {
+                return sizeof(Node);
             }
             
         }; // struct Node
@@ -55,10 +68,16 @@ namespace gc {
             context.push(this->head);
         }
         
+        virtual std::size_t _gc_bytes() const override {
+            return sizeof(MichaelScottQueue);
+        }
+        
         void push(T value) {
             // Make new node
             Node* a = new Node;
             assert(a);
+            using gc::shade;
+            shade(value);
             a->value = std::move(value);
             
             // Load the tail
@@ -89,6 +108,12 @@ namespace gc {
                 if (next == nullptr)
                     // The queue contains only the sentinel node
                     return false;
+                // A push has linked next but not yet advanced tail; help
+                Node* last = expected;
+                if (tail.load(std::memory_order::relaxed) == last)
+                    tail.compare_exchange_strong(last, next,
+                                                 std::memory_order::release,
+                                                 std::memory_order::relaxed);
                 if (head.compare_exchange_strong(expected, next, std::memory_order::release, std::memory_order::acquire)) {
                     // We moved head forward
                     value = std::move(next->value);
@@ -0,0 +1,362 @@
+//
+//  registers.cpp
+//  qet
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "opcodes.hpp"
+#include "registers.hpp"
+
+namespace lox {
+
+    namespace {
+
+        struct Lowering {
+
+            const Chunk* stack;
+            Chunk* out;
+
+            // What each stack position holds: its own register if the value
+            // is in place, another register, or an RK constant
+            std::vector<int> operands;
+
+            // Offset of the destination byte of the last instruction, if it
+            // wrote the top of the stack and nothing has been emitted since
+            ptrdiff_t fresh = -1;
+
+            bool ok = true;
+            int registerCount = 0;
+            int line = 0;
+            const char* where = nullptr;
+
+            int height() const {
+                return (int) operands.size();
+            }
+
+            void emit(uint8_t byte) {
+                out->write(byte, line, where);
+            }
+
+            void emitShort(size_t value) {
+                emit((value >> 8) & 0xff);
+                emit(value & 0xff);
+            }
+
+            // the register of a new value pushed on the stack
+            int pushRegister() {
+                int r = height();
+                if (r >= RK_CONSTANT)
+                    ok = false;
+                operands.push_back(r);
+                return r;
+            }
+
+            void pushResult(uint8_t opcode) {
+                fresh = -1;
+                emit(opcode);
+                fresh = out->code.size();
+                emit((uint8_t) pushRegister());
+            }
+
+            int pop() {
+                int operand = operands.back();
+                operands.pop_back();
+                return operand;
+            }
+
+            // write a deferred value into its own register
+            void materialize(int position) {
+                int operand = operands[position];
+                if (operand == position)
+                    return;
+                fresh = -1;
+                emit(OPCODE_REG_MOVE);
+                emit((uint8_t) position);
+                emit((uint8_t) operand);
+                operands[position] = position;
+            }
+
+            // every value in place, as jumps and their targets expect
+            void flush() {
+                for (int position = 0; position != height(); ++position)
+                    materialize(position);
+                fresh = -1;
+            }
+
+            // before a local is overwritten, values still deferred to it must
+            // be copied out
+            void beforeWrite(int local) {
+                for (int position = local + 1; position < height(); ++position)
+                    if (operands[position] == local)
+                        materialize(position);
+            }
+
+            void binary(uint8_t opcode) {
+                int b = pop();
+                int a = pop();
+                fresh = -1;
+                emit(opcode);
+                fresh = out->code.size();
+                emit((uint8_t) pushRegister());
+                emit((uint8_t) a);
+                emit((uint8_t) b);
+            }
+
+            void unary(uint8_t opcode) {
+                int a = pop();
+                fresh = -1;
+                emit(opcode);
+                fresh = out->code.size();
+                emit((uint8_t) pushRegister());
+                emit((uint8_t) a);
+            }
+
+        };
+
+        struct Patch {
+            size_t at;     // <-- offset of the jump operand in the output
+            size_t target; // <-- offset of the target in the stack code
+        };
+
+        bool lower(Lowering& lowering, int arity) {
+            const Chunk* stack = lowering.stack;
+            Chunk* out = lowering.out;
+
+            size_t size = stack->code.size();
+
+            // where jumps land, and the stack height when they do
+            std::vector<bool> isTarget(size + 1, false);
+            for (size_t offset = 0; offset < size; offset += instructionLength(stack, offset)) {
+                const uint8_t* p = stack->code.data() + offset;
+                switch (p[0]) {
+                    case OPCODE_JUMP:
+                    case OPCODE_JUMP_IF_FALSE:
+                        isTarget[offset + 3 + ((p[1] << 8) | p[2])] = true;
+                        break;
+                    case OPCODE_LOOP:
+                        isTarget[offset + 3 - ((p[1] << 8) | p[2])] = true;
+                        break;
+                    default:
+                        break;
+                }
+            }
+            std::vector<int> heights(size + 1, -1);
+            std::vector<size_t> offsets(size + 1, SIZE_MAX);
+            std::vector<Patch> patches;
+
+            // the callee and its arguments
+            for (int i = 0; i <= arity; ++i)
+                lowering.pushRegister();
+
+            bool reachable = true;
+            for (size_t offset = 0; lowering.ok && (offset < size);) {
+                const uint8_t* p = stack->code.data() + offset;
+                size_t length = instructionLength(stack, offset);
+                const LineTable::Run& run = stack->lines.find(offset);
+                lowering.line = run.line;
+                lowering.where = run.where;
+
+                if (isTarget[offset]) {
+                    if (reachable) {
+                        lowering.flush();
+                        if ((heights[offset] != -1) && (heights[offset] != lowering.height()))
+                            return false;
+                    } else {
+                        if (heights[offset] == -1)
+                            return false;
+                        lowering.operands.clear();
+                        for (int i = 0; i != heights[offset]; ++i)
+                            lowering.pushRegister();
+                    }
+                    reachable = true;
+                    lowering.fresh = -1;
+                    heights[offset] = lowering.height();
+                }
+                offsets[offset] = out->code.size();
+
+                if (!reachable) {
+                    // dead code after a jump or return
+                    offset += length;
+                    continue;
+                }
+
+                switch (p[0]) {
+                    case OPCODE_CONSTANT:
+                        if (p[1] >= RK_CONSTANT)
+                            return false;
+                        lowering.operands.push_back(RK_CONSTANT | p[1]);
+                        if (lowering.height() > RK_CONSTANT)
+                            return false;
+                        break;
+                    case OPCODE_NIL:
+                        lowering.pushResult(OPCODE_REG_NIL);
+                        break;
+                    case OPCODE_TRUE:
+                        lowering.pushResult(OPCODE_REG_TRUE);
+                        break;
+                    case OPCODE_FALSE:
+                        lowering.pushResult(OPCODE_REG_FALSE);
+                        break;
+                    case OPCODE_POP:
+                        lowering.pop();
+                        lowering.fresh = -1;
+                        break;
+                    case OPCODE_GET_LOCAL:
+                        lowering.materialize(p[1]);
+                        lowering.operands.push_back(p[1]);
+                        lowering.fresh = -1;
+                        if (lowering.height() > RK_CONSTANT)
+                            return false;
+                        break;
+                    case OPCODE_SET_LOCAL: {
+                        int local = p[1];
+                        int top = lowering.height() - 1;
+                        lowering.beforeWrite(local);
+                        if ((lowering.fresh != -1) && (lowering.operands[top] == top)) {
+                            // the value was just computed; compute it into the
+                            // local instead
+                            out->code[lowering.fresh] = (uint8_t) local;
+                            lowering.operands[top] = local;
+                        } else if (lowering.operands[top] != local) {
+                            lowering.emit(OPCODE_REG_MOVE);
+                            lowering.emit((uint8_t) local);
+                            lowering.emit((uint8_t) lowering.operands[top]);
+                        }
+                        lowering.operands[local] = local;
+                        lowering.fresh = -1;
+                        break;
+                    }
+                    case OPCODE_GET_GLOBAL_SLOT:
+                        lowering.pushResult(OPCODE_REG_GET_GLOBAL_SLOT);
+                        lowering.emit(p[1]);
+                        lowering.emit(p[2]);
+                        break;
+                    case OPCODE_DEFINE_GLOBAL_SLOT:
+                    case OPCODE_SET_GLOBAL_SLOT: {
+                        int value = lowering.operands.back();
+                        if (p[0] == OPCODE_DEFINE_GLOBAL_SLOT)
+                            lowering.pop();
+                        lowering.fresh = -1;
+                        lowering.emit(p[0] == OPCODE_SET_GLOBAL_SLOT ? OPCODE_REG_SET_GLOBAL_SLOT : OPCODE_REG_DEFINE_GLOBAL_SLOT);
+                        lowering.emit((uint8_t) value);
+                        lowering.emit(p[1]);
+                        lowering.emit(p[2]);
+                        break;
+                    }
+                    case OPCODE_GET_UPVALUE:
+                        lowering.pushResult(OPCODE_REG_GET_UPVALUE);
+                        lowering.emit(p[1]);
+                        break;
+                    case OPCODE_SET_UPVALUE:
+                        lowering.fresh = -1;
+                        lowering.emit(OPCODE_REG_SET_UPVALUE);
+                        lowering.emit(p[1]);
+                        lowering.emit((uint8_t) lowering.operands.back());
+                        break;
+                    case OPCODE_EQUAL: lowering.binary(OPCODE_REG_EQUAL); break;
+                    case OPCODE_GREATER: lowering.binary(OPCODE_REG_GREATER); break;
+                    case OPCODE_LESS: lowering.binary(OPCODE_REG_LESS); break;
+                    case OPCODE_ADD: lowering.binary(OPCODE_REG_ADD); break;
+                    case OPCODE_SUBTRACT: lowering.binary(OPCODE_REG_SUBTRACT); break;
+                    case OPCODE_MULTIPLY: lowering.binary(OPCODE_REG_MULTIPLY); break;
+                    case OPCODE_DIVIDE: lowering.binary(OPCODE_REG_DIVIDE); break;
+                    case OPCODE_NOT: lowering.unary(OPCODE_REG_NOT); break;
+                    case OPCODE_NEGATE: lowering.unary(OPCODE_REG_NEGATE); break;
+                    case OPCODE_PRINT:
+                        lowering.fresh = -1;
+                        lowering.emit(OPCODE_REG_PRINT);
+                        lowering.emit((uint8_t) lowering.pop());
+                        break;
+                    case OPCODE_JUMP:
+                    case OPCODE_JUMP_IF_FALSE: {
+                        lowering.flush();
+                        size_t target = offset + 3 + ((p[1] << 8) | p[2]);
+                        if ((heights[target] != -1) && (heights[target] != lowering.height()))
+                            return false;
+                        heights[target] = lowering.height();
+                        if (p[0] == OPCODE_JUMP) {
+                            lowering.emit(OPCODE_JUMP);
+                            reachable = false;
+                        } else {
+                            lowering.emit(OPCODE_REG_JUMP_IF_FALSE);
+                            lowering.emit((uint8_t) lowering.operands.back());
+                        }
+                        patches.push_back({out->code.size(), target});
+                        lowering.emitShort(0);
+                        break;
+                    }
+                    case OPCODE_LOOP: {
+                        lowering.flush();
+                        size_t target = offset + 3 - ((p[1] << 8) | p[2]);
+                        if (heights[target] != lowering.height())
+                            return false;
+                        lowering.emit(OPCODE_LOOP);
+                        size_t jump = out->code.size() + 2 - offsets[target];
+                        if (jump > UINT16_MAX)
+                            return false;
+                        lowering.emitShort(jump);
+                        reachable = false;
+                        break;
+                    }
+                    case OPCODE_CALL: {
+                        int argCount = p[1];
+                        lowering.flush();
+                        int base = lowering.height() - argCount - 1;
+                        lowering.emit(OPCODE_REG_CALL);
+                        lowering.emit((uint8_t) base);
+                        lowering.emit((uint8_t) argCount);
+                        // the result replaces the callee
+                        for (int i = 0; i != argCount; ++i)
+                            lowering.pop();
+                        break;
+                    }
+                    case OPCODE_RETURN:
+                        lowering.fresh = -1;
+                        lowering.emit(OPCODE_REG_RETURN);
+                        lowering.emit((uint8_t) lowering.pop());
+                        reachable = false;
+                        break;
+                    default:
+                        // no register form
+                        return false;
+                }
+                offset += length;
+                lowering.registerCount = std::max(lowering.registerCount, lowering.height());
+            }
+            if (!lowering.ok)
+                return false;
+            offsets[size] = out->code.size();
+
+            for (const Patch& patch : patches) {
+                if (offsets[patch.target] == SIZE_MAX)
+                    return false;
+                size_t jump = offsets[patch.target] - (patch.at + 2);
+                if (jump > UINT16_MAX)
+                    return false;
+                out->code[patch.at] = (jump >> 8) & 0xff;
+                out->code[patch.at + 1] = jump & 0xff;
+            }
+
+            return true;
+        }
+
+    } // namespace
+
+    int lowerToRegisters(const Chunk* stack, int arity, Chunk* registers) {
+        Lowering lowering;
+        lowering.stack = stack;
+        lowering.out = registers;
+        if (!lower(lowering, arity) || (lowering.registerCount > RK_CONSTANT)) {
+            registers->code.clear();
+            registers->lines.clear();
+            return 0;
+        }
+        registers->constants = stack->constants;
+        registers->source = stack->source;
+        return lowering.registerCount;
+    }
+
+} // namespace lox
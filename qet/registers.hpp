@@ -0,0 +1,37 @@
+//
+//  registers.hpp
+//  qet
+//
+
+#ifndef registers_hpp
+#define registers_hpp
+
+#include "chunk.hpp"
+
+namespace lox {
+
+    // Register-based form of a function
+    //
+    // The stack code keeps every temporary in frame->slots, at the depth the
+    // stack would have reached, so the stack position of a value is already
+    // a register number.  Lowering tracks what each position holds; reads of
+    // locals and constants are deferred and named directly by the consuming
+    // instruction, and a result bound for a local is written straight to it.
+    // The REG_ instructions are three-address ops over frame->slots, and so
+    // do none of the push and pop traffic of the stack code.
+    //
+    // Operands that may be constants are RK: a register below RK_CONSTANT,
+    // or RK_CONSTANT plus a constant index.  Functions that need more
+    // registers or constants than that, or use instructions that have no
+    // register form (properties, classes, closures), keep only their stack
+    // code.
+    constexpr uint8_t RK_CONSTANT = 0x80;
+
+    // Fills registers with the register form of the stack chunk, returning
+    // how many registers a frame needs, or 0 if the function has no register
+    // form
+    int lowerToRegisters(const Chunk* stack, int arity, Chunk* registers);
+
+} // namespace lox
+
+#endif /* registers_hpp */
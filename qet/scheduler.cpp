@@ -0,0 +1,233 @@
+//
+//  scheduler.cpp
+//  qet
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#include "scheduler.hpp"
+
+namespace lox {
+
+    namespace {
+        
+        // local.roots is used as a set, so order doesn't matter
+        void unroot(const gc::Object* object) {
+            for (gc::Object*& root : gc::local.roots) {
+                if (root == object) {
+                    root = gc::local.roots.back();
+                    gc::local.roots.pop_back();
+                    return;
+                }
+            }
+        }
+        
+    } // namespace
+
+    void Scheduler::Registry::_gc_scan(gc::ScanContext& context) const {
+        std::unique_lock lock{mutex};
+        for (Task* task : tasks) {
+            context.push(task->source);
+            context.push(task->vm);
+            context.push(task->closure);
+        }
+    }
+
+    std::size_t Scheduler::Registry::_gc_bytes() const {
+        return sizeof(Registry);
+    }
+
+    Scheduler::Scheduler(std::size_t threads)
+    : registry(new Registry) {
+        // the workers may not handshake before this thread next does
+        gc::local.roots.push_back(registry);
+        threads = std::max<std::size_t>(threads, 1);
+        for (std::size_t i = 0; i != threads; ++i)
+            deques.push_back(std::make_unique<gc::WorkStealingDeque<Task*>>());
+        for (std::size_t i = 0; i != threads; ++i)
+            workers.emplace_back(&Scheduler::worker, this, i);
+    }
+
+    Scheduler::~Scheduler() {
+        wait();
+        {
+            std::unique_lock lock{mutex};
+            stopping = true;
+        }
+        condition_variable.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+        unroot(registry);
+    }
+
+    Task* Scheduler::spawn(Source* source) {
+        std::unique_ptr<Task> owned = std::make_unique<Task>();
+        Task* task = owned.get();
+        task->source = source;
+        {
+            std::unique_lock lock{mutex};
+            tasks.push_back(std::move(owned));
+        }
+        enqueue(task);
+        return task;
+    }
+    
+    void Scheduler::spawn(VM* vm, ObjectClosure* closure) {
+        // nobody reads the result, so finish frees the task
+        Task* task = new Task;
+        task->detached = true;
+        vm->timeSlice = VM_TIME_SLICE;
+        task->vm = vm;
+        task->closure = closure;
+        enqueue(task);
+    }
+    
+    void Scheduler::enqueue(Task* task) {
+        {
+            std::unique_lock lock{registry->mutex};
+            task->index = registry->tasks.size();
+            registry->tasks.push_back(task);
+        }
+        {
+            std::unique_lock lock{mutex};
+            incoming.push_back(task);
+            ++pending;
+        }
+        condition_variable.notify_one();
+    }
+
+    void Scheduler::wait() {
+        std::unique_lock lock{mutex};
+        while (pending) {
+            condition_variable.wait_for(lock, std::chrono::milliseconds(1));
+            lock.unlock();
+            gc::this_thread::safepoint();
+            lock.lock();
+        }
+    }
+
+    // New tasks come first, then the top of our own deque, so that a task
+    // that yielded waits behind the others, and then other workers' deques
+    Task* Scheduler::next(std::size_t index) {
+        Task* task = nullptr;
+        {
+            std::unique_lock lock{mutex};
+            if (!incoming.empty()) {
+                task = incoming.front();
+                incoming.pop_front();
+                return task;
+            }
+        }
+        std::size_t n = deques.size();
+        for (std::size_t i = 0; i != n; ++i)
+            if (deques[(index + i) % n]->steal(task))
+                return task;
+        return nullptr;
+    }
+
+    void Scheduler::slice(std::size_t index, Task* task) {
+        InterpretResult result;
+        if (!task->vm) {
+            VM* vm = new VM;
+            {
+                std::unique_lock lock{registry->mutex};
+                task->vm = vm;
+            }
+            vm->initVM();
+            vm->timeSlice = VM_TIME_SLICE;
+            result = vm->interpret(task->source);
+        } else if (task->closure) {
+            result = task->vm->start(task->closure);
+            std::unique_lock lock{registry->mutex};
+            task->closure = nullptr;
+        } else {
+            result = task->vm->resume();
+        }
+        if (result == INTERPRET_YIELD)
+            deques[index]->push(task);
+        else
+            finish(task, result);
+    }
+
+    void Scheduler::finish(Task* task, InterpretResult result) {
+        {
+            // the VM is garbage once it leaves the registry
+            std::unique_lock lock{registry->mutex};
+            Task* last = registry->tasks.back();
+            registry->tasks[task->index] = last;
+            last->index = task->index;
+            registry->tasks.pop_back();
+            task->source = nullptr;
+            task->vm = nullptr;
+            task->closure = nullptr;
+        }
+        if (task->detached) {
+            delete task;
+        } else {
+            task->result = result;
+            task->done.store(true, std::memory_order_release);
+        }
+        {
+            std::unique_lock lock{mutex};
+            --pending;
+        }
+        condition_variable.notify_all();
+    }
+
+    void Scheduler::worker(std::size_t index) {
+        char name[16];
+        snprintf(name, 16, "W%zu", index);
+        pthread_setname_np(name);
+        gc::this_thread::enter();
+        gc::local.roots.push_back(registry);
+        for (;;) {
+            if (Task* task = next(index)) {
+                slice(index, task);
+            } else {
+                std::unique_lock lock{mutex};
+                if (stopping)
+                    break;
+                // idle workers must still handshake
+                if (incoming.empty())
+                    condition_variable.wait_for(lock, std::chrono::milliseconds(1));
+            }
+            gc::this_thread::safepoint();
+        }
+        unroot(registry);
+        gc::this_thread::leave();
+    }
+
+    namespace {
+        
+        std::mutex sharedMutex;
+        Scheduler* sharedScheduler = nullptr;
+        
+    } // namespace
+    
+    Scheduler& Scheduler::shared() {
+        std::unique_lock lock{sharedMutex};
+        if (!sharedScheduler)
+            sharedScheduler = new Scheduler;
+        return *sharedScheduler;
+    }
+    
+    void Scheduler::stopShared() {
+        Scheduler* scheduler = nullptr;
+        {
+            std::unique_lock lock{sharedMutex};
+            scheduler = sharedScheduler;
+        }
+        if (!scheduler)
+            return;
+        // tasks may spawn more while we wait, but none once all are done
+        scheduler->wait();
+        {
+            std::unique_lock lock{sharedMutex};
+            sharedScheduler = nullptr;
+        }
+        delete scheduler;
+    }
+
+} // namespace lox
@@ -0,0 +1,110 @@
+//
+//  scheduler.hpp
+//  qet
+//
+
+#ifndef scheduler_hpp
+#define scheduler_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "vm.hpp"
+#include "workstealing.hpp"
+
+namespace lox {
+
+    // Many VMs on a pool of worker threads
+    //
+    // Each spawned script runs on a VM of its own, as a green task.  A task
+    // runs for a time slice of VM_TIME_SLICE safepoints, then yields and goes
+    // to the back of its worker's deque, so that long scripts don't starve
+    // short ones.  Workers take new tasks from a shared queue first, then
+    // from the top of their own deque, and steal from the others' when it
+    // runs dry.
+    //
+    // Every worker is a GC participant.  A parked VM is reachable from the
+    // scheduler's registry, which each worker and the thread that made the
+    // scheduler hold in their local roots, and the collector scans its
+    // stack; a running VM shades its own.  Workers drop the root as they
+    // stop, and the destructor drops it from the roots of the thread that
+    // runs it, which should be the one that made the scheduler.
+    //
+    // The spawn native runs closures on a shared scheduler, made on first
+    // use, which the program stops before it exits.
+
+    constexpr int VM_TIME_SLICE = 1024;
+
+    struct Task {
+
+        Source* source = nullptr;
+        VM* vm = nullptr; // <-- made by the first worker to run the task
+        ObjectClosure* closure = nullptr; // <-- to start vm with, if spawned
+        InterpretResult result = INTERPRET_OK;
+        std::atomic<bool> done = false;
+        std::size_t index = 0; // <-- in the registry, while running
+        bool detached = false; // <-- freed once done, as nobody reads it
+
+    };
+
+    struct Scheduler {
+
+        // Holds the VMs of unfinished tasks, for the collector to find
+        struct Registry : gc::Object {
+            mutable std::mutex mutex;
+            std::vector<Task*> tasks;
+            virtual void _gc_scan(gc::ScanContext& context) const override;
+            virtual std::size_t _gc_bytes() const override;
+        };
+
+        explicit Scheduler(std::size_t threads = std::thread::hardware_concurrency());
+        Scheduler(const Scheduler&) = delete;
+        Scheduler& operator=(const Scheduler&) = delete;
+        ~Scheduler(); // <-- waits for the tasks, then stops the workers
+
+        // Queues a script to run on a VM of its own; the task belongs to
+        // the scheduler, and can be read once it is done
+        Task* spawn(Source* source);
+        
+        // Queues a closure of no arguments to start on a VM made by
+        // initVM(parent); the task is freed once it is done
+        void spawn(VM* vm, ObjectClosure* closure);
+
+        // Returns once every task spawned so far is done.  The caller must
+        // be a GC participant, and keeps handshaking while it waits, so it
+        // should hold its own roots in gc::local.roots.
+        void wait();
+        
+        static Scheduler& shared();
+        static void stopShared(); // <-- waits for its tasks, if it was made
+
+    private:
+
+        std::vector<std::unique_ptr<gc::WorkStealingDeque<Task*>>> deques;
+        std::vector<std::thread> workers;
+        Registry* registry;
+
+        std::mutex mutex; // <-- guards the rest
+        std::condition_variable condition_variable;
+        std::deque<Task*> incoming;
+        std::vector<std::unique_ptr<Task>> tasks; // <-- spawned scripts
+        std::size_t pending = 0;
+        bool stopping = false;
+
+        void enqueue(Task* task);
+        Task* next(std::size_t index);
+        void slice(std::size_t index, Task* task);
+        void finish(Task* task, InterpretResult result);
+        void worker(std::size_t index);
+
+    };
+
+} // namespace lox
+
+#endif /* scheduler_hpp */
@@ -8,38 +8,87 @@
 #ifndef stack_hpp
 #define stack_hpp
 
+#include <array>
+#include <functional>
+#include <thread>
+
 #include "gc.hpp"
 
 namespace gc {
     
+    // T must have ADL-visible scan and shade overloads, as for
+    // MichaelScottQueue
+    //
+    // Every push allocates a fresh Node, and nodes are never recycled by
+    // hand.  A popped node may still be held by a pop that loaded it from
+    // head and has yet to fail its compare_exchange; reusing it would let
+    // that compare_exchange succeed against a different stack (ABA).  The
+    // collector frees a node only once nothing can reach it, and gc::alloc
+    // then reuses its memory from a thread-local pool, so the collector is
+    // the free list, and its deferral is what makes the stack ABA-free.
+    //
+    // Under contention, a push and a pop that both fail on head try to
+    // meet in a random slot of an elimination array instead.  The push
+    // parks its node in an empty slot and spins briefly; a pop that finds
+    // it there takes it, and the pair complete without touching head.  If
+    // no pop comes, the push takes its node back and retries on head.  A
+    // parked node is a fresh object that the collector keeps alive, so the
+    // slots have no ABA either.
+    
     template<typename T>
     struct TrieberStack : Object {
+        
+        static constexpr std::size_t ELIMINATION_SLOTS = 8;
+        static constexpr int ELIMINATION_SPINS = 64;
+        
         struct Node : Object {
             Atomic<StrongPtr<Node>> next;
             T value;
             virtual ~Node() override = default;
             virtual void _gc_scan(ScanContext& context) const override {
                 context.push(this->next);
-                context.push(this->value);
+                scan(this->value, context);
+            }
+            virtual std::size_t _gc_bytes() const override {
+                return sizeof(Node);
             }
         }; // struct Node
         
         Atomic<StrongPtr<Node>> head;
+        std::array<Atomic<StrongPtr<Node>>, ELIMINATION_SLOTS> elimination;
+        bool eliminating;
+        
+        explicit TrieberStack(bool eliminating = true)
+        : eliminating(eliminating) {
+        }
         
         virtual void _gc_scan(ScanContext& context) const override {
             context.push(this->head);
+            for (const Atomic<StrongPtr<Node>>& slot : elimination)
+                context.push(slot);
+        }
+        
+        virtual std::size_t _gc_bytes() const override {
+            return sizeof(TrieberStack);
         }
         
         void push(T value) {
             Node* desired = new Node;
+            using gc::shade;
+            shade(value);
             desired->value = std::move(value);
             Node* expected = head.load(std::memory_order::acquire);
-            do {
-                desired->next.ptr.store(expected, std::memory_order::relaxed);
-            } while (!head.compare_exchange_strong(expected,
-                                                   desired,
-                                                   std::memory_order::release,
-                                                   std::memory_order::acquire));
+            for (;;) {
+                desired->next.inner.store(expected, std::memory_order::relaxed);
+                if (head.compare_exchange_strong(expected,
+                                                 desired,
+                                                 std::memory_order::release,
+                                                 std::memory_order::acquire))
+                    return;
+                if (eliminating && _eliminate_push(desired))
+                    return;
+                expected = head.load(std::memory_order::acquire);
+            }
         }
         
         bool pop(T& value) {
@@ -55,9 +104,51 @@ namespace gc {
                     value = std::move(expected->value);
                     return true;
                 }
+                if (eliminating && _eliminate_pop(value))
+                    return true;
             }
         }
         
+    private:
+        
+        static std::size_t _slot() {
+            // a per-thread linear congruential generator
+            thread_local std::size_t state = std::hash<std::thread::id>()(std::this_thread::get_id());
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            return (state >> 33) % ELIMINATION_SLOTS;
+        }
+        
+        bool _eliminate_push(Node* node) {
+            Atomic<StrongPtr<Node>>& slot = elimination[_slot()];
+            Node* empty = nullptr;
+            if (!slot.compare_exchange_strong(empty,
+                                              node,
+                                              std::memory_order::release,
+                                              std::memory_order::relaxed))
+                return false;
+            for (int i = 0; i != ELIMINATION_SPINS; ++i)
+                if (slot.load(std::memory_order::relaxed) != node)
+                    return true;
+            // withdraw the node, unless a pop has just taken it
+            Node* expected = node;
+            return !slot.compare_exchange_strong(expected,
+                                                 nullptr,
+                                                 std::memory_order::relaxed,
+                                                 std::memory_order::relaxed);
+        }
+        
+        bool _eliminate_pop(T& value) {
+            Atomic<StrongPtr<Node>>& slot = elimination[_slot()];
+            Node* node = slot.load(std::memory_order::acquire);
+            if ((node == nullptr) || !slot.compare_exchange_strong(node,
+                                                                   nullptr,
+                                                                   std::memory_order::acquire,
+                                                                   std::memory_order::relaxed))
+                return false;
+            value = std::move(node->value);
+            return true;
+        }
+        
     }; // TrieberStack<T>
 }
 
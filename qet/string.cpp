@@ -5,6 +5,9 @@
 //  Created by Antony Searle on 20/4/2024.
 //
 
+#include <algorithm>
+#include <vector>
+
 #include "string.hpp"
 
 namespace gc {
@@ -33,10 +36,19 @@ namespace gc {
         MNode* toCompressed(CNode* cn, int lev);
         MNode* toContracted(CNode* cn, int lev);
         
+        // A query of a bulk emplace, and its answer
+        struct Pending {
+            Query q;
+            SNode* result;
+        };
+        
+        SNode* emplaceFrom(INode* i, Query q, int lev, INode* parent);
+        
         struct MNode : ANode {
             virtual std::pair<Result, SNode*> _emplace(INode* i, Query q, int lev, INode* parent) = 0;
             virtual std::pair<Result, SNode*> _erase(INode* i, SNode* k, int lev, INode* parent) = 0;
             virtual void _erase2(INode* i, SNode* k, int lev, INode* parent) {};
+            virtual void _emplace_many(INode* i, Pending* first, Pending* last, int lev, INode* parent);
             virtual BNode* _resurrect(INode* parent);
             virtual void vcleanA(INode* i, int lev) {}
             virtual bool vcleanParentA(INode* p, INode* i, std::size_t hc, int lev,
@@ -103,6 +115,7 @@ namespace gc {
             CNode* removed(int pos, std::uint64_t flag) const;
             virtual std::pair<Result, SNode*> _emplace(INode* i, Query q, int lev, INode* parent) override;
             virtual std::pair<Result, SNode*> _erase(INode* i, SNode* k, int lev, INode* parent) override;
+            virtual void _emplace_many(INode* i, Pending* first, Pending* last, int lev, INode* parent) override;
             virtual void vcleanA(INode* i, int lev) override;
             virtual bool vcleanParentA(INode* p, INode* i, std::size_t hc, int lev,
                                        MNode* m) override ;
@@ -123,6 +136,7 @@ namespace gc {
             virtual void _gc_debug() const override;
 
             SNode* emplace(Query q);
+            void emplace(std::span<const Query> queries, SNode** results);
             SNode* remove(SNode* k);
             
             INode* root;
@@ -183,6 +197,11 @@ namespace gc {
         
         BNode* MNode::_resurrect(INode* parent) { return parent; };
         
+        void MNode::_emplace_many(INode* i, Pending* first, Pending* last, int lev, INode* parent) {
+            for (; first != last; ++first)
+                first->result = emplaceFrom(i, first->q, lev, parent);
+        }
+        
         
         
         INode::INode(MNode* desired) : main(desired) {}
@@ -214,6 +233,10 @@ namespace gc {
             return global_string_ctrie->emplace(q);
         }
         
+        void SNode::make(std::span<const Query> queries, SNode** results) {
+            global_string_ctrie->emplace(queries, results);
+        }
+        
         SNode* SNode::make(const char * data, std::size_t size) {
             return make(Query(std::string_view(data, size)));
         }
@@ -226,6 +249,7 @@ namespace gc {
         SNode::SNode(Query q)
         : _hash(q.hash)
         , _size(q.view.size()) {
+            kind = lox::OBJECT_STRING;
             std::memcpy(_data, q.view.data(), _size);
             _data[_size] = '\0';
         }
@@ -262,7 +286,6 @@ namespace gc {
                        _size,
                        (int)_size,
                        _data);
-                delete this;
                 return context.WHITE;
             } else {
                 abort();
@@ -275,7 +298,7 @@ namespace gc {
             bool equivalent = sn->_hash == q.hash && sn->view() == q.view;
             if (equivalent) {
                 Color expected = local.WHITE;
-                Color desired{static_cast<std::intptr_t>(expected) ^ 1};
+                Color desired{static_cast<std::int32_t>(expected) ^ 1};
                 // Attempt upgrade
                 this->color.compare_exchange_strong(expected, desired, std::memory_order::relaxed, std::memory_order::relaxed);
                 assert(expected != Color::GRAY);
@@ -628,6 +651,72 @@ namespace gc {
             }
         }
         
+        void CNode::_emplace_many(INode* i, Pending* first, Pending* last, int lev, INode* parent) {
+            // The queries are sorted by path, so those that share this
+            // node's slot are contiguous.  Queries that are alone in an
+            // empty slot are inserted together; the others descend.
+            std::vector<Pending*> fresh;
+            std::uint64_t flags = 0;
+            std::vector<std::pair<Pending*, Pending*>> descend;
+            for (Pending* a = first; a != last;) {
+                std::size_t digit = (a->q.hash >> lev) & 63;
+                Pending* b = a + 1;
+                while (b != last && ((b->q.hash >> lev) & 63) == digit)
+                    ++b;
+                std::uint64_t flag = std::uint64_t{1} << digit;
+                if (!(bmp & flag) && (b - a == 1)) {
+                    fresh.push_back(a);
+                    flags |= flag;
+                } else {
+                    descend.emplace_back(a, b);
+                }
+                a = b;
+            }
+            if (!fresh.empty()) {
+                int n = __builtin_popcountll(bmp);
+                int k = (int) fresh.size();
+                CNode* ncn = CNode::make(n + k);
+                ncn->bmp = bmp | flags;
+                std::uint64_t rest = ncn->bmp;
+                int old = 0, added = 0;
+                for (int j = 0; j != n + k; ++j) {
+                    std::uint64_t flag = rest & -rest;
+                    rest ^= flag;
+                    if (flags & flag) {
+                        ncn->array[j] = SNode::_make(fresh[added]->q);
+                        fresh[added]->result = static_cast<SNode*>(ncn->array[j]);
+                        ++added;
+                    } else {
+                        ncn->array[j] = array[old++];
+                    }
+                }
+                ShadeContext context;
+                context.WHITE = local.WHITE;
+                for (int j = 0; j != n + k; ++j)
+                    ncn->array[j]->_gc_shade_weak(context);
+                MNode* expected = this;
+                if (!i->main.compare_exchange_strong(expected,
+                                                     ncn,
+                                                     std::memory_order::release,
+                                                     std::memory_order::relaxed)) {
+                    // lost the race; the speculative SNodes are garbage
+                    for (Pending* p : fresh)
+                        p->result = emplaceFrom(i, p->q, lev, parent);
+                }
+            }
+            for (auto [a, b] : descend) {
+                auto [flag, pos] = flagpos(a->q.hash, lev, bmp);
+                BNode* child = (bmp & flag) ? array[pos] : nullptr;
+                if (child && child->kind != lox::OBJECT_STRING) {
+                    // an INode; walk the shared path once for the group
+                    INode* in = static_cast<INode*>(child);
+                    in->main.load(std::memory_order::acquire)->_emplace_many(in, a, b, lev + 6, i);
+                } else {
+                    MNode::_emplace_many(i, a, b, lev, parent);
+                }
+            }
+        }
+        
         std::pair<Result, SNode*> CNode::_erase(INode* i, SNode* k, int lev, INode* parent) {
             auto [flag, pos] = flagpos(k->_hash, lev, bmp);
             if (!(flag & bmp)) {
@@ -681,6 +770,16 @@ namespace gc {
             return i->main.load(std::memory_order::acquire)->_emplace(i, q, lev, parent);
         }
         
+        // An INode is only detached from the trie after it is entombed, and
+        // then any emplace through it restarts, so an emplace may begin at
+        // any INode that was reached from the root
+        SNode* emplaceFrom(INode* i, Query q, int lev, INode* parent) {
+            auto [res, v] = iinsert(i, q, lev, parent);
+            if (res == RESTART)
+                return global_string_ctrie->emplace(q);
+            return v;
+        }
+        
         
         
         
@@ -719,6 +818,47 @@ namespace gc {
             }
         }
         
+        // Orders hashes by the sequence of 6-bit digits that select their
+        // path from the root, least significant first
+        static bool pathLess(std::size_t a, std::size_t b) {
+            std::size_t x = a ^ b;
+            if (!x)
+                return false;
+            int shift = (__builtin_ctzll(x) / 6) * 6;
+            return ((a >> shift) & 63) < ((b >> shift) & 63);
+        }
+        
+        void Ctrie::emplace(std::span<const Query> queries, SNode** results) {
+            std::vector<std::size_t> order(queries.size());
+            for (std::size_t j = 0; j != order.size(); ++j)
+                order[j] = j;
+            std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+                const Query& p = queries[a];
+                const Query& q = queries[b];
+                if (p.hash != q.hash)
+                    return pathLess(p.hash, q.hash);
+                return p.view < q.view;
+            });
+            // duplicates share one Pending
+            std::vector<Pending> pending;
+            std::vector<std::size_t> slot(queries.size());
+            pending.reserve(queries.size());
+            for (std::size_t j : order) {
+                const Query& q = queries[j];
+                if (pending.empty()
+                    || pending.back().q.hash != q.hash
+                    || pending.back().q.view != q.view)
+                    pending.push_back(Pending{q, nullptr});
+                slot[j] = pending.size() - 1;
+            }
+            INode* r = root;
+            r->main.load(std::memory_order::acquire)->_emplace_many(r, pending.data(), pending.data() + pending.size(), 0, nullptr);
+            for (std::size_t j = 0; j != queries.size(); ++j) {
+                assert(pending[slot[j]].result);
+                results[j] = pending[slot[j]].result;
+            }
+        }
+        
         SNode* Ctrie::remove(SNode* k) {
             for (;;) {
                 INode* r = root;
@@ -9,6 +9,7 @@
 #define string_hpp
 
 #include <cassert>
+#include <span>
 #include <string_view>
 
 #include "gc.hpp"
@@ -92,7 +93,7 @@ namespace gc {
         
         struct SNode : gc::Leaf<BNode> {
             
-            using Query = Query;
+            using Query = _string::Query;
             
             // class methods
             
@@ -106,6 +107,12 @@ namespace gc {
             static SNode* make(const char*, std::size_t);
             static SNode* make(char);
             
+            // Interns many strings at once, writing results[i] for
+            // queries[i].  The queries are sorted by their path through the
+            // trie, so each shared path is walked once, and the new strings
+            // that land in the same node are inserted with a single CAS.
+            static void make(std::span<const Query> queries, SNode** results);
+            
             static SNode* _make(Query q);
 
 
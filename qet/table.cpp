@@ -5,6 +5,7 @@
 //  Created by Antony Searle on 22/3/2024.
 //
 
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -19,6 +20,12 @@
 #define GROW_CAPACITY(capacity) \
 ((capacity) < 8 ? 8 : (capacity) * 2)
 
+// Buckets of the old array moved per operation while growing.  The old
+// array is at most 3/8 full of the new one's capacity C, and is emptied in
+// C / (2 * TABLE_MIGRATE_BUCKETS) operations, so with two or more buckets
+// the move is done before the new array reaches TABLE_MAX_LOAD.
+#define TABLE_MIGRATE_BUCKETS 16
+
 namespace lox {
     
     void Table::scan(gc::ScanContext& context) const {
@@ -34,6 +41,9 @@ namespace lox {
          */
         // entries->scan(context);
         context.push((gc::Array<Entry>*) entries);
+#ifdef LOX_TABLE_INCREMENTAL_REHASH
+        context.push((gc::Array<Entry>*) migrating);
+#endif
     }
     
     void initTable(Table* table) {
@@ -42,6 +52,10 @@ namespace lox {
         // table->capacity = 0;
         // table->entries = NULL;
         table->entries = nullptr;
+#ifdef LOX_TABLE_INCREMENTAL_REHASH
+        table->migrating = nullptr;
+        table->migrated = 0;
+#endif
     }
     
     void freeTable(Table* table) {
@@ -72,6 +86,123 @@ namespace lox {
         }
     }
     
+#ifdef LOX_TABLE_INCREMENTAL_REHASH
+    
+    // Moves up to n buckets of the old array into entries, leaving
+    // tombstones behind so that probes of the old array still terminate
+    static void migrateBuckets(Table* table, int n) {
+        gc::Array<Entry>* old_entries = table->migrating.inner.load(std::memory_order_relaxed);
+        if (!old_entries)
+            return;
+        gc::Array<Entry>* v = table->entries.inner.load(std::memory_order_relaxed);
+        int capacity = (int) old_entries->_capacity;
+        int end = (n < capacity - table->migrated) ? table->migrated + n : capacity;
+        for (int i = table->migrated; i != end; ++i) {
+            Entry* entry = &old_entries->_data[i];
+            if (entry->key == nullptr)
+                continue;
+            Entry* dest = findEntry(v, (ObjectString*) entry->key);
+            if (dest->value.load().is_nil())
+                ++(table->count);
+            dest->key = entry->key;
+            dest->value = entry->value;
+            entry->key = nullptr;
+            entry->value = Value(true);
+        }
+        table->migrated = end;
+        if (end == capacity) {
+            table->migrating = nullptr;
+            table->migrated = 0;
+        }
+    }
+    
+    // A key is in at most one of the arrays; look in the new one first
+    static Entry* findExisting(Table* table, ObjectString* key) {
+        gc::Array<Entry>* v = table->entries.inner.load(std::memory_order_relaxed);
+        if (v) {
+            Entry* entry = findEntry(v, key);
+            if (entry->key != nullptr)
+                return entry;
+        }
+        gc::Array<Entry>* old_entries = table->migrating.inner.load(std::memory_order_relaxed);
+        if (old_entries) {
+            Entry* entry = findEntry(old_entries, key);
+            if (entry->key != nullptr)
+                return entry;
+        }
+        return nullptr;
+    }
+    
+    bool tableGet(Table* table, ObjectString* key, Value* value) {
+        if (table->count == 0 && table->migrating == nullptr) return false;
+        
+        migrateBuckets(table, TABLE_MIGRATE_BUCKETS);
+        Entry* entry = findExisting(table, key);
+        if (entry == nullptr) return false;
+        
+        *value = entry->value.load();
+        return true;
+    }
+    
+    bool tableDelete(Table* table, ObjectString* key) {
+        if (table->count == 0 && table->migrating == nullptr) return false;
+        
+        migrateBuckets(table, TABLE_MIGRATE_BUCKETS);
+        Entry* entry = findExisting(table, key);
+        if (entry == nullptr) return false;
+        
+        // Place a tombstone in the entry.
+        entry->key = nullptr;
+        entry->value = Value(true);
+        return true;
+    }
+    
+    bool tableSet(Table* table, ObjectString* key, Value value) {
+        gc::Array<Entry>* v = table->entries.inner.load(std::memory_order_relaxed);
+        if ((v == nullptr) || ((table->count + 1) > (v->_capacity * TABLE_MAX_LOAD))) {
+            // finish any previous growth before starting another
+            migrateBuckets(table, INT_MAX);
+            int new_capacity = GROW_CAPACITY(v ? (int) v->_capacity : 0);
+            gc::Array<Entry>* new_entries = gc::Array<Entry>::make(new_capacity);
+            for (int i = 0; i < new_capacity; i++) {
+                new_entries->_data[i].key = nullptr;
+                new_entries->_data[i].value = Value();
+            }
+            table->migrating = v;
+            table->migrated = 0;
+            table->entries = new_entries;
+            table->count = 0;
+            v = new_entries;
+        }
+        migrateBuckets(table, TABLE_MIGRATE_BUCKETS);
+        Entry* entry = findEntry(v, key);
+        bool isNewKey = (entry->key == nullptr);
+        if (isNewKey) {
+            // the key may not have been moved yet
+            gc::Array<Entry>* old_entries = table->migrating.inner.load(std::memory_order_relaxed);
+            if (old_entries) {
+                Entry* old_entry = findEntry(old_entries, key);
+                if (old_entry->key != nullptr) {
+                    old_entry->key = nullptr;
+                    old_entry->value = Value(true);
+                    isNewKey = false;
+                }
+            }
+            if (entry->value.load().is_nil())
+                ++(table->count);
+        }
+        entry->key = key;
+        entry->value = value;
+        return isNewKey;
+    }
+    
+    gc::Array<Entry>* tableEntries(Table* table) {
+        migrateBuckets(table, INT_MAX);
+        return table->entries.inner.load(std::memory_order_relaxed);
+    }
+    
+#else
+    
     bool tableGet(Table* table, ObjectString* key, Value* value) {
         // std::unique_lock lock{table->_mutex};
         if (table->count == 0) return false;
@@ -141,9 +272,15 @@ namespace lox {
         return isNewKey;
     }
     
+    gc::Array<Entry>* tableEntries(Table* table) {
+        return table->entries.inner.load(std::memory_order_relaxed);
+    }
+    
+#endif
+    
     void tableAddAll(Table* from, Table* to) {
         // std::unique_lock lock{from->_mutex};
-        gc::Array<Entry>* from_v = from->entries.inner.load(std::memory_order_relaxed);
+        gc::Array<Entry>* from_v = tableEntries(from);
         if (from_v) {
             for (int i = 0; i < from_v->_capacity; i++) {
                 Entry* entry = &from_v->_data[i];
@@ -217,7 +354,7 @@ namespace lox {
         // std::unique_lock lock{table->_mutex};
         printf("struct Table {\n");
         printf("    int count = %d;\n", table->count);
-        gc::Array<Entry>* v = table->entries.inner.load(std::memory_order_acquire);
+        gc::Array<Entry>* v = tableEntries(table);
         printf("    int capacity = %d;\n", (int) v->_capacity);
         printf("    Entry* entries = {\n");
         for (int i = 0; i < v->_capacity; i++) {
@@ -238,7 +375,7 @@ namespace lox {
     void printTable(Table* table) {
         // std::unique_lock lock{table->_mutex};
         printf("{\n");
-        gc::Array<Entry>* v = table->entries.inner.load(std::memory_order_acquire);
+        gc::Array<Entry>* v = tableEntries(table);
         for (int i = 0; i < v->_capacity; i++) {
             Entry* entry = &v->_data[i];
             if (entry->key) {
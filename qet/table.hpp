@@ -53,6 +53,12 @@ namespace lox {
         // int capacity;
         // Entry* entries;
         gc::StrongPtr<gc::Array<Entry>> entries;
+#ifdef LOX_TABLE_INCREMENTAL_REHASH
+        // while growing, the smaller array that entries are moved out of, and
+        // how many of its buckets have been moved; count is only of entries
+        gc::StrongPtr<gc::Array<Entry>> migrating;
+        int migrated;
+#endif
         void scan(gc::ScanContext& context) const;        
     };
     
@@ -62,6 +68,8 @@ namespace lox {
     bool tableGet(Table* table, ObjectString* key, Value* value);
     bool tableDelete(Table* table, ObjectString* key);
     void tableAddAll(Table* from, Table* to);
+    // finishes any growth in progress, so that one array holds every entry
+    gc::Array<Entry>* tableEntries(Table* table);
     // ObjectString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
     // void tableRemoveWhite(Table* table);
     // void markTable(const Table* table);
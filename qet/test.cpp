@@ -0,0 +1,141 @@
+//
+//  test.cpp
+//  qet
+//
+
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <thread>
+
+#include "ctrie.hpp"
+#include "test.hpp"
+#include "value.hpp"
+
+namespace lox {
+
+    namespace {
+
+        // integers are their own hashes, so they need no interning
+        struct IntegerHash {
+            std::size_t operator()(const Value& value) const {
+                return std::hash<int64_t>()(value.as_int64());
+            }
+        };
+
+        using IntegerMap = gc::Ctrie<Value, Value, IntegerHash>;
+
+        constexpr int64_t KEYS = 20000;
+
+        // the entries of a snapshot of the first KEYS integers mapped to
+        // themselves, counted serially and in parallel
+        struct Enumeration {
+            std::atomic<int64_t> count{0};
+            std::atomic<int64_t> wrong{0};
+            void operator()(const Value& key, const Value& value) {
+                int64_t k = key.as_int64();
+                if (k < 0 || k >= KEYS || !(value == key))
+                    wrong.fetch_add(1, std::memory_order_relaxed);
+                count.fetch_add(1, std::memory_order_relaxed);
+            }
+            bool ok() const {
+                return (count.load() == KEYS) && !wrong.load();
+            }
+        };
+
+    } // namespace
+
+    bool testCtrie() {
+        int failures = 0;
+        auto expect = [&failures](bool condition, const char* what) {
+            if (!condition) {
+                fprintf(stderr, "ctrie: %s\n", what);
+                ++failures;
+            }
+        };
+
+        IntegerMap* map = new IntegerMap;
+        IntegerMap* frozen = nullptr;
+        IntegerMap* copy = nullptr;
+        // this thread's roots, shaded whenever it handshakes
+        auto safepoint = [&]() {
+            if (gc::this_thread::safepoint()) {
+                gc::shade(map);
+                gc::shade(frozen);
+                gc::shade(copy);
+            }
+        };
+
+        for (int64_t i = 0; i != KEYS; ++i) {
+            map->insert_or_assign(Value(i), Value(i));
+            safepoint();
+        }
+        // the read-only snapshot comes last, so that a snapshot that failed
+        // to renew the original's root is not masked by the other renewing it
+        copy = map->snapshot();
+        frozen = map->read_only_snapshot();
+
+        // the writer inserts the next KEYS integers, then erases the even
+        // keys below KEYS and negates the odd ones
+        std::atomic<bool> writing{true};
+        std::thread writer([map, &writing]() {
+            gc::this_thread::enter();
+            for (int64_t i = KEYS; i != 2 * KEYS; ++i) {
+                map->insert_or_assign(Value(i), Value(i));
+                if (gc::this_thread::safepoint())
+                    gc::shade(map);
+            }
+            for (int64_t i = 0; i != KEYS; ++i) {
+                if (i & 1)
+                    map->insert_or_assign(Value(i), Value(-i));
+                else
+                    map->erase(Value(i));
+                if (gc::this_thread::safepoint())
+                    gc::shade(map);
+            }
+            gc::this_thread::leave();
+            writing.store(false, std::memory_order_release);
+        });
+
+        // the snapshots must not change however the writer interleaves
+        int rounds = 0;
+        do {
+            Enumeration serial, parallel, copied;
+            frozen->for_each(std::ref(serial));
+            frozen->parallel_for_each(std::ref(parallel), 4);
+            copy->for_each(std::ref(copied));
+            expect(serial.ok(), "for_each saw the read-only snapshot change");
+            expect(parallel.ok(), "parallel_for_each saw the read-only snapshot change");
+            expect(copied.ok(), "for_each saw the writable snapshot change");
+            ++rounds;
+            safepoint();
+        } while (writing.load(std::memory_order_acquire));
+        writer.join();
+
+        for (int64_t i = 0; i != 2 * KEYS; ++i) {
+            std::optional<Value> found = map->find(Value(i));
+            if (i >= KEYS)
+                expect(found && (*found == Value(i)), "an inserted key is missing");
+            else if (i & 1)
+                expect(found && (*found == Value(-i)), "an assigned key has the wrong value");
+            else
+                expect(!found, "an erased key is still present");
+            safepoint();
+        }
+        int64_t count = 0;
+        map->for_each([&count](const Value&, const Value&) { ++count; });
+        expect(count == KEYS + KEYS / 2, "for_each miscounted the original");
+
+        // writing to the writable snapshot touches neither of the others
+        copy->insert_or_assign(Value((int64_t) 1), Value((int64_t) 2));
+        copy->erase(Value((int64_t) 3));
+        expect(*map->find(Value((int64_t) 1)) == Value((int64_t) -1), "the snapshot's write reached the original");
+        expect(*frozen->find(Value((int64_t) 1)) == Value((int64_t) 1), "the snapshot's write reached the read-only snapshot");
+        expect(frozen->find(Value((int64_t) 3)).has_value(), "the snapshot's erase reached the read-only snapshot");
+
+        if (!failures)
+            printf("ctrie: ok after %d enumerations during writes\n", rounds);
+        return !failures;
+    }
+
+} // namespace lox
@@ -0,0 +1,19 @@
+//
+//  test.hpp
+//  qet
+//
+
+#ifndef test_hpp
+#define test_hpp
+
+namespace lox {
+
+    // enumerate read-only and writable snapshots of a gc::Ctrie, serially
+    // and in parallel, while another thread keeps inserting into and
+    // erasing from the original, then check the original; reports any
+    // discrepancies to stderr and returns whether there were none
+    bool testCtrie();
+
+} // namespace lox
+
+#endif /* test_hpp */
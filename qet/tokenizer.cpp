@@ -65,8 +65,11 @@ namespace lox {
         return c >= '0' && c <= '9';
     }
     
+    // The text need not be null-terminated, as a mapped file isn't, so
+    // reads stop at last
+    
     bool ConcreteTokenizer::isAtEnd() const {
-        return *current == '\0';
+        return current == last;
     }
     
     char ConcreteTokenizer::advance() {
@@ -74,11 +77,13 @@ namespace lox {
     }
     
     char ConcreteTokenizer::peek() const {
+        if (isAtEnd())
+            return '\0';
         return *current;
     }
     
     char ConcreteTokenizer::peekNext() const {
-        if (isAtEnd())
+        if (last - current < 2)
             return '\0';
         return *(current + 1);
     }
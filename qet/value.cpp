@@ -15,36 +15,59 @@
 namespace lox {
     
     void scan(const Value& self, gc::ScanContext& context) {
-        if (self.type == VALUE_OBJECT)
-            scan(self.as.object, context);
+        if (self.is_object())
+            scan(self.as_object(), context);
     }
     
     void scan(const AtomicValue& self, gc::ScanContext& context) {
         scan(self.load(), context);
     }
     
+    void AtomicValue::scan(gc::ScanContext& context) const {
+        lox::scan(*this, context);
+    }
+    
+#ifdef LOX_NAN_BOXING
+    
     bool Value::invariant() const {
-        switch (type) {
+        // every bit pattern with QNAN set decodes to something, but the
+        // unused low values of the singleton range do not, and a NaN is
+        // only ever the canonical one
+        if (is_double())
+            return (as_double() == as_double()) || (_bits == BITS_NAN);
+        return is_object() || is_int64() || is_bool() || is_nil()
+            || is_undefined();
+    }
+    
+#else
+    
+    bool Value::invariant() const {
+        switch (_type) {
             case VALUE_NIL:
-                return as.int64 == 0; // caution punning
+                // caution punning; 1 is the undefined sentinel
+                return (_as.int64 == 0) || (_as.int64 == 1);
             case VALUE_BOOL:
-                return (as.int64 == 0) || (as.int64 == 1);
+                return (_as.int64 == 0) || (_as.int64 == 1);
             case VALUE_INT64:
+            case VALUE_DOUBLE:
                 return true;
             case VALUE_OBJECT:
-                return as.object != nullptr;
+                return _as.object != nullptr;
             default:
                 return false;
         }
     }
     
+#endif
+    
     void printValue(Value value) {
-        switch (value.type) {
+        switch (value.type()) {
             case VALUE_BOOL:
                 printf(value.as_bool() ? "true" : "false");
                 break;
             case VALUE_NIL: printf("nil"); break;
             case VALUE_INT64: printf("%" PRId64, value.as_int64()); break;
+            case VALUE_DOUBLE: printf("%g", value.as_double()); break;
             case VALUE_OBJECT: printObject(value); break;
         }
     }
@@ -62,20 +85,40 @@ namespace lox {
     }
     
     bool operator==(const Value& a, const Value& b) {
-        if (a.type != b.type)
+        // doubles compare as IEEE, so that NaN != NaN and -0.0 == 0.0, and
+        // with integers by exact value
+        if (a.is_double()) {
+            if (b.is_double())
+                return a.as_double() == b.as_double();
+            return b.is_int64() && equalityAsReals(b.as_int64(), a.as_double());
+        }
+        if (b.is_double())
+            return a.is_int64() && equalityAsReals(a.as_int64(), b.as_double());
+#ifdef LOX_NAN_BOXING
+        // every other value has a unique encoding
+        return a._bits == b._bits;
+#else
+        if (a._type != b._type)
             return false;
-        switch (a.type) {
+        switch (a._type) {
             case VALUE_NIL:
             case VALUE_BOOL:
             case VALUE_INT64:
-                return a.as.int64 == b.as.int64;
+                return a._as.int64 == b._as.int64;
+            case VALUE_DOUBLE:
+                return a._as.float64 == b._as.float64;
             case VALUE_OBJECT:
-                return a.as.object == b.as.object;
+                return a._as.object == b._as.object;
         }
+#endif
     }
     
     void Value::shade() const {
         gc::shade(as_object());
     }
     
+    void shade(const Value& self) {
+        self.shade();
+    }
+    
 } // namespace lox
@@ -9,6 +9,7 @@
 #define value_hpp
 
 #include <cassert>
+#include <cstring>
 
 #include "common.hpp"
 #include "gc.hpp"
@@ -19,6 +20,7 @@ namespace lox {
 X(NIL)\
 X(BOOL)\
 X(INT64)\
+X(DOUBLE)\
 X(OBJECT)\
 
 #define X(Z) VALUE_##Z,
@@ -32,59 +34,184 @@ X(OBJECT)\
     
     struct Object;
     
+#ifdef LOX_NAN_BOXING
+    
+    // Quiet NaN boxing
+    //
+    // A double that is not a quiet NaN with the bits of QNAN set is stored
+    // as itself; NaNs are all stored as one canonical NaN that doesn't have
+    // them.  Otherwise:
+    //
+    //     nil, false, true:  QNAN | 1, 2, 3
+    //     int64:             QNAN | TAG_INT | 48-bit two's complement payload
+    //     Object*:           SIGN | QNAN | 48-bit pointer
+    //
+    // Integer results are wrapped to 48 bits and sign-extended when read.
+    
+    struct Value {
+        
+        static constexpr uint64_t SIGN = 0x8000000000000000;
+        static constexpr uint64_t QNAN = 0x7ffc000000000000;
+        static constexpr uint64_t TAG_INT = 0x0001000000000000;
+        static constexpr uint64_t PAYLOAD = 0x0000ffffffffffff;
+        
+        static constexpr uint64_t BITS_NIL = QNAN | 1;
+        static constexpr uint64_t BITS_FALSE = QNAN | 2;
+        static constexpr uint64_t BITS_TRUE = QNAN | 3;
+        static constexpr uint64_t BITS_UNDEFINED = QNAN | 4;
+        static constexpr uint64_t BITS_NAN = 0x7ff8000000000000;
+        
+        uint64_t _bits;
+        
+        bool invariant() const;
+        
+        explicit Value() : _bits(BITS_NIL) {}
+        explicit Value(bool value) : _bits(value ? BITS_TRUE : BITS_FALSE) {}
+        explicit Value(int64_t value) : _bits(QNAN | TAG_INT | ((uint64_t) value & PAYLOAD)) {}
+        explicit Value(double value) {
+            if (value == value)
+                std::memcpy(&_bits, &value, sizeof(double));
+            else
+                _bits = BITS_NAN;
+        }
+        explicit Value(Object* value) : _bits(SIGN | QNAN | (uint64_t) value) {
+            assert(value != nullptr);
+            assert(!((uint64_t) value & ~PAYLOAD));
+        }
+        
+        // marks an empty global slot; never visible to Lox, where it would
+        // read as nil
+        static Value undefined() {
+            Value value;
+            value._bits = BITS_UNDEFINED;
+            return value;
+        }
+        
+        explicit operator bool() const {
+            return (_bits != BITS_NIL) && (_bits != BITS_FALSE);
+        }
+        
+        bool is_nil() const { return _bits == BITS_NIL; }
+        bool is_bool() const { return (_bits | 1) == BITS_TRUE; }
+        bool is_int64() const { return (_bits & (SIGN | QNAN | TAG_INT | (TAG_INT << 1))) == (QNAN | TAG_INT); }
+        bool is_double() const { return (_bits & QNAN) != QNAN; }
+        bool is_object() const { return (_bits & (SIGN | QNAN)) == (SIGN | QNAN); }
+        bool is_undefined() const { return _bits == BITS_UNDEFINED; }
+        
+        bool as_bool() const { assert(is_bool()); return _bits == BITS_TRUE; }
+        int64_t as_int64() const {
+            assert(is_int64());
+            // shift the payload to the top of the word and sign-extend it back
+            return ((int64_t) (_bits << 16)) >> 16;
+        }
+        double as_double() const {
+            assert(is_double());
+            double value;
+            std::memcpy(&value, &_bits, sizeof(double));
+            return value;
+        }
+        Object* as_object() const { return is_object() ? (Object*) (_bits & PAYLOAD) : nullptr; }
+        
+        ValueType type() const {
+            if (is_double())
+                return VALUE_DOUBLE;
+            if (is_object())
+                return VALUE_OBJECT;
+            if (is_int64())
+                return VALUE_INT64;
+            if (is_bool())
+                return VALUE_BOOL;
+            return VALUE_NIL;
+        }
+        
+        void shade() const;
+        
+    };
+    
+#else
+    
     struct Value {
         
-        ValueType type;
+        ValueType _type;
         
         // 4 bytes padding
         
         union _as_t {
             
             int64_t int64;
+            double float64;
             Object* object;         // garbage collected
             
             uint8_t bytes[8];
             
-        } as;
+        } _as;
         
         bool invariant() const;
         
-        explicit Value() { type = VALUE_NIL; as.object = nullptr; }
-        explicit Value(bool value) { type = VALUE_BOOL; as.int64 = value; }
-        explicit Value(int64_t value) { type = VALUE_INT64; as.int64 = value; }
-        explicit Value(Object* value) { type = VALUE_OBJECT; assert(value != nullptr); as.object = value; }
+        explicit Value() { _type = VALUE_NIL; _as.object = nullptr; }
+        explicit Value(bool value) { _type = VALUE_BOOL; _as.int64 = value; }
+        explicit Value(int64_t value) { _type = VALUE_INT64; _as.int64 = value; }
+        explicit Value(double value) { _type = VALUE_DOUBLE; _as.float64 = value; }
+        explicit Value(Object* value) { _type = VALUE_OBJECT; assert(value != nullptr); _as.object = value; }
+        
+        // marks an empty global slot; never visible to Lox, where it would
+        // read as nil
+        static Value undefined() {
+            Value value;
+            value._as.int64 = 1;
+            return value;
+        }
         
         explicit operator bool() const {
-            return (type != VALUE_NIL) && ((type != VALUE_BOOL) || as.int64);
+            return (_type != VALUE_NIL) && ((_type != VALUE_BOOL) || _as.int64);
         }
         
-        bool is_nil() const { return type == VALUE_NIL    ; }
-        bool is_bool() const { return type == VALUE_BOOL   ; }
-        bool is_int64() const { return type == VALUE_INT64  ; }
-        bool is_object() const { return type == VALUE_OBJECT    ; }
+        bool is_nil() const { return _type == VALUE_NIL    ; }
+        bool is_bool() const { return _type == VALUE_BOOL   ; }
+        bool is_int64() const { return _type == VALUE_INT64  ; }
+        bool is_double() const { return _type == VALUE_DOUBLE ; }
+        bool is_object() const { return _type == VALUE_OBJECT    ; }
+        bool is_undefined() const { return (_type == VALUE_NIL) && _as.int64; }
+        
+        bool as_bool() const { assert(is_bool());    return (bool) _as.int64; }
+        int64_t as_int64() const { assert(is_int64());   return _as.int64; }
+        double as_double() const { assert(is_double());  return _as.float64; }
+        Object* as_object() const { return is_object() ? _as.object : nullptr; }
         
-        bool as_bool() const { assert(is_bool());    return (bool) as.int64; }
-        int64_t as_int64() const { assert(is_int64());   return as.int64; }
-        Object* as_object() const { return is_object() ? as.object : nullptr; }
+        ValueType type() const { return _type; }
         
         void shade() const;
         
     };
     
+#endif
+    
+    // Lox has one kind of number, held as an integer until an operation
+    // involves a double, so the two compare equal by value
+    inline bool is_number(const Value& value) {
+        return value.is_int64() || value.is_double();
+    }
+    
+    inline double as_number(const Value& value) {
+        return value.is_int64() ? (double) value.as_int64() : value.as_double();
+    }
+    
     bool operator==(const Value& a, const Value& b);
     
     void printValue(Value value);
     
     decltype(auto) visit(const Value& value, auto&& visitor) {
-        switch (value.type) {
+        switch (value.type()) {
             case VALUE_NIL:
-                return std::forward<decltype(visitor)>(value.as.bytes);
+                return std::forward<decltype(visitor)>(visitor)(nullptr);
             case VALUE_BOOL:
-                return std::forward<decltype(visitor)>((bool) value.as.int64);
+                return std::forward<decltype(visitor)>(visitor)(value.as_bool());
             case VALUE_INT64:
-                return std::forward<decltype(visitor)>(value.as.int64);
+                return std::forward<decltype(visitor)>(visitor)(value.as_int64());
+            case VALUE_DOUBLE:
+                return std::forward<decltype(visitor)>(visitor)(value.as_double());
             case VALUE_OBJECT:
-                return std::forward<decltype(visitor)>(value.as.object);
+                return std::forward<decltype(visitor)>(visitor)(value.as_object());
         }
     }
     
@@ -92,6 +219,11 @@ X(OBJECT)\
         
         std::atomic<Value> inner;
         
+#ifdef LOX_NAN_BOXING
+        static_assert(sizeof(Value) == 8);
+        static_assert(std::atomic<Value>::is_always_lock_free);
+#endif
+        
         AtomicValue() : inner(Value()) {}
         
         explicit AtomicValue(const AtomicValue& other)
@@ -113,6 +245,8 @@ X(OBJECT)\
             value.shade();
             Value old = inner.exchange(value, std::memory_order_release);
             old.shade();
+            if (value.is_object())
+                gc::remember(this);
             return *this;
         }
         
@@ -124,10 +258,13 @@ X(OBJECT)\
             return inner.exchange(Value(), std::memory_order_relaxed);
         }
         
+        void scan(gc::ScanContext& context) const; // <-- for gc::Array
+        
     };
     
     void scan(const Value&, gc::ScanContext&);
     void scan(const AtomicValue&, gc::ScanContext&);
+    void shade(const Value&); // <-- for gc::Ctrie
 
     
 } // namespace lox
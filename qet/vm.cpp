@@ -5,16 +5,24 @@
 //  Created by Antony Searle on 20/3/2024.
 //
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <thread>
 
 #include "common.hpp"
 #include "compiler.hpp"
 #include "debug.hpp"
+#include "image.hpp"
+#include "natives.hpp"
 #include "object.hpp"
 #include "opcodes.hpp"
+#include "registers.hpp"
+#include "scheduler.hpp"
 #include "string.hpp"
 #include "vm.hpp"
 
@@ -24,14 +32,228 @@ namespace lox {
     
     GC gc;
     
-    static Value clockNative(int argCount, AtomicValue* args) {
-        return Value((int64_t)(clock() / CLOCKS_PER_SEC));
+    // clock() returns the wall time in nanoseconds, from a monotonic clock,
+    // since it was first called; rather than since the clock's own epoch, so
+    // that it fits a NaN-boxed integer for longer
+    static Value clockNative(VM&, int, Value*) {
+        static const auto start = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return Value((int64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
     }
     
+    static Value stringBuilderNative(VM&, int, Value*) {
+        return Value(new ObjectStringBuilder);
+    }
+    
+    // append(builder, value) appends a string, number, bool or nil to the
+    // builder and returns it, or returns nil for any other arguments
+    static Value appendNative(VM&, int, Value* args) {
+        if (!IS_STRING_BUILDER(args[0]))
+            return Value();
+        ObjectStringBuilder* builder = AS_STRING_BUILDER(args[0]);
+        Value value = args[1];
+        std::unique_lock lock{builder->mutex};
+        if (IS_STRING(value) || IS_TRANSIENT_STRING(value)) {
+            builder->buffer.append(stringView(value.as_object()));
+        } else if (IS_ROPE(value)) {
+            AS_ROPE(value)->appendTo(builder->buffer);
+        } else if (value.is_int64()) {
+            builder->buffer.append(std::to_string(value.as_int64()));
+        } else if (value.is_double()) {
+            // as printValue prints it
+            char digits[32];
+            builder->buffer.append(digits, snprintf(digits, sizeof(digits), "%g", value.as_double()));
+        } else if (value.is_bool()) {
+            builder->buffer.append(value.as_bool() ? "true" : "false");
+        } else if (value.is_nil()) {
+            builder->buffer.append("nil");
+        } else {
+            return Value();
+        }
+        return Value(builder);
+    }
+    
+    // toString(value) flattens a rope, or copies the contents of a builder
+    static Value toStringNative(VM&, int, Value* args) {
+        Value value = args[0];
+        if (IS_ROPE(value))
+            return Value(AS_ROPE(value)->flatten());
+        if (IS_STRING_BUILDER(value)) {
+            ObjectStringBuilder* builder = AS_STRING_BUILDER(value);
+            std::unique_lock lock{builder->mutex};
+            return Value(ObjectTransientString::make(builder->buffer));
+        }
+        return value;
+    }
+    
+    // the collector's statistics, as a JSON string
+    static Value gcStatsNative(VM&, int, Value*) {
+        std::string json = gc::statistics_json();
+        return Value(ObjectTransientString::make(json));
+    }
+    
+#ifdef LOX_PROFILE
+    // profile(true) begins profiling this VM and profile(false) ends it;
+    // profile() returns the sampled stacks of the last profile, collapsed for
+    // flame graph tools, or nil if there is none
+    static Value profileNative(VM& vm, int argCount, Value* args) {
+        if (argCount == 1 && args[0].is_bool()) {
+            if (args[0].as_bool())
+                vm.beginProfile();
+            else
+                vm.endProfile();
+            return Value();
+        }
+        if (argCount != 0 || vm.profile == nullptr)
+            return Value();
+        return Value(ObjectTransientString::make(vm.profile->collapsed()));
+    }
+#endif
+    
+    // spawn(fn) starts fn, a closure of no arguments, on a VM of its own,
+    // returning true, or returns nil for any other arguments.  The child
+    // can't share the variables fn captured that are still open on this
+    // VM's stack, so it runs a copy of fn that captures their current
+    // values instead; other closures that reach such variables fail when
+    // the child calls them.
+    static Value spawnNative(VM& vm, int, Value* args) {
+        if (!IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity)
+            return Value();
+        ObjectClosure* closure = AS_CLOSURE(args[0]);
+        ObjectClosure* copy = ObjectClosure::make(closure->function);
+        for (int i = 0; i != closure->upvalueCount; ++i) {
+            Value captured = closure->upvalues[i];
+            if (captured.is_object() && (captured.as_object()->kind == OBJECT_UPVALUE)) {
+                ObjectUpvalue* upvalue = static_cast<ObjectUpvalue*>(captured.as_object());
+                if (Value* location = upvalue->location.load(std::memory_order_relaxed)) {
+                    ObjectUpvalue* closed = new ObjectUpvalue(nullptr);
+                    closed->closed = *location;
+                    captured = Value(closed);
+                }
+            }
+            copy->upvalues[i] = captured;
+        }
+        VM* child = new VM;
+        child->initVM(vm);
+        Scheduler::shared().spawn(child, copy);
+        return Value(true);
+    }
+    
+    static Value channelNative(VM&, int, Value*) {
+        return Value(new ObjectChannel(false));
+    }
+    
+    static Value stackNative(VM&, int, Value*) {
+        return Value(new ObjectChannel(true));
+    }
+    
+    // send(channel, value) returns true, or nil for any other arguments;
+    // nil itself can't be sent, since it is what an empty receive returns
+    static Value sendNative(VM&, int, Value* args) {
+        if (!IS_CHANNEL(args[0]) || args[1].is_nil())
+            return Value();
+        AS_CHANNEL(args[0])->send(args[1]);
+        return Value(true);
+    }
+    
+    // receive(channel) returns the next value, waiting for one if there is
+    // none yet, or returns nil for any other argument.  A task doesn't wait
+    // here: the channel stands in for the result, the slice ends at the
+    // call's safepoint, and resume tries again until a value arrives.  A VM
+    // outside the scheduler has no slice to end, so it waits in place,
+    // handshaking meanwhile.
+    static Value receiveNative(VM& vm, int, Value* args) {
+        if (!IS_CHANNEL(args[0]))
+            return Value();
+        ObjectChannel* channel = AS_CHANNEL(args[0]);
+        Value value;
+        if (channel->receive(value))
+            return value;
+        if (vm.timeSlice) {
+            vm.receiving = true;
+            vm.sliceRemaining = 1;
+            return args[0];
+        }
+        while (!channel->receive(value)) {
+            if (gc::this_thread::safepoint())
+                vm.shadeRoots();
+            std::this_thread::yield();
+        }
+        return value;
+    }
+    
+    // these check the types of their arguments, and mostly return nil for
+    // bad ones; profile takes zero or one
+    static const NativeEntry coreNatives[] = {
+        { "clock", 0, clockNative },
+        { "gcStats", 0, gcStatsNative },
+        { "StringBuilder", 0, stringBuilderNative },
+        { "append", 2, appendNative },
+        { "toString", 1, toStringNative },
+        { "spawn", 1, spawnNative },
+        { "Channel", 0, channelNative },
+        { "Stack", 0, stackNative },
+        { "send", 2, sendNative },
+        { "receive", 1, receiveNative },
+#ifdef LOX_PROFILE
+        { "profile", -1, profileNative },
+#endif
+    };
+    
+    const std::span<const NativeEntry> coreModule = coreNatives;
+    
+#ifdef LOX_DEBUG_TRACE_EXECUTION
+    static void traceExecution(VM* vm, CallFrame* frame) {
+        printf("          ");
+        for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+            printf("[ ");
+            printValue(*slot);
+            printf(" ]");
+        }
+        printf("\n");
+        disassembleInstruction(frame->chunk,
+                               frame->ip - frame->chunk->code.data());
+    }
+#endif
+    
     void VM::resetStack() {
         stackTop = stack;
         frameCount = 0;
-        openUpvalues = nullptr;
+        for (uint32_t slot : openSlots)
+            openUpvalues[slot] = nullptr;
+        openSlots.clear();
+    }
+    
+    bool VM::growFrames() {
+        if (frameCapacity == frameLimit)
+            return false;
+        int capacity = std::min(frameCapacity * 2, frameLimit);
+        CallFrame* grown = new CallFrame[capacity];
+        std::copy(frames, frames + frameCount, grown);
+        delete[] frames;
+        frames = grown;
+        frameCapacity = capacity;
+        return true;
+    }
+    
+    // Moves the stack, and everything that points into it.  Only calls grow
+    // the stack, and the interpreter reloads its frame after every call.
+    void VM::growStack(size_t needed) {
+        size_t capacity = stackCapacity;
+        while (capacity < needed)
+            capacity *= 2;
+        Value* grown = new Value[capacity];
+        // the top frame's registers may be above stackTop
+        std::copy(stack, stack + stackCapacity, grown);
+        for (int i = 0; i != frameCount; ++i)
+            frames[i].slots = grown + (frames[i].slots - stack);
+        openUpvalues.resize(capacity);
+        for (uint32_t slot : openSlots)
+            openUpvalues[slot]->location.store(grown + slot, std::memory_order_relaxed);
+        stackTop = grown + (stackTop - stack);
+        delete[] stack;
+        stack = grown;
+        stackCapacity = capacity;
     }
     
     void VM::runtimeError(const char* format, ...) {
@@ -41,12 +263,18 @@ namespace lox {
         va_end(args);
         fputs("\n", stderr);
         
+        // a stack overflow has frameLimit frames, so print only the
+        // innermost and outermost few
         for (int i = frameCount - 1; i >= 0; i--) {
+            if (i == frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+                fprintf(stderr, "... %d frames elided\n", i + 1 - TRACE_FRAMES);
+                i = TRACE_FRAMES - 1;
+            }
             CallFrame* frame = &frames[i];
             const ObjectFunction* function = frame->closure->function;
-            ptrdiff_t instruction = frame->ip - function->chunk.code.data() - 1;
+            ptrdiff_t instruction = frame->ip - frame->chunk->code.data() - 1;
             fprintf(stderr, "[line %d] in ",
-                    function->chunk.lines[instruction]);
+                    frame->chunk->lines.line(instruction));
             if (function->name == NULL) {
                 fprintf(stderr, "script\n");
             } else {
@@ -57,16 +285,136 @@ namespace lox {
         resetStack();
     }
     
-    void VM::defineNative(const char* name, NativeFn function) {
-        tableSet(&globals, 
-                 copyString(name, (int) strlen(name)),
-                 Value(new ObjectNative(function)));
+    void VM::defineNative(const char* name, NativeFn function, int arity) {
+        defineGlobal(copyString(name, (int) strlen(name)),
+                     Value(new ObjectNative(function, arity)));
+    }
+    
+    void VM::defineModule(std::span<const NativeEntry> module) {
+        for (const NativeEntry& entry : module)
+            defineNative(entry.name, entry.function, entry.arity);
+    }
+    
+#ifdef LOX_GLOBALS_CTRIE
+    
+    // Lox never undefines a global, so once find has seen a name it stays
+    // defined and assignment can't resurrect a deleted one
+    
+    bool VM::getGlobal(ObjectString* name, Value* value) {
+        std::optional<Value> result = globals->find(name);
+        if (!result)
+            return false;
+        *value = *result;
+        return true;
+    }
+    
+    void VM::defineGlobal(ObjectString* name, Value value) {
+        globals->insert_or_assign(name, value);
+    }
+    
+    bool VM::setGlobal(ObjectString* name, Value value) {
+        if (!globals->find(name))
+            return false;
+        globals->insert_or_assign(name, value);
+        return true;
+    }
+    
+    void VM::initVM() {
+        initVM(new Globals);
+    }
+    
+    void VM::initVM(Globals* shared) {
+        resetStack();
+        globals = shared;
+#else
+    
+    int VM::globalSlot(ObjectString* name) {
+        Value slot;
+        if (tableGet(&globalSlots, name, &slot))
+            return (int) slot.as_int64();
+        std::size_t index = globalNames.size();
+        globalNames.push_back(name);
+        tableSet(&globalSlots, name, Value((int64_t) index));
+        gc::Array<AtomicValue>* values = (gc::Array<AtomicValue>*) globalValues;
+        if (index == values->_capacity) {
+            std::size_t capacity = values->_capacity < 8 ? 8 : values->_capacity * 2;
+            gc::Array<AtomicValue>* grown = gc::Array<AtomicValue>::make(capacity);
+            for (std::size_t i = 0; i != capacity; ++i)
+                grown->_data[i] = (i < values->_capacity) ? values->_data[i].load() : Value::undefined();
+            globalValues = grown;
+        }
+        return (int) index;
+    }
+    
+    ObjectString* VM::globalName(int slot) {
+        return ((std::size_t) slot < globalNames.size()) ? globalNames[slot] : nullptr;
+    }
+    
+    bool VM::getGlobal(ObjectString* name, Value* value) {
+        Value slot;
+        if (!tableGet(&globalSlots, name, &slot))
+            return false;
+        *value = globalValues->_data[slot.as_int64()].load();
+        return !value->is_undefined();
+    }
+    
+    void VM::defineGlobal(ObjectString* name, Value value) {
+        // find the slot first; it may grow globalValues
+        int slot = globalSlot(name);
+        globalValues->_data[slot] = value;
+    }
+    
+    bool VM::setGlobal(ObjectString* name, Value value) {
+        Value slot;
+        if (!tableGet(&globalSlots, name, &slot))
+            return false;
+        AtomicValue& target = globalValues->_data[slot.as_int64()];
+        if (target.load().is_undefined())
+            return false;
+        target = value;
+        return true;
     }
     
     void VM::initVM() {
         resetStack();
-        initTable(&globals);
-        defineNative("clock", clockNative);
+        initTable(&globalSlots);
+        globalValues = gc::Array<AtomicValue>::make(0);
+        globalNames.clear();
+        globalsSnapshot = false;
+#endif
+#ifdef LOX_COMPUTED_GOTO
+        dispatchMode = DISPATCH_THREADED;
+#else
+        dispatchMode = DISPATCH_SWITCH;
+#endif
+        useRegisters = false;
+        defineModule(coreModule);
+        defineModule(stringModule);
+        defineModule(arrayModule);
+    }
+    
+    // A spawned VM runs code compiled by its parent, which names globals by
+    // slot, so it starts with its parent's globals.  With the ctrie they are
+    // shared; with slots, it gets a snapshot, which it may read but not
+    // assign.  The parent may grow its array while the child runs, so the
+    // two can't share it.
+    void VM::initVM(VM& parent) {
+        resetStack();
+#ifdef LOX_GLOBALS_CTRIE
+        globals = (Globals*) parent.globals;
+#else
+        initTable(&globalSlots);
+        tableAddAll(&parent.globalSlots, &globalSlots);
+        gc::Array<AtomicValue>* values = (gc::Array<AtomicValue>*) parent.globalValues;
+        gc::Array<AtomicValue>* copy = gc::Array<AtomicValue>::make(values->_capacity);
+        for (std::size_t i = 0; i != values->_capacity; ++i)
+            copy->_data[i] = values->_data[i].load();
+        globalValues = copy;
+        globalNames = parent.globalNames;
+        globalsSnapshot = true;
+#endif
+        dispatchMode = parent.dispatchMode;
+        useRegisters = parent.useRegisters;
     }
     
     void initGC() {
@@ -79,7 +427,9 @@ namespace lox {
     }
     
     void VM::freeVM() {
-        freeTable(&globals);
+#ifndef LOX_GLOBALS_CTRIE
+        freeTable(&globalSlots);
+#endif
         initVM();
     }
     
@@ -97,15 +447,62 @@ namespace lox {
     
     Value VM::pop() {
         stackTop--;
-        Value value = stackTop->reset();
-        gc::shade(value.as_object());
-        return value;
+        return *stackTop;
     }
     
     Value VM::peek(int distance) {
-        return stackTop[-1 - distance].load();
+        return stackTop[-1 - distance];
     }
     
+    // Called after each handshake.  Values the stack held at the handshake
+    // are kept by shading them now; values pushed later were either
+    // allocated BLACK, or loaded from objects that are traced or whose
+    // overwritten fields the write barrier shades.
+    void VM::shadeRoots() {
+        gc::shade(this);
+        Value* top = liveTop();
+        for (Value* slot = stack; slot != top; ++slot)
+            slot->shade();
+        for (int i = 0; i != frameCount; ++i)
+            gc::shade(frames[i].closure);
+        for (uint32_t slot : openSlots)
+            gc::shade(openUpvalues[slot]);
+    }
+    
+    Value* VM::liveTop() const {
+        Value* top = stackTop;
+        if (frameCount) {
+            // register code keeps its temporaries above stackTop
+            const CallFrame* frame = &frames[frameCount - 1];
+            const ObjectFunction* function = frame->closure->function;
+            if (frame->chunk == &function->registers)
+                top = std::max(top, frame->slots + function->registerCount);
+        }
+        return top;
+    }
+    
+    namespace {
+        
+        // Claims a VM for the calling thread, waiting out a collector scan
+        struct Running {
+        
+            VM* vm;
+        
+            explicit Running(VM* vm) : vm(vm) {
+                while (vm->busy.exchange(true, std::memory_order_acquire))
+                    std::this_thread::yield();
+            }
+        
+            // parks the VM, shading what it now holds
+            ~Running() {
+                vm->shadeRoots();
+                vm->busy.store(false, std::memory_order_release);
+            }
+        
+        };
+        
+    } // namespace
+    
     bool VM::call(ObjectClosure* closure, int argCount) {
         if (argCount != closure->function->arity) {
             runtimeError("Expected %d arguments but got %d.",
@@ -113,19 +510,32 @@ namespace lox {
             return false;
         }
         
-        if (frameCount == FRAMES_MAX) {
+        if (frameCount == frameCapacity && !growFrames()) {
             runtimeError("Stack overflow.");
             return false;
         }
         
+        size_t base = stackTop - argCount - 1 - stack;
+        if (base + UINT8_COUNT > stackCapacity)
+            growStack(base + UINT8_COUNT);
+        
+        ObjectFunction* function = closure->function;
+        Value* slots = stack + base;
+        Chunk* chunk = &function->chunk;
+        // registers live above the arguments, where the stack code would have
+        // pushed its temporaries
+        if (useRegisters && function->registerCount)
+            chunk = &function->registers;
+        
         CallFrame* frame = &frames[frameCount++];
         frame->closure = closure;
-        frame->ip = closure->function->chunk.code.data();
-        frame->slots = stackTop - argCount - 1;
+        frame->chunk = chunk;
+        frame->ip = chunk->code.data();
+        frame->slots = slots;
         return true;
     }
     
-    bool Object::callObject(VM& vm, int argCount) {
+    bool Object::callObject(VM& vm, int) {
         vm.runtimeError("Can only call functions and classes.");
         return false;
     }
@@ -152,14 +562,35 @@ namespace lox {
     }
     
     bool ObjectNative::callObject(VM& vm, int argCount) {
-        Value result = this->function(argCount, vm.stackTop - argCount);
+        if ((arity != -1) && (argCount != arity)) {
+            vm.runtimeError("Expected %d arguments but got %d.", arity, argCount);
+            return false;
+        }
+        Value result = this->function(vm, argCount, vm.stackTop - argCount);
         vm.stackTop -= argCount + 1;
         vm.push(result);
         return true;
     }
     
     bool VM::callValue(Value callee, int argCount) {
-        return callee.as_object()->callObject(*this, argCount);
+        // qualified calls dispatch on the kind rather than the vtable
+        if (callee.is_object()) {
+            lox::Object* object = callee.as_object();
+            switch (object->kind) {
+                case OBJECT_BOUND_METHOD:
+                    return static_cast<ObjectBoundMethod*>(object)->ObjectBoundMethod::callObject(*this, argCount);
+                case OBJECT_CLASS:
+                    return static_cast<ObjectClass*>(object)->ObjectClass::callObject(*this, argCount);
+                case OBJECT_CLOSURE:
+                    return call(static_cast<ObjectClosure*>(object), argCount);
+                case OBJECT_NATIVE:
+                    return static_cast<ObjectNative*>(object)->ObjectNative::callObject(*this, argCount);
+                default:
+                    break;
+            }
+        }
+        runtimeError("Can only call functions and classes.");
+        return false;
     }
 
     bool VM::invokeFromClass(ObjectClass* class_, ObjectString* name, int argCount) {
@@ -174,7 +605,7 @@ namespace lox {
     bool VM::invoke(ObjectString* name, int argCount) {
         Value receiver = peek(argCount);
         
-        ObjectInstance* instance = dynamic_cast<ObjectInstance*>(receiver.as_object());
+        ObjectInstance* instance = IS_INSTANCE(receiver) ? AS_INSTANCE(receiver) : nullptr;
 
         
         if (!instance) {
@@ -183,7 +614,7 @@ namespace lox {
         }
                 
         Value value;
-        if (tableGet(&instance->fields, name, &value)) {
+        if (instance->getField(name, &value)) {
             // Name is a field, and shadows any method with the same name.
             stackTop[-argCount - 1] = value;
             return callValue(value, argCount);
@@ -205,35 +636,24 @@ namespace lox {
         return true;
     }
     
-    ObjectUpvalue* VM::captureUpvalue(AtomicValue* local) {
-        ObjectUpvalue* prevUpvalue = NULL;
-        ObjectUpvalue* upvalue = (ObjectUpvalue*) openUpvalues;
-        while (upvalue != NULL && upvalue->location > local) {
-            prevUpvalue = upvalue;
-            upvalue = upvalue->next;
-        }
-        
-        if (upvalue != NULL && upvalue->location == local) {
+    ObjectUpvalue* VM::captureUpvalue(Value* local) {
+        uint32_t slot = (uint32_t) (local - stack);
+        ObjectUpvalue*& upvalue = openUpvalues[slot];
+        if (upvalue)
             return upvalue;
-        }
-        
-        ObjectUpvalue* createdUpvalue = new ObjectUpvalue(local);
-        createdUpvalue->next = upvalue;
-        if (prevUpvalue == NULL) {
-            openUpvalues = createdUpvalue;
-        } else {
-            prevUpvalue->next = createdUpvalue;
-        }
-        return createdUpvalue;
+        upvalue = new ObjectUpvalue(local);
+        // usually the highest, since frames capture their own locals
+        openSlots.insert(std::upper_bound(openSlots.begin(), openSlots.end(), slot), slot);
+        return upvalue;
     }
     
-    void VM::closeUpvalues(AtomicValue* last) {
-        while (openUpvalues != nullptr &&
-               openUpvalues->location >= last) {
-            ObjectUpvalue* upvalue = (ObjectUpvalue*) openUpvalues;
-            upvalue->closed = *upvalue->location;
-            upvalue->location = &upvalue->closed;
-            openUpvalues = upvalue->next;
+    void VM::closeUpvalues(Value* last) {
+        uint32_t first = (uint32_t) (last - stack);
+        while (!openSlots.empty() && (openSlots.back() >= first)) {
+            ObjectUpvalue* upvalue = std::exchange(openUpvalues[openSlots.back()], nullptr);
+            upvalue->closed = *upvalue->location.load(std::memory_order_relaxed);
+            upvalue->location.store(nullptr, std::memory_order_release);
+            openSlots.pop_back();
         }
     }
     
@@ -245,23 +665,54 @@ namespace lox {
     }
     
     void VM::concatenate() {
-        ObjectString* b = AS_STRING(peek(0));
-        ObjectString* a = AS_STRING(peek(1));
-        
-        int length = a->_size + b->_size;
-        char* chars = (char*) operator new(length + 1);
-        memcpy(chars, a->_data, a->_size);
-        memcpy(chars + a->_size, b->_data, b->_size);
-        chars[length] = '\0';
-        
-        ObjectString* result = takeString(chars, length);
+        Value result = concatenate(peek(1), peek(0));
         pop();
         pop();
-        push(Value(result));
+        push(result);
     }
     
-    InterpretResult VM::run() {
+    Value VM::concatenate(Value a, Value b) {
+        lox::Object* right = b.as_object();
+        lox::Object* left = a.as_object();
+        
+        // every rope is at least ROPE_MIN_LENGTH long, so short results are
+        // always made from two flat strings
+        std::size_t length = stringLength(left) + stringLength(right);
+        lox::Object* result;
+        if (length >= ROPE_MIN_LENGTH) {
+            result = new ObjectRope(left, right);
+        } else {
+            std::string_view a = stringView(left);
+            std::string_view b = stringView(right);
+            ObjectTransientString* s = ObjectTransientString::make(length);
+            memcpy(s->_data, a.data(), a.size());
+            memcpy(s->_data + a.size(), b.data(), b.size());
+            result = s;
+        }
+        return Value(result);
+    }
+    
+    // Remembers what a property site did for one more receiver shape, unless
+    // the cache is already full or another entry already covers the shape
+    static void fillCache(InlineCache* cache,
+                          ObjectShape* shape,
+                          int index,
+                          ObjectShape* transition,
+                          ObjectClosure* method) {
+        if (cache->lookup(shape))
+            return;
+        if (InlineCache::Entry* entry = cache->claim()) {
+            entry->index.store(index, std::memory_order_relaxed);
+            entry->transition.store(transition, std::memory_order_relaxed);
+            entry->method.store(method, std::memory_order_relaxed);
+            entry->key.store(shape, std::memory_order_release);
+        }
+    }
+    
+    template<bool THREADED>
+    InterpretResult VM::_run() {
         CallFrame* frame = &frames[this->frameCount - 1];
+        uint8_t rk;
         
 #define READ_BYTE() (*frame->ip++)
         
@@ -269,213 +720,462 @@ namespace lox {
 (frame->ip += 2, \
 (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
         
-#define READ_CONSTANT() (frame->closure->function->chunk.constants[READ_BYTE()])
+#define READ_CONSTANT() (frame->chunk->constants[READ_BYTE()])
         
 #define READ_STRING() AS_STRING(READ_CONSTANT())
         
-#define BINARY_OP(valueType, op) \
+#define READ_CACHE() (&frame->chunk->caches->_data[READ_SHORT()])
+        
+#define READ_RK() \
+(rk = READ_BYTE(), \
+(rk & RK_CONSTANT) ? frame->chunk->constants[rk & ~RK_CONSTANT] : frame->slots[rk])
+        
+        // Quickening
+        //
+        // The generic arithmetic and comparison opcodes look at their
+        // operands and rewrite themselves in the chunk to a variant for two
+        // integers or for floats (a double and a double or an integer),
+        // whose handler checks only for that case.  A variant that meets
+        // other operands rewrites itself back and dispatches again to the
+        // generic opcode, which chooses again.  Chunks are shared by the
+        // threads running them, so opcodes are stored and loaded through
+        // relaxed atomic_refs, which compile to plain byte moves; a thread
+        // that reads the old opcode still runs a correct handler.  Operands
+        // are never rewritten, so READ_BYTE stays plain.
+        
+#define QUICKEN(Z) \
+std::atomic_ref<uint8_t>(frame->ip[-1]).store(OPCODE_##Z, std::memory_order_relaxed)
+        
+#define READ_OPCODE() \
+std::atomic_ref<uint8_t>(*frame->ip++).load(std::memory_order_relaxed)
+        
+#define BINARY_OP(Z, op) \
+do { \
+Value b = stackTop[-1]; \
+Value a = stackTop[-2]; \
+if (a.is_int64() && b.is_int64()) { \
+QUICKEN(Z##_INT); \
+stackTop[-2] = Value(a.as_int64() op b.as_int64()); \
+} else if (is_number(a) && is_number(b)) { \
+QUICKEN(Z##_FLOAT); \
+stackTop[-2] = Value(as_number(a) op as_number(b)); \
+} else { \
+runtimeError("Operands must be numbers."); \
+return INTERPRET_RUNTIME_ERROR; \
+} \
+--stackTop; \
+} while(false)
+        
+#define INT_BINARY_OP(Z, op) \
+do { \
+Value b = stackTop[-1]; \
+Value a = stackTop[-2]; \
+if (a.is_int64() && b.is_int64()) { \
+stackTop[-2] = Value(a.as_int64() op b.as_int64()); \
+--stackTop; \
+} else { \
+QUICKEN(Z); \
+--frame->ip; \
+} \
+} while(false)
+        
+#define FLOAT_BINARY_OP(Z, op) \
+do { \
+Value b = stackTop[-1]; \
+Value a = stackTop[-2]; \
+if (a.is_double() && b.is_double()) { \
+stackTop[-2] = Value(a.as_double() op b.as_double()); \
+--stackTop; \
+} else if (is_number(a) && is_number(b) && !(a.is_int64() && b.is_int64())) { \
+stackTop[-2] = Value(as_number(a) op as_number(b)); \
+--stackTop; \
+} else { \
+QUICKEN(Z); \
+--frame->ip; \
+} \
+} while(false)
+        
+#define REGISTER_BINARY_OP(op) \
 do { \
-if ( !peek(0).is_int64() || !peek(1).is_int64() ) { \
+Value& dst = frame->slots[READ_BYTE()]; \
+Value a = READ_RK(); \
+Value b = READ_RK(); \
+if (a.is_int64() && b.is_int64()) { \
+dst = Value(a.as_int64() op b.as_int64()); \
+} else if (is_number(a) && is_number(b)) { \
+dst = Value(as_number(a) op as_number(b)); \
+} else { \
 runtimeError("Operands must be numbers."); \
 return INTERPRET_RUNTIME_ERROR; \
 } \
-int64_t b = pop().as_int64(); \
-int64_t a = pop().as_int64(); \
-push(Value(a op b)); \
 } while(false)
         
-        for (int qqq = 0;; ++qqq) {
+        // sample the stack when the profile's interval has elapsed
+#ifdef LOX_PROFILE
+#define SAMPLE() \
+do { \
+if (profiling && profile->due()) \
+profile->sample(*this); \
+} while(false)
+#else
+#define SAMPLE() do {} while(false)
+#endif
+        
+        // shade the VM only when a safepoint actually handshakes; between
+        // handshakes the write barriers keep the collector informed
+#define SAFEPOINT() \
+do { \
+if (gc::this_thread::safepoint()) \
+shadeRoots(); \
+SAMPLE(); \
+if (timeSlice && !--sliceRemaining) \
+return INTERPRET_YIELD; \
+} while(false)
+        
 #ifdef LOX_DEBUG_TRACE_EXECUTION
-            printf("          ");
-            for (AtomicValue* slot = this->stack; slot < this->stackTop; slot++) {
-                printf("[ ");
-                printValue(slot->load());
-                printf(" ]");
-            }
-            printf("\n");
-            disassembleInstruction(&frame->closure->function->chunk,
-                                   frame->ip - frame->closure->function->chunk.code.data());
+#define TRACE_EXECUTION() traceExecution(this, frame)
+#else
+#define TRACE_EXECUTION() do {} while(false)
 #endif
-            
-            // handshake every 128 instructions
-            //if (!(qqq & 127)) {
-                // printf("---\n");
-                gc::this_thread::handshake();
-                gc::shade(this);
-            //}
-
-            
-            
-            uint8_t instruction;
-            switch (instruction = READ_BYTE()) {
-                case OPCODE_CONSTANT: {
+        
+#ifdef LOX_PROFILE
+#define PROFILE_INSTRUCTION() \
+do { \
+if (profiling) \
+profile->instruction(frame->closure->function, std::atomic_ref<uint8_t>(*frame->ip).load(std::memory_order_relaxed)); \
+} while(false)
+#else
+#define PROFILE_INSTRUCTION() do {} while(false)
+#endif
+        
+        // In threaded mode each handler ends with its own indirect jump
+        // through the label table, so the branch predictor sees one site per
+        // opcode rather than the single shared site of the switch.  The
+        // switch is still used to enter the first handler.
+        //
+        // The table lists the labels in the enum's order, which is their
+        // opcodes' order, then enough of the unknown opcode handler that
+        // every byte lands on one.
+#ifdef LOX_COMPUTED_GOTO
+#define CASE(Z) case OPCODE_##Z: LABEL_OPCODE_##Z
+#define DEFAULT() default: LABEL_UNKNOWN_OPCODE
+#define DISPATCH() \
+if constexpr (THREADED) { \
+TRACE_EXECUTION(); \
+PROFILE_INSTRUCTION(); \
+goto *dispatchTable[READ_OPCODE()]; \
+} else continue
+        
+#define X(Z) &&LABEL_OPCODE_##Z,
+#define UNKNOWN4 &&LABEL_UNKNOWN_OPCODE, &&LABEL_UNKNOWN_OPCODE, &&LABEL_UNKNOWN_OPCODE, &&LABEL_UNKNOWN_OPCODE,
+#define UNKNOWN16 UNKNOWN4 UNKNOWN4 UNKNOWN4 UNKNOWN4
+#define UNKNOWN64 UNKNOWN16 UNKNOWN16 UNKNOWN16 UNKNOWN16
+        static void* const dispatchTable[] = { ENUMERATEX_OPCODES UNKNOWN64 UNKNOWN64 UNKNOWN64 UNKNOWN64 };
+#undef UNKNOWN64
+#undef UNKNOWN16
+#undef UNKNOWN4
+#undef X
+#else
+#define CASE(Z) case OPCODE_##Z
+#define DEFAULT() default
+#define DISPATCH() continue
+#endif
+        
+        shadeRoots();
+        
+        for (;;) {
+            TRACE_EXECUTION();
+            PROFILE_INSTRUCTION();
+            switch (READ_OPCODE()) {
+                CASE(CONSTANT): {
                     Value constant = READ_CONSTANT();
                     push(constant);
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_NIL: push(Value()); break;
-                case OPCODE_TRUE: push(Value(true)); break;
-                case OPCODE_FALSE: push(Value(false)); break;
-                case OPCODE_POP: pop(); break;
-                case OPCODE_GET_LOCAL: {
+                CASE(NIL): push(Value()); DISPATCH();
+                CASE(TRUE): push(Value(true)); DISPATCH();
+                CASE(FALSE): push(Value(false)); DISPATCH();
+                CASE(POP): pop(); DISPATCH();
+                CASE(GET_LOCAL): {
                     uint8_t slot = READ_BYTE();
-                    push(frame->slots[slot].load());
-                    break;
+                    push(frame->slots[slot]);
+                    DISPATCH();
                 }
-                case OPCODE_SET_LOCAL: {
+                CASE(SET_LOCAL): {
                     uint8_t slot = READ_BYTE();
                     frame->slots[slot] = peek(0);
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_GET_GLOBAL: {
+                CASE(GET_GLOBAL): {
                     ObjectString* name = READ_STRING();
                     Value value;
-                    if (!tableGet(&this->globals, name, &value)) {
+                    if (!getGlobal(name, &value)) {
                         runtimeError("Undefined variable '%s'.", name->_data);
                         return INTERPRET_RUNTIME_ERROR;
                     }
                     push(value);
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_DEFINE_GLOBAL: {
+                CASE(DEFINE_GLOBAL): {
                     ObjectString* name = READ_STRING();
-                    tableSet(&this->globals, name, peek(0));
+                    defineGlobal(name, peek(0));
                     pop();
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_SET_GLOBAL: {
+                CASE(SET_GLOBAL): {
                     ObjectString* name = READ_STRING();
-                    if (tableSet(&this->globals, name, peek(0))) {
-                        tableDelete(&this->globals, name);
+                    if (!setGlobal(name, peek(0))) {
                         runtimeError("Undefined variable '%s'.", name->_data);
                         return INTERPRET_RUNTIME_ERROR;
                     }
-                    break;
+                    DISPATCH();
+                }
+#ifdef LOX_GLOBALS_CTRIE
+                CASE(GET_GLOBAL_SLOT):
+                CASE(DEFINE_GLOBAL_SLOT):
+                CASE(SET_GLOBAL_SLOT):
+                CASE(REG_GET_GLOBAL_SLOT):
+                CASE(REG_DEFINE_GLOBAL_SLOT):
+                CASE(REG_SET_GLOBAL_SLOT): {
+                    // shared globals are always looked up by name
+                    abort();
                 }
-                case OPCODE_GET_UPVALUE: {
+#else
+                CASE(GET_GLOBAL_SLOT): {
+                    uint16_t slot = READ_SHORT();
+                    Value value = globalValues->_data[slot].load();
+                    if (value.is_undefined()) {
+                        runtimeError("Undefined variable '%s'.", globalName(slot)->_data);
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    push(value);
+                    DISPATCH();
+                }
+                CASE(DEFINE_GLOBAL_SLOT): {
+                    uint16_t slot = READ_SHORT();
+                    globalValues->_data[slot] = peek(0);
+                    pop();
+                    DISPATCH();
+                }
+                CASE(SET_GLOBAL_SLOT): {
+                    uint16_t slot = READ_SHORT();
+                    if (globalsSnapshot) {
+                        runtimeError("Can't assign global variable '%s' from a spawned task.", globalName(slot)->_data);
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    AtomicValue& target = globalValues->_data[slot];
+                    if (target.load().is_undefined()) {
+                        runtimeError("Undefined variable '%s'.", globalName(slot)->_data);
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    target = peek(0);
+                    DISPATCH();
+                }
+#endif
+                CASE(GET_UPVALUE): {
                     uint8_t slot = READ_BYTE();
-                    push(frame->closure->upvalues[slot]->location->load());
-                    break;
+                    Value value;
+                    if (!frame->closure->loadUpvalue(*this, slot, &value)) {
+                        runtimeError("Can't reach a local variable of another task.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    push(value);
+                    DISPATCH();
                 }
-                case OPCODE_SET_UPVALUE: {
+                CASE(SET_UPVALUE): {
                     uint8_t slot = READ_BYTE();
-                    *frame->closure->upvalues[slot]->location = peek(0);
-                    break;
+                    if (!frame->closure->storeUpvalue(*this, slot, peek(0))) {
+                        runtimeError("Can't reach a local variable of another task.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    DISPATCH();
                 }
-                case OPCODE_GET_PROPERTY: {
-                    ObjectInstance* instance = dynamic_cast<ObjectInstance*>(peek(0).as_object());
+                CASE(GET_PROPERTY): {
+                    ObjectInstance* instance = IS_INSTANCE(peek(0)) ? AS_INSTANCE(peek(0)) : nullptr;
                     if (!instance) {
                         runtimeError("Only instances have properties.");
                         return INTERPRET_RUNTIME_ERROR;
                     }
                     
                     ObjectString* name = READ_STRING();
+                    InlineCache* cache = READ_CACHE();
+                    ObjectShape* shape = (ObjectShape*) instance->shape;
+                    
+                    if (InlineCache::Entry* entry = shape ? cache->lookup(shape) : nullptr) {
+                        int index = entry->index.load(std::memory_order_relaxed);
+                        if (index >= 0) {
+                            Value value = instance->slots->_data[index].load();
+                            pop(); // Instance.
+                            push(value);
+                        } else {
+                            ObjectBoundMethod* bound = new ObjectBoundMethod(peek(0), entry->method.load(std::memory_order_relaxed));
+                            pop(); // Instance.
+                            push(Value(bound));
+                        }
+                        DISPATCH();
+                    }
                     
                     Value value;
-                    if (tableGet(&instance->fields, name, &value)) {
+                    if (instance->getField(name, &value)) {
+                        if (shape)
+                            fillCache(cache, shape, shape->find(name), nullptr, nullptr);
                         pop(); // Instance.
                         push(value);
-                        break;
+                        DISPATCH();
                     }
                     
+                    if (shape && tableGet(&instance->class_->methods, name, &value))
+                        fillCache(cache, shape, -1, nullptr, AS_CLOSURE(value));
                     if (!bindMethod(instance->class_, name)) {
                         return INTERPRET_RUNTIME_ERROR;
                     }
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_SET_PROPERTY: {
-                    ObjectInstance* instance = dynamic_cast<ObjectInstance*>(peek(1).as_object());
+                CASE(SET_PROPERTY): {
+                    ObjectInstance* instance = IS_INSTANCE(peek(1)) ? AS_INSTANCE(peek(1)) : nullptr;
                     if (!instance) {
                         runtimeError("Only instances have properties.");
                         return INTERPRET_RUNTIME_ERROR;
                     }
-                    tableSet(&instance->fields, READ_STRING(), peek(0));
+                    
+                    ObjectString* name = READ_STRING();
+                    InlineCache* cache = READ_CACHE();
+                    ObjectShape* shape = (ObjectShape*) instance->shape;
+                    
+                    if (InlineCache::Entry* entry = shape ? cache->lookup(shape) : nullptr) {
+                        int index = entry->index.load(std::memory_order_relaxed);
+                        ObjectShape* transition = entry->transition.load(std::memory_order_relaxed);
+                        if (transition)
+                            instance->addField(transition, index, peek(0));
+                        else
+                            instance->slots->_data[index] = peek(0);
+                    } else {
+                        instance->setField(name, peek(0));
+                        ObjectShape* next = (ObjectShape*) instance->shape;
+                        if (shape && next)
+                            fillCache(cache, shape, next->find(name), (next != shape) ? next : nullptr, nullptr);
+                    }
                     Value value = pop();
                     pop();
                     push(value);
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_GET_SUPER: {
+                CASE(GET_SUPER): {
                     ObjectString* name = READ_STRING();
                     ObjectClass* superclass = AS_CLASS(pop());
                     if (!bindMethod(superclass, name)) {
                         return INTERPRET_RUNTIME_ERROR;
                     }
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_EQUAL: {
+                CASE(EQUAL): {
                     Value b = pop();
                     Value a = pop();
-                    push(Value(a == b));
-                    break;
+                    // strings of different kinds may still be equal
+                    if (isString(a) && isString(b))
+                        push(Value(stringsEqual(a.as_object(), b.as_object())));
+                    else
+                        push(Value(a == b));
+                    DISPATCH();
                 }
-                case OPCODE_LESS: BINARY_OP(BOOL_VAL, <); break;
-                case OPCODE_GREATER: BINARY_OP(BOOL_VAL, >); break;
-                case OPCODE_ADD: {
-                    if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                CASE(LESS): BINARY_OP(LESS, <); DISPATCH();
+                CASE(GREATER): BINARY_OP(GREATER, >); DISPATCH();
+                CASE(ADD): {
+                    // strings stay with the generic opcode
+                    if (isString(peek(0)) && isString(peek(1))) {
                         concatenate();
                     } else if (peek(0).is_int64() && peek(1).is_int64()) {
+                        QUICKEN(ADD_INT);
                         int64_t b = pop().as_int64();
                         int64_t a = pop().as_int64();
                         push(Value(a + b));
+                    } else if (is_number(peek(0)) && is_number(peek(1))) {
+                        QUICKEN(ADD_FLOAT);
+                        double b = as_number(pop());
+                        double a = as_number(pop());
+                        push(Value(a + b));
                     } else {
                         runtimeError("Operands must be two numbers or two strings.");
                         return INTERPRET_RUNTIME_ERROR;
                     }
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-                case OPCODE_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-                case OPCODE_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-                case OPCODE_NOT:
+                CASE(SUBTRACT): BINARY_OP(SUBTRACT, -); DISPATCH();
+                CASE(MULTIPLY): BINARY_OP(MULTIPLY, *); DISPATCH();
+                CASE(DIVIDE): BINARY_OP(DIVIDE, /); DISPATCH();
+                CASE(NOT):
                     push(Value(!(bool)pop()));
-                    break;
-                case OPCODE_NEGATE:
-                    if (!peek(0).is_int64()) {
+                    DISPATCH();
+                CASE(NEGATE):
+                    if (peek(0).is_int64()) {
+                        push(Value(-pop().as_int64()));
+                    } else if (peek(0).is_double()) {
+                        push(Value(-pop().as_double()));
+                    } else {
                         runtimeError("Operand must be a number.\n");
                         return INTERPRET_RUNTIME_ERROR;
                     }
-                    push(Value(-pop().as_int64()));
-                    break;
-                case OPCODE_PRINT: {
+                    DISPATCH();
+                CASE(PRINT): {
                     printValue(pop());
                     printf("\n");
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_JUMP: {
+                CASE(JUMP): {
                     uint16_t offset = READ_SHORT();
                     frame->ip += offset;
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_JUMP_IF_FALSE: {
+                CASE(JUMP_IF_FALSE): {
                     uint16_t offset = READ_SHORT();
                     if (!(bool)peek(0))
                         frame->ip += offset;
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_LOOP: {
+                CASE(LOOP): {
                     uint16_t offset = READ_SHORT();
                     frame->ip -= offset;
-                    break;
+                    SAFEPOINT();
+                    DISPATCH();
                 }
-                case OPCODE_CALL: {
+                CASE(CALL): {
                     int argCount = READ_BYTE();
                     if (!callValue(peek(argCount), argCount)) {
                         return INTERPRET_RUNTIME_ERROR;
                     }
                     frame = &this->frames[this->frameCount - 1];
-                    break;
+                    SAFEPOINT();
+                    DISPATCH();
                 }
-                case OPCODE_INVOKE: {
+                CASE(INVOKE): {
                     ObjectString* method = READ_STRING();
                     int argCount = READ_BYTE();
-                    if (!invoke(method, argCount)) {
-                        return INTERPRET_RUNTIME_ERROR;
+                    InlineCache* cache = READ_CACHE();
+                    
+                    Value receiver = peek(argCount);
+                    ObjectInstance* instance = IS_INSTANCE(receiver) ? AS_INSTANCE(receiver) : nullptr;
+                    ObjectShape* shape = instance ? (ObjectShape*) instance->shape : nullptr;
+                    if (InlineCache::Entry* entry = shape ? cache->lookup(shape) : nullptr) {
+                        if (!call(entry->method.load(std::memory_order_relaxed), argCount)) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
+                    } else {
+                        // A field of the same name shadows the method, and is
+                        // rare enough not to cache
+                        Value value;
+                        if (shape
+                            && shape->find(method) < 0
+                            && tableGet(&instance->class_->methods, method, &value))
+                            fillCache(cache, shape, -1, nullptr, AS_CLOSURE(value));
+                        if (!invoke(method, argCount)) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
                     }
                     frame = &this->frames[this->frameCount - 1];
-                    break;
+                    SAFEPOINT();
+                    DISPATCH();
                 }
-                case OPCODE_SUPER_INVOKE: {
+                CASE(SUPER_INVOKE): {
                     ObjectString* method = READ_STRING();
                     int argCount = READ_BYTE();
                     ObjectClass* superclass = AS_CLASS(pop());
@@ -483,31 +1183,39 @@ push(Value(a op b)); \
                         return INTERPRET_RUNTIME_ERROR;
                     }
                     frame = &this->frames[this->frameCount - 1];
-                    break;
+                    SAFEPOINT();
+                    DISPATCH();
                 }
-                case OPCODE_CLOSURE: {
+                CASE(CLOSURE): {
                     ObjectFunction* function = AS_FUNCTION(READ_CONSTANT());
                     // ObjectClosure* closure = new(gc::extra_val_t{function->upvalueCount * sizeof(ObjectUpvalue*)}) ObjectClosure(function);
                     ObjectClosure* closure = ObjectClosure::make(function);
+                    // pushed first, so that a local function that captures
+                    // itself by value finds itself in its slot
                     push(Value(closure));
                     for (int i = 0; i < closure->upvalueCount; i++) {
-                        uint8_t isLocal = READ_BYTE();
+                        uint8_t capture = READ_BYTE();
                         uint8_t index = READ_BYTE();
-                        if (isLocal) {
-                            closure->upvalues[i] =
-                            captureUpvalue(frame->slots + index);
-                        } else {
-                            closure->upvalues[i] = frame->closure->upvalues[index];
+                        switch (capture) {
+                            case CAPTURE_UPVALUE:
+                                closure->upvalues[i] = frame->closure->upvalues[index];
+                                break;
+                            case CAPTURE_LOCAL:
+                                closure->upvalues[i] = Value(captureUpvalue(frame->slots + index));
+                                break;
+                            case CAPTURE_VALUE:
+                                closure->upvalues[i] = frame->slots[index];
+                                break;
                         }
                     }
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_CLOSE_UPVALUE: {
+                CASE(CLOSE_UPVALUE): {
                     closeUpvalues(this->stackTop - 1);
                     pop();
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_RETURN: {
+                CASE(RETURN): {
                     Value result = pop();
                     closeUpvalues(frame->slots);
                     this->frameCount--;
@@ -519,13 +1227,14 @@ push(Value(a op b)); \
                     this->stackTop = frame->slots;
                     push(result);
                     frame = &this->frames[this->frameCount - 1];
-                    break;
+                    SAFEPOINT();
+                    DISPATCH();
                 }
-                case OPCODE_CLASS: {
+                CASE(CLASS): {
                     push(Value(new ObjectClass(READ_STRING())));
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_INHERIT: {
+                CASE(INHERIT): {
                     Value superclass = peek(1);
                     if (!IS_CLASS(superclass)) {
                         runtimeError("Superclass must be a class.");
@@ -535,24 +1244,302 @@ push(Value(a op b)); \
                     ObjectClass* subclass = AS_CLASS(peek(0));
                     tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
                     pop(); // Subclass.
-                    break;
+                    DISPATCH();
                 }
-                case OPCODE_METHOD: {
+                CASE(METHOD): {
                     defineMethod(READ_STRING());
-                    break;
+                    DISPATCH();
+                }
+                CASE(GET_LOCAL_GET_LOCAL): {
+                    uint8_t first = READ_BYTE();
+                    uint8_t second = READ_BYTE();
+                    push(frame->slots[first]);
+                    push(frame->slots[second]);
+                    DISPATCH();
+                }
+                CASE(SET_LOCAL_POP): {
+                    uint8_t slot = READ_BYTE();
+                    frame->slots[slot] = pop();
+                    DISPATCH();
+                }
+                CASE(ADD_CONSTANT): {
+                    // only fused for integer constants
+                    int64_t b = READ_CONSTANT().as_int64();
+                    if (peek(0).is_int64()) {
+                        int64_t a = pop().as_int64();
+                        push(Value(a + b));
+                    } else if (peek(0).is_double()) {
+                        double a = pop().as_double();
+                        push(Value(a + (double) b));
+                    } else {
+                        runtimeError("Operands must be two numbers or two strings.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    DISPATCH();
+                }
+                CASE(LESS_JUMP_IF_FALSE): {
+                    uint16_t offset = READ_SHORT();
+                    bool less;
+                    if (peek(0).is_int64() && peek(1).is_int64()) {
+                        int64_t b = pop().as_int64();
+                        int64_t a = pop().as_int64();
+                        less = a < b;
+                    } else if (is_number(peek(0)) && is_number(peek(1))) {
+                        double b = as_number(pop());
+                        double a = as_number(pop());
+                        less = a < b;
+                    } else {
+                        runtimeError("Operands must be numbers.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    push(Value(less));
+                    if (!less)
+                        frame->ip += offset;
+                    DISPATCH();
+                }
+                // a quickened opcode that fails its check dispatches again to
+                // the generic opcode it has restored
+                CASE(ADD_INT): INT_BINARY_OP(ADD, +); DISPATCH();
+                CASE(ADD_FLOAT): FLOAT_BINARY_OP(ADD, +); DISPATCH();
+                CASE(SUBTRACT_INT): INT_BINARY_OP(SUBTRACT, -); DISPATCH();
+                CASE(SUBTRACT_FLOAT): FLOAT_BINARY_OP(SUBTRACT, -); DISPATCH();
+                CASE(MULTIPLY_INT): INT_BINARY_OP(MULTIPLY, *); DISPATCH();
+                CASE(MULTIPLY_FLOAT): FLOAT_BINARY_OP(MULTIPLY, *); DISPATCH();
+                CASE(DIVIDE_INT): INT_BINARY_OP(DIVIDE, /); DISPATCH();
+                CASE(DIVIDE_FLOAT): FLOAT_BINARY_OP(DIVIDE, /); DISPATCH();
+                CASE(LESS_INT): INT_BINARY_OP(LESS, <); DISPATCH();
+                CASE(LESS_FLOAT): FLOAT_BINARY_OP(LESS, <); DISPATCH();
+                CASE(GREATER_INT): INT_BINARY_OP(GREATER, >); DISPATCH();
+                CASE(GREATER_FLOAT): FLOAT_BINARY_OP(GREATER, >); DISPATCH();
+                CASE(REG_MOVE): {
+                    Value& dst = frame->slots[READ_BYTE()];
+                    dst = READ_RK();
+                    DISPATCH();
+                }
+                CASE(REG_NIL): {
+                    frame->slots[READ_BYTE()] = Value();
+                    DISPATCH();
+                }
+                CASE(REG_TRUE): {
+                    frame->slots[READ_BYTE()] = Value(true);
+                    DISPATCH();
+                }
+                CASE(REG_FALSE): {
+                    frame->slots[READ_BYTE()] = Value(false);
+                    DISPATCH();
+                }
+#ifndef LOX_GLOBALS_CTRIE
+                CASE(REG_GET_GLOBAL_SLOT): {
+                    Value& dst = frame->slots[READ_BYTE()];
+                    uint16_t slot = READ_SHORT();
+                    Value value = globalValues->_data[slot].load();
+                    if (value.is_undefined()) {
+                        runtimeError("Undefined variable '%s'.", globalName(slot)->_data);
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    dst = value;
+                    DISPATCH();
+                }
+                CASE(REG_DEFINE_GLOBAL_SLOT): {
+                    Value value = READ_RK();
+                    uint16_t slot = READ_SHORT();
+                    globalValues->_data[slot] = value;
+                    DISPATCH();
+                }
+                CASE(REG_SET_GLOBAL_SLOT): {
+                    Value value = READ_RK();
+                    uint16_t slot = READ_SHORT();
+                    if (globalsSnapshot) {
+                        runtimeError("Can't assign global variable '%s' from a spawned task.", globalName(slot)->_data);
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    AtomicValue& target = globalValues->_data[slot];
+                    if (target.load().is_undefined()) {
+                        runtimeError("Undefined variable '%s'.", globalName(slot)->_data);
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    target = value;
+                    DISPATCH();
+                }
+#endif
+                CASE(REG_GET_UPVALUE): {
+                    Value& dst = frame->slots[READ_BYTE()];
+                    uint8_t slot = READ_BYTE();
+                    if (!frame->closure->loadUpvalue(*this, slot, &dst)) {
+                        runtimeError("Can't reach a local variable of another task.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    DISPATCH();
+                }
+                CASE(REG_SET_UPVALUE): {
+                    uint8_t slot = READ_BYTE();
+                    if (!frame->closure->storeUpvalue(*this, slot, READ_RK())) {
+                        runtimeError("Can't reach a local variable of another task.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    DISPATCH();
+                }
+                CASE(REG_EQUAL): {
+                    Value& dst = frame->slots[READ_BYTE()];
+                    Value a = READ_RK();
+                    Value b = READ_RK();
+                    // strings of different kinds may still be equal
+                    if (isString(a) && isString(b))
+                        dst = Value(stringsEqual(a.as_object(), b.as_object()));
+                    else
+                        dst = Value(a == b);
+                    DISPATCH();
+                }
+                CASE(REG_LESS): REGISTER_BINARY_OP(<); DISPATCH();
+                CASE(REG_GREATER): REGISTER_BINARY_OP(>); DISPATCH();
+                CASE(REG_ADD): {
+                    Value& dst = frame->slots[READ_BYTE()];
+                    Value a = READ_RK();
+                    Value b = READ_RK();
+                    if (isString(a) && isString(b)) {
+                        dst = concatenate(a, b);
+                    } else if (a.is_int64() && b.is_int64()) {
+                        dst = Value(a.as_int64() + b.as_int64());
+                    } else if (is_number(a) && is_number(b)) {
+                        dst = Value(as_number(a) + as_number(b));
+                    } else {
+                        runtimeError("Operands must be two numbers or two strings.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    DISPATCH();
+                }
+                CASE(REG_SUBTRACT): REGISTER_BINARY_OP(-); DISPATCH();
+                CASE(REG_MULTIPLY): REGISTER_BINARY_OP(*); DISPATCH();
+                CASE(REG_DIVIDE): REGISTER_BINARY_OP(/); DISPATCH();
+                CASE(REG_NOT): {
+                    Value& dst = frame->slots[READ_BYTE()];
+                    dst = Value(!(bool)READ_RK());
+                    DISPATCH();
+                }
+                CASE(REG_NEGATE): {
+                    Value& dst = frame->slots[READ_BYTE()];
+                    Value a = READ_RK();
+                    if (a.is_int64()) {
+                        dst = Value(-a.as_int64());
+                    } else if (a.is_double()) {
+                        dst = Value(-a.as_double());
+                    } else {
+                        runtimeError("Operand must be a number.\n");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    DISPATCH();
+                }
+                CASE(REG_PRINT): {
+                    printValue(READ_RK());
+                    printf("\n");
+                    DISPATCH();
+                }
+                CASE(REG_JUMP_IF_FALSE): {
+                    Value condition = READ_RK();
+                    uint16_t offset = READ_SHORT();
+                    if (!(bool)condition)
+                        frame->ip += offset;
+                    DISPATCH();
+                }
+                CASE(REG_CALL): {
+                    uint8_t base = READ_BYTE();
+                    int argCount = READ_BYTE();
+                    // the callee and its arguments are already in place
+                    this->stackTop = frame->slots + base + argCount + 1;
+                    if (!callValue(peek(argCount), argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame = &this->frames[this->frameCount - 1];
+                    SAFEPOINT();
+                    DISPATCH();
+                }
+                CASE(REG_RETURN): {
+                    Value result = READ_RK();
+                    closeUpvalues(frame->slots);
+                    this->frameCount--;
+                    this->stackTop = frame->slots;
+                    if (this->frameCount == 0) {
+                        return INTERPRET_OK;
+                    }
+                    
+                    push(result);
+                    frame = &this->frames[this->frameCount - 1];
+                    SAFEPOINT();
+                    DISPATCH();
+                }
+                DEFAULT(): {
+                    runtimeError("Unknown opcode %d.", (int) frame->ip[-1]);
+                    return INTERPRET_RUNTIME_ERROR;
                 }
             }
         }
         
 #undef READ_BYTE
+#undef READ_OPCODE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef READ_RK
+#undef QUICKEN
+#undef BINARY_OP
+#undef INT_BINARY_OP
+#undef FLOAT_BINARY_OP
+#undef REGISTER_BINARY_OP
+#undef SAFEPOINT
+#undef TRACE_EXECUTION
+#undef PROFILE_INSTRUCTION
+#undef SAMPLE
+#undef CASE
+#undef DEFAULT
+#undef DISPATCH
         
     }
+    
+    InterpretResult VM::run() {
+        sliceRemaining = timeSlice;
+        InterpretResult result;
+#ifdef LOX_COMPUTED_GOTO
+        if (dispatchMode == DISPATCH_THREADED)
+            result = _run<true>();
+        else
+#endif
+            result = _run<false>();
+#ifdef LOX_PROFILE
+        // don't charge the time parked to the function that was running
+        if (profiling)
+            profile->pause();
+#endif
+        return result;
+    }
+    
+#ifdef LOX_PROFILE
+    void VM::beginProfile() {
+        delete profile;
+        profile = new Profile;
+        profiling = true;
+    }
+    
+    void VM::endProfile() {
+        if (profiling)
+            profile->pause();
+        profiling = false;
+    }
+#endif
         
     InterpretResult VM::interpret(const char* first, const char* last) {
-        ObjectFunction* function = compile(first, last);
+        Running running{this};
+        return runScript(compile(this, first, last));
+    }
+    
+    InterpretResult VM::interpret(Source* source, const char* cache) {
+        Running running{this};
+        return runScript(cache ? compileCached(this, source, cache)
+                         : compile(this, source->first, source->last, source));
+    }
+    
+    // the caller holds the VM
+    InterpretResult VM::runScript(ObjectFunction* function) {
         if (function == NULL) return INTERPRET_COMPILE_ERROR;
         
         push(Value(function));
@@ -563,21 +1550,60 @@ push(Value(a op b)); \
         
         return run();
     }
+    
+    InterpretResult VM::start(ObjectClosure* closure) {
+        Running running{this};
+        push(Value(closure));
+        if (!call(closure, 0))
+            return INTERPRET_RUNTIME_ERROR;
+        return run();
+    }
+    
+    InterpretResult VM::resume() {
+        Running running{this};
+        if (receiving) {
+            // the channel holds the place of receive's result
+            Value value;
+            if (!AS_CHANNEL(stackTop[-1])->receive(value))
+                return INTERPRET_YIELD;
+            stackTop[-1] = value;
+            receiving = false;
+        }
+        return run();
+    }
             
     void VM::_gc_scan(gc::ScanContext& context) const {
-        // We have to scan the whole fixed size arrays else we race with
-        // frameCount and stackTop
-        for (int i = 0; i != FRAMES_MAX; ++i)
-            context.push(frames[i].closure);
-        for (int i = 0; i != STACK_MAX; ++i)
-            context.push(stack[i].load().as_object());
-        this->globals.scan(context);
-        context.push(openUpvalues);
+        if (!busy.exchange(true, std::memory_order_acquire)) {
+            // parked, so nothing will touch the frames and stack
+            using lox::scan;
+            for (const Value* slot = stack; slot != liveTop(); ++slot)
+                scan(*slot, context);
+            for (int i = 0; i != frameCount; ++i)
+                context.push(frames[i].closure);
+            for (uint32_t slot : openSlots)
+                context.push(openUpvalues[slot]);
+            busy.store(false, std::memory_order_release);
+        }
+#ifdef LOX_GLOBALS_CTRIE
+        context.push(globals);
+#else
+        this->globalSlots.scan(context);
+        context.push(globalValues);
+#endif
     }
     
     
+    VM::~VM() {
+        delete[] frames;
+        delete[] stack;
+#ifdef LOX_PROFILE
+        delete profile;
+#endif
+    }
+    
     std::size_t VM::_gc_bytes() const {
-        return sizeof(VM);
+        return sizeof(VM) + frameCapacity * sizeof(CallFrame)
+            + stackCapacity * (sizeof(Value) + sizeof(ObjectUpvalue*));
     }
     
     void VM::_gc_debug() const {
@@ -8,10 +8,22 @@
 #ifndef vm_hpp
 #define vm_hpp
 
+#include <span>
+#include <vector>
+
 #include "object.hpp"
 #include "table.hpp"
 #include "value.hpp"
 
+#ifdef LOX_GLOBALS_CTRIE
+#include "ctrie.hpp"
+#include "string.hpp"
+#endif
+
+#ifdef LOX_PROFILE
+#include "profile.hpp"
+#endif
+
 namespace lox {
     
     struct GC {
@@ -21,64 +33,193 @@ namespace lox {
     
     extern GC gc;
     
-    constexpr size_t FRAMES_MAX = 64;
-    constexpr size_t STACK_MAX  = FRAMES_MAX + UINT8_COUNT;
+    // The frames and stack start small and grow on demand, up to
+    // VM::frameLimit frames.  Each frame has room for UINT8_COUNT slots
+    // above its base, which bounds its locals, temporaries and registers,
+    // so the frame limit also limits the stack.
+    constexpr int FRAMES_INITIAL = 8;
+    constexpr int FRAMES_MAX = 1 << 16; // <-- default frameLimit
+    constexpr int TRACE_FRAMES = 16; // <-- printed at each end of a stack trace
+    constexpr size_t STACK_INITIAL = UINT8_COUNT;
     
     struct CallFrame {
-        gc::StrongPtr<ObjectClosure> closure;
+        ObjectClosure* closure;
+        Chunk* chunk; // <-- the function's stack or register code
         uint8_t* ip;
-        AtomicValue* slots;
+        Value* slots;
     };
     
     enum InterpretResult {
         INTERPRET_OK,
         INTERPRET_COMPILE_ERROR,
         INTERPRET_RUNTIME_ERROR,
+        INTERPRET_YIELD, // <-- the time slice ran out, or receive must wait; resume to continue
     };
     
+    enum DispatchMode {
+        DISPATCH_SWITCH,
+        DISPATCH_THREADED, // requires LOX_COMPUTED_GOTO
+    };
+    
+#ifdef LOX_GLOBALS_CTRIE
+    // Interned names are unique, so the ctrie compares them by identity and
+    // hashes them by their precomputed hash
+    using Globals = gc::Ctrie<ObjectString*, Value, ObjectString::Hash>;
+#endif
+    
     struct VM : gc::Object {
 
-        CallFrame frames[FRAMES_MAX];
-        int frameCount;
+        // The frames and stack are roots that the VM's own thread shades at
+        // each handshake, rather than fields the collector scans, so they are
+        // read and written without atomics or write barriers
+        //
+        // The stack is one array, moved when it grows, so that the slots of
+        // a frame stay contiguous and open upvalues stay ordered by address
+        CallFrame* frames = new CallFrame[FRAMES_INITIAL];
+        int frameCount = 0;
+        int frameCapacity = FRAMES_INITIAL;
+        int frameLimit = FRAMES_MAX;
         
-        AtomicValue stack[STACK_MAX];
-        AtomicValue* stackTop;
-        Table globals;
-        gc::StrongPtr<ObjectUpvalue> openUpvalues;
+        Value* stack = new Value[STACK_INITIAL];
+        Value* stackTop = stack;
+        size_t stackCapacity = STACK_INITIAL;
+#ifdef LOX_GLOBALS_CTRIE
+        gc::StrongPtr<Globals> globals;
+#else
+        // The compiler resolves each global name to a slot once, and the
+        // bytecode then indexes globalValues directly; slots that are not
+        // yet defined hold Value::undefined().  globalNames maps slots back
+        // to names for error messages; globalSlots keeps those names alive.
+        // A spawned VM reads a snapshot of its parent's globals, and may not
+        // assign them, since the parent would never see it
+        Table globalSlots;
+        gc::StrongPtr<gc::Array<AtomicValue>> globalValues;
+        std::vector<ObjectString*> globalNames;
+        bool globalsSnapshot = false;
+#endif
+        // Open upvalues are found by the stack slot they capture, and
+        // openSlots lists the slots that have one in increasing order, so
+        // that closing those at or above a slot pops them from its back
+        std::vector<ObjectUpvalue*> openUpvalues = std::vector<ObjectUpvalue*>(STACK_INITIAL);
+        std::vector<uint32_t> openSlots;
+        DispatchMode dispatchMode;
+        bool useRegisters; // <-- run register code where a function has it
+        
+        // A VM can run on any thread, but only one at a time.  The thread
+        // running it holds busy, and shades the stack at its handshakes and
+        // when it parks the VM.  The collector scans the stack of a parked
+        // VM, and only tries for busy, since a running VM shades itself.
+        mutable std::atomic<bool> busy = false;
+        
+        // run yields after this many safepoints, or never if 0
+        int timeSlice = 0;
+        int sliceRemaining = 0;
+        bool receiving = false; // <-- yielded in receive, which resume retries
+        
+#ifdef LOX_PROFILE
+        Profile* profile = nullptr; // <-- the last profile begun
+        bool profiling = false;
+        void beginProfile(); // <-- discards any earlier profile
+        void endProfile();
+#endif
 
         // public?
         
         void initVM();
+#ifdef LOX_GLOBALS_CTRIE
+        void initVM(Globals* shared);
+#endif
+        void initVM(VM& parent); // <-- for spawn, on the parent's thread
         void freeVM();
         void push(Value value);
         Value pop();
         Value peek(int distance);
+        void shadeRoots();
+        Value* liveTop() const;
 
         // private?
         
         void resetStack();
+        bool growFrames();
+        void growStack(size_t needed);
         void runtimeError(const char* format, ...);
-        void defineNative(const char* name, NativeFn function);
+        void defineNative(const char* name, NativeFn function, int arity = -1);
+        void defineModule(std::span<const NativeEntry> module);
+        bool getGlobal(ObjectString* name, Value* value);
+        void defineGlobal(ObjectString* name, Value value);
+        bool setGlobal(ObjectString* name, Value value);
+#ifndef LOX_GLOBALS_CTRIE
+        int globalSlot(ObjectString* name);
+        ObjectString* globalName(int slot);
+#endif
         bool call(ObjectClosure* closure, int argCount);
         bool callValue(Value callee, int argCount);
         bool invokeFromClass(ObjectClass* class_, ObjectString* name, int argCount);
         bool invoke(ObjectString* name, int argCount);
         bool bindMethod(ObjectClass* class_, ObjectString* name);
-        ObjectUpvalue* captureUpvalue(AtomicValue* local);
-        void closeUpvalues(AtomicValue* last);
+        ObjectUpvalue* captureUpvalue(Value* local);
+        void closeUpvalues(Value* last);
         void defineMethod(ObjectString* name);
         void concatenate();
+        Value concatenate(Value left, Value right);
+        template<bool THREADED> InterpretResult _run();
         InterpretResult run();
         InterpretResult interpret(const char* first, const char* last);
+        // the script's functions keep source alive; with a cache path, the
+        // compiled script is kept in an image there
+        InterpretResult interpret(Source* source, const char* cache = nullptr);
+        InterpretResult runScript(ObjectFunction* function);
+        InterpretResult start(ObjectClosure* closure); // <-- of no arguments
+        InterpretResult resume();
+        bool ownsSlot(const Value* slot) const { return (slot >= stack) && (slot < stack + stackCapacity); }
 
 
 
+        virtual ~VM() override;
         virtual void _gc_scan(gc::ScanContext&) const override;
         virtual std::size_t _gc_bytes() const override;
         virtual void _gc_debug() const override;
         
     };
     
+    // A spawned VM shares the closed upvalues of the closures it reaches,
+    // but those still open live on another thread's stack, which only that
+    // thread may touch; the parent closes them with release, so that a
+    // null location means closed is ready to read
+    
+    inline bool ObjectClosure::loadUpvalue(const VM& vm, int slot, Value* value) const {
+        Value captured = upvalues[slot];
+        if (!captured.is_object() || (captured.as_object()->kind != OBJECT_UPVALUE)) {
+            *value = captured;
+            return true;
+        }
+        ObjectUpvalue* upvalue = static_cast<ObjectUpvalue*>(captured.as_object());
+        Value* location = upvalue->location.load(std::memory_order_acquire);
+        if (!location) {
+            *value = upvalue->closed.load();
+            return true;
+        }
+        if (!vm.ownsSlot(location))
+            return false;
+        *value = *location;
+        return true;
+    }
+    
+    // only variables that are assigned are captured by reference
+    inline bool ObjectClosure::storeUpvalue(const VM& vm, int slot, Value value) {
+        assert(upvalues[slot].is_object() && (upvalues[slot].as_object()->kind == OBJECT_UPVALUE));
+        ObjectUpvalue* upvalue = static_cast<ObjectUpvalue*>(upvalues[slot].as_object());
+        Value* location = upvalue->location.load(std::memory_order_acquire);
+        if (!location) {
+            upvalue->closed = value;
+            return true;
+        }
+        if (!vm.ownsSlot(location))
+            return false;
+        *location = value;
+        return true;
+    }
+    
     // extern VM vm;
     
    
@@ -0,0 +1,139 @@
+//
+//  workstealing.hpp
+//  qet
+//
+
+#ifndef workstealing_hpp
+#define workstealing_hpp
+
+#include <cstdint>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace gc {
+
+    // Chase-Lev work-stealing deque
+    //
+    // A single owner pushes and pops at the bottom; any number of thieves
+    // steal from the top.  Uses the memory orderings of Lê, Pop, Cohen and
+    // Zappa Nardelli, "Correct and Efficient Work-Stealing for Weak Memory
+    // Models" (2013).
+    //
+    // T must be trivially copyable, and is typically a pointer.  Outgrown
+    // buffers may still be read by a concurrent thief, so they are retired
+    // rather than freed until the deque is destroyed.
+
+    template<typename T>
+    struct WorkStealingDeque {
+
+        struct Buffer {
+            std::int64_t _mask;
+            std::unique_ptr<std::atomic<T>[]> _data;
+
+            explicit Buffer(std::int64_t capacity)
+            : _mask(capacity - 1)
+            , _data(new std::atomic<T>[capacity]) {
+            }
+
+            std::int64_t capacity() const { return _mask + 1; }
+
+            T get(std::int64_t i) const {
+                return _data[i & _mask].load(std::memory_order_relaxed);
+            }
+
+            void put(std::int64_t i, T x) {
+                _data[i & _mask].store(x, std::memory_order_relaxed);
+            }
+        };
+
+        alignas(64) std::atomic<std::int64_t> _top;
+        alignas(64) std::atomic<std::int64_t> _bottom;
+        std::atomic<Buffer*> _buffer;
+        std::vector<std::unique_ptr<Buffer>> _buffers; // <-- owner only
+
+        explicit WorkStealingDeque(std::int64_t capacity = 256)
+        : _top(0)
+        , _bottom(0) {
+            _buffers.push_back(std::make_unique<Buffer>(capacity));
+            _buffer.store(_buffers.back().get(), std::memory_order_relaxed);
+        }
+
+        WorkStealingDeque(const WorkStealingDeque&) = delete;
+        WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+        // approximate when called by a thief
+        bool empty() const {
+            std::int64_t b = _bottom.load(std::memory_order_relaxed);
+            std::int64_t t = _top.load(std::memory_order_relaxed);
+            return b <= t;
+        }
+
+        // owner only
+        void push(T x) {
+            std::int64_t b = _bottom.load(std::memory_order_relaxed);
+            std::int64_t t = _top.load(std::memory_order_acquire);
+            Buffer* a = _buffer.load(std::memory_order_relaxed);
+            if (b - t > a->capacity() - 1)
+                a = _grow(a, b, t);
+            a->put(b, x);
+            std::atomic_thread_fence(std::memory_order_release);
+            _bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        // owner only
+        bool pop(T& x) {
+            std::int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+            Buffer* a = _buffer.load(std::memory_order_relaxed);
+            _bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::int64_t t = _top.load(std::memory_order_relaxed);
+            if (t > b) {
+                // empty
+                _bottom.store(b + 1, std::memory_order_relaxed);
+                return false;
+            }
+            x = a->get(b);
+            if (t == b) {
+                // last element; race the thieves for it
+                bool won = _top.compare_exchange_strong(t,
+                                                        t + 1,
+                                                        std::memory_order_seq_cst,
+                                                        std::memory_order_relaxed);
+                _bottom.store(b + 1, std::memory_order_relaxed);
+                return won;
+            }
+            return true;
+        }
+
+        // any thread; fails spuriously when racing another thief or the owner
+        bool steal(T& x) {
+            std::int64_t t = _top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::int64_t b = _bottom.load(std::memory_order_acquire);
+            if (t >= b)
+                return false;
+            // consume would suffice
+            Buffer* a = _buffer.load(std::memory_order_acquire);
+            x = a->get(t);
+            return _top.compare_exchange_strong(t,
+                                                t + 1,
+                                                std::memory_order_seq_cst,
+                                                std::memory_order_relaxed);
+        }
+
+        Buffer* _grow(Buffer* a, std::int64_t b, std::int64_t t) {
+            _buffers.push_back(std::make_unique<Buffer>(a->capacity() * 2));
+            Buffer* c = _buffers.back().get();
+            for (std::int64_t i = t; i != b; ++i)
+                c->put(i, a->get(i));
+            _buffer.store(c, std::memory_order_release);
+            return c;
+        }
+
+    }; // struct WorkStealingDeque
+
+} // namespace gc
+
+#endif /* workstealing_hpp */